@@ -16,6 +16,7 @@
 #ifndef NB_ONE_FILE
 #include "interfaces.h"
 #include "queue.h"
+#include "request.h"
 #include "response.h"
 #include "run.h"
 #include "var.h"
@@ -29,12 +30,28 @@
 #include <ppapi/c/ppp_instance.h>
 #include <ppapi/c/ppp_messaging.h>
 #include <pthread.h>
+#include <stdlib.h>
 
-enum { NB_QUEUE_MAX_SIZE = 256 };
+/* The hard cap on queued messages can be changed with the
+ * "nb-queue-max-size" attribute of the embed element. Embed in naclbind.js
+ * posts no more requests than this at once; set it with
+ * Embed.$setQueueMaxSize so both sides agree. */
+enum { NB_QUEUE_DEFAULT_MAX_SIZE = 4096 };
+
+/* More workers than this can't all be busy; see NB_RUN_POOL_MAX_JOBS. */
+enum { NB_WORKERS_MAX = 64 };
+
+/* Messages with this id are posted to JavaScript when the queue reaches its
+ * high-water mark, and again when it drains to its low-water mark. Request ids
+ * start at 1. */
+enum { NB_QUEUE_STATUS_ID = 0 };
 
 static PPB_GetInterface s_nb_get_browser_interface = NULL;
 static pthread_t s_nb_thread_id;
 static struct NB_Queue* s_nb_message_queue;
+/* Number of threads running requests, set by the "nb-workers" attribute of
+ * the embed element. By default, requests run one at a time. */
+static int s_nb_workers_count = 0;
 
 static PP_Bool nb_instance_did_create(PP_Instance,
                                       uint32_t,
@@ -46,6 +63,8 @@ static void nb_instance_did_change_focus(PP_Instance, PP_Bool);
 static PP_Bool nb_instance_handle_document_load(PP_Instance, PP_Resource);
 static void nb_instance_handle_message(PP_Instance, struct PP_Var);
 static void* nb_handle_message_thread(void*);
+static void nb_queue_watermark(struct NB_Queue*, int, void*);
+static void nb_post_dropped(struct PP_Var);
 
 PP_EXPORT int32_t
     PPP_InitializeModule(PP_Module a_module_id, PPB_GetInterface get_browser) {
@@ -79,8 +98,35 @@ PP_Bool nb_instance_did_create(PP_Instance instance,
                                uint32_t argc,
                                const char* argn[],
                                const char* argv[]) {
+  int max_size = NB_QUEUE_DEFAULT_MAX_SIZE;
+  uint32_t i;
+
+  for (i = 0; i < argc; ++i) {
+    if (strcmp(argn[i], "nb-queue-max-size") == 0) {
+      max_size = atoi(argv[i]);
+      if (max_size < 4) {
+        NB_VERROR("Invalid nb-queue-max-size: \"%s\".", argv[i]);
+        max_size = NB_QUEUE_DEFAULT_MAX_SIZE;
+      }
+    } else if (strcmp(argn[i], "nb-workers") == 0) {
+      char* end;
+      long workers_count = strtol(argv[i], &end, 10);
+      if (end == argv[i] || *end != 0 || workers_count < 0) {
+        NB_VERROR("Invalid nb-workers: \"%s\".", argv[i]);
+      } else if (workers_count > NB_WORKERS_MAX) {
+        NB_VERROR("nb-workers is %ld, using the maximum of %d.", workers_count,
+                  NB_WORKERS_MAX);
+        s_nb_workers_count = NB_WORKERS_MAX;
+      } else {
+        s_nb_workers_count = (int)workers_count;
+      }
+    }
+  }
+
   nb_interfaces_init(instance, s_nb_get_browser_interface);
-  s_nb_message_queue = nb_queue_create(NB_QUEUE_MAX_SIZE);
+  s_nb_message_queue = nb_queue_create(max_size);
+  nb_queue_set_watermarks(s_nb_message_queue, max_size / 4,
+                          max_size - max_size / 4, &nb_queue_watermark, NULL);
   pthread_create(&s_nb_thread_id, NULL, &nb_handle_message_thread, NULL);
   return PP_TRUE;
 }
@@ -98,12 +144,79 @@ PP_Bool nb_instance_handle_document_load(PP_Instance instance,
 }
 
 void nb_instance_handle_message(PP_Instance instance, struct PP_Var var) {
-  if (!nb_queue_enqueue(s_nb_message_queue, var)) {
+  int enqueued;
+
+  /* A native thread is blocked waiting for each callback result, and JS
+   * doesn't count them as in flight, so they are never dropped. */
+  if (nb_response_var_is_callback(var)) {
+    enqueued = nb_queue_enqueue_unbounded(s_nb_message_queue, var);
+  } else {
+    enqueued = nb_queue_enqueue(s_nb_message_queue, var);
+  }
+
+  if (!enqueued) {
     NB_ERROR("Warning: dropped message because the queue was full.");
+    nb_post_dropped(var);
   }
 }
 
+/* Tell JavaScript that the request |var| was dropped, so it isn't left
+ * waiting for a response. Posts {id, dropped: true}. */
+static void nb_post_dropped(struct PP_Var var) {
+  int id = nb_request_var_id(var);
+  struct PP_Var response;
+
+  if (id == 0) {
+    /* Not a request; there is no one to tell. */
+    return;
+  }
+
+  response = nb_var_dict_create();
+  if (!nb_var_dict_set_key(response, NB_VAR_KEY_ID, PP_MakeInt32(id)) ||
+      !nb_var_dict_set_key(response, NB_VAR_KEY_DROPPED,
+                           PP_MakeBool(PP_TRUE))) {
+    NB_ERROR("Failed to create dropped message.");
+    goto cleanup;
+  }
+
+  g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
+
+cleanup:
+  nb_var_release(response);
+}
+
+/* Tell JavaScript to stop sending requests, or that it can start again.
+ * "space" is how many more messages would fit in the queue right now. */
+static void nb_queue_watermark(struct NB_Queue* queue,
+                               int above_high_water,
+                               void* user_data) {
+  struct PP_Var status = nb_var_dict_create();
+  uint32_t size = nb_queue_size(queue);
+  uint32_t max_size = nb_queue_max_size(queue);
+  /* Callback results can push the queue past its cap. */
+  int32_t space = size < max_size ? (int32_t)(max_size - size) : 0;
+
+  if (!nb_var_dict_set_key(status, NB_VAR_KEY_ID,
+                           PP_MakeInt32(NB_QUEUE_STATUS_ID)) ||
+      !nb_var_dict_set_key(
+          status, NB_VAR_KEY_THROTTLE,
+          PP_MakeBool(above_high_water ? PP_TRUE : PP_FALSE)) ||
+      !nb_var_dict_set_key(status, NB_VAR_KEY_SPACE, PP_MakeInt32(space))) {
+    NB_ERROR("Failed to create queue status message.");
+    goto cleanup;
+  }
+
+  g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, status);
+
+cleanup:
+  nb_var_release(status);
+}
+
 static void* nb_handle_message_thread(void* user_data) {
-  nb_run_message_loop(s_nb_message_queue);
+  if (s_nb_workers_count > 1) {
+    nb_run_message_loop_pool(s_nb_message_queue, s_nb_workers_count);
+  } else {
+    nb_run_message_loop(s_nb_message_queue);
+  }
   return NULL;
 }
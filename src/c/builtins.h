@@ -15,6 +15,9 @@
 #ifndef NB_BUILTINS_H_
 #define NB_BUILTINS_H_
 
+/* This header is parsed by naclbind-gen to find the builtins, so it doesn't
+ * include anything; the generator would export those functions too. */
+
 #define NB_FOREACH_PRIMITIVE(x)     \
   x(voidp, void*);                  \
   x(char, char);                    \
@@ -40,6 +43,14 @@
   x(float, float, float);                               \
   x(double, double, double);
 
+/* Buffer kernels: name, element type, accumulator type for sums and dot
+ * products, and a signed integer type of the same size as the element. */
+#define NB_FOREACH_KERNEL(x)                           \
+  x(float, float, float, int);                         \
+  x(double, double, double, long long);                \
+  x(int, int, int, int);                               \
+  x(uchar, unsigned char, unsigned int, signed char);
+
 #define NB_GET(name, t) \
   static inline t nb_get_##name(t* p) { return *p; }
 #define NB_SET(name, t) \
@@ -60,9 +71,223 @@
   static inline t1 nb_add_##name(t1 a, t2 b) { return a + b; }
 #define NB_SUB(name, t1, t2) \
   static inline t1 nb_sub_##name(t1 a, t2 b) { return a - b; }
+/* Copy |count| elements between p[offset] and a buffer, e.g. an ArrayBuffer
+ * handle. Nothing is copied if |offset| or |count| is negative. */
+#define NB_SET_ARRAY(name, t)                                               \
+  static inline void nb_set_array_##name(t* p, int offset, const void* src, \
+                                         int count) {                       \
+    if (offset < 0 || count < 0)                                            \
+      return;                                                               \
+    __builtin_memcpy(p + offset, src, count * sizeof(t));                   \
+  }
+#define NB_GET_ARRAY(name, t)                                         \
+  static inline void nb_get_array_##name(t* p, int offset, void* dst, \
+                                         int count) {                 \
+    if (offset < 0 || count < 0)                                      \
+      return;                                                         \
+    __builtin_memcpy(dst, p + offset, count * sizeof(t));             \
+  }
+/* Copy one field of |count| records between an array of records and a packed
+ * buffer, e.g. an ArrayBuffer handle. Each record is |stride| bytes, and the
+ * field is |offset| bytes into it. The field doesn't have to be aligned.
+ * Nothing is copied if |count|, |stride| or |offset| is negative. */
+#define NB_GATHER(name, t)                                                  \
+  static inline void nb_gather_##name(t* dst, const void* base, int stride, \
+                                      int offset, int count) {              \
+    const char* src = (const char*)base + offset;                           \
+    int i;                                                                  \
+    if (count < 0 || stride < 0 || offset < 0)                              \
+      return;                                                               \
+    for (i = 0; i < count; ++i, src += stride)                              \
+      __builtin_memcpy(&dst[i], src, sizeof(t));                            \
+  }
+#define NB_SCATTER(name, t)                                                  \
+  static inline void nb_scatter_##name(const t* src, void* base, int stride, \
+                                       int offset, int count) {              \
+    char* dst = (char*)base + offset;                                        \
+    int i;                                                                   \
+    if (count < 0 || stride < 0 || offset < 0)                               \
+      return;                                                                \
+    for (i = 0; i < count; ++i, dst += stride)                               \
+      __builtin_memcpy(dst, &src[i], sizeof(t));                             \
+  }
+
+/* The buffer kernels run most of their loop on 16-byte vectors (SSE2 or NEON
+ * width) when the compiler supports vector types, and finish the remainder
+ * one element at a time. PNaCl's stable ABI only allows 128-bit vectors of
+ * 8, 16 and 32-bit integers and float, so the double kernels are always
+ * scalar there. Define NB_NO_SIMD to always use the scalar loops. Vector sums
+ * add in a different order, so float results may differ slightly from the
+ * scalar loop. Sums and dot products of uchar are always scalar, since they
+ * are accumulated in a wider type. */
+#if !defined(NB_NO_SIMD) &&                           \
+    (defined(__clang__) || __GNUC__ > 4 ||            \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define NB_SIMD_ON(...) __VA_ARGS__
+#else
+#define NB_SIMD_ON(...)
+#endif
+#define NB_SIMD_OFF(...)
+#define NB_SIMD_float NB_SIMD_ON
+#define NB_SIMD_int NB_SIMD_ON
+#define NB_SIMD_uchar NB_SIMD_ON
+#ifdef __pnacl__
+#define NB_SIMD_double NB_SIMD_OFF
+#else
+#define NB_SIMD_double NB_SIMD_ON
+#endif
+
+/* Expands to the rest of the arguments if kernel |name| uses vectors. */
+#define NB_IF_SIMD(name, ...) NB_SIMD_##name(__VA_ARGS__)
+#define NB_VECTOR_TYPES(name, t, acc, mask)                   \
+  NB_IF_SIMD(name,                                            \
+    typedef t nb_vec_##name __attribute__((vector_size(16))); \
+    typedef mask nb_mask_##name __attribute__((vector_size(16))))
+
+#define NB_LANES(t) ((int)(16 / sizeof(t)))
+#define NB_VLOAD(v, p) __builtin_memcpy(&(v), (p), sizeof(v))
+#define NB_VSTORE(p, v) __builtin_memcpy((p), &(v), sizeof(v))
+#define NB_VSPLAT(t, v, x)               \
+  do {                                   \
+    int k_;                              \
+    for (k_ = 0; k_ < NB_LANES(t); ++k_) \
+      (v)[k_] = (x);                     \
+  } while (0)
+/* Lanes of |a| where |cond| is true, otherwise lanes of |b|. */
+#define NB_VSELECT(name, cond, a, b)                                 \
+  ((nb_vec_##name)(((nb_mask_##name)(a) & (nb_mask_##name)(cond)) | \
+                   ((nb_mask_##name)(b) & ~(nb_mask_##name)(cond))))
+
+#define NB_SUM_ARRAY(name, t, acc, mask)                                  \
+  static inline acc nb_sum_array_##name(const t* p, int count) {          \
+    acc result = 0;                                                       \
+    int i = 0;                                                            \
+    NB_IF_SIMD(name,                                                      \
+      if (sizeof(acc) == sizeof(t) && count >= NB_LANES(t)) {             \
+        nb_vec_##name sum, v;                                             \
+        int j;                                                            \
+        NB_VLOAD(sum, p);                                                 \
+        for (i = NB_LANES(t); i + NB_LANES(t) <= count; i += NB_LANES(t)) { \
+          NB_VLOAD(v, p + i);                                             \
+          sum += v;                                                       \
+        }                                                                 \
+        for (j = 0; j < NB_LANES(t); ++j)                                 \
+          result += sum[j];                                               \
+      })                                                                  \
+    for (; i < count; ++i)                                                \
+      result += p[i];                                                     \
+    return result;                                                        \
+  }
+#define NB_DOT_ARRAY(name, t, acc, mask)                                     \
+  static inline acc nb_dot_array_##name(const t* a, const t* b, int count) { \
+    acc result = 0;                                                          \
+    int i = 0;                                                               \
+    NB_IF_SIMD(name,                                                         \
+      if (sizeof(acc) == sizeof(t) && count >= NB_LANES(t)) {                \
+        nb_vec_##name sum, va, vb;                                           \
+        int j;                                                               \
+        NB_VLOAD(va, a);                                                     \
+        NB_VLOAD(vb, b);                                                     \
+        sum = va * vb;                                                       \
+        for (i = NB_LANES(t); i + NB_LANES(t) <= count; i += NB_LANES(t)) {  \
+          NB_VLOAD(va, a + i);                                               \
+          NB_VLOAD(vb, b + i);                                               \
+          sum += va * vb;                                                    \
+        }                                                                    \
+        for (j = 0; j < NB_LANES(t); ++j)                                    \
+          result += sum[j];                                                  \
+      })                                                                     \
+    for (; i < count; ++i)                                                   \
+      result += (acc)a[i] * b[i];                                            \
+    return result;                                                           \
+  }
+/* |op| is < for min and > for max. Returns 0 if |count| is 0. */
+#define NB_MINMAX_ARRAY(fn, op, name, t)                                  \
+  static inline t nb_##fn##_array_##name(const t* p, int count) {         \
+    t result;                                                             \
+    int i = 1;                                                            \
+    if (count <= 0)                                                       \
+      return 0;                                                           \
+    result = p[0];                                                        \
+    NB_IF_SIMD(name,                                                      \
+      if (count >= NB_LANES(t)) {                                         \
+        nb_vec_##name m, v;                                               \
+        int j;                                                            \
+        NB_VLOAD(m, p);                                                   \
+        for (i = NB_LANES(t); i + NB_LANES(t) <= count; i += NB_LANES(t)) { \
+          NB_VLOAD(v, p + i);                                             \
+          m = NB_VSELECT(name, v op m, v, m);                             \
+        }                                                                 \
+        for (j = 0; j < NB_LANES(t); ++j)                                 \
+          if (m[j] op result)                                             \
+            result = m[j];                                                \
+      })                                                                  \
+    for (; i < count; ++i)                                                \
+      if (p[i] op result)                                                 \
+        result = p[i];                                                    \
+    return result;                                                        \
+  }
+#define NB_MIN_ARRAY(name, t, acc, mask) NB_MINMAX_ARRAY(min, <, name, t)
+#define NB_MAX_ARRAY(name, t, acc, mask) NB_MINMAX_ARRAY(max, >, name, t)
+/* dst[i] = src[i] * factor. |dst| may be the same as |src|. */
+#define NB_SCALE_ARRAY(name, t, acc, mask)                                  \
+  static inline void nb_scale_array_##name(t* dst, const t* src, t factor,  \
+                                           int count) {                     \
+    int i = 0;                                                              \
+    NB_IF_SIMD(name,                                                        \
+      nb_vec_##name v, f;                                                   \
+      NB_VSPLAT(t, f, factor);                                              \
+      for (; i + NB_LANES(t) <= count; i += NB_LANES(t)) {                  \
+        NB_VLOAD(v, src + i);                                               \
+        v *= f;                                                             \
+        NB_VSTORE(dst + i, v);                                              \
+      })                                                                    \
+    for (; i < count; ++i)                                                  \
+      dst[i] = (t)(src[i] * factor);                                        \
+  }
+/* dst[i] = src[i] clamped to [lo, hi]. |dst| may be the same as |src|. */
+#define NB_CLAMP_ARRAY(name, t, acc, mask)                                  \
+  static inline void nb_clamp_array_##name(t* dst, const t* src, t lo, t hi, \
+                                           int count) {                     \
+    int i = 0;                                                              \
+    NB_IF_SIMD(name,                                                        \
+      nb_vec_##name v, vlo, vhi;                                            \
+      NB_VSPLAT(t, vlo, lo);                                                \
+      NB_VSPLAT(t, vhi, hi);                                                \
+      for (; i + NB_LANES(t) <= count; i += NB_LANES(t)) {                  \
+        NB_VLOAD(v, src + i);                                               \
+        v = NB_VSELECT(name, v < vlo, vlo, v);                              \
+        v = NB_VSELECT(name, v > vhi, vhi, v);                              \
+        NB_VSTORE(dst + i, v);                                              \
+      })                                                                    \
+    for (; i < count; ++i) {                                                \
+      t x = src[i];                                                         \
+      dst[i] = x < lo ? lo : x > hi ? hi : x;                               \
+    }                                                                       \
+  }
+/* dst[i] = a[i] + b[i]. |dst| may be the same as |a| or |b|. */
+#define NB_ADD_ARRAY(name, t, acc, mask)                                     \
+  static inline void nb_add_array_##name(t* dst, const t* a, const t* b,     \
+                                         int count) {                        \
+    int i = 0;                                                               \
+    NB_IF_SIMD(name,                                                         \
+      nb_vec_##name va, vb;                                                  \
+      for (; i + NB_LANES(t) <= count; i += NB_LANES(t)) {                   \
+        NB_VLOAD(va, a + i);                                                 \
+        NB_VLOAD(vb, b + i);                                                 \
+        va += vb;                                                            \
+        NB_VSTORE(dst + i, va);                                              \
+      })                                                                     \
+    for (; i < count; ++i)                                                   \
+      dst[i] = (t)(a[i] + b[i]);                                             \
+  }
 
 NB_FOREACH_PRIMITIVE(NB_GET)
 NB_FOREACH_PRIMITIVE(NB_SET)
+NB_FOREACH_PRIMITIVE(NB_SET_ARRAY)
+NB_FOREACH_PRIMITIVE(NB_GET_ARRAY)
+NB_FOREACH_PRIMITIVE(NB_GATHER)
+NB_FOREACH_PRIMITIVE(NB_SCATTER)
 NB_FOREACH_ADDSUB(NB_ADD)
 NB_FOREACH_ADDSUB(NB_SUB)
 NB_FOREACH_PRIMITIVE(NB_LT)
@@ -71,6 +296,14 @@ NB_FOREACH_PRIMITIVE(NB_GT)
 NB_FOREACH_PRIMITIVE(NB_GE)
 NB_FOREACH_PRIMITIVE(NB_EQ)
 NB_FOREACH_PRIMITIVE(NB_NE)
+NB_FOREACH_KERNEL(NB_VECTOR_TYPES)
+NB_FOREACH_KERNEL(NB_SUM_ARRAY)
+NB_FOREACH_KERNEL(NB_MIN_ARRAY)
+NB_FOREACH_KERNEL(NB_MAX_ARRAY)
+NB_FOREACH_KERNEL(NB_DOT_ARRAY)
+NB_FOREACH_KERNEL(NB_SCALE_ARRAY)
+NB_FOREACH_KERNEL(NB_CLAMP_ARRAY)
+NB_FOREACH_KERNEL(NB_ADD_ARRAY)
 
 /* naclbind-gen:
   -r nb_get_voidp=get
@@ -103,6 +336,101 @@ NB_FOREACH_PRIMITIVE(NB_NE)
   -r nb_set_float=set
   -r nb_set_double=set
 
+  -r nb_set_array_voidp=setArray
+  -r nb_set_array_char=setArray
+  -r nb_set_array_schar=setArray
+  -r nb_set_array_uchar=setArray
+  -r nb_set_array_short=setArray
+  -r nb_set_array_ushort=setArray
+  -r nb_set_array_int=setArray
+  -r nb_set_array_uint=setArray
+  -r nb_set_array_long=setArray
+  -r nb_set_array_ulong=setArray
+  -r nb_set_array_longlong=setArray
+  -r nb_set_array_ulonglong=setArray
+  -r nb_set_array_float=setArray
+  -r nb_set_array_double=setArray
+
+  -r nb_get_array_voidp=getArray
+  -r nb_get_array_char=getArray
+  -r nb_get_array_schar=getArray
+  -r nb_get_array_uchar=getArray
+  -r nb_get_array_short=getArray
+  -r nb_get_array_ushort=getArray
+  -r nb_get_array_int=getArray
+  -r nb_get_array_uint=getArray
+  -r nb_get_array_long=getArray
+  -r nb_get_array_ulong=getArray
+  -r nb_get_array_longlong=getArray
+  -r nb_get_array_ulonglong=getArray
+  -r nb_get_array_float=getArray
+  -r nb_get_array_double=getArray
+
+  -r nb_gather_voidp=gather
+  -r nb_gather_char=gather
+  -r nb_gather_schar=gather
+  -r nb_gather_uchar=gather
+  -r nb_gather_short=gather
+  -r nb_gather_ushort=gather
+  -r nb_gather_int=gather
+  -r nb_gather_uint=gather
+  -r nb_gather_long=gather
+  -r nb_gather_ulong=gather
+  -r nb_gather_longlong=gather
+  -r nb_gather_ulonglong=gather
+  -r nb_gather_float=gather
+  -r nb_gather_double=gather
+
+  -r nb_scatter_voidp=scatter
+  -r nb_scatter_char=scatter
+  -r nb_scatter_schar=scatter
+  -r nb_scatter_uchar=scatter
+  -r nb_scatter_short=scatter
+  -r nb_scatter_ushort=scatter
+  -r nb_scatter_int=scatter
+  -r nb_scatter_uint=scatter
+  -r nb_scatter_long=scatter
+  -r nb_scatter_ulong=scatter
+  -r nb_scatter_longlong=scatter
+  -r nb_scatter_ulonglong=scatter
+  -r nb_scatter_float=scatter
+  -r nb_scatter_double=scatter
+
+  -r nb_sum_array_float=sumArray
+  -r nb_sum_array_double=sumArray
+  -r nb_sum_array_int=sumArray
+  -r nb_sum_array_uchar=sumArray
+
+  -r nb_min_array_float=minArray
+  -r nb_min_array_double=minArray
+  -r nb_min_array_int=minArray
+  -r nb_min_array_uchar=minArray
+
+  -r nb_max_array_float=maxArray
+  -r nb_max_array_double=maxArray
+  -r nb_max_array_int=maxArray
+  -r nb_max_array_uchar=maxArray
+
+  -r nb_dot_array_float=dotArray
+  -r nb_dot_array_double=dotArray
+  -r nb_dot_array_int=dotArray
+  -r nb_dot_array_uchar=dotArray
+
+  -r nb_scale_array_float=scaleArray
+  -r nb_scale_array_double=scaleArray
+  -r nb_scale_array_int=scaleArray
+  -r nb_scale_array_uchar=scaleArray
+
+  -r nb_clamp_array_float=clampArray
+  -r nb_clamp_array_double=clampArray
+  -r nb_clamp_array_int=clampArray
+  -r nb_clamp_array_uchar=clampArray
+
+  -r nb_add_array_float=addArray
+  -r nb_add_array_double=addArray
+  -r nb_add_array_int=addArray
+  -r nb_add_array_uchar=addArray
+
   -r nb_eq_voidp=eq
   -r nb_eq_char=eq
   -r nb_eq_schar=eq
@@ -213,6 +541,10 @@ NB_FOREACH_PRIMITIVE(NB_NE)
 
 #undef NB_GET
 #undef NB_SET
+#undef NB_SET_ARRAY
+#undef NB_GET_ARRAY
+#undef NB_GATHER
+#undef NB_SCATTER
 #undef NB_ADD
 #undef NB_SUB
 #undef NB_LT
@@ -221,7 +553,29 @@ NB_FOREACH_PRIMITIVE(NB_NE)
 #undef NB_GTE
 #undef NB_EQ
 #undef NB_NE
+#undef NB_SUM_ARRAY
+#undef NB_DOT_ARRAY
+#undef NB_MINMAX_ARRAY
+#undef NB_MIN_ARRAY
+#undef NB_MAX_ARRAY
+#undef NB_SCALE_ARRAY
+#undef NB_CLAMP_ARRAY
+#undef NB_ADD_ARRAY
+#undef NB_IF_SIMD
+#undef NB_SIMD_ON
+#undef NB_SIMD_OFF
+#undef NB_SIMD_float
+#undef NB_SIMD_double
+#undef NB_SIMD_int
+#undef NB_SIMD_uchar
+#undef NB_VECTOR_TYPES
+#undef NB_LANES
+#undef NB_VLOAD
+#undef NB_VSTORE
+#undef NB_VSPLAT
+#undef NB_VSELECT
 #undef NB_FOREACH_PRIMITIVE
 #undef NB_FOREACH_ADDSUB
+#undef NB_FOREACH_KERNEL
 
 #endif /* NB_BUILTINS_H_ */
@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,7 +32,18 @@
 #endif
 
 #define NB_HANDLE_MAP_INITIAL_CAPACITY 16
+#define NB_HANDLE_SLOTS_INITIAL_CAPACITY 256
+#define NB_HANDLE_EXTRAS_INITIAL_CAPACITY 16
+#define NB_HANDLE_STRING_BLOCK_SIZE 4096
+/* Ephemeral ids come from the wire, and directly index the arena, so bound
+ * them (across all nested frames) rather than trying to allocate whatever
+ * they ask for. A power of two, so growing the arena never overshoots it. */
+#define NB_HANDLE_ARENA_MAX (1 << 22)
+/* Tables shrink when they are less than 1/NB_HANDLE_SHRINK_FACTOR full. This
+ * is well below the load at which they grow, to avoid thrashing. */
+#define NB_HANDLE_SHRINK_FACTOR 8
 #define NB_INVALID_HANDLE 0
+#define NB_INVALID_EXTRA ((uint32_t)-1)
 
 typedef size_t NB_HashIndex;
 
@@ -48,38 +60,144 @@ typedef union {
   double float64;
   void* voidp;
   void (*funcp)(void);
-  struct PP_Var var;
+  /* Used when the type is NB_TYPE_VAR or NB_TYPE_FUNC_ID. This is an index
+   * into s_nb_handle_extras. */
+  uint32_t extra;
 } NB_HandleValue;
 
+/* Payloads that are too large or too rarely used to be stored with every
+ * handle. */
+typedef union {
+  struct {
+    struct PP_Var var;
+    union {
+      /* PP_Var strings are not guaranteed to be NULL-terminated, so if we
+       * want to use it as a C string, we have to copy it to the string arena.
+       * The copy is reused until the arena frame it was made in is popped,
+       * which changes the strings epoch of the thread that made it. */
+      char* string_value;
+      /* ArrayBuffers are used in place. They are mapped the first time their
+       * data is requested, and unmapped when the handle is destroyed. */
+      void* buffer_data;
+    };
+    uint32_t string_epoch;
+  };
+  struct {
+    NB_FuncId func_id;
+    /* This will be called when the handle is destroyed to free the
+     * corresponding function pointer. */
+    NB_FuncIdFree free_func;
+  };
+  /* Only used when the extra is free. This is the index of the next extra in
+   * the free list. */
+  uint32_t next_free;
+} NB_HandleExtra;
+
+/* The directly indexed tables are stored as parallel arrays, so that finding
+ * a handle only touches the dense handle and type arrays, and converting it
+ * only touches one 8-byte value. Entries whose handle is NB_INVALID_HANDLE
+ * are free. */
+typedef struct {
+  NB_Handle* handles;
+  uint8_t* types;
+  NB_HandleValue* values;
+  size_t size;
+  size_t capacity;
+} NB_HandleColumns;
+
 typedef struct NB_HandleMapEntry {
   NB_Handle handle;
   NB_Type type;
   NB_HandleValue value;
   struct NB_HandleMapEntry* next;
-  union {
-    /* PP_Var strings are not guaranteed to be NULL-terminated, so if we want
-     * to use it as a C string, we have to allocate space for a NULL and
-     * remember to free it later.
-     *
-     * This field will be non-NULL when type == NB_TYPE_VAR and
-     * nb_handle_get_charp() has been called. The memory will be free'd in
-     * DestroyHandle.
-     */
-    char* string_value;
-    /* Only used when the entry is "free". This points to the previous entry in
-     * the free list. */
-    struct NB_HandleMapEntry* prev;
-    /* Used when the type is NB_TYPE_FUNC_ID. This will be called when the
-     * handle is destroyed to free the corresponding function pointer. */
-    NB_FuncIdFree free_func;
-  };
+  /* Only used when the entry is "free". This points to the previous entry in
+   * the free list. */
+  struct NB_HandleMapEntry* prev;
 } NB_HandleMapEntry;
 
+/* A handle found by nb_get_handle_entry. The type and value are copies; the
+ * handle is stored at |index| of |columns|, or in |map_entry| if |columns| is
+ * NULL. */
+typedef struct {
+  NB_Type type;
+  NB_HandleValue value;
+  NB_HandleColumns* columns;
+  size_t index;
+  NB_HandleMapEntry* map_entry;
+} NB_HandleEntry;
+
+/* Handles are allocated by JavaScript from a counter, so the live handles are
+ * almost always a dense window of recent ids. The slot table exploits this:
+ * handle h lives in slot (h & (capacity - 1)), so lookup is a single compare.
+ * As the window of live ids slides forward it wraps around the table, and
+ * only when a new handle lands on a slot still held by an older one is
+ * anything moved: the table doubles if it is at least half full, otherwise
+ * the old handle is evicted to the chained hash map below. */
+static NB_HandleColumns s_nb_handle_slots;
+
+/* Chained hash map for handles that don't fit in the slot table. */
 static NB_HandleMapEntry* s_nb_handle_map = NULL;
 static size_t s_nb_handle_map_size = 0;
 static size_t s_nb_handle_map_capacity = 0;
 static NB_HandleMapEntry* s_nb_handle_map_free_head = NULL;
 
+/* NULL-terminated copies of string vars are bump-allocated from a chain of
+ * blocks, and freed all at once when the arena frame they were made in is
+ * popped. Blocks after |strings_current| are unused, and are kept to be
+ * reused by the next request. */
+typedef struct NB_HandleStringBlock {
+  struct NB_HandleStringBlock* next;
+  size_t capacity;
+  size_t used;
+  char data[];
+} NB_HandleStringBlock;
+
+/* Handles with negative ids are request-scoped. They live in an arena,
+ * directly indexed by -handle - 1 from the base of the current request's
+ * frame, and are all destroyed when that request is finished. Requests run
+ * from inside a callback push a new frame above the current one, so they can
+ * reuse the same ids.
+ *
+ * Each thread running requests has its own arena and string blocks, so
+ * concurrent requests can use the same ids too. Entries at or above
+ * |arena_top| are always free.
+ *
+ * A string copy is valid while its extra's epoch matches |strings_epoch| of
+ * the thread reading it. Epochs are unique across threads, so a thread
+ * freeing its strings doesn't invalidate the copies of other threads, and
+ * never validates them. 0 means no epoch has been taken yet.
+ * |compact_generation| is the last nb_handle_compact this thread has freed its
+ * unused memory for; see nb_handle_thread_compact. */
+typedef struct {
+  NB_HandleColumns arena;
+  size_t arena_base;
+  size_t arena_top;
+  NB_HandleStringBlock* strings_head;
+  NB_HandleStringBlock* strings_current;
+  uint32_t strings_epoch;
+  uint32_t compact_generation;
+} NB_HandleThreadState;
+
+static __thread NB_HandleThreadState s_nb_handle_thread;
+
+/* The last strings epoch taken by any thread. */
+static uint32_t s_nb_handle_strings_epoch;
+
+/* Bumped by nb_handle_compact, so the other threads free their unused memory
+ * too. */
+static uint32_t s_nb_handle_compact_generation;
+
+/* See nb_handle_set_thread_safe. The mutex is recursive, because some of the
+ * public functions call each other. */
+static NB_Bool s_nb_handle_thread_safe = NB_FALSE;
+static pthread_mutex_t s_nb_handle_mutex;
+
+/* Side table for NB_HandleExtra, shared by all handles. */
+static NB_HandleExtra* s_nb_handle_extras = NULL;
+static uint32_t s_nb_handle_extras_size = 0;
+static uint32_t s_nb_handle_extras_capacity = 0;
+static uint32_t s_nb_handle_extras_free_head = NB_INVALID_EXTRA;
+
 static inline NB_Bool nb_is_power_of_two(size_t n) {
   return (n & (n - 1)) == 0;
 }
@@ -93,10 +211,142 @@ static inline NB_HandleMapEntry* nb_handle_main_entry(NB_Handle handle) {
   return &s_nb_handle_map[nb_hash_handle(handle)];
 }
 
+static inline size_t nb_handle_slot_index(NB_Handle handle) {
+  assert(nb_is_power_of_two(s_nb_handle_slots.capacity));
+  return (size_t)handle & (s_nb_handle_slots.capacity - 1);
+}
+
+static inline NB_Bool nb_handle_is_ephemeral(NB_Handle handle) {
+  return handle < 0;
+}
+
+static inline size_t nb_handle_arena_index(NB_Handle handle) {
+  assert(nb_handle_is_ephemeral(handle));
+  return s_nb_handle_thread.arena_base + (size_t)(-(int64_t)handle - 1);
+}
+
 static inline NB_Bool nb_handle_entry_is_free(NB_HandleMapEntry* entry) {
   return entry->handle == NB_INVALID_HANDLE;
 }
 
+static NB_Bool nb_handle_columns_alloc(NB_HandleColumns* columns,
+                                       size_t capacity) {
+  NB_HandleColumns new_columns;
+  new_columns.handles = calloc(capacity, sizeof(NB_Handle));
+  new_columns.types = malloc(capacity * sizeof(uint8_t));
+  new_columns.values = malloc(capacity * sizeof(NB_HandleValue));
+  new_columns.size = 0;
+  new_columns.capacity = capacity;
+  if (!new_columns.handles || !new_columns.types || !new_columns.values) {
+    free(new_columns.handles);
+    free(new_columns.types);
+    free(new_columns.values);
+    return NB_FALSE;
+  }
+
+  *columns = new_columns;
+  return NB_TRUE;
+}
+
+static void nb_handle_columns_free(NB_HandleColumns* columns) {
+  free(columns->handles);
+  free(columns->types);
+  free(columns->values);
+  memset(columns, 0, sizeof(NB_HandleColumns));
+}
+
+static NB_Bool nb_handle_columns_grow(NB_HandleColumns* columns,
+                                      size_t new_capacity) {
+  assert(new_capacity > columns->capacity);
+
+  /* If any of these fail, the arrays that were grown are just larger than
+   * they need to be. */
+  NB_Handle* new_handles =
+      realloc(columns->handles, sizeof(NB_Handle) * new_capacity);
+  if (!new_handles) {
+    return NB_FALSE;
+  }
+  columns->handles = new_handles;
+
+  uint8_t* new_types =
+      realloc(columns->types, sizeof(uint8_t) * new_capacity);
+  if (!new_types) {
+    return NB_FALSE;
+  }
+  columns->types = new_types;
+
+  NB_HandleValue* new_values =
+      realloc(columns->values, sizeof(NB_HandleValue) * new_capacity);
+  if (!new_values) {
+    return NB_FALSE;
+  }
+  columns->values = new_values;
+
+  memset(&columns->handles[columns->capacity],
+         0,
+         sizeof(NB_Handle) * (new_capacity - columns->capacity));
+  columns->capacity = new_capacity;
+  return NB_TRUE;
+}
+
+static inline void nb_handle_columns_set(NB_HandleColumns* columns,
+                                         size_t index,
+                                         NB_Handle handle,
+                                         NB_Type type,
+                                         NB_HandleValue value) {
+  assert(columns->handles[index] == NB_INVALID_HANDLE);
+  columns->handles[index] = handle;
+  columns->types[index] = (uint8_t)type;
+  columns->values[index] = value;
+  columns->size++;
+}
+
+static NB_Bool nb_handle_extra_new(uint32_t* out_index) {
+  if (s_nb_handle_extras_free_head == NB_INVALID_EXTRA) {
+    uint32_t new_capacity = s_nb_handle_extras_capacity
+                                ? s_nb_handle_extras_capacity * 2
+                                : NB_HANDLE_EXTRAS_INITIAL_CAPACITY;
+    uint32_t i;
+    NB_HandleExtra* new_extras =
+        realloc(s_nb_handle_extras, sizeof(NB_HandleExtra) * new_capacity);
+    if (!new_extras) {
+      return NB_FALSE;
+    }
+
+    for (i = new_capacity; i > s_nb_handle_extras_capacity; --i) {
+      new_extras[i - 1].next_free = s_nb_handle_extras_free_head;
+      s_nb_handle_extras_free_head = i - 1;
+    }
+
+    s_nb_handle_extras = new_extras;
+    s_nb_handle_extras_capacity = new_capacity;
+  }
+
+  *out_index = s_nb_handle_extras_free_head;
+  s_nb_handle_extras_free_head =
+      s_nb_handle_extras[s_nb_handle_extras_free_head].next_free;
+  s_nb_handle_extras_size++;
+  return NB_TRUE;
+}
+
+static void nb_handle_extra_free(uint32_t index) {
+  assert(index < s_nb_handle_extras_capacity);
+  s_nb_handle_extras[index].next_free = s_nb_handle_extras_free_head;
+  s_nb_handle_extras_free_head = index;
+  s_nb_handle_extras_size--;
+}
+
+static void nb_handle_extras_shrink(void) {
+  /* Extras are referred to by index, so the table can only be freed, not
+   * moved to a smaller one. */
+  if (s_nb_handle_extras_size == 0) {
+    free(s_nb_handle_extras);
+    s_nb_handle_extras = NULL;
+    s_nb_handle_extras_capacity = 0;
+    s_nb_handle_extras_free_head = NB_INVALID_EXTRA;
+  }
+}
+
 static NB_HandleMapEntry* nb_handle_new_entry(NB_Handle handle) {
   NB_HandleMapEntry* entry = nb_handle_main_entry(handle);
   if (!nb_handle_entry_is_free(entry)) {
@@ -188,7 +438,9 @@ static NB_Bool nb_handle_map_resize(size_t new_capacity) {
   if (old_map) {
     /* Copy from old map to new map */
     for (i = 0; i < old_capacity; ++i) {
-      if (nb_handle_entry_is_free(&old_map[i])) {
+      /* Skip free entries, and those marked dead by nb_handle_destroy_many. */
+      if (nb_handle_entry_is_free(&old_map[i]) ||
+          old_map[i].type == NB_TYPE_INVALID) {
         continue;
       }
 
@@ -197,7 +449,6 @@ static NB_Bool nb_handle_map_resize(size_t new_capacity) {
       assert(entry != NULL);
       entry->type = old_map[i].type;
       entry->value = old_map[i].value;
-      entry->string_value = old_map[i].string_value;
     }
   }
 
@@ -205,9 +456,9 @@ static NB_Bool nb_handle_map_resize(size_t new_capacity) {
   return NB_TRUE;
 }
 
-static NB_Bool nb_register_handle(NB_Handle handle,
-                                  NB_Type type,
-                                  NB_HandleValue value) {
+static NB_Bool nb_handle_map_insert(NB_Handle handle,
+                                    NB_Type type,
+                                    NB_HandleValue value) {
   if (!s_nb_handle_map) {
     if (!nb_handle_map_resize(NB_HANDLE_MAP_INITIAL_CAPACITY)) {
       return NB_FALSE;
@@ -228,122 +479,426 @@ static NB_Bool nb_register_handle(NB_Handle handle,
 
   entry->type = type;
   entry->value = value;
-  entry->string_value = NULL;
   s_nb_handle_map_size++;
   return NB_TRUE;
 }
 
-int32_t nb_handle_count(void) {
-  return s_nb_handle_map_size;
+static NB_Bool nb_handle_map_find(NB_Handle handle,
+                                  NB_HandleMapEntry** out_entry) {
+  if (s_nb_handle_map_size == 0) {
+    return NB_FALSE;
+  }
+
+  NB_HandleMapEntry* entry = nb_handle_main_entry(handle);
+  if (nb_handle_entry_is_free(entry)) {
+    return NB_FALSE;
+  }
+
+  do {
+    if (entry->handle == handle) {
+      *out_entry = entry;
+      return NB_TRUE;
+    }
+
+    entry = entry->next;
+  } while (entry != NULL);
+
+  return NB_FALSE;
 }
 
-NB_Bool nb_handle_register_int8(NB_Handle handle, int8_t value) {
+static NB_Bool nb_handle_map_reserve(size_t count) {
+  size_t new_capacity = s_nb_handle_map_capacity
+                            ? s_nb_handle_map_capacity
+                            : NB_HANDLE_MAP_INITIAL_CAPACITY;
+  while (new_capacity - s_nb_handle_map_size < count) {
+    new_capacity *= 2;
+  }
+
+  if (new_capacity == s_nb_handle_map_capacity) {
+    return NB_TRUE;
+  }
+
+  return nb_handle_map_resize(new_capacity);
+}
+
+static NB_Bool nb_handle_evict_slot(size_t index) {
+  NB_Handle handle = s_nb_handle_slots.handles[index];
+  if (!nb_handle_map_insert(handle,
+                            s_nb_handle_slots.types[index],
+                            s_nb_handle_slots.values[index])) {
+    return NB_FALSE;
+  }
+
+  NB_VLOG("Evicting handle %d from slot table", handle);
+  s_nb_handle_slots.handles[index] = NB_INVALID_HANDLE;
+  s_nb_handle_slots.size--;
+  return NB_TRUE;
+}
+
+static NB_Bool nb_handle_slots_resize(size_t new_capacity) {
+  NB_VLOG("Resizing handle slots %u -> %u",
+          s_nb_handle_slots.capacity,
+          new_capacity);
+  assert(nb_is_power_of_two(new_capacity));
+
+  NB_HandleColumns old_slots = s_nb_handle_slots;
+  size_t i;
+
+  /* Handles that didn't collide in the old table can't collide in a larger
+   * one. When shrinking they may; make sure there is room in the map for the
+   * handles that have to be evicted before changing anything. */
+  if (new_capacity < old_slots.capacity &&
+      !nb_handle_map_reserve(old_slots.size)) {
+    return NB_FALSE;
+  }
+
+  if (!nb_handle_columns_alloc(&s_nb_handle_slots, new_capacity)) {
+    return NB_FALSE;
+  }
+
+  for (i = 0; i < old_slots.capacity; ++i) {
+    NB_Handle handle = old_slots.handles[i];
+    if (handle == NB_INVALID_HANDLE) {
+      continue;
+    }
+
+    size_t index = nb_handle_slot_index(handle);
+    NB_Handle other_handle = s_nb_handle_slots.handles[index];
+    if (other_handle != NB_INVALID_HANDLE) {
+      /* Keep the newer handle in the slot. */
+      assert(new_capacity < old_slots.capacity);
+      if (other_handle > handle) {
+        NB_Bool result = nb_handle_map_insert(
+            handle, old_slots.types[i], old_slots.values[i]);
+        assert(result);
+        (void)result;
+        continue;
+      }
+
+      NB_Bool result = nb_handle_evict_slot(index);
+      assert(result);
+      (void)result;
+    }
+
+    nb_handle_columns_set(&s_nb_handle_slots,
+                          index,
+                          handle,
+                          old_slots.types[i],
+                          old_slots.values[i]);
+  }
+
+  nb_handle_columns_free(&old_slots);
+  return NB_TRUE;
+}
+
+static size_t nb_handle_capacity_for(size_t size, size_t min_capacity) {
+  size_t capacity = min_capacity;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static void nb_handle_map_shrink(size_t new_capacity) {
+  if (s_nb_handle_map_size == 0) {
+    NB_VLOG("Freeing handle map %u", s_nb_handle_map_capacity);
+    free(s_nb_handle_map);
+    s_nb_handle_map = NULL;
+    s_nb_handle_map_capacity = 0;
+    s_nb_handle_map_free_head = NULL;
+    return;
+  }
+
+  if (new_capacity < s_nb_handle_map_capacity) {
+    /* If this fails, the old map is still valid; just keep using it. */
+    nb_handle_map_resize(new_capacity);
+  }
+}
+
+static void nb_handle_maybe_shrink(void) {
+  if (s_nb_handle_slots.capacity > NB_HANDLE_SLOTS_INITIAL_CAPACITY &&
+      s_nb_handle_slots.size <
+          s_nb_handle_slots.capacity / NB_HANDLE_SHRINK_FACTOR) {
+    nb_handle_slots_resize(nb_handle_capacity_for(
+        s_nb_handle_slots.size * 4, NB_HANDLE_SLOTS_INITIAL_CAPACITY));
+  }
+
+  if (s_nb_handle_map_capacity > 0 &&
+      s_nb_handle_map_size <
+          s_nb_handle_map_capacity / NB_HANDLE_SHRINK_FACTOR) {
+    nb_handle_map_shrink(nb_handle_capacity_for(
+        s_nb_handle_map_size * 4, NB_HANDLE_MAP_INITIAL_CAPACITY));
+  }
+
+  if (s_nb_handle_extras_capacity > NB_HANDLE_EXTRAS_INITIAL_CAPACITY) {
+    nb_handle_extras_shrink();
+  }
+}
+
+static NB_Bool nb_handle_arena_register(NB_Handle handle,
+                                        NB_Type type,
+                                        NB_HandleValue value) {
+  size_t index = nb_handle_arena_index(handle);
+  if (index >= NB_HANDLE_ARENA_MAX) {
+    NB_VERROR("handle %d is out of range of the handle arena.", handle);
+    return NB_FALSE;
+  }
+
+  if (index >= s_nb_handle_thread.arena.capacity) {
+    size_t new_capacity = s_nb_handle_thread.arena.capacity
+                              ? s_nb_handle_thread.arena.capacity
+                              : NB_HANDLE_SLOTS_INITIAL_CAPACITY;
+    /* Can't overflow; index < NB_HANDLE_ARENA_MAX, so this stops there. */
+    while (index >= new_capacity) {
+      new_capacity *= 2;
+    }
+    assert(new_capacity <= NB_HANDLE_ARENA_MAX);
+
+    NB_VLOG("Resizing handle arena %u -> %u",
+            s_nb_handle_thread.arena.capacity,
+            new_capacity);
+    if (!nb_handle_columns_grow(&s_nb_handle_thread.arena, new_capacity)) {
+      return NB_FALSE;
+    }
+  }
+
+  if (s_nb_handle_thread.arena.handles[index] == handle) {
+    NB_VERROR("handle %d is already registered.", handle);
+    return NB_FALSE;
+  }
+
+  if (index >= s_nb_handle_thread.arena_top) {
+    s_nb_handle_thread.arena_top = index + 1;
+  }
+
+  nb_handle_columns_set(&s_nb_handle_thread.arena, index, handle, type, value);
+  return NB_TRUE;
+}
+
+static NB_Bool nb_register_handle(NB_Handle handle,
+                                  NB_Type type,
+                                  NB_HandleValue value) {
+  if (handle == NB_INVALID_HANDLE) {
+    NB_VERROR("handle %d is invalid.", handle);
+    return NB_FALSE;
+  }
+
+  if (nb_handle_is_ephemeral(handle)) {
+    return nb_handle_arena_register(handle, type, value);
+  }
+
+  if (!s_nb_handle_slots.handles) {
+    if (!nb_handle_slots_resize(NB_HANDLE_SLOTS_INITIAL_CAPACITY)) {
+      return NB_FALSE;
+    }
+  }
+
+  size_t index = nb_handle_slot_index(handle);
+  NB_HandleMapEntry* map_entry;
+  if (s_nb_handle_slots.handles[index] == handle ||
+      nb_handle_map_find(handle, &map_entry)) {
+    NB_VERROR("handle %d is already registered.", handle);
+    return NB_FALSE;
+  }
+
+  if (s_nb_handle_slots.handles[index] != NB_INVALID_HANDLE &&
+      s_nb_handle_slots.size >= s_nb_handle_slots.capacity / 2) {
+    /* The window of live handles is wider than the table; grow it. */
+    if (!nb_handle_slots_resize(s_nb_handle_slots.capacity * 2)) {
+      return NB_FALSE;
+    }
+    index = nb_handle_slot_index(handle);
+  }
+
+  if (s_nb_handle_slots.handles[index] != NB_INVALID_HANDLE) {
+    /* An older handle is still using this slot. */
+    if (!nb_handle_evict_slot(index)) {
+      return NB_FALSE;
+    }
+  }
+
+  nb_handle_columns_set(&s_nb_handle_slots, index, handle, type, value);
+  return NB_TRUE;
+}
+
+/* Only the calling thread's arena is counted; see handle.h. */
+static int32_t nb_handle_count_unlocked(void) {
+  return s_nb_handle_slots.size + s_nb_handle_thread.arena.size +
+         s_nb_handle_map_size;
+}
+
+static NB_Bool nb_handle_register_int8_unlocked(NB_Handle handle,
+                                                int8_t value) {
   NB_HandleValue hval;
   hval.int8 = value;
   return nb_register_handle(handle, NB_TYPE_INT8, hval);
 }
 
-NB_Bool nb_handle_register_uint8(NB_Handle handle, uint8_t value) {
+static NB_Bool nb_handle_register_uint8_unlocked(NB_Handle handle,
+                                                 uint8_t value) {
   NB_HandleValue hval;
   hval.uint8 = value;
   return nb_register_handle(handle, NB_TYPE_UINT8, hval);
 }
 
-NB_Bool nb_handle_register_int16(NB_Handle handle, int16_t value) {
+static NB_Bool nb_handle_register_int16_unlocked(NB_Handle handle,
+                                                 int16_t value) {
   NB_HandleValue hval;
   hval.int16 = value;
   return nb_register_handle(handle, NB_TYPE_INT16, hval);
 }
 
-NB_Bool nb_handle_register_uint16(NB_Handle handle, uint16_t value) {
+static NB_Bool nb_handle_register_uint16_unlocked(NB_Handle handle,
+                                                  uint16_t value) {
   NB_HandleValue hval;
   hval.uint16 = value;
   return nb_register_handle(handle, NB_TYPE_UINT16, hval);
 }
 
-NB_Bool nb_handle_register_int32(NB_Handle handle, int32_t value) {
+static NB_Bool nb_handle_register_int32_unlocked(NB_Handle handle,
+                                                 int32_t value) {
   NB_HandleValue hval;
   hval.int32 = value;
   return nb_register_handle(handle, NB_TYPE_INT32, hval);
 }
 
-NB_Bool nb_handle_register_uint32(NB_Handle handle, uint32_t value) {
+static NB_Bool nb_handle_register_uint32_unlocked(NB_Handle handle,
+                                                  uint32_t value) {
   NB_HandleValue hval;
   hval.uint32 = value;
   return nb_register_handle(handle, NB_TYPE_UINT32, hval);
 }
 
-NB_Bool nb_handle_register_int64(NB_Handle handle, int64_t value) {
+static NB_Bool nb_handle_register_int64_unlocked(NB_Handle handle,
+                                                 int64_t value) {
   NB_HandleValue hval;
   hval.int64 = value;
   return nb_register_handle(handle, NB_TYPE_INT64, hval);
 }
 
-NB_Bool nb_handle_register_uint64(NB_Handle handle, uint64_t value) {
+static NB_Bool nb_handle_register_uint64_unlocked(NB_Handle handle,
+                                                  uint64_t value) {
   NB_HandleValue hval;
   hval.uint64 = value;
   return nb_register_handle(handle, NB_TYPE_UINT64, hval);
 }
 
-NB_Bool nb_handle_register_float(NB_Handle handle, float value) {
+static NB_Bool nb_handle_register_float_unlocked(NB_Handle handle,
+                                                 float value) {
   NB_HandleValue hval;
   hval.float32 = value;
   return nb_register_handle(handle, NB_TYPE_FLOAT, hval);
 }
 
-NB_Bool nb_handle_register_double(NB_Handle handle, double value) {
+static NB_Bool nb_handle_register_double_unlocked(NB_Handle handle,
+                                                  double value) {
   NB_HandleValue hval;
   hval.float64 = value;
   return nb_register_handle(handle, NB_TYPE_DOUBLE, hval);
 }
 
-NB_Bool nb_handle_register_voidp(NB_Handle handle, void* value) {
+static NB_Bool nb_handle_register_voidp_unlocked(NB_Handle handle,
+                                                 void* value) {
   NB_HandleValue hval;
   hval.voidp = value;
   return nb_register_handle(handle, NB_TYPE_VOID_P, hval);
 }
 
-NB_Bool nb_handle_register_funcp(NB_Handle handle, void (*value)(void)) {
+static NB_Bool nb_handle_register_funcp_unlocked(NB_Handle handle,
+                                                 void (*value)(void)) {
   NB_HandleValue hval;
   hval.funcp = value;
   return nb_register_handle(handle, NB_TYPE_FUNC_P, hval);
 }
 
-NB_Bool nb_handle_register_func_id(NB_Handle handle, NB_FuncId value) {
+static NB_Bool nb_handle_register_func_id_unlocked(NB_Handle handle,
+                                                   NB_FuncId value) {
   NB_HandleValue hval;
-  hval.int32 = value;
-  return nb_register_handle(handle, NB_TYPE_FUNC_ID, hval);
-}
+  if (!nb_handle_extra_new(&hval.extra)) {
+    return NB_FALSE;
+  }
 
-NB_Bool nb_handle_register_var(NB_Handle handle, struct PP_Var value) {
-  NB_HandleValue hval;
-  hval.var = value;
-  nb_var_addref(hval.var);
+  s_nb_handle_extras[hval.extra].func_id = value;
+  s_nb_handle_extras[hval.extra].free_func = NULL;
+  if (!nb_register_handle(handle, NB_TYPE_FUNC_ID, hval)) {
+    nb_handle_extra_free(hval.extra);
+    return NB_FALSE;
+  }
+
+  return NB_TRUE;
+}
 
+static NB_Bool nb_handle_register_var_unlocked(NB_Handle handle,
+                                               struct PP_Var value) {
   switch (value.type) {
     case PP_VARTYPE_ARRAY_BUFFER:
     case PP_VARTYPE_ARRAY:
     case PP_VARTYPE_DICTIONARY:
     case PP_VARTYPE_STRING:
-      return nb_register_handle(handle, NB_TYPE_VAR, hval);
+      break;
     default:
       return NB_FALSE;
   }
+
+  NB_HandleValue hval;
+  if (!nb_handle_extra_new(&hval.extra)) {
+    return NB_FALSE;
+  }
+
+  s_nb_handle_extras[hval.extra].var = value;
+  s_nb_handle_extras[hval.extra].string_value = NULL;
+  s_nb_handle_extras[hval.extra].string_epoch = 0;
+  if (!nb_register_handle(handle, NB_TYPE_VAR, hval)) {
+    nb_handle_extra_free(hval.extra);
+    return NB_FALSE;
+  }
+
+  nb_var_addref(value);
+  return NB_TRUE;
+}
+
+static inline void nb_handle_columns_entry(NB_HandleColumns* columns,
+                                           size_t index,
+                                           NB_HandleEntry* out_entry) {
+  out_entry->type = (NB_Type)columns->types[index];
+  out_entry->value = columns->values[index];
+  out_entry->columns = columns;
+  out_entry->index = index;
+  out_entry->map_entry = NULL;
 }
 
 static NB_Bool nb_get_handle_entry(NB_Handle handle,
-                                   NB_HandleMapEntry** out_entry) {
-  NB_HandleMapEntry* entry = nb_handle_main_entry(handle);
-  do {
-    if (entry->handle == handle) {
-      *out_entry = entry;
+                                   NB_HandleEntry* out_entry) {
+  if (s_nb_handle_slots.size > 0 && handle != NB_INVALID_HANDLE) {
+    size_t index = nb_handle_slot_index(handle);
+    if (s_nb_handle_slots.handles[index] == handle) {
+      nb_handle_columns_entry(&s_nb_handle_slots, index, out_entry);
       return NB_TRUE;
     }
+  }
 
-    entry = entry->next;
-  } while(!nb_handle_entry_is_free(entry));
+  if (nb_handle_is_ephemeral(handle)) {
+    size_t index = nb_handle_arena_index(handle);
+    if (index < s_nb_handle_thread.arena_top &&
+        s_nb_handle_thread.arena.handles[index] == handle) {
+      nb_handle_columns_entry(&s_nb_handle_thread.arena, index, out_entry);
+      return NB_TRUE;
+    }
 
-  return NB_FALSE;
+    return NB_FALSE;
+  }
+
+  NB_HandleMapEntry* map_entry;
+  if (!nb_handle_map_find(handle, &map_entry)) {
+    return NB_FALSE;
+  }
+
+  out_entry->type = map_entry->type;
+  out_entry->value = map_entry->value;
+  out_entry->columns = NULL;
+  out_entry->index = 0;
+  out_entry->map_entry = map_entry;
+  return NB_TRUE;
 }
 
 #define NB_TYPE_INT8_MIN (-0x80)
@@ -389,10 +944,10 @@ static NB_Bool nb_get_handle_entry(NB_Handle handle,
 #define NB_TYPE_FLOAT_FIELD float32
 #define NB_TYPE_DOUBLE_FIELD float64
 
-#define NB_HENTRY_FIELD(type) (hentry->value.type##_FIELD)
+#define NB_HENTRY_FIELD(type) (hentry.value.type##_FIELD)
 
 #define NB_TYPE_SWITCH(to_type, to)                 \
-  switch (hentry->type) {                           \
+  switch (hentry.type) {                           \
     NB_TYPE_CASE(to_type, NB_TYPE_INT8, to, I8);    \
     NB_TYPE_CASE(to_type, NB_TYPE_UINT8, to, U8);   \
     NB_TYPE_CASE(to_type, NB_TYPE_INT16, to, I16);  \
@@ -529,7 +1084,7 @@ static NB_Bool nb_get_handle_entry(NB_Handle handle,
   default:                                             \
     NB_VERROR("handle %d is of type %s. Expected %s.", \
               handle,                                  \
-              nb_type_to_string(hentry->type),         \
+              nb_type_to_string(hentry.type),         \
               nb_type_to_string(to_type));             \
     return NB_FALSE /* no semicolon */
 
@@ -615,12 +1170,13 @@ static NB_Bool nb_get_handle_entry(NB_Handle handle,
   NB_VERROR("handle %d(%s) with value " from_type##_FMT \
             " cannot be represented as %s.",            \
             handle,                                     \
-            nb_type_to_string(hentry->type),            \
+            nb_type_to_string(hentry.type),            \
             NB_HENTRY_FIELD(from_type),                 \
             nb_type_to_string(to_type))
 
-NB_Bool nb_handle_get_int8(NB_Handle handle, int8_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_int8_unlocked(NB_Handle handle,
+                                           int8_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -628,8 +1184,9 @@ NB_Bool nb_handle_get_int8(NB_Handle handle, int8_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_INT8, I8);
 }
 
-NB_Bool nb_handle_get_uint8(NB_Handle handle, uint8_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_uint8_unlocked(NB_Handle handle,
+                                            uint8_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -637,8 +1194,9 @@ NB_Bool nb_handle_get_uint8(NB_Handle handle, uint8_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_UINT8, U8);
 }
 
-NB_Bool nb_handle_get_int16(NB_Handle handle, int16_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_int16_unlocked(NB_Handle handle,
+                                            int16_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -646,8 +1204,9 @@ NB_Bool nb_handle_get_int16(NB_Handle handle, int16_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_INT16, I16);
 }
 
-NB_Bool nb_handle_get_uint16(NB_Handle handle, uint16_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_uint16_unlocked(NB_Handle handle,
+                                             uint16_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -655,8 +1214,9 @@ NB_Bool nb_handle_get_uint16(NB_Handle handle, uint16_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_UINT16, U16);
 }
 
-NB_Bool nb_handle_get_int32(NB_Handle handle, int32_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_int32_unlocked(NB_Handle handle,
+                                            int32_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -664,8 +1224,9 @@ NB_Bool nb_handle_get_int32(NB_Handle handle, int32_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_INT32, I32);
 }
 
-NB_Bool nb_handle_get_uint32(NB_Handle handle, uint32_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_uint32_unlocked(NB_Handle handle,
+                                             uint32_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -673,8 +1234,9 @@ NB_Bool nb_handle_get_uint32(NB_Handle handle, uint32_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_UINT32, U32);
 }
 
-NB_Bool nb_handle_get_int64(NB_Handle handle, int64_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_int64_unlocked(NB_Handle handle,
+                                            int64_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -682,8 +1244,9 @@ NB_Bool nb_handle_get_int64(NB_Handle handle, int64_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_INT64, I64);
 }
 
-NB_Bool nb_handle_get_uint64(NB_Handle handle, uint64_t* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_uint64_unlocked(NB_Handle handle,
+                                             uint64_t* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -691,8 +1254,9 @@ NB_Bool nb_handle_get_uint64(NB_Handle handle, uint64_t* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_UINT64, U64);
 }
 
-NB_Bool nb_handle_get_float(NB_Handle handle, float* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_float_unlocked(NB_Handle handle,
+                                            float* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -700,8 +1264,9 @@ NB_Bool nb_handle_get_float(NB_Handle handle, float* out_value) {
   NB_TYPE_SWITCH(NB_TYPE_FLOAT, FLT);
 }
 
-NB_Bool nb_handle_get_double(NB_Handle handle, double* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_double_unlocked(NB_Handle handle,
+                                             double* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -867,41 +1432,150 @@ NB_Bool nb_handle_get_double(NB_Handle handle, double* out_value) {
 #undef NB_CHECK_MAX_INT_TO_DBL
 #undef NB_CHECK_ERROR
 
-static NB_Bool nb_hentry_string_value(NB_HandleMapEntry* hentry,
+static char* nb_handle_string_alloc(size_t size) {
+  NB_HandleStringBlock* block = s_nb_handle_thread.strings_current;
+  if (block && block->capacity - block->used >= size) {
+    char* result = &block->data[block->used];
+    block->used += size;
+    return result;
+  }
+
+  /* Move on to the next unused block, replacing it if it is too small. */
+  NB_HandleStringBlock* next =
+      block ? block->next : s_nb_handle_thread.strings_head;
+  if (!next || next->capacity < size) {
+    size_t capacity =
+        size > NB_HANDLE_STRING_BLOCK_SIZE ? size : NB_HANDLE_STRING_BLOCK_SIZE;
+    NB_HandleStringBlock* new_block =
+        malloc(sizeof(NB_HandleStringBlock) + capacity);
+    if (!new_block) {
+      return NULL;
+    }
+
+    new_block->capacity = capacity;
+    new_block->next = next ? next->next : NULL;
+    free(next);
+    if (block) {
+      block->next = new_block;
+    } else {
+      s_nb_handle_thread.strings_head = new_block;
+    }
+    next = new_block;
+  }
+
+  next->used = size;
+  s_nb_handle_thread.strings_current = next;
+  return next->data;
+}
+
+static void nb_handle_strings_free_unused(NB_Bool oversized_only) {
+  NB_HandleStringBlock** link = s_nb_handle_thread.strings_current
+                                    ? &s_nb_handle_thread.strings_current->next
+                                    : &s_nb_handle_thread.strings_head;
+  while (*link) {
+    NB_HandleStringBlock* block = *link;
+    if (oversized_only && block->capacity <= NB_HANDLE_STRING_BLOCK_SIZE) {
+      link = &block->next;
+      continue;
+    }
+
+    *link = block->next;
+    free(block);
+  }
+}
+
+static uint32_t nb_handle_next_strings_epoch(void) {
+  uint32_t epoch;
+  do {
+    epoch = __sync_add_and_fetch(&s_nb_handle_strings_epoch, 1);
+  } while (epoch == 0);
+  return epoch;
+}
+
+static NB_Bool nb_hentry_string_value(NB_HandleEntry* hentry,
                                       char** out_value) {
-  if (hentry->string_value == NULL) {
+  NB_HandleExtra* extra = &s_nb_handle_extras[hentry->value.extra];
+  if (s_nb_handle_thread.strings_epoch == 0) {
+    s_nb_handle_thread.strings_epoch = nb_handle_next_strings_epoch();
+  }
+
+  if (extra->string_epoch != s_nb_handle_thread.strings_epoch) {
     uint32_t len;
     const char* str;
-    if (!nb_var_string(hentry->value.var, &str, &len)) {
+    if (!nb_var_string(extra->var, &str, &len)) {
+      return NB_FALSE;
+    }
+
+    char* string_value = nb_handle_string_alloc(len + 1);
+    if (!string_value) {
+      return NB_FALSE;
+    }
+
+    memcpy(string_value, str, len);
+    string_value[len] = 0;
+    extra->string_value = string_value;
+    extra->string_epoch = s_nb_handle_thread.strings_epoch;
+  }
+
+  *out_value = extra->string_value;
+  return NB_TRUE;
+}
+
+static NB_Bool nb_hentry_buffer_data(NB_HandleEntry* hentry,
+                                     void** out_value) {
+  NB_HandleExtra* extra = &s_nb_handle_extras[hentry->value.extra];
+  if (extra->buffer_data == NULL) {
+    extra->buffer_data = nb_var_buffer_map(extra->var);
+    if (extra->buffer_data == NULL) {
       return NB_FALSE;
     }
+  }
+
+  *out_value = extra->buffer_data;
+  return NB_TRUE;
+}
+
+/* Returns the data of a string or ArrayBuffer var handle as a pointer. */
+static NB_Bool nb_hentry_var_pointer(NB_Handle handle,
+                                     NB_HandleEntry* hentry,
+                                     void** out_value) {
+  struct PP_Var var = s_nb_handle_extras[hentry->value.extra].var;
+  char* string_value;
+
+  if (var.type == PP_VARTYPE_ARRAY_BUFFER) {
+    if (!nb_hentry_buffer_data(hentry, out_value)) {
+      NB_VERROR("unable to map buffer for handle %d", handle);
+      return NB_FALSE;
+    }
+    return NB_TRUE;
+  }
 
-    hentry->string_value = strndup(str, len);
+  if (!nb_hentry_string_value(hentry, &string_value)) {
+    NB_VERROR("unable to get string for handle %d", handle);
+    return NB_FALSE;
   }
 
-  *out_value = hentry->string_value;
+  *out_value = string_value;
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_voidp(NB_Handle handle, void** out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_voidp_unlocked(NB_Handle handle,
+                                            void** out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type == NB_TYPE_VAR) {
-    char* string_value;
-    if (!nb_hentry_string_value(hentry, &string_value)) {
-      NB_VERROR("unable to get string for handle %d", handle);
+  if (hentry.type == NB_TYPE_VAR) {
+    if (!nb_hentry_var_pointer(handle, &hentry, out_value)) {
       return NB_FALSE;
     }
-    *out_value = string_value;
-  } else if (hentry->type == NB_TYPE_VOID_P) {
-    *out_value = hentry->value.voidp;
+  } else if (hentry.type == NB_TYPE_VOID_P) {
+    *out_value = hentry.value.voidp;
   } else {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_VOID_P));
     return NB_FALSE;
   }
@@ -909,61 +1583,124 @@ NB_Bool nb_handle_get_voidp(NB_Handle handle, void** out_value) {
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_funcp(NB_Handle handle, void (**out_value)(void)) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_buffer_length_unlocked(NB_Handle handle,
+                                                    uint32_t* out_length) {
+  NB_HandleEntry hentry;
+  struct PP_Var var;
+  if (!nb_get_handle_entry(handle, &hentry) || hentry.type != NB_TYPE_VAR) {
+    return NB_FALSE;
+  }
+
+  var = s_nb_handle_extras[hentry.value.extra].var;
+  if (var.type != PP_VARTYPE_ARRAY_BUFFER) {
+    return NB_FALSE;
+  }
+
+  *out_length = nb_var_buffer_byte_length(var);
+  return NB_TRUE;
+}
+
+static NB_Bool nb_handle_get_funcp_unlocked(NB_Handle handle,
+                                            void (**out_value)(void)) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type != NB_TYPE_FUNC_P) {
+  if (hentry.type != NB_TYPE_FUNC_P) {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_FUNC_P));
     return NB_FALSE;
   }
 
-  *out_value = hentry->value.funcp;
+  *out_value = hentry.value.funcp;
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_func_id(NB_Handle handle, NB_FuncId* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_func_id_unlocked(NB_Handle handle,
+                                              NB_FuncId* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type != NB_TYPE_FUNC_ID) {
+  if (hentry.type != NB_TYPE_FUNC_ID) {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_FUNC_ID));
     return NB_FALSE;
   }
 
-  *out_value = hentry->value.int32;
+  *out_value = s_nb_handle_extras[hentry.value.extra].func_id;
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_charp(NB_Handle handle, char** out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_charp_unlocked(NB_Handle handle,
+                                            char** out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type == NB_TYPE_VAR) {
-    char* string_value;
-    if (!nb_hentry_string_value(hentry, &string_value)) {
+  if (hentry.type == NB_TYPE_VAR) {
+    void* pointer_value;
+    if (!nb_hentry_var_pointer(handle, &hentry, &pointer_value)) {
+      return NB_FALSE;
+    }
+    *out_value = (char*)pointer_value;
+  } else if (hentry.type == NB_TYPE_VOID_P) {
+    *out_value = (char*)hentry.value.voidp;
+  } else {
+    NB_VERROR("handle %d is of type %s. Expected %s.",
+              handle,
+              nb_type_to_string(hentry.type),
+              nb_type_to_string(NB_TYPE_VOID_P));
+    return NB_FALSE;
+  }
+
+  return NB_TRUE;
+}
+
+static NB_Bool nb_handle_get_string_unlocked(NB_Handle handle,
+                                             const char** out_value,
+                                             uint32_t* out_length) {
+  NB_HandleEntry hentry;
+  if (!nb_get_handle_entry(handle, &hentry)) {
+    return NB_FALSE;
+  }
+
+  if (hentry.type == NB_TYPE_VAR) {
+    struct PP_Var var = s_nb_handle_extras[hentry.value.extra].var;
+    uint32_t length;
+
+    if (var.type == PP_VARTYPE_ARRAY_BUFFER) {
+      void* buffer_data;
+      if (!nb_hentry_buffer_data(&hentry, &buffer_data)) {
+        NB_VERROR("unable to map buffer for handle %d", handle);
+        return NB_FALSE;
+      }
+      *out_value = (const char*)buffer_data;
+      length = nb_var_buffer_byte_length(var);
+    } else if (!nb_var_string(var, out_value, &length)) {
       NB_VERROR("unable to get string for handle %d", handle);
       return NB_FALSE;
     }
-    *out_value = string_value;
-  } else if (hentry->type == NB_TYPE_VOID_P) {
-    *out_value = (char*)hentry->value.voidp;
+
+    if (out_length) {
+      *out_length = length;
+    }
+  } else if (hentry.type == NB_TYPE_VOID_P) {
+    *out_value = (const char*)hentry.value.voidp;
+    if (out_length) {
+      *out_length = *out_value ? strlen(*out_value) : 0;
+    }
   } else {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_VOID_P));
     return NB_FALSE;
   }
@@ -971,30 +1708,42 @@ NB_Bool nb_handle_get_charp(NB_Handle handle, char** out_value) {
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_var(NB_Handle handle, struct PP_Var* out_value) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_var_unlocked(NB_Handle handle,
+                                          struct PP_Var* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type != NB_TYPE_VAR) {
+  if (hentry.type != NB_TYPE_VAR) {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_VAR));
     return NB_FALSE;
   }
 
-  *out_value = hentry->value.var;
+  *out_value = s_nb_handle_extras[hentry.value.extra].var;
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_get_default(NB_Handle handle,
-                              NB_VarArgInt** iargs,
-                              NB_VarArgInt* max_iargs,
-                              NB_VarArgDbl** dargs,
-                              NB_VarArgDbl* max_dargs) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_get_type_unlocked(NB_Handle handle,
+                                           NB_Type* out_type) {
+  NB_HandleEntry hentry;
+  if (!nb_get_handle_entry(handle, &hentry)) {
+    return NB_FALSE;
+  }
+
+  *out_type = hentry.type;
+  return NB_TRUE;
+}
+
+static NB_Bool nb_handle_get_default_unlocked(NB_Handle handle,
+                                              NB_VarArgInt** iargs,
+                                              NB_VarArgInt* max_iargs,
+                                              NB_VarArgDbl** dargs,
+                                              NB_VarArgDbl* max_dargs) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
@@ -1008,22 +1757,22 @@ NB_Bool nb_handle_get_default(NB_Handle handle,
 #ifdef __x86_64__
 #define NB_PUSH_INT(field)                     \
   NB_CHECK(*iargs, max_iargs, 1, "non-float ") \
-  *(*iargs)++ = (uint64_t)(int64_t)hentry->value.field
+  *(*iargs)++ = (uint64_t)(int64_t)hentry.value.field
 
 #define NB_PUSH_UINT(field)                    \
   NB_CHECK(*iargs, max_iargs, 1, "non-float ") \
-  *(*iargs)++ = (uint64_t)hentry->value.field
+  *(*iargs)++ = (uint64_t)hentry.value.field
 
 #define NB_PUSH_INT64(field) NB_PUSH_INT(field)
 #define NB_PUSH_UINT64(field) NB_PUSH_UINT(field)
 
 #define NB_PUSH_DOUBLE(field)              \
   NB_CHECK(*dargs, max_dargs, 1, "float ") \
-  *(*dargs)++ = (double)hentry->value.field
+  *(*dargs)++ = (double)hentry.value.field
 
 #define NB_PUSH_VOIDP(field)                   \
   NB_CHECK(*iargs, max_iargs, 1, "non-float ") \
-  *(*iargs)++ = (uint64_t)(uint32_t)hentry->value.field
+  *(*iargs)++ = (uint64_t)(uint32_t)hentry.value.field
 
 #else
 
@@ -1040,34 +1789,34 @@ NB_Bool nb_handle_get_default(NB_Handle handle,
   } x;
 
 #define NB_PUSH_INT(field)                                          \
-  NB_CHECK(*iargs, max_iargs, 1, "") x.int32 = hentry->value.field; \
+  NB_CHECK(*iargs, max_iargs, 1, "") x.int32 = hentry.value.field; \
   *(*iargs)++ = x.lo
 
 #define NB_PUSH_UINT(field)                                          \
-  NB_CHECK(*iargs, max_iargs, 1, "") x.uint32 = hentry->value.field; \
+  NB_CHECK(*iargs, max_iargs, 1, "") x.uint32 = hentry.value.field; \
   *(*iargs)++ = x.lo
 
 #define NB_PUSH_INT64(field)                                        \
-  NB_CHECK(*iargs, max_iargs, 2, "") x.int64 = hentry->value.field; \
+  NB_CHECK(*iargs, max_iargs, 2, "") x.int64 = hentry.value.field; \
   *(*iargs)++ = x.lo;                                               \
   *(*iargs)++ = x.hi
 
 #define NB_PUSH_UINT64(field)                                        \
-  NB_CHECK(*iargs, max_iargs, 2, "") x.uint64 = hentry->value.field; \
+  NB_CHECK(*iargs, max_iargs, 2, "") x.uint64 = hentry.value.field; \
   *(*iargs)++ = x.lo;                                                \
   *(*iargs)++ = x.hi
 
 #define NB_PUSH_DOUBLE(field)                                         \
-  NB_CHECK(*iargs, max_iargs, 2, "") x.float64 = hentry->value.field; \
+  NB_CHECK(*iargs, max_iargs, 2, "") x.float64 = hentry.value.field; \
   *(*iargs)++ = x.lo;                                                 \
   *(*iargs)++ = x.hi
 
 #define NB_PUSH_VOIDP(field)         \
   NB_CHECK(*iargs, max_iargs, 1, "") \
-  *(*iargs)++ = (uint32_t)hentry->value.field
+  *(*iargs)++ = (uint32_t)hentry.value.field
 #endif
 
-  switch (hentry->type) {
+  switch (hentry.type) {
     case NB_TYPE_INT8:
       NB_PUSH_INT(int8);
       return NB_TRUE;
@@ -1104,7 +1853,7 @@ NB_Bool nb_handle_get_default(NB_Handle handle,
 
     default:
       NB_VERROR("Invalid type %s, can\'t make default promotion.",
-                nb_type_to_string(hentry->type));
+                nb_type_to_string(hentry.type));
       return NB_FALSE;
   }
 }
@@ -1117,29 +1866,30 @@ NB_Bool nb_handle_get_default(NB_Handle handle,
 #undef NB_PUSH_DOUBLE
 #undef NB_PUSH_VOIDP
 
-void nb_handle_destroy(NB_Handle handle) {
-  NB_HandleMapEntry* entry;
-  if (!nb_get_handle_entry(handle, &entry)) {
-    NB_VERROR("Destroying handle %d, but it doesn't exist.", handle);
-    return;
-  }
-
+static void nb_handle_release_entry(NB_Handle handle, NB_HandleEntry* entry) {
   /* Destroy resources associated with this handle */
   if (entry->type == NB_TYPE_VAR) {
-    nb_var_release(entry->value.var);
-    free(entry->string_value);
-    entry->string_value = NULL;
+    NB_HandleExtra* extra = &s_nb_handle_extras[entry->value.extra];
+    if (extra->var.type == PP_VARTYPE_ARRAY_BUFFER && extra->buffer_data) {
+      nb_var_buffer_unmap(extra->var);
+    }
+    nb_var_release(extra->var);
+    nb_handle_extra_free(entry->value.extra);
   } else if (entry->type == NB_TYPE_FUNC_ID) {
-    if (*entry->free_func) {
-      (*entry->free_func)(entry->value.int32);
+    NB_HandleExtra* extra = &s_nb_handle_extras[entry->value.extra];
+    if (extra->free_func) {
+      (*extra->free_func)(extra->func_id);
     } else {
       NB_VERROR("Warning: potentially leaking function pointer via handle %d.",
                 handle);
     }
+    nb_handle_extra_free(entry->value.extra);
   }
+}
 
+static void nb_handle_map_remove(NB_HandleMapEntry* entry) {
   /* Remove from chain */
-  NB_HandleMapEntry* search = nb_handle_main_entry(handle);
+  NB_HandleMapEntry* search = nb_handle_main_entry(entry->handle);
   assert(search != NULL);
   if (search != entry) {
     while (search->next != entry) {
@@ -1169,66 +1919,293 @@ void nb_handle_destroy(NB_Handle handle) {
   s_nb_handle_map_size--;
 }
 
-void nb_handle_destroy_many(NB_Handle* handles, uint32_t handles_count) {
-  /* TODO(binji): optimize */
+/* Removes the handle from its table, without releasing its resources. */
+static void nb_handle_unlink_entry(NB_HandleEntry* entry) {
+  if (entry->columns) {
+    entry->columns->handles[entry->index] = NB_INVALID_HANDLE;
+    entry->columns->size--;
+  } else {
+    nb_handle_map_remove(entry->map_entry);
+  }
+}
+
+static void nb_handle_destroy_unlocked(NB_Handle handle) {
+  NB_HandleEntry entry;
+  if (!nb_get_handle_entry(handle, &entry)) {
+    NB_VERROR("Destroying handle %d, but it doesn't exist.", handle);
+    return;
+  }
+
+  nb_handle_release_entry(handle, &entry);
+  nb_handle_unlink_entry(&entry);
+  nb_handle_maybe_shrink();
+}
+
+static void nb_handle_destroy_if_exists_unlocked(NB_Handle handle) {
+  NB_HandleEntry entry;
+  if (!nb_get_handle_entry(handle, &entry)) {
+    return;
+  }
+
+  nb_handle_release_entry(handle, &entry);
+  nb_handle_unlink_entry(&entry);
+  nb_handle_maybe_shrink();
+}
+
+static NB_Bool nb_handle_move_unlocked(NB_Handle from, NB_Handle to) {
+  NB_HandleEntry entry;
+
+  if (from == to || to == NB_INVALID_HANDLE ||
+      (nb_handle_is_ephemeral(to) &&
+       nb_handle_arena_index(to) >= NB_HANDLE_ARENA_MAX)) {
+    NB_VERROR("Can't move handle %d to %d.", from, to);
+    return NB_FALSE;
+  }
+
+  /* Check |from| before destroying |to|, so a failed move leaves |to| as it
+   * was. */
+  if (!nb_get_handle_entry(from, &entry)) {
+    NB_VERROR("Moving handle %d, but it doesn't exist.", from);
+    return NB_FALSE;
+  }
+
+  /* Destroying |to| may resize the tables that |entry| points into, so look
+   * |from| up again afterward. */
+  nb_handle_destroy_if_exists_unlocked(to);
+  nb_get_handle_entry(from, &entry);
+
+  /* The value, including any extra it owns, is transferred as is. */
+  nb_handle_unlink_entry(&entry);
+  if (!nb_register_handle(to, entry.type, entry.value)) {
+    /* Only running out of memory gets here. |from|'s place was just freed,
+     * so it can almost always take its value back. */
+    if (!nb_register_handle(from, entry.type, entry.value)) {
+      nb_handle_release_entry(from, &entry);
+    }
+    return NB_FALSE;
+  }
+
+  return NB_TRUE;
+}
+
+static void nb_handle_map_sweep(NB_Handle* handles,
+                                uint32_t handles_count,
+                                uint32_t dead_count) {
+  uint32_t i;
+  if (dead_count * 4 >= s_nb_handle_map_capacity) {
+    /* Rebuilding the map drops every dead entry in one pass over the table,
+     * which is cheaper than unlinking them one at a time. */
+    s_nb_handle_map_size -= dead_count;
+    if (nb_handle_map_resize(s_nb_handle_map_capacity)) {
+      return;
+    }
+    s_nb_handle_map_size += dead_count;
+  }
+
+  for (i = 0; i < handles_count; ++i) {
+    NB_HandleMapEntry* entry;
+    if (nb_handle_map_find(handles[i], &entry) &&
+        entry->type == NB_TYPE_INVALID) {
+      nb_handle_map_remove(entry);
+    }
+  }
+}
+
+static void nb_handle_destroy_many_unlocked(NB_Handle* handles,
+                                            uint32_t handles_count) {
+  uint32_t map_destroyed_count = 0;
   uint32_t i;
   for (i = 0; i < handles_count; ++i) {
     NB_Handle handle = handles[i];
-    nb_handle_destroy(handle);
+    NB_HandleEntry entry;
+    /* Skipped quietly, like nb_handle_destroy_if_exists; see handle.h. */
+    if (!nb_get_handle_entry(handle, &entry) ||
+        entry.type == NB_TYPE_INVALID) {
+      continue;
+    }
+
+    nb_handle_release_entry(handle, &entry);
+
+    if (entry.columns) {
+      entry.columns->handles[entry.index] = NB_INVALID_HANDLE;
+      entry.columns->size--;
+    } else {
+      /* Leave the entry in its chain so the remaining handles can still be
+       * found; the chains are repaired below. */
+      entry.map_entry->type = NB_TYPE_INVALID;
+      map_destroyed_count++;
+    }
+  }
+
+  if (map_destroyed_count > 0) {
+    nb_handle_map_sweep(handles, handles_count, map_destroyed_count);
+  }
+
+  nb_handle_maybe_shrink();
+}
+
+/* Frees the calling thread's unused string blocks, and its arena if no
+ * request is running on it. Other threads can't free this memory, so
+ * nb_handle_compact leaves it to each thread, which catches up when its
+ * outermost request finishes. */
+static void nb_handle_thread_compact(void) {
+  NB_HandleThreadState* thread = &s_nb_handle_thread;
+  nb_handle_strings_free_unused(NB_FALSE);
+  if (thread->arena_top == 0) {
+    nb_handle_columns_free(&thread->arena);
+    thread->compact_generation = s_nb_handle_compact_generation;
+  }
+}
+
+static NB_HandleArenaMark nb_handle_arena_push_unlocked(void) {
+  NB_HandleThreadState* thread = &s_nb_handle_thread;
+  NB_HandleArenaMark mark;
+  mark.base = thread->arena_base;
+  mark.string_block = thread->strings_current;
+  mark.string_used =
+      thread->strings_current ? thread->strings_current->used : 0;
+  thread->arena_base = thread->arena_top;
+  return mark;
+}
+
+static void nb_handle_arena_pop_unlocked(NB_HandleArenaMark mark) {
+  NB_HandleThreadState* thread = &s_nb_handle_thread;
+  size_t high_water = thread->arena_top;
+  size_t i;
+  for (i = thread->arena_base; i < thread->arena_top; ++i) {
+    NB_Handle handle = thread->arena.handles[i];
+    if (handle == NB_INVALID_HANDLE) {
+      continue;
+    }
+
+    NB_HandleEntry entry;
+    nb_handle_columns_entry(&thread->arena, i, &entry);
+    nb_handle_release_entry(handle, &entry);
+    thread->arena.handles[i] = NB_INVALID_HANDLE;
+    thread->arena.size--;
+  }
+
+  thread->arena_top = thread->arena_base;
+  thread->arena_base = mark.base;
+
+  /* Free the strings made in this frame, and invalidate this thread's cached
+   * strings, since they may have been among them. */
+  thread->strings_current = mark.string_block;
+  if (thread->strings_current) {
+    thread->strings_current->used = mark.string_used;
+  }
+  thread->strings_epoch = nb_handle_next_strings_epoch();
+  nb_handle_strings_free_unused(NB_TRUE);
+
+  if (thread->arena_top == 0 &&
+      thread->arena.capacity > NB_HANDLE_SLOTS_INITIAL_CAPACITY &&
+      high_water < thread->arena.capacity / NB_HANDLE_SHRINK_FACTOR) {
+    /* The outermost request used only a small part of the arena. It is empty
+     * now, so there is nothing to copy. */
+    NB_HandleColumns new_arena;
+    if (nb_handle_columns_alloc(&new_arena, thread->arena.capacity / 2)) {
+      nb_handle_columns_free(&thread->arena);
+      thread->arena = new_arena;
+    }
+  }
+
+  if (thread->arena_top == 0 &&
+      thread->compact_generation != s_nb_handle_compact_generation) {
+    nb_handle_thread_compact();
+  }
+}
+
+static void nb_handle_compact_unlocked(void) {
+  size_t i;
+
+  /* Move handles that were evicted from the slot table back, if their slot
+   * is free now. */
+  for (i = 0; i < s_nb_handle_map_capacity; ++i) {
+    NB_HandleMapEntry* entry = &s_nb_handle_map[i];
+    while (!nb_handle_entry_is_free(entry) &&
+           s_nb_handle_slots.capacity > 0 &&
+           s_nb_handle_slots.handles[nb_handle_slot_index(entry->handle)] ==
+               NB_INVALID_HANDLE) {
+      nb_handle_columns_set(&s_nb_handle_slots,
+                            nb_handle_slot_index(entry->handle),
+                            entry->handle,
+                            entry->type,
+                            entry->value);
+      /* This may move another entry of the chain into |entry|. */
+      nb_handle_map_remove(entry);
+    }
+  }
+
+  if (s_nb_handle_slots.capacity > 0) {
+    size_t new_capacity = nb_handle_capacity_for(
+        s_nb_handle_slots.size * 2, NB_HANDLE_SLOTS_INITIAL_CAPACITY);
+    if (new_capacity < s_nb_handle_slots.capacity) {
+      nb_handle_slots_resize(new_capacity);
+    }
+  }
+
+  if (s_nb_handle_map_capacity > 0) {
+    nb_handle_map_shrink(nb_handle_capacity_for(
+        s_nb_handle_map_size * 2, NB_HANDLE_MAP_INITIAL_CAPACITY));
   }
+
+  nb_handle_extras_shrink();
+  s_nb_handle_compact_generation++;
+  nb_handle_thread_compact();
 }
 
-NB_Bool nb_handle_convert_to_var(NB_Handle handle, struct PP_Var* var) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_convert_to_var_unlocked(NB_Handle handle,
+                                                 struct PP_Var* var) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  switch (hentry->type) {
+  switch (hentry.type) {
     case NB_TYPE_INT8:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.int8;
+      var->value.as_int = hentry.value.int8;
       break;
     case NB_TYPE_UINT8:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.uint8;
+      var->value.as_int = hentry.value.uint8;
       break;
     case NB_TYPE_INT16:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.int16;
+      var->value.as_int = hentry.value.int16;
       break;
     case NB_TYPE_UINT16:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.uint16;
+      var->value.as_int = hentry.value.uint16;
       break;
     case NB_TYPE_INT32:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.int32;
+      var->value.as_int = hentry.value.int32;
       break;
     case NB_TYPE_UINT32:
       var->type = PP_VARTYPE_INT32;
-      var->value.as_int = hentry->value.uint32;
+      var->value.as_int = hentry.value.uint32;
       break;
     case NB_TYPE_INT64:
-      *var = nb_var_int64_create(hentry->value.int64);
+      *var = nb_var_int64_create(hentry.value.int64);
       break;
     case NB_TYPE_UINT64:
-      *var = nb_var_int64_create((int64_t)hentry->value.uint64);
+      *var = nb_var_int64_create((int64_t)hentry.value.uint64);
       break;
     case NB_TYPE_FLOAT:
       var->type = PP_VARTYPE_DOUBLE;
-      var->value.as_double = hentry->value.float32;
+      var->value.as_double = hentry.value.float32;
       break;
     case NB_TYPE_DOUBLE:
       var->type = PP_VARTYPE_DOUBLE;
-      var->value.as_double = hentry->value.float64;
+      var->value.as_double = hentry.value.float64;
       break;
     case NB_TYPE_VAR:
-      *var = hentry->value.var;
+      *var = s_nb_handle_extras[hentry.value.extra].var;
       nb_var_addref(*var);
       break;
     case NB_TYPE_VOID_P:
-      if (hentry->value.voidp) {
+      if (hentry.value.voidp) {
         var->type = PP_VARTYPE_INT32;
         var->value.as_int = handle;
       } else {
@@ -1238,27 +2215,229 @@ NB_Bool nb_handle_convert_to_var(NB_Handle handle, struct PP_Var* var) {
     default:
       NB_VERROR("Don't know how to convert handle %d with type %s to var",
                 handle,
-                nb_type_to_string(hentry->type));
+                nb_type_to_string(hentry.type));
       return NB_FALSE;
   }
 
   return NB_TRUE;
 }
 
-NB_Bool nb_handle_set_func_id_free(NB_Handle handle, NB_FuncIdFree free_func) {
-  NB_HandleMapEntry* hentry;
+static NB_Bool nb_handle_convert_to_scalar_unlocked(
+    NB_Handle handle,
+    NB_Type* out_type,
+    NB_HandleScalar* out_value) {
+  NB_HandleEntry hentry;
   if (!nb_get_handle_entry(handle, &hentry)) {
     return NB_FALSE;
   }
 
-  if (hentry->type != NB_TYPE_FUNC_ID) {
+  /* These must match nb_handle_convert_to_var above. */
+  switch (hentry.type) {
+    case NB_TYPE_INT8:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.int8;
+      break;
+    case NB_TYPE_UINT8:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.uint8;
+      break;
+    case NB_TYPE_INT16:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.int16;
+      break;
+    case NB_TYPE_UINT16:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.uint16;
+      break;
+    case NB_TYPE_INT32:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.int32;
+      break;
+    case NB_TYPE_UINT32:
+      *out_type = NB_TYPE_INT32;
+      out_value->int32 = hentry.value.uint32;
+      break;
+    case NB_TYPE_INT64:
+      *out_type = NB_TYPE_INT64;
+      out_value->int64 = hentry.value.int64;
+      break;
+    case NB_TYPE_UINT64:
+      *out_type = NB_TYPE_INT64;
+      out_value->int64 = (int64_t)hentry.value.uint64;
+      break;
+    case NB_TYPE_FLOAT:
+      *out_type = NB_TYPE_DOUBLE;
+      out_value->float64 = hentry.value.float32;
+      break;
+    case NB_TYPE_DOUBLE:
+      *out_type = NB_TYPE_DOUBLE;
+      out_value->float64 = hentry.value.float64;
+      break;
+    case NB_TYPE_VOID_P:
+      if (hentry.value.voidp) {
+        *out_type = NB_TYPE_INT32;
+        out_value->int32 = handle;
+      } else {
+        *out_type = NB_TYPE_INVALID;
+      }
+      break;
+    default:
+      return NB_FALSE;
+  }
+
+  return NB_TRUE;
+}
+
+static NB_Bool nb_handle_set_func_id_free_unlocked(NB_Handle handle,
+                                                   NB_FuncIdFree free_func) {
+  NB_HandleEntry hentry;
+  if (!nb_get_handle_entry(handle, &hentry)) {
+    return NB_FALSE;
+  }
+
+  if (hentry.type != NB_TYPE_FUNC_ID) {
     NB_VERROR("handle %d is of type %s. Expected %s.",
               handle,
-              nb_type_to_string(hentry->type),
+              nb_type_to_string(hentry.type),
               nb_type_to_string(NB_TYPE_FUNC_ID));
     return NB_FALSE;
   }
 
-  hentry->free_func = free_func;
+  s_nb_handle_extras[hentry.value.extra].free_func = free_func;
   return NB_TRUE;
 }
+
+void nb_handle_set_thread_safe(void) {
+  pthread_mutexattr_t attr;
+
+  if (s_nb_handle_thread_safe) {
+    return;
+  }
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&s_nb_handle_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  s_nb_handle_thread_safe = NB_TRUE;
+}
+
+static inline void nb_handle_lock(void) {
+  if (s_nb_handle_thread_safe) {
+    pthread_mutex_lock(&s_nb_handle_mutex);
+  }
+}
+
+static inline void nb_handle_unlock(void) {
+  if (s_nb_handle_thread_safe) {
+    pthread_mutex_unlock(&s_nb_handle_mutex);
+  }
+}
+
+/* The public functions are the *_unlocked functions above, run with the lock
+ * held. */
+#define NB_HANDLE_LOCKED(ret_type, name, params, args) \
+  ret_type name params {                               \
+    ret_type result;                                   \
+    nb_handle_lock();                                  \
+    result = name##_unlocked args;                     \
+    nb_handle_unlock();                                \
+    return result;                                     \
+  }
+
+#define NB_HANDLE_LOCKED_VOID(name, params, args) \
+  void name params {                              \
+    nb_handle_lock();                             \
+    name##_unlocked args;                         \
+    nb_handle_unlock();                           \
+  }
+
+#define NB_HANDLE_LOCKED_REGISTER_GET(name, type)       \
+  NB_HANDLE_LOCKED(NB_Bool,                             \
+                   nb_handle_register_##name,           \
+                   (NB_Handle handle, type value),      \
+                   (handle, value))                     \
+  NB_HANDLE_LOCKED(NB_Bool,                             \
+                   nb_handle_get_##name,                \
+                   (NB_Handle handle, type* out_value), \
+                   (handle, out_value))
+
+NB_HANDLE_LOCKED(int32_t, nb_handle_count, (void), ())
+NB_HANDLE_LOCKED_REGISTER_GET(int8, int8_t)
+NB_HANDLE_LOCKED_REGISTER_GET(uint8, uint8_t)
+NB_HANDLE_LOCKED_REGISTER_GET(int16, int16_t)
+NB_HANDLE_LOCKED_REGISTER_GET(uint16, uint16_t)
+NB_HANDLE_LOCKED_REGISTER_GET(int32, int32_t)
+NB_HANDLE_LOCKED_REGISTER_GET(uint32, uint32_t)
+NB_HANDLE_LOCKED_REGISTER_GET(int64, int64_t)
+NB_HANDLE_LOCKED_REGISTER_GET(uint64, uint64_t)
+NB_HANDLE_LOCKED_REGISTER_GET(float, float)
+NB_HANDLE_LOCKED_REGISTER_GET(double, double)
+NB_HANDLE_LOCKED_REGISTER_GET(voidp, void*)
+NB_HANDLE_LOCKED_REGISTER_GET(func_id, NB_FuncId)
+NB_HANDLE_LOCKED_REGISTER_GET(var, struct PP_Var)
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_register_funcp,
+                 (NB_Handle handle, void (*value)(void)),
+                 (handle, value))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_buffer_length,
+                 (NB_Handle handle, uint32_t* out_length),
+                 (handle, out_length))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_funcp,
+                 (NB_Handle handle, void (**out_value)(void)),
+                 (handle, out_value))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_charp,
+                 (NB_Handle handle, char** out_value),
+                 (handle, out_value))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_string,
+                 (NB_Handle handle,
+                  const char** out_value,
+                  uint32_t* out_length),
+                 (handle, out_value, out_length))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_type,
+                 (NB_Handle handle, NB_Type* out_type),
+                 (handle, out_type))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_get_default,
+                 (NB_Handle handle,
+                  NB_VarArgInt** iargs,
+                  NB_VarArgInt* max_iargs,
+                  NB_VarArgDbl** dargs,
+                  NB_VarArgDbl* max_dargs),
+                 (handle, iargs, max_iargs, dargs, max_dargs))
+NB_HANDLE_LOCKED_VOID(nb_handle_destroy, (NB_Handle handle), (handle))
+NB_HANDLE_LOCKED_VOID(nb_handle_destroy_if_exists,
+                      (NB_Handle handle),
+                      (handle))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_move,
+                 (NB_Handle from, NB_Handle to),
+                 (from, to))
+NB_HANDLE_LOCKED_VOID(nb_handle_destroy_many,
+                      (NB_Handle* handles, uint32_t handles_count),
+                      (handles, handles_count))
+NB_HANDLE_LOCKED(NB_HandleArenaMark, nb_handle_arena_push, (void), ())
+NB_HANDLE_LOCKED_VOID(nb_handle_arena_pop, (NB_HandleArenaMark mark), (mark))
+NB_HANDLE_LOCKED_VOID(nb_handle_compact, (void), ())
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_convert_to_var,
+                 (NB_Handle handle, struct PP_Var* var),
+                 (handle, var))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_convert_to_scalar,
+                 (NB_Handle handle,
+                  NB_Type* out_type,
+                  NB_HandleScalar* out_value),
+                 (handle, out_type, out_value))
+NB_HANDLE_LOCKED(NB_Bool,
+                 nb_handle_set_func_id_free,
+                 (NB_Handle handle, NB_FuncIdFree free_func),
+                 (handle, free_func))
+
+#undef NB_HANDLE_LOCKED_REGISTER_GET
+#undef NB_HANDLE_LOCKED_VOID
+#undef NB_HANDLE_LOCKED
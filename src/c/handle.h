@@ -16,6 +16,7 @@
 #ifndef NB_HANDLE_H_
 #define NB_HANDLE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <ppapi/c/pp_var.h>
 
@@ -40,6 +41,8 @@ typedef uint32_t NB_VarArgInt;
 typedef double NB_VarArgDbl;
 #endif
 
+/* Counts the shared handles, plus the request-scoped (negative) handles of the
+ * calling thread only. Other threads' arenas aren't visible here. */
 int32_t nb_handle_count(void);
 NB_Bool nb_handle_register_int8(NB_Handle, int8_t);
 NB_Bool nb_handle_register_uint8(NB_Handle, uint8_t);
@@ -65,20 +68,81 @@ NB_Bool nb_handle_get_int64(NB_Handle, int64_t*);
 NB_Bool nb_handle_get_uint64(NB_Handle, uint64_t*);
 NB_Bool nb_handle_get_float(NB_Handle, float*);
 NB_Bool nb_handle_get_double(NB_Handle, double*);
+/* For ArrayBuffer vars, this returns the buffer's data in place. The buffer is
+ * mapped on first use and unmapped when the handle is destroyed. */
 NB_Bool nb_handle_get_voidp(NB_Handle, void**);
+/* Gets the size of an ArrayBuffer var handle's data. Returns NB_FALSE for other
+ * handles, e.g. native pointers, whose size isn't known. */
+NB_Bool nb_handle_get_buffer_length(NB_Handle, uint32_t* out_length);
 NB_Bool nb_handle_get_funcp(NB_Handle, void(**)(void));
 NB_Bool nb_handle_get_func_id(NB_Handle, NB_FuncId*);
+/* For string vars, this returns a NULL-terminated copy, which stays valid
+ * until the end of the current request. */
 NB_Bool nb_handle_get_charp(NB_Handle, char**);
+/* Like nb_handle_get_charp, but returns the length instead of copying. The
+ * string is not NULL-terminated. ArrayBuffer vars return their mapped data.
+ * |out_length| may be NULL; otherwise, for void* handles it is found with
+ * strlen, so only pass it when the pointer is known to be NULL-terminated. */
+NB_Bool nb_handle_get_string(NB_Handle, const char**, uint32_t* out_length);
 NB_Bool nb_handle_get_var(NB_Handle, struct PP_Var*);
+/* Gets the type of the handle's value. Unlike the getters above, this doesn't
+ * log an error if the handle doesn't exist. */
+NB_Bool nb_handle_get_type(NB_Handle, NB_Type*);
 NB_Bool nb_handle_get_default(NB_Handle,
                               NB_VarArgInt** iargs,
                               NB_VarArgInt* max_iargs,
                               NB_VarArgDbl** dargs,
                               NB_VarArgDbl* max_dargs);
 void nb_handle_destroy(NB_Handle);
+/* Handles that don't exist are skipped. A request's destroy list may name the
+ * ret handles of commands that never ran, e.g. in an untaken $if branch. */
 void nb_handle_destroy_many(NB_Handle*, uint32_t handles_count);
+/* Like nb_handle_destroy, but does nothing if the handle doesn't exist. */
+void nb_handle_destroy_if_exists(NB_Handle);
+/* Destroys |to| if it exists, then gives the value of |from| to |to|. |from|
+ * no longer exists afterward. If |from| doesn't exist or |to| is invalid,
+ * nothing changes. If memory runs out, |to| is still destroyed, but |from|
+ * keeps its value. */
+NB_Bool nb_handle_move(NB_Handle from, NB_Handle to);
+
+/* Handles with negative ids are request-scoped: they are destroyed in one
+ * sweep when the arena frame they were registered in is popped. Pushing a
+ * frame hides the ephemeral handles of the enclosing frame until it is
+ * popped again. Strings returned by nb_handle_get_charp are freed when the
+ * frame is popped too. */
+typedef struct {
+  size_t base;
+  void* string_block;
+  size_t string_used;
+} NB_HandleArenaMark;
+NB_HandleArenaMark nb_handle_arena_push(void);
+void nb_handle_arena_pop(NB_HandleArenaMark);
+
+/* The handle tables shrink automatically when they become mostly empty. This
+ * shrinks them as far as possible, e.g. when the application is idle. */
+void nb_handle_compact(void);
+
 NB_Bool nb_handle_convert_to_var(NB_Handle, struct PP_Var*);
 
+typedef union {
+  int32_t int32;
+  int64_t int64;
+  double float64;
+} NB_HandleScalar;
+
+/* Like nb_handle_convert_to_var, but without creating a var. |out_type| is
+ * set to NB_TYPE_INT32, NB_TYPE_INT64 or NB_TYPE_DOUBLE, or NB_TYPE_INVALID
+ * for a NULL pointer. Fails for handles that can only be converted to vars,
+ * e.g. strings. */
+NB_Bool nb_handle_convert_to_scalar(NB_Handle,
+                                    NB_Type* out_type,
+                                    NB_HandleScalar* out_value);
+
+/* Make the handle functions safe to call from several threads at once. Must
+ * be called before any other thread uses handles. Request-scoped handles are
+ * per-thread, so concurrent requests can use the same negative ids. */
+void nb_handle_set_thread_safe(void);
+
 typedef void (*NB_FuncIdFree)(NB_FuncId);
 NB_Bool nb_handle_set_func_id_free(NB_Handle, NB_FuncIdFree);
 
@@ -15,6 +15,7 @@
 
 #ifndef NB_ONE_FILE
 #include "interfaces.h"
+#include "var.h"
 #endif
 
 #include <stdlib.h>
@@ -41,4 +42,6 @@ void nb_interfaces_init(PP_Instance instance, PPB_GetInterface get_interface) {
       (struct PPB_##s##_##v*)get_interface(PPB_##d##_INTERFACE_##v);
   NB_INTERFACES
 #undef X
+
+  nb_var_keys_init();
 }
@@ -18,83 +18,383 @@
 #include "var.h"
 #endif
 
+#include <assert.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
+/* Number of times the consumer polls an empty queue before going to sleep. */
+#define NB_QUEUE_SPIN_COUNT 1000
+
+/* Capacity of the first ring segment; the queue grows from there up to
+ * |max_size|. */
+#define NB_QUEUE_INITIAL_SIZE 16
+
+/* The queue has exactly one producer (the main thread, which must never
+ * block) and one consumer (the thread running requests), so it is a
+ * lock-free ring buffer: only the producer writes |tail|, and only the
+ * consumer writes |head|. Both are free-running counters; the ring index is
+ * the counter masked by capacity - 1.
+ *
+ * When a ring segment is full, the producer links a new segment twice the
+ * size and continues there. The consumer frees the old segment once it has
+ * read everything in it, so the producer never touches a segment again after
+ * linking |next|. */
+struct NB_QueueSegment {
+  struct NB_QueueSegment* volatile next;
+  uint32_t capacity;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  struct PP_Var data[1];
+};
+
+/* |size| counts the messages in all segments, and is the only field written
+ * by both threads.
+ *
+ * The mutex and condition variable are only used when the consumer has found
+ * the queue empty for a while and goes to sleep; it sets |waiting| first, so
+ * the producer knows to wake it. */
 struct NB_Queue {
-  struct PP_Var* data;
+  struct NB_QueueSegment* producer_segment;
+  struct NB_QueueSegment* consumer_segment;
+  uint32_t max_size;
+  volatile uint32_t size;
+  volatile uint32_t waiting;
   pthread_mutex_t mutex;
   pthread_cond_t not_empty_cond;
-  int capacity;
-  int start;
-  int end;
-  int size;
+
+  /* See nb_queue_set_watermarks. Both threads can cross a watermark at the
+   * same time, so the callback is serialized by |watermark_mutex|, and
+   * reports |above_high_water| as it is then, rather than the crossing that
+   * triggered it. */
+  uint32_t low_water;
+  uint32_t high_water;
+  volatile uint32_t above_high_water;
+  uint32_t reported_above_high_water;
+  pthread_mutex_t watermark_mutex;
+  NB_QueueWatermarkFunc watermark_func;
+  void* watermark_user_data;
+
+  /* See nb_queue_get_stats. The first three are only written by the
+   * producer, the rest only by the consumer. */
+  volatile uint32_t max_depth;
+  volatile uint32_t enqueued;
+  volatile uint32_t dropped;
+  uint32_t dequeued;
+  uint32_t waits;
+  double wait_time_ms;
 };
 
+/* Older toolchains only have the __sync builtins, which are all full
+ * barriers. */
+#ifdef __ATOMIC_ACQUIRE
+static inline uint32_t nb_atomic_load_acquire(volatile uint32_t* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void nb_atomic_store_release(volatile uint32_t* p,
+                                           uint32_t value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static inline struct NB_QueueSegment* nb_atomic_load_acquire_segment(
+    struct NB_QueueSegment* volatile* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void nb_atomic_store_release_segment(
+    struct NB_QueueSegment* volatile* p,
+    struct NB_QueueSegment* value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static inline void nb_atomic_fence(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#else
+static inline uint32_t nb_atomic_load_acquire(volatile uint32_t* p) {
+  uint32_t value = *p;
+  __sync_synchronize();
+  return value;
+}
+
+static inline void nb_atomic_store_release(volatile uint32_t* p,
+                                           uint32_t value) {
+  __sync_synchronize();
+  *p = value;
+}
+
+static inline struct NB_QueueSegment* nb_atomic_load_acquire_segment(
+    struct NB_QueueSegment* volatile* p) {
+  struct NB_QueueSegment* value = *p;
+  __sync_synchronize();
+  return value;
+}
+
+static inline void nb_atomic_store_release_segment(
+    struct NB_QueueSegment* volatile* p,
+    struct NB_QueueSegment* value) {
+  __sync_synchronize();
+  *p = value;
+}
+
+static inline void nb_atomic_fence(void) {
+  __sync_synchronize();
+}
+#endif
+
+static struct NB_QueueSegment* nb_queue_segment_create(uint32_t capacity) {
+  return calloc(1, sizeof(struct NB_QueueSegment) +
+                       (capacity - 1) * sizeof(struct PP_Var));
+}
+
 struct NB_Queue* nb_queue_create(int max_size) {
   struct NB_Queue* queue = calloc(1, sizeof(struct NB_Queue));
-  queue->data = calloc(max_size, sizeof(struct PP_Var));
-  queue->capacity = max_size;
+  uint32_t capacity = 1;
+  while (capacity < (uint32_t)max_size && capacity < NB_QUEUE_INITIAL_SIZE) {
+    capacity *= 2;
+  }
+
+  queue->producer_segment = nb_queue_segment_create(capacity);
+  queue->producer_segment->capacity = capacity;
+  queue->consumer_segment = queue->producer_segment;
+  queue->max_size = max_size;
 
   pthread_mutex_init(&queue->mutex, NULL);
   pthread_cond_init(&queue->not_empty_cond, NULL);
+  pthread_mutex_init(&queue->watermark_mutex, NULL);
 
   return queue;
 }
 
 void nb_queue_destroy(struct NB_Queue* queue) {
-  free(queue->data);
+  struct NB_QueueSegment* segment = queue->consumer_segment;
+  while (segment) {
+    struct NB_QueueSegment* next = segment->next;
+    free(segment);
+    segment = next;
+  }
+
+  pthread_mutex_destroy(&queue->watermark_mutex);
+  pthread_cond_destroy(&queue->not_empty_cond);
+  pthread_mutex_destroy(&queue->mutex);
   free(queue);
 }
 
-static int nb_queue_isempty(struct NB_Queue* queue) {
-  return queue->size == 0;
+void nb_queue_set_watermarks(struct NB_Queue* queue,
+                             uint32_t low_water,
+                             uint32_t high_water,
+                             NB_QueueWatermarkFunc func,
+                             void* user_data) {
+  assert(low_water < high_water);
+  queue->low_water = low_water;
+  queue->high_water = high_water;
+  queue->watermark_func = func;
+  queue->watermark_user_data = user_data;
+}
+
+static void nb_queue_notify_watermark(struct NB_Queue* queue) {
+  uint32_t above_high_water;
+
+  pthread_mutex_lock(&queue->watermark_mutex);
+  above_high_water = nb_atomic_load_acquire(&queue->above_high_water);
+  if (above_high_water != queue->reported_above_high_water) {
+    queue->reported_above_high_water = above_high_water;
+    queue->watermark_func(queue, above_high_water,
+                          queue->watermark_user_data);
+  }
+  pthread_mutex_unlock(&queue->watermark_mutex);
 }
 
-static int nb_queue_isfull(struct NB_Queue* queue) {
-  return queue->size == queue->capacity;
+static double nb_queue_now_ms(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
 }
 
-int nb_queue_enqueue(struct NB_Queue* queue, struct PP_Var message) {
+void nb_queue_get_stats(struct NB_Queue* queue, struct NB_QueueStats* stats) {
+  stats->size = nb_atomic_load_acquire(&queue->size);
+  stats->max_size = queue->max_size;
+  stats->max_depth = nb_atomic_load_acquire(&queue->max_depth);
+  stats->enqueued = nb_atomic_load_acquire(&queue->enqueued);
+  stats->dequeued = queue->dequeued;
+  stats->dropped = nb_atomic_load_acquire(&queue->dropped);
+  stats->waits = queue->waits;
+  stats->wait_time_ms = queue->wait_time_ms;
+}
+
+uint32_t nb_queue_size(struct NB_Queue* queue) {
+  return nb_atomic_load_acquire(&queue->size);
+}
+
+uint32_t nb_queue_max_size(struct NB_Queue* queue) {
+  return queue->max_size;
+}
+
+static int nb_queue_enqueue_internal(struct NB_Queue* queue,
+                                     struct PP_Var message,
+                                     int bounded) {
+  struct NB_QueueSegment* segment = queue->producer_segment;
+  uint32_t tail = segment->tail;
+  uint32_t size;
+
+  /* We shouldn't block the main thread waiting for the queue to not be full,
+   * so just drop the message, unless the caller can't afford to lose it. Only the consumer can change |size| behind our
+   * back, and it only makes it smaller. */
+  if (bounded && nb_atomic_load_acquire(&queue->size) >= queue->max_size) {
+    goto dropped;
+  }
+
+  if (tail - nb_atomic_load_acquire(&segment->head) == segment->capacity) {
+    struct NB_QueueSegment* new_segment;
+    uint32_t capacity = segment->capacity * 2;
+
+    new_segment = nb_queue_segment_create(capacity);
+    if (new_segment == NULL) {
+      goto dropped;
+    }
+
+    new_segment->capacity = capacity;
+    nb_atomic_store_release_segment(&segment->next, new_segment);
+    queue->producer_segment = segment = new_segment;
+    tail = 0;
+  }
+
   /* Take ownership of message */
   nb_var_addref(message);
 
-  pthread_mutex_lock(&queue->mutex);
+  segment->data[tail & (segment->capacity - 1)] = message;
 
-  /* We shouldn't block the main thread waiting for the queue to not be full,
-   * so just drop the message. */
-  if (nb_queue_isfull(queue)) {
+  /* Count the message before publishing it, so the consumer can never
+   * subtract it from |size| first and wrap below zero. */
+  size = __sync_add_and_fetch(&queue->size, 1);
+  nb_atomic_store_release(&segment->tail, tail + 1);
+
+  nb_atomic_store_release(&queue->enqueued, queue->enqueued + 1);
+  if (size > queue->max_depth) {
+    nb_atomic_store_release(&queue->max_depth, size);
+  }
+
+  if (queue->watermark_func && size >= queue->high_water &&
+      __sync_bool_compare_and_swap(&queue->above_high_water, 0, 1)) {
+    /* The consumer may have drained to the low-water mark after we read
+     * |size|, and failed to clear |above_high_water| because we hadn't set it
+     * yet. Nothing would clear it after that, so check again here. Both sides
+     * use full barriers, so either we see the new |size|, or the consumer
+     * sees |above_high_water| set. */
+    if (nb_atomic_load_acquire(&queue->size) <= queue->low_water) {
+      __sync_bool_compare_and_swap(&queue->above_high_water, 1, 0);
+    }
+    nb_queue_notify_watermark(queue);
+  }
+
+  /* The barrier orders the stores to |tail| and |next| above before the load
+   * of |waiting|, so either the consumer sees the new message before it
+   * sleeps, or we see that it is sleeping. */
+  nb_atomic_fence();
+  if (nb_atomic_load_acquire(&queue->waiting)) {
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cond_signal(&queue->not_empty_cond);
     pthread_mutex_unlock(&queue->mutex);
-    nb_var_release(message);
-    return 0;
   }
 
-  queue->data[queue->end] = message;
-  queue->end = (queue->end + 1) % queue->capacity;
-  queue->size++;
+  return 1;
 
-  pthread_cond_signal(&queue->not_empty_cond);
+dropped:
+  nb_atomic_store_release(&queue->dropped, queue->dropped + 1);
+  return 0;
+}
 
-  pthread_mutex_unlock(&queue->mutex);
+int nb_queue_enqueue(struct NB_Queue* queue, struct PP_Var message) {
+  return nb_queue_enqueue_internal(queue, message, 1);
+}
 
-  return 1;
+int nb_queue_enqueue_unbounded(struct NB_Queue* queue, struct PP_Var message) {
+  return nb_queue_enqueue_internal(queue, message, 0);
+}
+
+/* Returns true if there is a message to read in |segment|, or the producer
+ * has moved on to the next segment. */
+static int nb_queue_segment_ready(struct NB_QueueSegment* segment,
+                                  uint32_t head) {
+  return nb_atomic_load_acquire(&segment->tail) != head ||
+         nb_atomic_load_acquire_segment(&segment->next) != NULL;
 }
 
 struct PP_Var nb_queue_dequeue(struct NB_Queue* queue) {
   struct PP_Var message;
+  nb_queue_dequeue_batch(queue, &message, 1);
+  return message;
+}
+
+uint32_t nb_queue_dequeue_batch(struct NB_Queue* queue,
+                                struct PP_Var* out_messages,
+                                uint32_t max_count) {
+  struct NB_QueueSegment* segment;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t count;
+  uint32_t size;
+  uint32_t i;
+  int spin;
+  double wait_start_ms;
+
+  assert(max_count > 0);
 
-  pthread_mutex_lock(&queue->mutex);
+  while (1) {
+    segment = queue->consumer_segment;
+    head = segment->head;
 
-  while (nb_queue_isempty(queue)) {
-    pthread_cond_wait(&queue->not_empty_cond, &queue->mutex);
+    for (spin = 0; spin < NB_QUEUE_SPIN_COUNT; ++spin) {
+      if (nb_queue_segment_ready(segment, head)) {
+        goto ready;
+      }
+    }
+
+    wait_start_ms = nb_queue_now_ms();
+    pthread_mutex_lock(&queue->mutex);
+    nb_atomic_store_release(&queue->waiting, 1);
+    nb_atomic_fence();
+    while (!nb_queue_segment_ready(segment, head)) {
+      pthread_cond_wait(&queue->not_empty_cond, &queue->mutex);
+    }
+    nb_atomic_store_release(&queue->waiting, 0);
+    pthread_mutex_unlock(&queue->mutex);
+    queue->waits++;
+    queue->wait_time_ms += nb_queue_now_ms() - wait_start_ms;
+
+  ready:
+    /* The producer writes the last message of a segment before linking
+     * |next|, so check |tail| again before moving on. */
+    tail = nb_atomic_load_acquire(&segment->tail);
+    if (tail != head) {
+      break;
+    }
+
+    queue->consumer_segment = segment->next;
+    free(segment);
   }
 
-  message = queue->data[queue->start];
-  queue->start = (queue->start + 1) % queue->capacity;
-  queue->size--;
+  /* Take everything that is ready in this segment, and publish the new |head|
+   * and |size| once for the whole batch. */
+  count = tail - head;
+  if (count > max_count) {
+    count = max_count;
+  }
 
-  pthread_mutex_unlock(&queue->mutex);
+  for (i = 0; i < count; ++i) {
+    out_messages[i] = segment->data[(head + i) & (segment->capacity - 1)];
+  }
+  nb_atomic_store_release(&segment->head, head + count);
+
+  queue->dequeued += count;
+  size = __sync_sub_and_fetch(&queue->size, count);
+  if (queue->watermark_func && size <= queue->low_water &&
+      __sync_bool_compare_and_swap(&queue->above_high_water, 1, 0)) {
+    nb_queue_notify_watermark(queue);
+  }
 
   /* pass refcount ownership from this queue to the caller */
-  return message;
+  return count;
 }
@@ -16,6 +16,7 @@
 #ifndef NB_QUEUE_H_
 #define NB_QUEUE_H_
 
+#include <stdint.h>
 #include <ppapi/c/pp_var.h>
 
 #ifdef __cplusplus
@@ -24,10 +25,51 @@ extern "C" {
 
 struct NB_Queue;
 
+/* The queue starts small and grows as needed, but never holds more than
+ * |max_size| messages; nb_queue_enqueue returns 0 instead. */
 struct NB_Queue* nb_queue_create(int max_size);
 void nb_queue_destroy(struct NB_Queue*);
+uint32_t nb_queue_size(struct NB_Queue*);
+uint32_t nb_queue_max_size(struct NB_Queue*);
+
+/* Counters for monitoring the queue under load. The producer's counters are
+ * read without stopping it, so they may be slightly stale. */
+struct NB_QueueStats {
+  uint32_t size;
+  uint32_t max_size;
+  uint32_t max_depth; /* The largest size the queue has reached. */
+  uint32_t enqueued;
+  uint32_t dequeued;
+  uint32_t dropped;
+  uint32_t waits; /* Times the consumer went to sleep on an empty queue. */
+  double wait_time_ms;
+};
+/* Must be called on the consumer thread. */
+void nb_queue_get_stats(struct NB_Queue*, struct NB_QueueStats*);
+
+/* |func| is called with above_high_water = 1 when the queue size reaches
+ * |high_water|, and then with above_high_water = 0 when it drops back to
+ * |low_water|. It may be called on either the producer or the consumer
+ * thread. */
+typedef void (*NB_QueueWatermarkFunc)(struct NB_Queue*,
+                                      int above_high_water,
+                                      void* user_data);
+void nb_queue_set_watermarks(struct NB_Queue*,
+                             uint32_t low_water,
+                             uint32_t high_water,
+                             NB_QueueWatermarkFunc func,
+                             void* user_data);
+
 int nb_queue_enqueue(struct NB_Queue*, struct PP_Var);
+/* Like nb_queue_enqueue, but ignores |max_size|, for messages that must not be
+ * dropped. Still returns 0 if memory runs out. */
+int nb_queue_enqueue_unbounded(struct NB_Queue*, struct PP_Var);
 struct PP_Var nb_queue_dequeue(struct NB_Queue*);
+/* Waits for at least one message, then dequeues as many as are ready, up to
+ * |max_count|. Returns the number of messages written to |out_messages|. */
+uint32_t nb_queue_dequeue_batch(struct NB_Queue*,
+                                struct PP_Var* out_messages,
+                                uint32_t max_count);
 
 #ifdef __cplusplus
 }
@@ -19,6 +19,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ppapi/c/pp_var.h>
@@ -32,12 +34,15 @@
 struct NB_Request;
 struct NB_Command;
 
-static void* nb_calloc_list(uint32_t len, size_t element_size);
+static struct NB_Request* nb_request_create(void);
+static void* nb_request_alloc(struct NB_Request* request,
+                              uint32_t len,
+                              size_t element_size);
 static NB_Bool nb_expect_key(struct PP_Var var,
-                             const char* key,
+                             NB_VarKey key,
                              struct PP_Var* out_value);
 static NB_Bool nb_optional_key(struct PP_Var var,
-                               const char* key,
+                               NB_VarKey key,
                                struct PP_Var* out_value);
 static NB_Bool nb_request_parse_id(struct NB_Request* request,
                                    struct PP_Var var);
@@ -49,8 +54,19 @@ static NB_Bool nb_request_parse_destroyhandles(struct NB_Request* request,
                                                struct PP_Var var);
 static NB_Bool nb_request_parse_commands(struct NB_Request* request,
                                          struct PP_Var var);
-static NB_Bool nb_request_parse_command(struct NB_Command* command,
+static NB_Bool nb_request_parse_packed(struct NB_Request* request,
+                                       struct PP_Var var);
+static NB_Bool nb_request_parse_programs(struct NB_Request* request,
+                                         struct PP_Var var);
+static NB_Bool nb_request_prepare(struct NB_Request* request,
+                                  int32_t program_id);
+static NB_Bool nb_request_use_program(struct NB_Request* request,
+                                      int32_t program_id);
+static NB_Bool nb_request_parse_command(struct NB_Request* request,
+                                        struct NB_Command* command,
                                         struct PP_Var var);
+static NB_Bool nb_request_parse_buffer(struct NB_Request* request,
+                                       struct PP_Var var);
 
 struct NB_Command {
   int id;
@@ -64,6 +80,15 @@ struct NB_HandleVarPair {
   struct PP_Var var;
 };
 
+/* A list of commands stored by a "prepare" request, so later requests can
+ * run it by id instead of sending the commands again. The commands and their
+ * args are allocated in the same block as the program. */
+struct NB_Program {
+  int32_t ref_count;
+  struct NB_Command* commands;
+  uint32_t commands_count;
+};
+
 struct NB_Request {
   int id;
   NB_Handle* gethandles;
@@ -74,8 +99,171 @@ struct NB_Request {
   uint32_t destroyhandles_count;
   struct NB_Command* commands;
   uint32_t commands_count;
+  /* If set, |commands| belong to this program, not the request. */
+  struct NB_Program* program;
+  /* If set, the response packs all values into one ArrayBuffer. */
+  NB_Bool packed_values;
+  /* The chunks the request and all of its lists are allocated from, newest
+   * first. The request itself is at the start of the last one. */
+  struct NB_RequestChunk* chunks;
+};
+
+/* Requests are allocated from chunks of memory that are freed all at once
+ * when the request is destroyed. The first chunk is sized to fit the previous
+ * request, and the last destroyed one is kept for the next request, so in
+ * steady state parsing doesn't call malloc or free. */
+struct NB_RequestChunk {
+  struct NB_RequestChunk* next;
+  size_t size;
+  size_t used;
+};
+
+#define NB_REQUEST_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define NB_REQUEST_CHUNK_HEADER_SIZE \
+  NB_REQUEST_ALIGN(sizeof(struct NB_RequestChunk))
+#define NB_REQUEST_CHUNK_DATA(chunk) \
+  ((uint8_t*)(chunk) + NB_REQUEST_CHUNK_HEADER_SIZE)
+#define NB_REQUEST_CHUNK_MIN_SIZE 1024
+/* A cached chunk this many times larger than the previous request is freed,
+ * so one large request doesn't keep its memory forever. */
+#define NB_REQUEST_CHUNK_SHRINK_FACTOR 4
+
+/* The size of the previous request. Only accessed while parsing. */
+static size_t s_nb_request_high_water = NB_REQUEST_CHUNK_MIN_SIZE;
+/* Requests may be destroyed on any thread, so this is swapped atomically. */
+static struct NB_RequestChunk* s_nb_request_free_chunk;
+
+/* Binary requests are sent as a single ArrayBuffer of little-endian 32-bit
+ * words, so they can be parsed without any PP_Var dictionary lookups:
+ *
+ *   header:   magic, id, flags, prepare program id, run program id, set
+ *             count, commands count, total args count, get count, destroy
+ *             count
+ *   set:      handle, value tag, value (int32: 1 word, double and int64: 2
+ *             words, null: none)
+ *   commands: function id, ret handle (0 for none), args count, args...
+ *   get:      handles...
+ *   destroy:  handles...
+ *
+ * Program ids are 0 if unused. Strings and functions can't be encoded;
+ * requests that set them use the dictionary format instead, as do requests
+ * that unprepare programs. */
+#define NB_REQUEST_BINARY_MAGIC 0x3152424e /* "NBR1" */
+
+enum {
+  NB_REQUEST_HEADER_MAGIC,
+  NB_REQUEST_HEADER_ID,
+  NB_REQUEST_HEADER_FLAGS,
+  NB_REQUEST_HEADER_PREPARE,
+  NB_REQUEST_HEADER_PROGRAM,
+  NB_REQUEST_HEADER_SET_COUNT,
+  NB_REQUEST_HEADER_COMMANDS_COUNT,
+  NB_REQUEST_HEADER_ARGS_COUNT,
+  NB_REQUEST_HEADER_GET_COUNT,
+  NB_REQUEST_HEADER_DESTROY_COUNT,
+  NB_REQUEST_HEADER_WORDS
+};
+
+/* Header flags */
+#define NB_REQUEST_FLAG_PACKED_VALUES 1
+
+enum {
+  NB_REQUEST_VALUE_INT32 = 0,
+  NB_REQUEST_VALUE_DOUBLE = 1,
+  NB_REQUEST_VALUE_INT64 = 2,
+  NB_REQUEST_VALUE_NULL = 3,
 };
 
+/* Programs indexed by id. Only accessed while parsing, which always happens on
+ * the same thread. Ids are small, so the table is bounded. */
+#define NB_PROGRAM_ID_MAX (1 << 20)
+static struct NB_Program** s_nb_programs;
+static uint32_t s_nb_programs_capacity;
+
+static struct NB_Program* nb_program_create(struct NB_Command* commands,
+                                            uint32_t commands_count) {
+  struct NB_Program* program;
+  NB_Handle* args;
+  size_t size = sizeof(struct NB_Program) +
+                commands_count * sizeof(struct NB_Command);
+  uint32_t i;
+
+  for (i = 0; i < commands_count; ++i) {
+    size += commands[i].args_count * sizeof(NB_Handle);
+  }
+
+  program = malloc(size);
+  if (!program) {
+    NB_VERROR("Unable to allocate program of %u commands.", commands_count);
+    return NULL;
+  }
+
+  program->ref_count = 1;
+  program->commands = (struct NB_Command*)(program + 1);
+  program->commands_count = commands_count;
+  args = (NB_Handle*)(program->commands + commands_count);
+  for (i = 0; i < commands_count; ++i) {
+    program->commands[i] = commands[i];
+    program->commands[i].args = args;
+    memcpy(args, commands[i].args, commands[i].args_count * sizeof(NB_Handle));
+    args += commands[i].args_count;
+  }
+
+  return program;
+}
+
+static void nb_program_release(struct NB_Program* program) {
+  /* Requests using the program may be destroyed on other threads. */
+  if (__sync_sub_and_fetch(&program->ref_count, 1) == 0) {
+    free(program);
+  }
+}
+
+static NB_Bool nb_program_set(int32_t id, struct NB_Program* program) {
+  if (id <= 0 || id > NB_PROGRAM_ID_MAX) {
+    NB_VERROR("Expected program id to be in (0, %d]. Got %d",
+              NB_PROGRAM_ID_MAX, id);
+    return NB_FALSE;
+  }
+
+  if ((uint32_t)id >= s_nb_programs_capacity) {
+    uint32_t new_capacity = s_nb_programs_capacity;
+    struct NB_Program** new_programs;
+
+    if (program == NULL) {
+      return NB_TRUE;
+    }
+
+    if (new_capacity == 0) {
+      new_capacity = 16;
+    }
+
+    while (new_capacity <= (uint32_t)id) {
+      new_capacity *= 2;
+    }
+
+    new_programs =
+        realloc(s_nb_programs, new_capacity * sizeof(struct NB_Program*));
+    if (!new_programs) {
+      NB_VERROR("Unable to grow program table to %u entries.", new_capacity);
+      return NB_FALSE;
+    }
+
+    s_nb_programs = new_programs;
+    memset(s_nb_programs + s_nb_programs_capacity, 0,
+           (new_capacity - s_nb_programs_capacity) *
+               sizeof(struct NB_Program*));
+    s_nb_programs_capacity = new_capacity;
+  }
+
+  if (s_nb_programs[id]) {
+    nb_program_release(s_nb_programs[id]);
+  }
+
+  s_nb_programs[id] = program;
+  return NB_TRUE;
+}
+
 static NB_Bool nb_string_to_long(const char* s, uint32_t len, long* out_value) {
   enum { kBufferSize = 32 };
   char buffer[kBufferSize + 1];
@@ -110,14 +298,120 @@ static NB_Bool nb_var_string_to_long(struct PP_Var var, long* out_value) {
   return NB_TRUE;
 }
 
+static struct NB_RequestChunk* nb_request_chunk_create(size_t size) {
+  struct NB_RequestChunk* chunk =
+      malloc(NB_REQUEST_CHUNK_HEADER_SIZE + size);
+  if (!chunk) {
+    NB_VERROR("Unable to allocate request chunk of %u bytes.", (uint32_t)size);
+    return NULL;
+  }
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+struct NB_Request* nb_request_create(void) {
+  struct NB_RequestChunk* chunk =
+      __sync_lock_test_and_set(&s_nb_request_free_chunk, NULL);
+  struct NB_Request* request;
+
+  if (chunk &&
+      (chunk->size < s_nb_request_high_water ||
+       chunk->size / NB_REQUEST_CHUNK_SHRINK_FACTOR > s_nb_request_high_water)) {
+    free(chunk);
+    chunk = NULL;
+  }
+
+  if (!chunk) {
+    chunk = nb_request_chunk_create(s_nb_request_high_water);
+    if (!chunk) {
+      return NULL;
+    }
+  }
+
+  request = (struct NB_Request*)NB_REQUEST_CHUNK_DATA(chunk);
+  memset(request, 0, sizeof(struct NB_Request));
+  chunk->next = NULL;
+  chunk->used = NB_REQUEST_ALIGN(sizeof(struct NB_Request));
+  request->chunks = chunk;
+  return request;
+}
+
+/* Returns zeroed memory for |len| elements that lives as long as |request|,
+ * or NULL if |len| is 0 or the memory can't be allocated. */
+void* nb_request_alloc(struct NB_Request* request,
+                       uint32_t len,
+                       size_t element_size) {
+  struct NB_RequestChunk* chunk = request->chunks;
+  size_t size;
+  uint8_t* result;
+
+  if (len == 0) {
+    return NULL;
+  }
+
+  /* |len| comes from the wire, so guard the multiply and the alignment. */
+  if (len > (SIZE_MAX - 7 - NB_REQUEST_CHUNK_HEADER_SIZE) / element_size) {
+    NB_VERROR("Request has too many elements: %u.", len);
+    return NULL;
+  }
+
+  size = NB_REQUEST_ALIGN(len * element_size);
+
+  if (chunk->size - chunk->used < size) {
+    size_t new_size = chunk->size * 2;
+    if (new_size < size) {
+      new_size = size;
+    }
+
+    chunk = nb_request_chunk_create(new_size);
+    if (!chunk) {
+      return NULL;
+    }
+
+    chunk->next = request->chunks;
+    request->chunks = chunk;
+  }
+
+  result = NB_REQUEST_CHUNK_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  memset(result, 0, size);
+  return result;
+}
+
 struct NB_Request* nb_request_parse(struct PP_Var var) {
-  struct NB_Request* request = calloc(1, sizeof(struct NB_Request));
-  if (!(nb_var_check_type_with_error(var, PP_VARTYPE_DICTIONARY) &&
-        nb_request_parse_id(request, var) &&
-        nb_request_parse_gethandles(request, var) &&
-        nb_request_parse_sethandles(request, var) &&
-        nb_request_parse_destroyhandles(request, var) &&
-        nb_request_parse_commands(request, var))) {
+  struct NB_Request* request = nb_request_create();
+  struct NB_RequestChunk* chunk;
+  NB_Bool result;
+
+  if (!request) {
+    return NULL;
+  }
+
+  if (var.type == PP_VARTYPE_ARRAY_BUFFER) {
+    result = nb_request_parse_buffer(request, var);
+  } else {
+    result = nb_var_check_type_with_error(var, PP_VARTYPE_DICTIONARY) &&
+             nb_request_parse_id(request, var) &&
+             nb_request_parse_gethandles(request, var) &&
+             nb_request_parse_sethandles(request, var) &&
+             nb_request_parse_destroyhandles(request, var) &&
+             nb_request_parse_commands(request, var) &&
+             nb_request_parse_packed(request, var) &&
+             nb_request_parse_programs(request, var);
+  }
+
+  s_nb_request_high_water = 0;
+  for (chunk = request->chunks; chunk; chunk = chunk->next) {
+    s_nb_request_high_water += chunk->used;
+  }
+  if (s_nb_request_high_water < NB_REQUEST_CHUNK_MIN_SIZE) {
+    s_nb_request_high_water = NB_REQUEST_CHUNK_MIN_SIZE;
+  }
+
+  if (!result) {
     nb_request_destroy(request);
     return NULL;
   }
@@ -125,47 +419,86 @@ struct NB_Request* nb_request_parse(struct PP_Var var) {
   return request;
 }
 
+int nb_request_var_id(struct PP_Var var) {
+  int32_t id = 0;
+
+  if (var.type == PP_VARTYPE_ARRAY_BUFFER) {
+    int32_t header[NB_REQUEST_HEADER_ID + 1];
+    const uint8_t* data = nb_var_buffer_map(var);
+
+    if (data == NULL) {
+      return 0;
+    }
+
+    if (nb_var_buffer_byte_length(var) >= sizeof(header)) {
+      memcpy(header, data, sizeof(header));
+      if (header[NB_REQUEST_HEADER_MAGIC] == NB_REQUEST_BINARY_MAGIC) {
+        id = header[NB_REQUEST_HEADER_ID];
+      }
+    }
+    nb_var_buffer_unmap(var);
+  } else if (var.type == PP_VARTYPE_DICTIONARY) {
+    struct PP_Var id_var = nb_var_dict_get_key(var, NB_VAR_KEY_ID);
+    struct PP_Var cb_id_var = nb_var_dict_get_key(var, NB_VAR_KEY_CB_ID);
+    /* Callback results have an id too, but they aren't requests. */
+    if (id_var.type == PP_VARTYPE_INT32 &&
+        cb_id_var.type == PP_VARTYPE_UNDEFINED) {
+      id = id_var.value.as_int;
+    }
+    nb_var_release(id_var);
+    nb_var_release(cb_id_var);
+  }
+
+  return id > 0 ? id : 0;
+}
+
 void nb_request_destroy(struct NB_Request* request) {
+  struct NB_RequestChunk* chunk;
   uint32_t i;
   assert(request != NULL);
 
-  for (i = 0; i < request->commands_count; ++i) {
-    free(request->commands[i].args);
-  }
-  free(request->commands);
-  free(request->destroyhandles);
-
   for (i = 0; i < request->sethandles_count; ++i) {
     nb_var_release(request->sethandles[i].var);
   }
-  free(request->sethandles);
-  free(request->gethandles);
-  free(request);
-}
 
-void* nb_calloc_list(uint32_t len, size_t element_size) {
-  return len ? calloc(len, element_size) : NULL;
+  if (request->program) {
+    nb_program_release(request->program);
+  }
+
+  /* Free all but the last chunk, which holds the request itself. */
+  chunk = request->chunks;
+  while (chunk->next) {
+    struct NB_RequestChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  if (!__sync_bool_compare_and_swap(&s_nb_request_free_chunk, NULL, chunk)) {
+    free(chunk);
+  }
 }
 
 NB_Bool nb_expect_key(struct PP_Var var,
-                      const char* key,
+                      NB_VarKey key,
                       struct PP_Var* out_value) {
   NB_Bool result = nb_optional_key(var, key, out_value);
   if (!result) {
-    NB_VERROR("Expected request to have key: %s", key);
+    NB_VERROR("Expected request to have key: %s", nb_var_key_string(key));
   }
 
   return result;
 }
 
 NB_Bool nb_optional_key(struct PP_Var var,
-                        const char* key,
+                        NB_VarKey key,
                         struct PP_Var* out_value) {
-  if (!nb_var_dict_has_key(var, key)) {
+  /* A missing key is returned as undefined, so one lookup is enough. */
+  struct PP_Var value = nb_var_dict_get_key(var, key);
+  if (value.type == PP_VARTYPE_UNDEFINED) {
     return NB_FALSE;
   }
 
-  *out_value = nb_var_dict_get(var, key);
+  *out_value = value;
   return NB_TRUE;
 }
 
@@ -173,7 +506,7 @@ NB_Bool nb_request_parse_id(struct NB_Request* request, struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var id = PP_MakeUndefined();
 
-  if (!nb_expect_key(var, "id", &id)) {
+  if (!nb_expect_key(var, NB_VAR_KEY_ID, &id)) {
     goto cleanup;
   }
 
@@ -197,10 +530,10 @@ NB_Bool nb_request_parse_gethandles(struct NB_Request* request,
                                     struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var gethandles_var = PP_MakeUndefined();
-  NB_Handle* gethandles = NULL;
+  NB_Handle* gethandles;
   uint32_t i, len;
 
-  if (!nb_optional_key(var, "get", &gethandles_var)) {
+  if (!nb_optional_key(var, NB_VAR_KEY_GET, &gethandles_var)) {
     result = NB_TRUE;
     goto cleanup;
   }
@@ -210,7 +543,11 @@ NB_Bool nb_request_parse_gethandles(struct NB_Request* request,
   }
 
   len = nb_var_array_length(gethandles_var);
-  gethandles = nb_calloc_list(len, sizeof(NB_Handle));
+  gethandles = nb_request_alloc(request, len, sizeof(NB_Handle));
+  if (len > 0 && !gethandles) {
+    goto cleanup;
+  }
+
   for (i = 0; i < len; ++i) {
     struct PP_Var handle = nb_var_array_get(gethandles_var, i);
     if (!nb_var_check_type_with_error(handle, PP_VARTYPE_INT32)) {
@@ -224,11 +561,8 @@ NB_Bool nb_request_parse_gethandles(struct NB_Request* request,
 
   request->gethandles = gethandles;
   request->gethandles_count = len;
-
   result = NB_TRUE;
-  gethandles = NULL; /* Pass ownership to the request. */
 cleanup:
-  free(gethandles);
   nb_var_release(gethandles_var);
   return result;
 }
@@ -238,11 +572,11 @@ NB_Bool nb_request_parse_sethandles(struct NB_Request* request,
   NB_Bool result = NB_FALSE;
   struct PP_Var sethandles_var = PP_MakeUndefined();
   struct PP_Var keys = PP_MakeUndefined();
-  struct NB_HandleVarPair* sethandles = NULL;
+  struct NB_HandleVarPair* sethandles;
   uint32_t i, len;
-  struct PP_Var value;
+  struct PP_Var value = PP_MakeUndefined();
 
-  if (!nb_optional_key(var, "set", &sethandles_var)) {
+  if (!nb_optional_key(var, NB_VAR_KEY_SET, &sethandles_var)) {
     result = NB_TRUE;
     goto cleanup;
   }
@@ -253,7 +587,12 @@ NB_Bool nb_request_parse_sethandles(struct NB_Request* request,
 
   keys = nb_var_dict_get_keys(sethandles_var);
   len = nb_var_array_length(keys);
-  sethandles = nb_calloc_list(len, sizeof(struct NB_HandleVarPair));
+  sethandles = nb_request_alloc(request, len, sizeof(struct NB_HandleVarPair));
+  if (len > 0 && !sethandles) {
+    goto cleanup;
+  }
+
+  request->sethandles = sethandles;
   for (i = 0; i < len; ++i) {
     struct PP_Var key = nb_var_array_get(keys, i);
     long key_long;
@@ -271,6 +610,7 @@ NB_Bool nb_request_parse_sethandles(struct NB_Request* request,
       case PP_VARTYPE_DOUBLE:
       case PP_VARTYPE_NULL:
       case PP_VARTYPE_STRING:
+      case PP_VARTYPE_ARRAY_BUFFER:
         break;
 
       case PP_VARTYPE_ARRAY: {
@@ -314,15 +654,13 @@ NB_Bool nb_request_parse_sethandles(struct NB_Request* request,
        sethandles[i].var. */
     sethandles[i].var = value;
     value = PP_MakeUndefined(); /* Don't release below in cleanup */
+    /* Only count values that were read, so destroy releases the right ones. */
+    request->sethandles_count = i + 1;
   }
 
-  request->sethandles = sethandles;
-  request->sethandles_count = len;
   result = NB_TRUE;
-  sethandles = NULL; /* Pass ownership to the request. */
 cleanup:
   nb_var_release(value);
-  free(sethandles);
   nb_var_release(keys);
   nb_var_release(sethandles_var);
   return result;
@@ -332,10 +670,10 @@ NB_Bool nb_request_parse_destroyhandles(struct NB_Request* request,
                                         struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var destroyhandles_var = PP_MakeUndefined();
-  NB_Handle* destroyhandles = NULL;
+  NB_Handle* destroyhandles;
   uint32_t i, len;
 
-  if (!nb_optional_key(var, "destroy", &destroyhandles_var)) {
+  if (!nb_optional_key(var, NB_VAR_KEY_DESTROY, &destroyhandles_var)) {
     result = NB_TRUE;
     goto cleanup;
   }
@@ -345,7 +683,11 @@ NB_Bool nb_request_parse_destroyhandles(struct NB_Request* request,
   }
 
   len = nb_var_array_length(destroyhandles_var);
-  destroyhandles = nb_calloc_list(len, sizeof(NB_Handle));
+  destroyhandles = nb_request_alloc(request, len, sizeof(NB_Handle));
+  if (len > 0 && !destroyhandles) {
+    goto cleanup;
+  }
+
   for (i = 0; i < len; ++i) {
     struct PP_Var handle = nb_var_array_get(destroyhandles_var, i);
     if (!nb_var_check_type_with_error(handle, PP_VARTYPE_INT32)) {
@@ -360,9 +702,7 @@ NB_Bool nb_request_parse_destroyhandles(struct NB_Request* request,
   request->destroyhandles = destroyhandles;
   request->destroyhandles_count = len;
   result = NB_TRUE;
-  destroyhandles = NULL; /* Pass ownership to the request. */
 cleanup:
-  free(destroyhandles);
   nb_var_release(destroyhandles_var);
   return result;
 }
@@ -371,10 +711,10 @@ NB_Bool nb_request_parse_commands(struct NB_Request* request,
                                   struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var commands_var = PP_MakeUndefined();
-  struct NB_Command* commands = NULL;
+  struct NB_Command* commands;
   uint32_t i, len;
 
-  if (!nb_optional_key(var, "commands", &commands_var)) {
+  if (!nb_optional_key(var, NB_VAR_KEY_COMMANDS, &commands_var)) {
     result = NB_TRUE;
     goto cleanup;
   }
@@ -384,10 +724,14 @@ NB_Bool nb_request_parse_commands(struct NB_Request* request,
   }
 
   len = nb_var_array_length(commands_var);
-  commands = nb_calloc_list(len, sizeof(struct NB_Command));
+  commands = nb_request_alloc(request, len, sizeof(struct NB_Command));
+  if (len > 0 && !commands) {
+    goto cleanup;
+  }
+
   for (i = 0; i < len; ++i) {
     struct PP_Var command_var = nb_var_array_get(commands_var, i);
-    if (!nb_request_parse_command(&commands[i], command_var)) {
+    if (!nb_request_parse_command(request, &commands[i], command_var)) {
       nb_var_release(command_var);
       goto cleanup;
     }
@@ -398,28 +742,139 @@ NB_Bool nb_request_parse_commands(struct NB_Request* request,
   request->commands = commands;
   request->commands_count = len;
   result = NB_TRUE;
-  commands = NULL; /* Pass ownership to the request. */
 cleanup:
-  free(commands);
   nb_var_release(commands_var);
   return result;
 }
 
-NB_Bool nb_request_parse_command(struct NB_Command* command,
+NB_Bool nb_request_parse_packed(struct NB_Request* request,
+                                struct PP_Var var) {
+  NB_Bool result = NB_FALSE;
+  struct PP_Var packed_var = PP_MakeUndefined();
+
+  if (!nb_optional_key(var, NB_VAR_KEY_PACKED, &packed_var)) {
+    result = NB_TRUE;
+    goto cleanup;
+  }
+
+  if (!nb_var_check_type_with_error(packed_var, PP_VARTYPE_BOOL)) {
+    goto cleanup;
+  }
+
+  request->packed_values = packed_var.value.as_bool ? NB_TRUE : NB_FALSE;
+  result = NB_TRUE;
+cleanup:
+  nb_var_release(packed_var);
+  return result;
+}
+
+NB_Bool nb_request_parse_programs(struct NB_Request* request,
+                                  struct PP_Var var) {
+  NB_Bool result = NB_FALSE;
+  struct PP_Var unprepare_var = PP_MakeUndefined();
+  struct PP_Var prepare_var = PP_MakeUndefined();
+  struct PP_Var program_var = PP_MakeUndefined();
+  uint32_t i, len;
+
+  if (nb_optional_key(var, NB_VAR_KEY_UNPREPARE, &unprepare_var)) {
+    if (!nb_var_check_type_with_error(unprepare_var, PP_VARTYPE_ARRAY)) {
+      goto cleanup;
+    }
+
+    len = nb_var_array_length(unprepare_var);
+    for (i = 0; i < len; ++i) {
+      struct PP_Var id = nb_var_array_get(unprepare_var, i);
+      if (!nb_var_check_type_with_error(id, PP_VARTYPE_INT32) ||
+          !nb_program_set(id.value.as_int, NULL)) {
+        nb_var_release(id);
+        goto cleanup;
+      }
+
+      nb_var_release(id);
+    }
+  }
+
+  if (nb_optional_key(var, NB_VAR_KEY_PREPARE, &prepare_var)) {
+    if (!nb_var_check_type_with_error(prepare_var, PP_VARTYPE_INT32) ||
+        !nb_request_prepare(request, prepare_var.value.as_int)) {
+      goto cleanup;
+    }
+  }
+
+  if (nb_optional_key(var, NB_VAR_KEY_PROGRAM, &program_var)) {
+    if (!nb_var_check_type_with_error(program_var, PP_VARTYPE_INT32) ||
+        !nb_request_use_program(request, program_var.value.as_int)) {
+      goto cleanup;
+    }
+  }
+
+  result = NB_TRUE;
+cleanup:
+  nb_var_release(program_var);
+  nb_var_release(prepare_var);
+  nb_var_release(unprepare_var);
+  return result;
+}
+
+/* Move the request's commands to a new program. They are run by requests
+ * that use the program, not by this one. */
+NB_Bool nb_request_prepare(struct NB_Request* request, int32_t program_id) {
+  struct NB_Program* program =
+      nb_program_create(request->commands, request->commands_count);
+
+  if (!program) {
+    return NB_FALSE;
+  }
+
+  if (!nb_program_set(program_id, program)) {
+    nb_program_release(program);
+    return NB_FALSE;
+  }
+
+  request->commands = NULL;
+  request->commands_count = 0;
+  return NB_TRUE;
+}
+
+NB_Bool nb_request_use_program(struct NB_Request* request,
+                               int32_t program_id) {
+  struct NB_Program* program;
+
+  if (request->commands_count != 0) {
+    NB_ERROR("Expected request that runs a program to have no commands.");
+    return NB_FALSE;
+  }
+
+  if (program_id <= 0 || (uint32_t)program_id >= s_nb_programs_capacity ||
+      s_nb_programs[program_id] == NULL) {
+    NB_VERROR("Unknown program id: %d.", program_id);
+    return NB_FALSE;
+  }
+
+  program = s_nb_programs[program_id];
+  __sync_add_and_fetch(&program->ref_count, 1);
+  request->program = program;
+  request->commands = program->commands;
+  request->commands_count = program->commands_count;
+  return NB_TRUE;
+}
+
+NB_Bool nb_request_parse_command(struct NB_Request* request,
+                                 struct NB_Command* command,
                                  struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var id_var = PP_MakeUndefined();
   struct PP_Var args_var = PP_MakeUndefined();
   struct PP_Var ret_var = PP_MakeUndefined();
-  NB_Handle* args = NULL;
+  NB_Handle* args;
   uint32_t i, len;
 
   if (!nb_var_check_type_with_error(var, PP_VARTYPE_DICTIONARY)) {
     goto cleanup;
   }
 
-  if (!nb_expect_key(var, "id", &id_var) ||
-      !nb_expect_key(var, "args", &args_var)) {
+  if (!nb_expect_key(var, NB_VAR_KEY_ID, &id_var) ||
+      !nb_expect_key(var, NB_VAR_KEY_ARGS, &args_var)) {
     goto cleanup;
   }
 
@@ -431,7 +886,7 @@ NB_Bool nb_request_parse_command(struct NB_Command* command,
     goto cleanup;
   }
 
-  ret_var = nb_var_dict_get(var, "ret");
+  ret_var = nb_var_dict_get_key(var, NB_VAR_KEY_RET);
   if (ret_var.type != PP_VARTYPE_INT32 &&
       ret_var.type != PP_VARTYPE_UNDEFINED) {
     NB_VERROR("Expected ret field to be int32 or undefined, not %s.",
@@ -441,7 +896,11 @@ NB_Bool nb_request_parse_command(struct NB_Command* command,
 
   /* Check that args_var is an array of ints. */
   len = nb_var_array_length(args_var);
-  args = nb_calloc_list(len, sizeof(NB_Handle));
+  args = nb_request_alloc(request, len, sizeof(NB_Handle));
+  if (len > 0 && !args) {
+    goto cleanup;
+  }
+
   for (i = 0; i < len; ++i) {
     struct PP_Var arg = nb_var_array_get(args_var, i);
     if (!nb_var_check_type_with_error(arg, PP_VARTYPE_INT32)) {
@@ -460,20 +919,261 @@ NB_Bool nb_request_parse_command(struct NB_Command* command,
     command->ret = ret_var.value.as_int;
   }
   result = NB_TRUE;
-  args = NULL; /* Pass ownership to the request. */
 cleanup:
-  free(args);
   nb_var_release(ret_var);
   nb_var_release(args_var);
   nb_var_release(id_var);
   return result;
 }
 
+static NB_Bool nb_read_int32(const uint8_t** p,
+                             const uint8_t* end,
+                             int32_t* out_value) {
+  if (end - *p < (ptrdiff_t)sizeof(int32_t)) {
+    NB_ERROR("Unexpected end of binary request.");
+    return NB_FALSE;
+  }
+
+  memcpy(out_value, *p, sizeof(int32_t));
+  *p += sizeof(int32_t);
+  return NB_TRUE;
+}
+
+static NB_Bool nb_read_int32s(const uint8_t** p,
+                              const uint8_t* end,
+                              int32_t* values,
+                              uint32_t count) {
+  size_t size = count * sizeof(int32_t);
+  /* Empty lists have no memory allocated, so |values| may be NULL. */
+  if (count == 0) {
+    return NB_TRUE;
+  }
+
+  if ((size_t)(end - *p) < size) {
+    NB_ERROR("Unexpected end of binary request.");
+    return NB_FALSE;
+  }
+
+  memcpy(values, *p, size);
+  *p += size;
+  return NB_TRUE;
+}
+
+static NB_Bool nb_read_sethandle(const uint8_t** p,
+                                 const uint8_t* end,
+                                 struct NB_HandleVarPair* sethandle) {
+  int32_t tag;
+
+  if (!nb_read_int32(p, end, &sethandle->id) ||
+      !nb_read_int32(p, end, &tag)) {
+    return NB_FALSE;
+  }
+
+  switch (tag) {
+    case NB_REQUEST_VALUE_INT32: {
+      int32_t value;
+      if (!nb_read_int32(p, end, &value)) {
+        return NB_FALSE;
+      }
+
+      sethandle->var = PP_MakeInt32(value);
+      return NB_TRUE;
+    }
+
+    case NB_REQUEST_VALUE_DOUBLE: {
+      double value;
+      if (end - *p < (ptrdiff_t)sizeof(double)) {
+        NB_ERROR("Unexpected end of binary request.");
+        return NB_FALSE;
+      }
+
+      memcpy(&value, *p, sizeof(double));
+      *p += sizeof(double);
+      sethandle->var = PP_MakeDouble(value);
+      return NB_TRUE;
+    }
+
+    case NB_REQUEST_VALUE_INT64: {
+      int32_t low;
+      int32_t high;
+      if (!nb_read_int32(p, end, &low) || !nb_read_int32(p, end, &high)) {
+        return NB_FALSE;
+      }
+
+      sethandle->var =
+          nb_var_int64_create(((int64_t)high << 32) | (uint32_t)low);
+      return NB_TRUE;
+    }
+
+    case NB_REQUEST_VALUE_NULL:
+      sethandle->var = PP_MakeNull();
+      return NB_TRUE;
+
+    default:
+      NB_VERROR("Unexpected binary set handle value tag: %d.", tag);
+      return NB_FALSE;
+  }
+}
+
+NB_Bool nb_request_parse_buffer(struct NB_Request* request,
+                                struct PP_Var var) {
+  NB_Bool result = NB_FALSE;
+  const uint8_t* data;
+  const uint8_t* p;
+  const uint8_t* end;
+  int32_t header[NB_REQUEST_HEADER_WORDS];
+  uint32_t max_words;
+  uint32_t words = 0;
+  uint32_t set_count;
+  uint32_t commands_count;
+  uint32_t args_count;
+  uint32_t get_count;
+  uint32_t destroy_count;
+  uint32_t args_used = 0;
+  NB_Handle* args;
+  uint32_t i;
+
+  data = nb_var_buffer_map(var);
+  if (data == NULL) {
+    NB_ERROR("Unable to map binary request.");
+    return NB_FALSE;
+  }
+
+  p = data;
+  end = data + nb_var_buffer_byte_length(var);
+  max_words = (uint32_t)(end - p) / sizeof(int32_t);
+
+  if (!nb_read_int32s(&p, end, header, NB_REQUEST_HEADER_WORDS)) {
+    goto cleanup;
+  }
+
+  if (header[NB_REQUEST_HEADER_MAGIC] != NB_REQUEST_BINARY_MAGIC) {
+    NB_VERROR("Bad binary request magic: 0x%08x.",
+              header[NB_REQUEST_HEADER_MAGIC]);
+    goto cleanup;
+  }
+
+  if (header[NB_REQUEST_HEADER_ID] <= 0) {
+    NB_VERROR("Expected request id to be > 0. Got %d",
+              header[NB_REQUEST_HEADER_ID]);
+    goto cleanup;
+  }
+
+  /* Every list entry takes at least one word, so larger counts can't be
+   * valid. Checking first also keeps the size computation below from
+   * overflowing. */
+  for (i = NB_REQUEST_HEADER_SET_COUNT; i < NB_REQUEST_HEADER_WORDS; ++i) {
+    if (header[i] < 0 || (uint32_t)header[i] > max_words - words) {
+      NB_VERROR("Bad binary request count: %d.", header[i]);
+      goto cleanup;
+    }
+    words += header[i];
+  }
+
+  set_count = header[NB_REQUEST_HEADER_SET_COUNT];
+  commands_count = header[NB_REQUEST_HEADER_COMMANDS_COUNT];
+  args_count = header[NB_REQUEST_HEADER_ARGS_COUNT];
+  get_count = header[NB_REQUEST_HEADER_GET_COUNT];
+  destroy_count = header[NB_REQUEST_HEADER_DESTROY_COUNT];
+
+  request->id = header[NB_REQUEST_HEADER_ID];
+  request->packed_values =
+      (header[NB_REQUEST_HEADER_FLAGS] & NB_REQUEST_FLAG_PACKED_VALUES)
+          ? NB_TRUE
+          : NB_FALSE;
+  request->sethandles =
+      nb_request_alloc(request, set_count, sizeof(struct NB_HandleVarPair));
+  request->commands =
+      nb_request_alloc(request, commands_count, sizeof(struct NB_Command));
+  args = nb_request_alloc(request, args_count, sizeof(NB_Handle));
+  request->gethandles = nb_request_alloc(request, get_count, sizeof(NB_Handle));
+  request->destroyhandles =
+      nb_request_alloc(request, destroy_count, sizeof(NB_Handle));
+  if ((set_count > 0 && !request->sethandles) ||
+      (commands_count > 0 && !request->commands) ||
+      (args_count > 0 && !args) ||
+      (get_count > 0 && !request->gethandles) ||
+      (destroy_count > 0 && !request->destroyhandles)) {
+    goto cleanup;
+  }
+
+  for (i = 0; i < set_count; ++i) {
+    if (!nb_read_sethandle(&p, end, &request->sethandles[i])) {
+      goto cleanup;
+    }
+
+    /* Only count values that were read, so destroy releases the right ones. */
+    request->sethandles_count = i + 1;
+  }
+
+  for (i = 0; i < commands_count; ++i) {
+    struct NB_Command* command = &request->commands[i];
+    int32_t command_args_count;
+
+    if (!nb_read_int32(&p, end, &command->id) ||
+        !nb_read_int32(&p, end, &command->ret) ||
+        !nb_read_int32(&p, end, &command_args_count)) {
+      goto cleanup;
+    }
+
+    if (command_args_count < 0 ||
+        (uint32_t)command_args_count > args_count - args_used) {
+      NB_VERROR("Bad binary request command args count: %d.",
+                command_args_count);
+      goto cleanup;
+    }
+
+    command->args = args + args_used;
+    command->args_count = command_args_count;
+    if (!nb_read_int32s(&p, end, command->args, command_args_count)) {
+      goto cleanup;
+    }
+    args_used += command_args_count;
+  }
+  request->commands_count = commands_count;
+
+  if (args_used != args_count) {
+    NB_VERROR("Expected %u binary request args, got %u.", args_count,
+              args_used);
+    goto cleanup;
+  }
+
+  if (!nb_read_int32s(&p, end, request->gethandles, get_count) ||
+      !nb_read_int32s(&p, end, request->destroyhandles, destroy_count)) {
+    goto cleanup;
+  }
+  request->gethandles_count = get_count;
+  request->destroyhandles_count = destroy_count;
+
+  if (p != end) {
+    NB_VERROR("Unexpected %d bytes at the end of binary request.",
+              (int)(end - p));
+    goto cleanup;
+  }
+
+  if ((header[NB_REQUEST_HEADER_PREPARE] != 0 &&
+       !nb_request_prepare(request, header[NB_REQUEST_HEADER_PREPARE])) ||
+      (header[NB_REQUEST_HEADER_PROGRAM] != 0 &&
+       !nb_request_use_program(request, header[NB_REQUEST_HEADER_PROGRAM]))) {
+    goto cleanup;
+  }
+
+  result = NB_TRUE;
+cleanup:
+  nb_var_buffer_unmap(var);
+  return result;
+}
+
 int nb_request_id(struct NB_Request* request) {
   assert(request != NULL);
   return request->id;
 }
 
+NB_Bool nb_request_packed_values(struct NB_Request* request) {
+  assert(request != NULL);
+  return request->packed_values;
+}
+
 int nb_request_sethandles_count(struct NB_Request* request) {
   assert(request != NULL);
   return request->sethandles_count;
@@ -33,6 +33,11 @@ struct NB_Request* nb_request_parse(struct PP_Var);
 void nb_request_destroy(struct NB_Request*);
 
 int nb_request_id(struct NB_Request*);
+/* Reads just the id of an unparsed request, in either format. Returns 0 if it
+ * has no valid id, or is a callback result rather than a request. */
+int nb_request_var_id(struct PP_Var);
+/* Whether the response should pack all values into one ArrayBuffer. */
+NB_Bool nb_request_packed_values(struct NB_Request*);
 
 int nb_request_sethandles_count(struct NB_Request*);
 void nb_request_sethandle(struct NB_Request*,
@@ -17,11 +17,12 @@
 #include "response.h"
 #endif
 
+static void* nb_calloc_list(uint32_t len, size_t element_size);
 static NB_Bool nb_expect_key(struct PP_Var var,
-                             const char* key,
+                             NB_VarKey key,
                              struct PP_Var* out_value);
 static NB_Bool nb_optional_key(struct PP_Var var,
-                               const char* key,
+                               NB_VarKey key,
                                struct PP_Var* out_value);
 static NB_Bool nb_response_parse_id(struct NB_Response* response,
                                     struct PP_Var var);
@@ -32,6 +33,9 @@ static NB_Bool nb_response_parse_values(struct NB_Response* response,
 
 struct NB_Response {
   struct PP_Var var;
+  /* The "values" array of |var|, kept so setting a value doesn't need a
+   * dictionary lookup. Undefined once the values have been packed. */
+  struct PP_Var values_var;
 
   /* The following are only used when parsing a response, not creating one. */
   int id;
@@ -40,34 +44,41 @@ struct NB_Response {
   uint32_t values_count;
 };
 
-struct NB_Response* nb_response_create(int id) {
+struct NB_Response* nb_response_create(int id, uint32_t values_count) {
   struct NB_Response* response = calloc(1, sizeof(struct NB_Response));
-  struct PP_Var values;
 
   response->var = nb_var_dict_create();
-  if (!nb_var_dict_set(response->var, "id", PP_MakeInt32(id))) {
+  if (!nb_var_dict_set_key(response->var, NB_VAR_KEY_ID, PP_MakeInt32(id))) {
     NB_VERROR("nb_response_create failed to set \"id\" to %d.", id);
     goto cleanup;
   }
 
-  values = nb_var_array_create();
-  if (!nb_var_dict_set(response->var, "values", values)) {
+  response->values_var = nb_var_array_create();
+  if (values_count > 0 &&
+      !nb_var_array_set_length(response->values_var, values_count)) {
+    NB_VERROR("nb_response_create failed to set \"values\" length to %u.",
+              values_count);
+    goto cleanup;
+  }
+
+  if (!nb_var_dict_set_key(response->var, NB_VAR_KEY_VALUES,
+                           response->values_var)) {
     NB_ERROR("nb_response_create failed to create \"values\" array.");
-    nb_var_release(values);
     goto cleanup;
   }
 
-  nb_var_release(values);
   return response;
 
 cleanup:
+  nb_var_release(response->values_var);
   nb_var_release(response->var);
   free(response);
   return NULL;
 }
 
 NB_Bool nb_response_set_cb_id(struct NB_Response* response, int cb_id) {
-  if (!nb_var_dict_set(response->var, "cbId", PP_MakeInt32(cb_id))) {
+  if (!nb_var_dict_set_key(response->var, NB_VAR_KEY_CB_ID,
+                           PP_MakeInt32(cb_id))) {
     NB_VERROR("nb_response_set_cb_id failed to set \"cbId\" to %d.", cb_id);
     return NB_FALSE;
   }
@@ -83,6 +94,7 @@ void nb_response_destroy(struct NB_Response* response) {
     nb_var_release(response->values[i]);
   }
 
+  nb_var_release(response->values_var);
   nb_var_release(response->var);
   free(response);
 }
@@ -90,19 +102,86 @@ void nb_response_destroy(struct NB_Response* response) {
 NB_Bool nb_response_set_value(struct NB_Response* response,
                               int i,
                               struct PP_Var value) {
-  NB_Bool result = NB_FALSE;
-  struct PP_Var values = nb_var_dict_get(response->var, "values");
-
-  if (!nb_var_array_set(values, i, value)) {
+  assert(response->values_var.type == PP_VARTYPE_ARRAY);
+  if (!nb_var_array_set(response->values_var, i, value)) {
     NB_VERROR("nb_response_set_value(%d, %s) failed.", i,
               nb_var_type_to_string(value.type));
+    return NB_FALSE;
+  }
+
+  return NB_TRUE;
+}
+
+/* Packed values are sent as an ArrayBuffer with a uint32 count, then a one
+ * byte tag per value, then each value in 8 bytes (little-endian), starting at
+ * the next multiple of 8. NULL values are zero. */
+enum {
+  NB_RESPONSE_PACKED_INT32 = 0,
+  NB_RESPONSE_PACKED_DOUBLE = 1,
+  NB_RESPONSE_PACKED_INT64 = 2,
+  NB_RESPONSE_PACKED_NULL = 3,
+};
+
+NB_Bool nb_response_set_packed_values(struct NB_Response* response,
+                                      const NB_Type* types,
+                                      const NB_HandleScalar* values,
+                                      uint32_t count) {
+  uint32_t values_offset = (sizeof(uint32_t) + count + 7) & ~7;
+  struct PP_Var buffer = nb_var_buffer_create(values_offset + count * 8);
+  uint8_t* data;
+  uint8_t* value_data;
+  NB_Bool result = NB_FALSE;
+  uint32_t i;
+
+  if (buffer.type != PP_VARTYPE_ARRAY_BUFFER) {
+    NB_VERROR("nb_response_set_packed_values(%u) failed to create buffer.",
+              count);
+    return NB_FALSE;
+  }
+
+  data = nb_var_buffer_map(buffer);
+  if (!data) {
+    NB_VERROR("nb_response_set_packed_values(%u) failed to map buffer.",
+              count);
     goto cleanup;
   }
 
+  memcpy(data, &count, sizeof(uint32_t));
+  value_data = data + values_offset;
+  for (i = 0; i < count; ++i, value_data += 8) {
+    switch (types[i]) {
+      case NB_TYPE_INT32:
+        data[sizeof(uint32_t) + i] = NB_RESPONSE_PACKED_INT32;
+        memcpy(value_data, &values[i].int32, sizeof(int32_t));
+        break;
+      case NB_TYPE_DOUBLE:
+        data[sizeof(uint32_t) + i] = NB_RESPONSE_PACKED_DOUBLE;
+        memcpy(value_data, &values[i].float64, sizeof(double));
+        break;
+      case NB_TYPE_INT64:
+        data[sizeof(uint32_t) + i] = NB_RESPONSE_PACKED_INT64;
+        memcpy(value_data, &values[i].int64, sizeof(int64_t));
+        break;
+      default:
+        assert(types[i] == NB_TYPE_INVALID);
+        data[sizeof(uint32_t) + i] = NB_RESPONSE_PACKED_NULL;
+        memset(value_data, 0, 8);
+        break;
+    }
+  }
+  nb_var_buffer_unmap(buffer);
+
+  if (!nb_var_dict_set_key(response->var, NB_VAR_KEY_VALUES, buffer)) {
+    NB_VERROR("nb_response_set_packed_values(%u) failed.", count);
+    goto cleanup;
+  }
+
+  nb_var_release(response->values_var);
+  response->values_var = PP_MakeUndefined();
   result = NB_TRUE;
 
 cleanup:
-  nb_var_release(values);
+  nb_var_release(buffer);
   return result;
 }
 
@@ -113,8 +192,8 @@ struct PP_Var nb_response_get_var(struct NB_Response* response) {
 
 NB_Bool nb_response_set_error(struct NB_Response* response,
                               int failed_command_idx) {
-  if (!nb_var_dict_set(response->var, "error",
-                       PP_MakeInt32(failed_command_idx))) {
+  if (!nb_var_dict_set_key(response->var, NB_VAR_KEY_ERROR,
+                           PP_MakeInt32(failed_command_idx))) {
     NB_VERROR("nb_response_set_error(%d) failed.", failed_command_idx);
     return NB_FALSE;
   }
@@ -122,6 +201,20 @@ NB_Bool nb_response_set_error(struct NB_Response* response,
   return NB_TRUE;
 }
 
+NB_Bool nb_response_var_is_callback(struct PP_Var var) {
+  struct PP_Var cb_id;
+  NB_Bool result;
+
+  if (var.type != PP_VARTYPE_DICTIONARY) {
+    return NB_FALSE;
+  }
+
+  cb_id = nb_var_dict_get_key(var, NB_VAR_KEY_CB_ID);
+  result = cb_id.type != PP_VARTYPE_UNDEFINED ? NB_TRUE : NB_FALSE;
+  nb_var_release(cb_id);
+  return result;
+}
+
 struct NB_Response* nb_response_parse(struct PP_Var var) {
   struct NB_Response* response = calloc(1, sizeof(struct NB_Response));
   if (!(nb_var_check_type_with_error(var, PP_VARTYPE_DICTIONARY) &&
@@ -135,12 +228,16 @@ struct NB_Response* nb_response_parse(struct PP_Var var) {
   return response;
 }
 
+void* nb_calloc_list(uint32_t len, size_t element_size) {
+  return len ? calloc(len, element_size) : NULL;
+}
+
 static NB_Bool nb_response_parse_id(struct NB_Response* response,
                                     struct PP_Var var) {
   NB_Bool result = NB_FALSE;
   struct PP_Var id = PP_MakeUndefined();
 
-  if (!nb_expect_key(var, "id", &id)) {
+  if (!nb_expect_key(var, NB_VAR_KEY_ID, &id)) {
     goto cleanup;
   }
 
@@ -165,7 +262,7 @@ static NB_Bool nb_response_parse_cb_id(struct NB_Response* response,
   NB_Bool result = NB_FALSE;
   struct PP_Var cb_id = PP_MakeUndefined();
 
-  if (!nb_optional_key(var, "cbId", &cb_id)) {
+  if (!nb_optional_key(var, NB_VAR_KEY_CB_ID, &cb_id)) {
     goto cleanup;
   }
 
@@ -192,7 +289,7 @@ static NB_Bool nb_response_parse_values(struct NB_Response* response,
   struct PP_Var* values = NULL;
   uint32_t i, len;
 
-  if (!nb_expect_key(var, "values", &values_var)) {
+  if (!nb_expect_key(var, NB_VAR_KEY_VALUES, &values_var)) {
     goto cleanup;
   }
 
@@ -20,6 +20,8 @@
 
 #ifndef NB_ONE_FILE
 #include "bool.h"
+#include "handle.h"
+#include "type.h"
 #endif
 
 #ifdef __cplusplus
@@ -28,14 +30,25 @@ extern "C" {
 
 struct NB_Response;
 
-struct NB_Response* nb_response_create(int id);
+/* |values_count| is the expected number of values; the values array is
+ * pre-sized to it and filled with undefined. */
+struct NB_Response* nb_response_create(int id, uint32_t values_count);
 void nb_response_destroy(struct NB_Response*);
 NB_Bool nb_response_set_cb_id(struct NB_Response*, int cb_id);
 NB_Bool nb_response_set_value(struct NB_Response*, int i, struct PP_Var value);
+/* Sets all values at once, packed into a single ArrayBuffer. |types| are as
+ * returned by nb_handle_convert_to_scalar. */
+NB_Bool nb_response_set_packed_values(struct NB_Response*,
+                                      const NB_Type* types,
+                                      const NB_HandleScalar* values,
+                                      uint32_t count);
 struct PP_Var nb_response_get_var(struct NB_Response*);
 NB_Bool nb_response_set_error(struct NB_Response*, int failed_command_idx);
 
 struct NB_Response* nb_response_parse(struct PP_Var);
+/* Returns NB_TRUE if |var| is a callback result, i.e. a dictionary with a
+ * cbId, without parsing the rest of it. */
+NB_Bool nb_response_var_is_callback(struct PP_Var);
 int nb_response_id(struct NB_Response*);
 int nb_response_cb_id(struct NB_Response*);
 int nb_response_values_count(struct NB_Response*);
@@ -18,37 +18,79 @@
 #endif
 
 #include <alloca.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 
 #ifndef NB_ONE_FILE
 #include "handle.h"
 #include "interfaces.h"
+#include "queue.h"
 #include "request.h"
 #include "response.h"
 #include "var.h"
 #endif
 
-/* This function is defined by the generated code. */
+/* Maximum number of requests taken from the queue at once. */
+#define NB_RUN_BATCH_SIZE 64
+
+/* These functions are defined by the generated code. */
 NB_Bool nb_request_command_run(struct NB_Queue* message_queue,
                                struct NB_Request* request,
                                int command_idx);
+int32_t nb_callbacks_allocated(void);
 
 static NB_Bool nb_request_set_handles(struct NB_Request* request);
 static NB_Bool nb_request_run_commands(struct NB_Queue* message_queue,
                                        struct NB_Request* request,
                                        int* out_failed_command_idx);
+static NB_Bool nb_request_run_range(struct NB_Queue* message_queue,
+                                    struct NB_Request* request,
+                                    int begin,
+                                    int end,
+                                    int* out_failed_command_idx);
+static NB_Bool nb_request_run_loop(struct NB_Queue* message_queue,
+                                   struct NB_Request* request,
+                                   int command_idx,
+                                   int end,
+                                   int* out_next_command_idx,
+                                   int* out_failed_command_idx);
+static NB_Bool nb_request_run_if(struct NB_Queue* message_queue,
+                                 struct NB_Request* request,
+                                 int command_idx,
+                                 int end,
+                                 int* out_next_command_idx,
+                                 int* out_failed_command_idx);
 static NB_Bool nb_request_get_handles(struct NB_Request* request,
                                       struct NB_Response* response);
+static NB_Bool nb_request_get_handles_packed(struct NB_Request* request,
+                                             struct NB_Response* response);
 static void nb_request_destroy_handles(struct NB_Request* request);
+static NB_Bool nb_request_run_parsed(struct NB_Queue* message_queue,
+                                     struct PP_Var request_var,
+                                     struct NB_Request* request,
+                                     double parse_time_ms,
+                                     struct PP_Var* out_response_var);
 
 void nb_run_message_loop(struct NB_Queue* message_queue) {
+  struct PP_Var requests[NB_RUN_BATCH_SIZE];
+
   while (1) {
-    struct PP_Var request = nb_queue_dequeue(message_queue);
-    struct PP_Var response = PP_MakeUndefined();
+    /* Drain a burst of requests at once, rather than going back to the queue
+     * for each one. */
+    uint32_t count =
+        nb_queue_dequeue_batch(message_queue, requests, NB_RUN_BATCH_SIZE);
+    uint32_t i;
 
-    nb_request_run(message_queue, request, &response);
-    g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
-    nb_var_release(response);
-    nb_var_release(request);
+    for (i = 0; i < count; ++i) {
+      struct PP_Var response = PP_MakeUndefined();
+
+      nb_request_run(message_queue, requests[i], &response);
+      g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
+      nb_var_release(response);
+      nb_var_release(requests[i]);
+    }
   }
 }
 
@@ -87,21 +129,463 @@ struct NB_Response* nb_run_message_loop_for_response(
   }
 }
 
+/* Times of each phase of nb_request_run, in milliseconds. */
+typedef struct {
+  uint32_t requests;
+  double parse_time_ms;
+  double execute_time_ms;
+  double serialize_time_ms;
+  double last_parse_time_ms;
+  double last_execute_time_ms;
+  double last_serialize_time_ms;
+} NB_RunStats;
+
+static pthread_mutex_t s_nb_run_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static NB_RunStats s_nb_run_stats;
+
+static double nb_run_now_ms(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static NB_Bool nb_run_stats_set(struct PP_Var stats,
+                                const char* key,
+                                double value) {
+  if (!nb_var_dict_set(stats, key, PP_MakeDouble(value))) {
+    NB_VERROR("Failed to set stats key \"%s\".", key);
+    return NB_FALSE;
+  }
+  return NB_TRUE;
+}
+
+struct PP_Var nb_run_get_stats(struct NB_Queue* message_queue) {
+  struct PP_Var stats = nb_var_dict_create();
+  NB_RunStats run_stats;
+
+  pthread_mutex_lock(&s_nb_run_stats_mutex);
+  run_stats = s_nb_run_stats;
+  pthread_mutex_unlock(&s_nb_run_stats_mutex);
+
+#define NB_RUN_STATS_SET(key, value)              \
+  if (!nb_run_stats_set(stats, key, value)) {     \
+    goto fail;                                    \
+  }
+
+  NB_RUN_STATS_SET("requests", run_stats.requests);
+  NB_RUN_STATS_SET("parseTime", run_stats.parse_time_ms);
+  NB_RUN_STATS_SET("executeTime", run_stats.execute_time_ms);
+  NB_RUN_STATS_SET("serializeTime", run_stats.serialize_time_ms);
+  NB_RUN_STATS_SET("lastParseTime", run_stats.last_parse_time_ms);
+  NB_RUN_STATS_SET("lastExecuteTime", run_stats.last_execute_time_ms);
+  NB_RUN_STATS_SET("lastSerializeTime", run_stats.last_serialize_time_ms);
+
+  /* There is no queue when running requests directly, e.g. in tests. */
+  if (message_queue) {
+    struct NB_QueueStats queue_stats;
+    nb_queue_get_stats(message_queue, &queue_stats);
+    NB_RUN_STATS_SET("queueSize", queue_stats.size);
+    NB_RUN_STATS_SET("queueMaxSize", queue_stats.max_size);
+    NB_RUN_STATS_SET("queueMaxDepth", queue_stats.max_depth);
+    NB_RUN_STATS_SET("queueEnqueued", queue_stats.enqueued);
+    NB_RUN_STATS_SET("queueDequeued", queue_stats.dequeued);
+    NB_RUN_STATS_SET("queueDropped", queue_stats.dropped);
+    NB_RUN_STATS_SET("queueWaits", queue_stats.waits);
+    NB_RUN_STATS_SET("queueWaitTime", queue_stats.wait_time_ms);
+  }
+
+#undef NB_RUN_STATS_SET
+
+  return stats;
+
+fail:
+  nb_var_release(stats);
+  return PP_MakeUndefined();
+}
+
+/* Maximum number of requests waiting for, or running on, a worker. */
+#define NB_RUN_POOL_MAX_JOBS 64
+
+/* A request waiting for, or running on, a worker. |handles| is the sorted set
+ * of handles it uses, not counting request-scoped ones. */
+typedef struct NB_RunJob {
+  struct NB_RunJob* next;
+  struct PP_Var request_var;
+  struct NB_Request* request;
+  double parse_time_ms;
+  NB_Handle* handles;
+  uint32_t handles_count;
+  NB_Bool running;
+} NB_RunJob;
+
+/* Jobs in the order they were received. A job can start once no earlier job
+ * uses any of its handles, so requests that share handles still run in
+ * order, and requests that don't can run at the same time. */
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t changed_cond;
+  NB_RunJob* head;
+  NB_RunJob* tail;
+  uint32_t count;
+} s_nb_run_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+
+static int nb_run_compare_handles(const void* a, const void* b) {
+  NB_Handle x = *(const NB_Handle*)a;
+  NB_Handle y = *(const NB_Handle*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Parses |request_var| and collects the handles it uses. Requests that may
+ * call back into JavaScript, or that run builtins other than $errorIf, must
+ * run on the thread reading the message queue with no other requests
+ * running; for those |*out_exclusive| is set. So are requests whose handles
+ * can't be collected. Returns NULL if the job can't be allocated.
+ *
+ * A request may call back into JavaScript if it sets a function, or uses a
+ * handle whose value is a function id, even one moved from another handle.
+ *
+ * Only requests that run exclusively can create function id handles, and they
+ * run to completion before the next request is parsed, so the handle types
+ * checked here are up to date. */
+static NB_RunJob* nb_run_job_create(struct PP_Var request_var,
+                                    NB_Bool* out_exclusive) {
+  NB_RunJob* job = calloc(1, sizeof(NB_RunJob));
+  struct NB_Request* request;
+  double parse_start_ms;
+  uint32_t max_handles = 0;
+  uint32_t count;
+  int commands_count;
+  int i;
+  int j;
+
+  *out_exclusive = NB_FALSE;
+  if (!job) {
+    return NULL;
+  }
+
+  parse_start_ms = nb_run_now_ms();
+  job->request_var = request_var;
+  job->request = request = nb_request_parse(request_var);
+  job->parse_time_ms = nb_run_now_ms() - parse_start_ms;
+  if (request == NULL) {
+    NB_ERROR("nb_request_parse() failed.");
+    return job;
+  }
+
+  commands_count = nb_request_commands_count(request);
+  for (i = 0; i < commands_count; ++i) {
+    max_handles += nb_request_command_arg_count(request, i) + 1;
+  }
+  max_handles += nb_request_sethandles_count(request) +
+                 nb_request_gethandles_count(request) +
+                 nb_request_destroyhandles_count(request);
+  job->handles = malloc(max_handles * sizeof(NB_Handle));
+  if (max_handles > 0 && !job->handles) {
+    /* Without its handles the job can't be checked for overlap. */
+    *out_exclusive = NB_TRUE;
+  }
+
+#define NB_RUN_JOB_ADD_HANDLE(handle)                           \
+  do {                                                          \
+    NB_Handle h = (handle);                                     \
+    NB_Type type;                                               \
+    if (h > 0) {                                                \
+      if (job->handles) {                                       \
+        job->handles[job->handles_count++] = h;                 \
+      }                                                         \
+      if (nb_handle_get_type(h, &type) &&                       \
+          type == NB_TYPE_FUNC_ID) {                            \
+        *out_exclusive = NB_TRUE;                               \
+      }                                                         \
+    }                                                           \
+  } while (0)
+
+  for (i = 0; i < nb_request_sethandles_count(request); ++i) {
+    NB_Handle handle;
+    struct PP_Var value;
+    const char* tag;
+    uint32_t tag_length;
+    uint32_t array_length;
+
+    nb_request_sethandle(request, i, &handle, &value);
+    NB_RUN_JOB_ADD_HANDLE(handle);
+    if (value.type == PP_VARTYPE_ARRAY &&
+        nb_var_tagged_array(value, &tag, &tag_length, &array_length) &&
+        strncmp(tag, "function", tag_length) == 0) {
+      *out_exclusive = NB_TRUE;
+    }
+  }
+
+  for (i = 0; i < commands_count; ++i) {
+    int function_idx = nb_request_command_function(request, i);
+    /* Builtins are exclusive, but control flow and map commands are not. */
+    if (function_idx < 0 && function_idx > NB_COMMAND_REPEAT &&
+        function_idx != -1 /* $errorIf */) {
+      *out_exclusive = NB_TRUE;
+    }
+
+    for (j = 0; j < nb_request_command_arg_count(request, i); ++j) {
+      NB_RUN_JOB_ADD_HANDLE(nb_request_command_arg(request, i, j));
+    }
+
+    if (nb_request_command_has_ret(request, i)) {
+      NB_RUN_JOB_ADD_HANDLE(nb_request_command_ret(request, i));
+    }
+  }
+
+  for (i = 0; i < nb_request_gethandles_count(request); ++i) {
+    NB_RUN_JOB_ADD_HANDLE(nb_request_gethandle(request, i));
+  }
+
+  for (i = 0; i < nb_request_destroyhandles_count(request); ++i) {
+    NB_RUN_JOB_ADD_HANDLE(nb_request_destroyhandle(request, i));
+  }
+
+#undef NB_RUN_JOB_ADD_HANDLE
+
+  /* Sort and remove duplicates. */
+  qsort(job->handles, job->handles_count, sizeof(NB_Handle),
+        nb_run_compare_handles);
+  count = 0;
+  for (i = 0; i < (int)job->handles_count; ++i) {
+    if (count == 0 || job->handles[i] != job->handles[count - 1]) {
+      job->handles[count++] = job->handles[i];
+    }
+  }
+  job->handles_count = count;
+
+  return job;
+}
+
+static void nb_run_job_destroy(NB_RunJob* job) {
+  nb_var_release(job->request_var);
+  free(job->handles);
+  free(job);
+}
+
+static NB_Bool nb_run_jobs_overlap(NB_RunJob* a, NB_RunJob* b) {
+  uint32_t i = 0;
+  uint32_t j = 0;
+  while (i < a->handles_count && j < b->handles_count) {
+    if (a->handles[i] == b->handles[j]) {
+      return NB_TRUE;
+    } else if (a->handles[i] < b->handles[j]) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  return NB_FALSE;
+}
+
+/* Must be called with the pool mutex held. */
+static NB_RunJob* nb_run_pool_next_job(void) {
+  NB_RunJob* job;
+  for (job = s_nb_run_pool.head; job; job = job->next) {
+    NB_RunJob* earlier;
+    if (job->running) {
+      continue;
+    }
+
+    for (earlier = s_nb_run_pool.head; earlier != job;
+         earlier = earlier->next) {
+      if (nb_run_jobs_overlap(earlier, job)) {
+        break;
+      }
+    }
+
+    if (earlier == job) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/* Must be called with the pool mutex held. */
+static void nb_run_pool_add(NB_RunJob* job) {
+  if (s_nb_run_pool.tail) {
+    s_nb_run_pool.tail->next = job;
+  } else {
+    s_nb_run_pool.head = job;
+  }
+  s_nb_run_pool.tail = job;
+  s_nb_run_pool.count++;
+}
+
+/* Must be called with the pool mutex held. */
+static void nb_run_pool_remove(NB_RunJob* job) {
+  NB_RunJob* prev = NULL;
+  NB_RunJob* iter;
+  for (iter = s_nb_run_pool.head; iter != job; iter = iter->next) {
+    prev = iter;
+  }
+
+  if (prev) {
+    prev->next = job->next;
+  } else {
+    s_nb_run_pool.head = job->next;
+  }
+
+  if (s_nb_run_pool.tail == job) {
+    s_nb_run_pool.tail = prev;
+  }
+  s_nb_run_pool.count--;
+}
+
+static void* nb_run_worker_thread(void* user_data) {
+  pthread_mutex_lock(&s_nb_run_pool.mutex);
+  while (1) {
+    NB_RunJob* job = nb_run_pool_next_job();
+    struct PP_Var response = PP_MakeUndefined();
+
+    if (!job) {
+      pthread_cond_wait(&s_nb_run_pool.changed_cond, &s_nb_run_pool.mutex);
+      continue;
+    }
+
+    job->running = NB_TRUE;
+    pthread_mutex_unlock(&s_nb_run_pool.mutex);
+
+    /* Workers have no message queue, so can't wait for callback responses;
+     * see nb_run_job_create. */
+    nb_request_run_parsed(NULL, job->request_var, job->request,
+                          job->parse_time_ms, &response);
+    g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
+    nb_var_release(response);
+
+    pthread_mutex_lock(&s_nb_run_pool.mutex);
+    nb_run_pool_remove(job);
+    pthread_cond_broadcast(&s_nb_run_pool.changed_cond);
+    nb_run_job_destroy(job);
+  }
+  return NULL;
+}
+
+void nb_run_message_loop_pool(struct NB_Queue* message_queue,
+                              int workers_count) {
+  struct PP_Var requests[NB_RUN_BATCH_SIZE];
+  int started = 0;
+  int i;
+
+  nb_handle_set_thread_safe();
+  for (i = 0; i < workers_count; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &nb_run_worker_thread, NULL) != 0) {
+      NB_VERROR("Unable to start worker thread %d.", i);
+      continue;
+    }
+    ++started;
+  }
+
+  if (started == 0) {
+    nb_run_message_loop(message_queue);
+    return;
+  }
+
+  while (1) {
+    uint32_t count =
+        nb_queue_dequeue_batch(message_queue, requests, NB_RUN_BATCH_SIZE);
+    uint32_t j;
+
+    for (j = 0; j < count; ++j) {
+      NB_Bool exclusive;
+      NB_RunJob* job = nb_run_job_create(requests[j], &exclusive);
+
+      /* A callback kept by the C library may be called by any request, and
+       * must wait for its response on the message queue. */
+      if (nb_callbacks_allocated() > 0) {
+        exclusive = NB_TRUE;
+      }
+
+      pthread_mutex_lock(&s_nb_run_pool.mutex);
+      if (!job) {
+        struct PP_Var response = PP_MakeUndefined();
+
+        /* Run it here, like an exclusive job. Its handles weren't collected,
+         * so it may not run alongside the workers. */
+        while (s_nb_run_pool.count > 0) {
+          pthread_cond_wait(&s_nb_run_pool.changed_cond, &s_nb_run_pool.mutex);
+        }
+        pthread_mutex_unlock(&s_nb_run_pool.mutex);
+
+        nb_request_run(message_queue, requests[j], &response);
+        g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
+        nb_var_release(response);
+        nb_var_release(requests[j]);
+        continue;
+      }
+
+      if (exclusive) {
+        struct PP_Var response = PP_MakeUndefined();
+
+        /* Wait for the workers to finish everything, then run it here. */
+        while (s_nb_run_pool.count > 0) {
+          pthread_cond_wait(&s_nb_run_pool.changed_cond, &s_nb_run_pool.mutex);
+        }
+        pthread_mutex_unlock(&s_nb_run_pool.mutex);
+
+        nb_request_run_parsed(message_queue, job->request_var, job->request,
+                              job->parse_time_ms, &response);
+        g_nb_ppb_messaging->PostMessage(g_nb_pp_instance, response);
+        nb_var_release(response);
+        nb_run_job_destroy(job);
+        continue;
+      }
+
+      /* Stop reading the message queue while the workers are busy, so it
+       * fills up and throttles JavaScript. */
+      while (s_nb_run_pool.count >= NB_RUN_POOL_MAX_JOBS) {
+        pthread_cond_wait(&s_nb_run_pool.changed_cond, &s_nb_run_pool.mutex);
+      }
+
+      nb_run_pool_add(job);
+      pthread_cond_broadcast(&s_nb_run_pool.changed_cond);
+      pthread_mutex_unlock(&s_nb_run_pool.mutex);
+    }
+  }
+}
+
 NB_Bool nb_request_run(struct NB_Queue* message_queue,
                        struct PP_Var request_var,
                        struct PP_Var* out_response_var) {
+  double parse_start_ms = nb_run_now_ms();
+  struct NB_Request* request = nb_request_parse(request_var);
+  if (request == NULL) {
+    NB_ERROR("nb_request_parse() failed.");
+  }
+
+  return nb_request_run_parsed(message_queue, request_var, request,
+                               nb_run_now_ms() - parse_start_ms,
+                               out_response_var);
+}
+
+/* Takes ownership of |request|, which is NULL if |request_var| failed to
+ * parse. Even then, the response has the request's id if it can be read, so
+ * JavaScript gets an error instead of waiting forever. */
+static NB_Bool nb_request_run_parsed(struct NB_Queue* message_queue,
+                                     struct PP_Var request_var,
+                                     struct NB_Request* request,
+                                     double parse_time_ms,
+                                     struct PP_Var* out_response_var) {
   NB_Bool result = NB_FALSE;
-  struct NB_Request* request = NULL;
   struct NB_Response* response = NULL;
   int failed_command_idx = -1;
+  NB_HandleArenaMark arena_mark = nb_handle_arena_push();
+  double execute_start_ms = nb_run_now_ms();
+  double serialize_start_ms = execute_start_ms;
+  double end_ms;
 
-  request = nb_request_parse(request_var);
   if (request == NULL) {
-    NB_ERROR("nb_request_parse() failed.");
+    int id = nb_request_var_id(request_var);
+    if (id > 0) {
+      response = nb_response_create(id, 0);
+    }
     goto cleanup;
   }
 
-  response = nb_response_create(nb_request_id(request));
+  response = nb_response_create(nb_request_id(request),
+                                nb_request_gethandles_count(request));
   if (response == NULL) {
     goto cleanup;
   }
@@ -118,6 +602,8 @@ NB_Bool nb_request_run(struct NB_Queue* message_queue,
     result = NB_FALSE;
   }
 
+  serialize_start_ms = nb_run_now_ms();
+
   if (!nb_request_get_handles(request, response)) {
     NB_ERROR("nb_request_get_handles() failed.");
     result = NB_FALSE;
@@ -126,6 +612,9 @@ NB_Bool nb_request_run(struct NB_Queue* message_queue,
   nb_request_destroy_handles(request);
 
 cleanup:
+  /* Destroy all request-scoped handles. */
+  nb_handle_arena_pop(arena_mark);
+
   if (request != NULL) {
     nb_request_destroy(request);
   }
@@ -142,6 +631,17 @@ cleanup:
     *out_response_var = PP_MakeUndefined();
   }
 
+  end_ms = nb_run_now_ms();
+  pthread_mutex_lock(&s_nb_run_stats_mutex);
+  s_nb_run_stats.requests++;
+  s_nb_run_stats.last_parse_time_ms = parse_time_ms;
+  s_nb_run_stats.last_execute_time_ms = serialize_start_ms - execute_start_ms;
+  s_nb_run_stats.last_serialize_time_ms = end_ms - serialize_start_ms;
+  s_nb_run_stats.parse_time_ms += s_nb_run_stats.last_parse_time_ms;
+  s_nb_run_stats.execute_time_ms += s_nb_run_stats.last_execute_time_ms;
+  s_nb_run_stats.serialize_time_ms += s_nb_run_stats.last_serialize_time_ms;
+  pthread_mutex_unlock(&s_nb_run_stats_mutex);
+
   return result;
 }
 
@@ -172,7 +672,8 @@ NB_Bool nb_request_set_handles(struct NB_Request* request) {
         }
         break;
 
-      case PP_VARTYPE_STRING: {
+      case PP_VARTYPE_STRING:
+      case PP_VARTYPE_ARRAY_BUFFER: {
         if (!nb_handle_register_var(handle, value)) {
           NB_VERROR("nb_handle_register_var(%d, %s) failed, i=%d.", handle,
                     nb_var_type_to_string(value.type), i);
@@ -259,26 +760,235 @@ cleanup:
 NB_Bool nb_request_run_commands(struct NB_Queue* message_queue,
                                 struct NB_Request* request,
                                 int* out_failed_command_idx) {
-  int commands_count = nb_request_commands_count(request);
-  int i;
+  return nb_request_run_range(message_queue, request, 0,
+                              nb_request_commands_count(request),
+                              out_failed_command_idx);
+}
 
-  for (i = 0; i < commands_count; ++i) {
-    if (!nb_request_command_run(message_queue, request, i)) {
+NB_Bool nb_request_run_range(struct NB_Queue* message_queue,
+                             struct NB_Request* request,
+                             int begin,
+                             int end,
+                             int* out_failed_command_idx) {
+  int i = begin;
+
+  while (i < end) {
+    int function_idx = nb_request_command_function(request, i);
+    int next = i + 1;
+
+    if (function_idx == NB_COMMAND_REPEAT || function_idx == NB_COMMAND_WHILE) {
+      if (!nb_request_run_loop(message_queue, request, i, end, &next,
+                               out_failed_command_idx)) {
+        return NB_FALSE;
+      }
+    } else if (function_idx == NB_COMMAND_IF) {
+      if (!nb_request_run_if(message_queue, request, i, end, &next,
+                             out_failed_command_idx)) {
+        return NB_FALSE;
+      }
+    } else if (!nb_request_command_run(message_queue, request, i)) {
       *out_failed_command_idx = i;
       NB_VERROR("nb_request_command_run(%d) failed.", i);
       return NB_FALSE;
     }
+
+    i = next;
   }
 
   return NB_TRUE;
 }
 
+static NB_Bool nb_run_handle_is_true(NB_Handle handle, NB_Bool* out_value) {
+  NB_Type type;
+  NB_HandleScalar value;
+
+  if (!nb_handle_convert_to_scalar(handle, &type, &value)) {
+    NB_VERROR("Expected handle %d to be a number or pointer.", handle);
+    return NB_FALSE;
+  }
+
+  switch (type) {
+    case NB_TYPE_INT32:
+      *out_value = value.int32 != 0;
+      break;
+    case NB_TYPE_INT64:
+      *out_value = value.int64 != 0;
+      break;
+    case NB_TYPE_DOUBLE:
+      *out_value = value.float64 != 0;
+      break;
+    default:
+      /* NULL pointer */
+      *out_value = NB_FALSE;
+      break;
+  }
+
+  return NB_TRUE;
+}
+
+NB_Bool nb_request_run_loop(struct NB_Queue* message_queue,
+                            struct NB_Request* request,
+                            int command_idx,
+                            int end,
+                            int* out_next_command_idx,
+                            int* out_failed_command_idx) {
+  NB_Bool is_while =
+      nb_request_command_function(request, command_idx) == NB_COMMAND_WHILE;
+  int args_count = nb_request_command_arg_count(request, command_idx);
+  NB_Bool has_ret = nb_request_command_has_ret(request, command_idx);
+  NB_Handle control;
+  int32_t count = 0;
+  int32_t body_count;
+  int body_begin = command_idx + 1;
+  int body_end;
+  int32_t iteration;
+  int i;
+
+  if (args_count < 2 || args_count % 2 != 0) {
+    NB_VERROR("Expected loop to have 2 args and [to, from] pairs, got %d.",
+              args_count);
+    goto fail;
+  }
+
+  if (is_while && has_ret) {
+    NB_ERROR("Expected while loop to have no ret handle.");
+    goto fail;
+  }
+
+  control = nb_request_command_arg(request, command_idx, 0);
+  if (!nb_handle_get_int32(nb_request_command_arg(request, command_idx, 1),
+                           &body_count) ||
+      body_count < 0 || body_count > end - body_begin) {
+    NB_VERROR("Bad loop body count at command %d.", command_idx);
+    goto fail;
+  }
+  body_end = body_begin + body_count;
+
+  if (!is_while && !nb_handle_get_int32(control, &count)) {
+    NB_VERROR("Unable to get handle %d as int32_t.", control);
+    goto fail;
+  }
+
+  for (iteration = 0;; ++iteration) {
+    if (is_while) {
+      NB_Bool condition;
+      if (!nb_run_handle_is_true(control, &condition)) {
+        goto fail;
+      }
+
+      if (!condition) {
+        break;
+      }
+    } else if (iteration >= count) {
+      break;
+    }
+
+    if (iteration > 0) {
+      for (i = body_begin; i < body_end; ++i) {
+        if (nb_request_command_has_ret(request, i)) {
+          nb_handle_destroy_if_exists(nb_request_command_ret(request, i));
+        }
+      }
+    }
+
+    if (has_ret) {
+      NB_Handle ret = nb_request_command_ret(request, command_idx);
+      nb_handle_destroy_if_exists(ret);
+      if (!nb_handle_register_int32(ret, iteration)) {
+        goto fail;
+      }
+    }
+
+    if (!nb_request_run_range(message_queue, request, body_begin, body_end,
+                              out_failed_command_idx)) {
+      return NB_FALSE;
+    }
+
+    for (i = 2; i < args_count; i += 2) {
+      if (!nb_handle_move(nb_request_command_arg(request, command_idx, i + 1),
+                          nb_request_command_arg(request, command_idx, i))) {
+        goto fail;
+      }
+    }
+  }
+
+  *out_next_command_idx = body_end;
+  return NB_TRUE;
+
+fail:
+  *out_failed_command_idx = command_idx;
+  return NB_FALSE;
+}
+
+NB_Bool nb_request_run_if(struct NB_Queue* message_queue,
+                          struct NB_Request* request,
+                          int command_idx,
+                          int end,
+                          int* out_next_command_idx,
+                          int* out_failed_command_idx) {
+  int then_begin = command_idx + 1;
+  int32_t then_count;
+  int32_t else_count;
+  NB_Bool condition;
+
+  if (nb_request_command_arg_count(request, command_idx) != 3 ||
+      nb_request_command_has_ret(request, command_idx)) {
+    NB_ERROR("Expected if to have 3 args and no ret handle.");
+    goto fail;
+  }
+
+  if (!nb_handle_get_int32(nb_request_command_arg(request, command_idx, 1),
+                           &then_count) ||
+      !nb_handle_get_int32(nb_request_command_arg(request, command_idx, 2),
+                           &else_count) ||
+      then_count < 0 || else_count < 0 ||
+      then_count > end - then_begin ||
+      else_count > end - then_begin - then_count) {
+    NB_VERROR("Bad if branch counts at command %d.", command_idx);
+    goto fail;
+  }
+
+  if (!nb_run_handle_is_true(nb_request_command_arg(request, command_idx, 0),
+                             &condition)) {
+    goto fail;
+  }
+
+  if (condition) {
+    if (!nb_request_run_range(message_queue, request, then_begin,
+                              then_begin + then_count,
+                              out_failed_command_idx)) {
+      return NB_FALSE;
+    }
+  } else {
+    if (!nb_request_run_range(message_queue, request, then_begin + then_count,
+                              then_begin + then_count + else_count,
+                              out_failed_command_idx)) {
+      return NB_FALSE;
+    }
+  }
+
+  *out_next_command_idx = then_begin + then_count + else_count;
+  return NB_TRUE;
+
+fail:
+  *out_failed_command_idx = command_idx;
+  return NB_FALSE;
+}
+
 NB_Bool nb_request_get_handles(struct NB_Request* request,
                                struct NB_Response* response) {
   NB_Bool result = NB_TRUE;
   int gethandles_count = nb_request_gethandles_count(request);
   int i;
 
+  /* If any value can't be packed, fall back to sending an array of vars. */
+  if (nb_request_packed_values(request) &&
+      nb_request_get_handles_packed(request, response)) {
+    return NB_TRUE;
+  }
+
+  /* The response's values are pre-sized to |gethandles_count|, so each value
+   * is set in place. */
   for (i = 0; i < gethandles_count; ++i) {
     NB_Handle handle = nb_request_gethandle(request, i);
     struct PP_Var value = PP_MakeUndefined();
@@ -298,6 +1008,35 @@ NB_Bool nb_request_get_handles(struct NB_Request* request,
   return result;
 }
 
+NB_Bool nb_request_get_handles_packed(struct NB_Request* request,
+                                      struct NB_Response* response) {
+  NB_Bool result = NB_FALSE;
+  int gethandles_count = nb_request_gethandles_count(request);
+  NB_Type* types = malloc(gethandles_count * sizeof(NB_Type));
+  NB_HandleScalar* values = malloc(gethandles_count * sizeof(NB_HandleScalar));
+  int i;
+
+  /* cleanup frees whichever allocation succeeded. */
+  if (gethandles_count > 0 && (!types || !values)) {
+    NB_ERROR("Failed to allocate packed values.");
+    goto cleanup;
+  }
+
+  for (i = 0; i < gethandles_count; ++i) {
+    if (!nb_handle_convert_to_scalar(nb_request_gethandle(request, i),
+                                     &types[i], &values[i])) {
+      goto cleanup;
+    }
+  }
+
+  result = nb_response_set_packed_values(response, types, values,
+                                         gethandles_count);
+cleanup:
+  free(values);
+  free(types);
+  return result;
+}
+
 void nb_request_destroy_handles(struct NB_Request* request) {
   int destroyhandles_count = nb_request_destroyhandles_count(request);
   NB_Handle* handles = alloca(destroyhandles_count * sizeof(NB_Handle));
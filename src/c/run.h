@@ -29,13 +29,58 @@ extern "C" {
 struct NB_Queue;
 struct NB_Response;
 
+/* Control flow commands. These are run by nb_request_run_commands itself,
+ * instead of being dispatched to a function. Their args are handles, and all
+ * counts are int32 handles.
+ *
+ * NB_COMMAND_REPEAT: args (count, body count, [to, from]...), ret optional.
+ *   Runs the next |body count| commands |count| times. The ret handle is set
+ *   to the iteration index (int32) before each iteration.
+ * NB_COMMAND_WHILE: args (condition, body count, [to, from]...), no ret.
+ *   Runs the next |body count| commands while |condition| is true, i.e. a
+ *   non-zero number or a non-NULL pointer.
+ * NB_COMMAND_IF: args (condition, then count, else count), no ret.
+ *   Runs the next |then count| commands and skips the |else count| commands
+ *   after them if |condition| is true. Otherwise skips the |then count|
+ *   commands and runs the |else count| commands. The ret handles of skipped
+ *   commands are never registered.
+ *
+ * For loops, the ret handles of the body commands are destroyed before each
+ * iteration after the first, so they can be registered again. After each
+ * iteration, each |from| handle is moved to its |to| handle (see
+ * nb_handle_move), so values can be carried to the next iteration.
+ *
+ * NB_COMMAND_MAP: args (function id, count, columns..., [out]), no ret.
+ *   Calls the function |count| times, passing the i-th element of each
+ *   column, and stores the result in the i-th element of |out| if the
+ *   function returns a value. Columns are pointers or ArrayBuffers of the
+ *   function's argument types. Only functions whose arguments and result are
+ *   numbers, enums or pointers can be mapped. This is dispatched by the
+ *   generated glue, like a function. */
+enum {
+  NB_COMMAND_REPEAT = -5,
+  NB_COMMAND_WHILE = -6,
+  NB_COMMAND_IF = -7,
+  NB_COMMAND_MAP = -8,
+};
+
 void nb_run_message_loop(struct NB_Queue* queue);
+/* Like nb_run_message_loop, but runs requests on |workers_count| threads.
+ * Requests that share no handles may run at the same time, and finish in any
+ * order. Requests that may call JavaScript functions run alone, on this
+ * thread. While C code holds on to a JavaScript function, i.e. until its
+ * handle is destroyed, every request runs alone, since any of them may call
+ * it. */
+void nb_run_message_loop_pool(struct NB_Queue* queue, int workers_count);
 struct NB_Response* nb_run_message_loop_for_response(struct NB_Queue* queue,
                                                      int id,
                                                      int cb_id);
 NB_Bool nb_request_run(struct NB_Queue* queue,
                        struct PP_Var request_var,
                        struct PP_Var* response_var);
+/* Returns a dictionary of counters and timings for |queue| and the requests
+ * run so far. Must be called on the thread running requests. */
+struct PP_Var nb_run_get_stats(struct NB_Queue* queue);
 
 #ifdef __cplusplus
 }
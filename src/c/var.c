@@ -25,6 +25,13 @@
 #include "interfaces.h"
 #endif
 
+static struct PP_Var s_nb_var_keys[NB_VAR_KEY_COUNT];
+static const char* s_nb_var_key_strings[NB_VAR_KEY_COUNT] = {
+#define X(name, str) str,
+  NB_VAR_KEYS
+#undef X
+};
+
 void nb_var_addref(struct PP_Var var) {
   g_nb_ppb_var->AddRef(var);
 }
@@ -81,6 +88,29 @@ struct PP_Var nb_var_string_create(const char* s, uint32_t len) {
   return g_nb_ppb_var->VarFromUtf8(s, len);
 }
 
+void nb_var_keys_init(void) {
+  int i;
+  for (i = 0; i < NB_VAR_KEY_COUNT; ++i) {
+    const char* key = s_nb_var_key_strings[i];
+    if (s_nb_var_keys[i].type == PP_VARTYPE_STRING) {
+      nb_var_release(s_nb_var_keys[i]);
+    }
+
+    s_nb_var_keys[i] = g_nb_ppb_var->VarFromUtf8(key, strlen(key));
+  }
+}
+
+struct PP_Var nb_var_key(NB_VarKey key) {
+  assert(key >= 0 && key < NB_VAR_KEY_COUNT);
+  assert(s_nb_var_keys[key].type == PP_VARTYPE_STRING);
+  return s_nb_var_keys[key];
+}
+
+const char* nb_var_key_string(NB_VarKey key) {
+  assert(key >= 0 && key < NB_VAR_KEY_COUNT);
+  return s_nb_var_key_strings[key];
+}
+
 struct PP_Var nb_var_array_create(void) {
   return g_nb_ppb_var_array->Create();
 }
@@ -102,6 +132,11 @@ NB_Bool nb_var_array_set(struct PP_Var var,
   return g_nb_ppb_var_array->Set(var, index, value);
 }
 
+NB_Bool nb_var_array_set_length(struct PP_Var var, uint32_t length) {
+  assert(var.type == PP_VARTYPE_ARRAY);
+  return g_nb_ppb_var_array->SetLength(var, length);
+}
+
 struct PP_Var nb_var_dict_create(void) {
   return g_nb_ppb_var_dictionary->Create();
 }
@@ -136,6 +171,16 @@ NB_Bool nb_var_dict_set_var(struct PP_Var var,
   return g_nb_ppb_var_dictionary->Set(var, key, value);
 }
 
+struct PP_Var nb_var_dict_get_key(struct PP_Var var, NB_VarKey key) {
+  return nb_var_dict_get_var(var, nb_var_key(key));
+}
+
+NB_Bool nb_var_dict_set_key(struct PP_Var var,
+                            NB_VarKey key,
+                            struct PP_Var value) {
+  return nb_var_dict_set_var(var, nb_var_key(key), value);
+}
+
 struct PP_Var nb_var_dict_get_keys(struct PP_Var var) {
   assert(var.type == PP_VARTYPE_DICTIONARY);
   return g_nb_ppb_var_dictionary->GetKeys(var);
@@ -161,9 +206,9 @@ uint32_t nb_var_buffer_byte_length(struct PP_Var var) {
   return length;
 }
 
-void nb_var_buffer_map(struct PP_Var var) {
+void* nb_var_buffer_map(struct PP_Var var) {
   assert(var.type == PP_VARTYPE_ARRAY_BUFFER);
-  g_nb_ppb_var_array_buffer->Map(var);
+  return g_nb_ppb_var_array_buffer->Map(var);
 }
 
 void nb_var_buffer_unmap(struct PP_Var var) {
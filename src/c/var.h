@@ -40,18 +40,55 @@ struct PP_Var nb_var_array_create(void);
 uint32_t nb_var_array_length(struct PP_Var);
 struct PP_Var nb_var_array_get(struct PP_Var, uint32_t index);
 NB_Bool nb_var_array_set(struct PP_Var, uint32_t index, struct PP_Var);
+NB_Bool nb_var_array_set_length(struct PP_Var, uint32_t length);
+
+/* Dictionary keys of requests and responses. The key vars are created once,
+ * by nb_interfaces_init, so they can be looked up without creating a string
+ * var each time. */
+#define NB_VAR_KEYS            \
+  X(ARGS, "args")              \
+  X(CB_ID, "cbId")             \
+  X(COMMANDS, "commands")      \
+  X(DESTROY, "destroy")        \
+  X(DROPPED, "dropped")        \
+  X(ERROR, "error")            \
+  X(GET, "get")                \
+  X(ID, "id")                  \
+  X(PACKED, "packed")          \
+  X(PREPARE, "prepare")        \
+  X(PROGRAM, "program")        \
+  X(RET, "ret")                \
+  X(SET, "set")                \
+  X(SPACE, "space")            \
+  X(THROTTLE, "throttle")      \
+  X(UNPREPARE, "unprepare")    \
+  X(VALUES, "values")
+
+typedef enum {
+#define X(name, str) NB_VAR_KEY_##name,
+  NB_VAR_KEYS
+#undef X
+  NB_VAR_KEY_COUNT
+} NB_VarKey;
+
+void nb_var_keys_init(void);
+/* The returned var is owned by the key cache; don't release it. */
+struct PP_Var nb_var_key(NB_VarKey);
+const char* nb_var_key_string(NB_VarKey);
 
 struct PP_Var nb_var_dict_create(void);
 struct PP_Var nb_var_dict_get(struct PP_Var, const char* key);
 struct PP_Var nb_var_dict_get_var(struct PP_Var, struct PP_Var key);
 NB_Bool nb_var_dict_set(struct PP_Var, const char* key, struct PP_Var);
 NB_Bool nb_var_dict_set_var(struct PP_Var, struct PP_Var key, struct PP_Var);
+struct PP_Var nb_var_dict_get_key(struct PP_Var, NB_VarKey);
+NB_Bool nb_var_dict_set_key(struct PP_Var, NB_VarKey, struct PP_Var);
 struct PP_Var nb_var_dict_get_keys(struct PP_Var);
 NB_Bool nb_var_dict_has_key(struct PP_Var, const char* key);
 
 struct PP_Var nb_var_buffer_create(uint32_t);
 uint32_t nb_var_buffer_byte_length(struct PP_Var);
-void nb_var_buffer_map(struct PP_Var);
+void* nb_var_buffer_map(struct PP_Var);
 void nb_var_buffer_unmap(struct PP_Var);
 
 struct PP_Var nb_var_int64_create(int64_t);
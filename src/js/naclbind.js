@@ -167,6 +167,15 @@ var utils = (function() {
 // embed ///////////////////////////////////////////////////////////////////////
 var Embed = (function(utils) {
 
+  // Posted by the module when its message queue reaches the high-water mark,
+  // and again when it drains to the low-water mark.
+  var QUEUE_STATUS_ID = 0;
+
+  // The default size of the module's message queue. The module drops requests
+  // that don't fit, so no more than this many are posted without a response.
+  // See $setQueueMaxSize.
+  var MAX_IN_FLIGHT = 4096;
+
   function Embed(naclEmbed) {
     if (!(this instanceof Embed)) {
       return new Embed(naclEmbed);
@@ -177,10 +186,31 @@ var Embed = (function(utils) {
     this.$naclEmbed_.$addLoadListener(this.$onLoad_.bind(this));
     this.$naclEmbed_.$addMessageListener(this.$onMessage_.bind(this));
     this.$loaded_ = false;
+    this.$throttled_ = false;
+    // Requests posted to the module that haven't been responded to yet.
+    this.$inFlight_ = 0;
+    this.$maxInFlight = MAX_IN_FLIGHT;
 
     this.$idCallbackMap_ = [];
   }
 
+  // Set the size of the module's message queue, and post no more requests than
+  // fit in it. Must be called before the module is loaded.
+  Embed.prototype.$setQueueMaxSize = function(maxSize) {
+    if (this.$loaded_) {
+      throw new Error('Expected NaCl module not to be loaded yet.');
+    }
+
+    // The module ignores smaller values.
+    if (!utils.isInteger(maxSize) || maxSize < 4) {
+      throw new Error('Expected queue max size to be an integer >= 4, not ' +
+                      maxSize + '.');
+    }
+
+    this.$naclEmbed_.$setAttribute('nb-queue-max-size', String(maxSize));
+    this.$maxInFlight = maxSize;
+  };
+
   Embed.prototype.$onLoad_ = function(e) {
     // Wait till the next time through the eventloop to allow other 'load'
     // listeners to be called.
@@ -212,6 +242,11 @@ var Embed = (function(utils) {
       throw new Error('Received message with bad id: ' + jsonMsg);
     }
 
+    if (id === QUEUE_STATUS_ID) {
+      this.$onQueueStatus_(msg);
+      return;
+    }
+
     cbId = msg.cbId;
     if (cbId !== undefined && !utils.isInteger(cbId)) {
       jsonMsg = JSON.stringify(msg);
@@ -231,15 +266,41 @@ var Embed = (function(utils) {
     // can't remove them from the map.
     if (cbId === undefined) {
       delete this.$idCallbackMap_[id];
+
+      // The module has finished a request, so there is room for another one.
+      this.$inFlight_--;
+      if (!this.$throttled_) {
+        this.$postQueuedMessages_(1);
+      }
+    }
+  };
+
+  Embed.prototype.$onQueueStatus_ = function(msg) {
+    this.$throttled_ = msg.throttle;
+    if (!this.$throttled_) {
+      this.$postQueuedMessages_(msg.space);
     }
   };
 
-  Embed.prototype.$postQueuedMessages_ = function() {
+  // Post at most |maxCount| queued messages, or all of them if |maxCount| is
+  // undefined. Never posts more than $maxInFlight requests at once.
+  Embed.prototype.$postQueuedMessages_ = function(maxCount) {
+    var count = this.$queuedMessages_.length;
     var i;
-    for (i = 0; i < this.$queuedMessages_.length; ++i) {
+
+    if (maxCount !== undefined && maxCount < count) {
+      count = maxCount;
+    }
+
+    if (this.$maxInFlight - this.$inFlight_ < count) {
+      count = Math.max(this.$maxInFlight - this.$inFlight_, 0);
+    }
+
+    for (i = 0; i < count; ++i) {
       this.$naclEmbed_.$postMessage(this.$queuedMessages_[i]);
     }
-    this.$queuedMessages_ = null;
+    this.$queuedMessages_.splice(0, count);
+    this.$inFlight_ += count;
   };
 
   // Should only be used for returning results from callbacks.
@@ -259,19 +320,30 @@ var Embed = (function(utils) {
     this.$naclEmbed_.$postMessage(msg);
   };
 
-  Embed.prototype.$postMessageWithResponse = function(msg, callback) {
-    if (msg.id === undefined) {
+  // |id| is only needed when |msg| is not an object with an id, e.g. a binary
+  // request.
+  Embed.prototype.$postMessageWithResponse = function(msg, callback, id) {
+    if (id === undefined) {
+      id = msg.id;
+    }
+
+    if (id === undefined) {
       throw new Error('Expected msg object to have id set.');
     }
 
-    this.$idCallbackMap_[msg.id] = callback;
+    this.$idCallbackMap_[id] = callback;
 
-    if (!this.$loaded_) {
+    // Keep messages in order: if any are already waiting, this one has to
+    // wait too.
+    if (!this.$loaded_ || this.$throttled_ ||
+        this.$queuedMessages_.length > 0 ||
+        this.$inFlight_ >= this.$maxInFlight) {
       this.$queuedMessages_.push(msg);
       return;
     }
 
     this.$naclEmbed_.$postMessage(msg);
+    this.$inFlight_++;
   };
 
   Embed.prototype.$appendToBody = function() {
@@ -937,6 +1009,10 @@ var NaClEmbed = (function() {
     document.body.appendChild(this.$element);
   };
 
+  NaClEmbed.prototype.$setAttribute = function(name, value) {
+    this.$element.setAttribute(name, value);
+  };
+
   NaClEmbed.prototype.$postMessage = function(msg) {
     this.$element.postMessage(msg);
   };
@@ -2104,6 +2180,7 @@ var type = (function(utils) {
     isCastError: isCastError,
     isCastOK: isCastOK,
     isCastWarning: isCastWarning,
+    isInteger: isInteger,
     isLessOrEquallyQualified: isLessOrEquallyQualified,
     isLessQualified: isLessQualified,
     isMoreOrEquallyQualified: isMoreOrEquallyQualified,
@@ -2116,6 +2193,37 @@ var type = (function(utils) {
 var mod = (function(Long, type, utils) {
 
   var ERROR_IF_ID = -1;
+  var COMPACT_HANDLES_ID = -3;
+  var GET_STATS_ID = -4;
+  var REPEAT_ID = -5;
+  var WHILE_ID = -6;
+  var IF_ID = -7;
+  var MAP_ID = -8;
+
+  // Binary request format; see src/c/request.c.
+  var BINARY_MAGIC = 0x3152424e;  // "NBR1"
+  var BINARY_HEADER_WORDS = 10;
+  var BINARY_FLAG_PACKED_VALUES = 1;
+  var BINARY_VALUE_INT32 = 0;
+  var BINARY_VALUE_DOUBLE = 1;
+  var BINARY_VALUE_INT64 = 2;
+  var BINARY_VALUE_NULL = 3;
+
+  // The type of handles holding a PP_Var, e.g. the result of $getStats().
+  var VAR_TYPE = type.Record('PP_Var', 16);
+
+  // Element types of typed arrays passed as $map columns.
+  var TYPED_ARRAY_TYPES = {
+    Int8Array: type.schar,
+    Uint8Array: type.uchar,
+    Uint8ClampedArray: type.uchar,
+    Int16Array: type.short,
+    Uint16Array: type.ushort,
+    Int32Array: type.int,
+    Uint32Array: type.uint,
+    Float32Array: type.float,
+    Float64Array: type.double
+  };
 
   function numberToType(n) {
     if (!(isFinite(n) && (utils.isInteger(n) || utils.isUnsignedInteger(n)))) {
@@ -2178,6 +2286,9 @@ var mod = (function(Long, type, utils) {
         return numberToType(obj);
       case 'String':
         return type.Pointer(type.char.$qualify(type.CONST));
+      case 'ArrayBuffer':
+        // Passed without copying; the module uses the buffer's data in place.
+        return type.Pointer(type.void);
       case 'Function':
         return type.Pointer(type.FunctionUntyped());
       // TODO(binji): handle other JS types.
@@ -2206,8 +2317,357 @@ var mod = (function(Long, type, utils) {
     });
   }
 
+  // The module reads $map columns in place, so a column's element type must
+  // have the same representation as the argument it is passed to.
+  function isColumnCompatible(elementType, argType) {
+    var from = type.getCanonical(elementType);
+    var to = type.getCanonical(argType);
+    var isInt = function(t) {
+      return type.isInteger(t) || t.$kind === type.ENUM;
+    };
+
+    if (from.$size !== to.$size) {
+      return false;
+    }
+
+    if (isInt(from) && isInt(to)) {
+      return true;
+    }
+
+    return from.$kind === to.$kind &&
+           (to.$kind === type.FLOAT || to.$kind === type.DOUBLE ||
+            to.$kind === type.POINTER);
+  }
+
+  // The array builtins are passed a raw pointer, so the module can't check
+  // that |array| holds |count| elements of |size| bytes. Check it here when
+  // |array| is, or is a handle to, an ArrayBuffer.
+  function checkArrayCount(name, array, count, size) {
+    var buffer = array;
+
+    if (typeof count !== 'number') {
+      return;
+    }
+
+    if (count < 0) {
+      throw new Error(name + ' expects a non-negative count, not ' + count +
+                      '.');
+    }
+
+    if (array instanceof Handle) {
+      buffer = array.$value;
+    }
+
+    if (buffer instanceof ArrayBuffer && count * size > buffer.byteLength) {
+      throw new Error(name + ' was given ' + count + ' elements, but the ' +
+                      'array has only ' + Math.floor(buffer.byteLength / size) +
+                      '.');
+    }
+  }
+
+  function handleToId(h) {
+    h.$checkEpoch_();
+    return h.$id;
+  }
+
   function handlesToIds(handles) {
-    return Array.prototype.map.call(handles, function(h) { return h.$id; });
+    return Array.prototype.map.call(handles, handleToId);
+  }
+
+  // Encode a request message as an ArrayBuffer, so the module can parse it
+  // without any dictionary lookups. Returns null if the message sets a value
+  // that has no binary encoding (strings and functions).
+  function encodeRequest(msg) {
+    var set = msg.set || {};
+    var setIds = Object.keys(set);
+    var commands = msg.commands || [];
+    var get = msg.get || [];
+    var destroy = msg.destroy || [];
+    var words = BINARY_HEADER_WORDS + get.length + destroy.length;
+    var argsCount = 0;
+    var view;
+    var offset = 0;
+    var i;
+    var j;
+    var value;
+
+    if (msg.unprepare) {
+      return null;
+    }
+
+    function write(x) {
+      view.setInt32(offset, x, true);
+      offset += 4;
+    }
+
+    for (i = 0; i < setIds.length; ++i) {
+      value = set[setIds[i]];
+      if (value === null) {
+        words += 2;
+      } else if (utils.isInteger(value)) {
+        words += 3;
+      } else if (utils.isNumber(value) ||
+                 (utils.getClass(value) === 'Array' && value[0] === 'long')) {
+        words += 4;
+      } else {
+        return null;
+      }
+    }
+
+    for (i = 0; i < commands.length; ++i) {
+      argsCount += commands[i].args.length;
+    }
+    words += 3 * commands.length + argsCount;
+
+    view = new DataView(new ArrayBuffer(words * 4));
+    write(BINARY_MAGIC);
+    write(msg.id);
+    write(msg.packed ? BINARY_FLAG_PACKED_VALUES : 0);
+    write(msg.prepare || 0);
+    write(msg.program || 0);
+    write(setIds.length);
+    write(commands.length);
+    write(argsCount);
+    write(get.length);
+    write(destroy.length);
+
+    for (i = 0; i < setIds.length; ++i) {
+      value = set[setIds[i]];
+      write(+setIds[i]);
+      if (value === null) {
+        write(BINARY_VALUE_NULL);
+      } else if (utils.isInteger(value)) {
+        write(BINARY_VALUE_INT32);
+        write(value);
+      } else if (utils.isNumber(value)) {
+        write(BINARY_VALUE_DOUBLE);
+        view.setFloat64(offset, value, true);
+        offset += 8;
+      } else {
+        write(BINARY_VALUE_INT64);
+        write(value[1]);
+        write(value[2]);
+      }
+    }
+
+    for (i = 0; i < commands.length; ++i) {
+      write(commands[i].id);
+      write(commands[i].ret || 0);
+      write(commands[i].args.length);
+      for (j = 0; j < commands[i].args.length; ++j) {
+        write(commands[i].args[j]);
+      }
+    }
+
+    for (i = 0; i < get.length; ++i) {
+      write(get[i]);
+    }
+
+    for (i = 0; i < destroy.length; ++i) {
+      write(destroy[i]);
+    }
+
+    return view.buffer;
+  }
+
+  // Packed response values; see src/c/response.c.
+  var PACKED_INT32 = 0;
+  var PACKED_DOUBLE = 1;
+  var PACKED_INT64 = 2;
+  var PACKED_NULL = 3;
+
+  function decodePackedValues(buffer) {
+    var view = new DataView(buffer);
+    var count = view.getUint32(0, true);
+    var offset = (4 + count + 7) & ~7;
+    var values = new Array(count);
+    var i;
+
+    for (i = 0; i < count; ++i, offset += 8) {
+      switch (view.getUint8(4 + i)) {
+        case PACKED_INT32:
+          values[i] = view.getInt32(offset, true);
+          break;
+        case PACKED_DOUBLE:
+          values[i] = view.getFloat64(offset, true);
+          break;
+        case PACKED_INT64:
+          values[i] = Long(view.getInt32(offset, true),
+                           view.getInt32(offset + 4, true));
+          break;
+        case PACKED_NULL:
+          values[i] = null;
+          break;
+        default:
+          throw new Error('Unexpected packed value tag: ' +
+                          view.getUint8(4 + i));
+      }
+    }
+
+    return values;
+  }
+
+  // $getStruct and $setStruct move records as ArrayBuffers, laid out as
+  // described by the fields added with $addField. Records become objects with
+  // a property per field, and arrays become Arrays. Pointers are plain
+  // addresses (null for NULL), not handles.
+  function decodeValue(view, offset, t) {
+    var result;
+    var field;
+    var name;
+    var i;
+
+    t = type.getCanonical(t);
+    switch (t.$kind) {
+      case type.BOOL:
+      case type.CHAR_U:
+      case type.UCHAR:
+        return view.getUint8(offset);
+      case type.CHAR_S:
+      case type.SCHAR:
+        return view.getInt8(offset);
+      case type.USHORT:
+        return view.getUint16(offset, true);
+      case type.SHORT:
+        return view.getInt16(offset, true);
+      case type.UINT:
+      case type.ULONG:
+        return view.getUint32(offset, true);
+      case type.WCHAR:
+      case type.INT:
+      case type.LONG:
+      case type.ENUM:
+        return view.getInt32(offset, true);
+      case type.LONGLONG:
+      case type.ULONGLONG:
+        return Long(view.getInt32(offset, true),
+                    view.getInt32(offset + 4, true));
+      case type.FLOAT:
+        return view.getFloat32(offset, true);
+      case type.DOUBLE:
+        return view.getFloat64(offset, true);
+      case type.POINTER:
+        return view.getUint32(offset, true) || null;
+      case type.RECORD:
+        result = {};
+        for (name in t.$fields) {
+          if (t.$fields.hasOwnProperty(name)) {
+            field = t.$fields[name];
+            result[name] = decodeValue(view, offset + field.$offset,
+                                       field.$type);
+          }
+        }
+        return result;
+      case type.CONSTANTARRAY:
+        result = new Array(t.$arraySize);
+        for (i = 0; i < t.$arraySize; ++i) {
+          result[i] = decodeValue(view, offset + i * t.$elementType.$size,
+                                  t.$elementType);
+        }
+        return result;
+      default:
+        throw new Error('Can\'t decode a value of type ' + t.$spelling + '.');
+    }
+  }
+
+  // The inverse of decodeValue. All fields of a struct must be given; for a
+  // union, only the fields given are encoded, and the bytes of |view| not
+  // covered by them are left as they are. |name| is used for errors.
+  function encodeValue(view, offset, t, value, name) {
+    var field;
+    var fieldName;
+    var i;
+
+    t = type.getCanonical(t);
+    if (type.isInteger(t) || t.$kind === type.ENUM ||
+        t.$kind === type.FLOAT || t.$kind === type.DOUBLE) {
+      if (value instanceof Long) {
+        if (t.$size !== 8) {
+          throw new Error('Expected ' + name + ' to be a number, not a Long.');
+        }
+      } else if (typeof value === 'boolean') {
+        value = +value;
+      } else if (typeof value !== 'number') {
+        throw new Error('Expected ' + name + ' to be a number, not ' +
+                        utils.getClass(value) + '.');
+      }
+    }
+
+    switch (t.$kind) {
+      case type.BOOL:
+      case type.CHAR_U:
+      case type.UCHAR:
+      case type.CHAR_S:
+      case type.SCHAR:
+        view.setUint8(offset, value);
+        break;
+      case type.USHORT:
+      case type.SHORT:
+        view.setUint16(offset, value, true);
+        break;
+      case type.UINT:
+      case type.ULONG:
+      case type.WCHAR:
+      case type.INT:
+      case type.LONG:
+      case type.ENUM:
+        view.setUint32(offset, value, true);
+        break;
+      case type.LONGLONG:
+      case type.ULONGLONG:
+        if (!(value instanceof Long)) {
+          value = Long.fromNumber(value);
+        }
+        view.setInt32(offset, value.getLowBits(), true);
+        view.setInt32(offset + 4, value.getHighBits(), true);
+        break;
+      case type.FLOAT:
+        view.setFloat32(offset, value, true);
+        break;
+      case type.DOUBLE:
+        view.setFloat64(offset, value, true);
+        break;
+      case type.POINTER:
+        if (value !== null && typeof value !== 'number') {
+          throw new Error('Expected ' + name + ' to be an address or null, ' +
+                          'not ' + utils.getClass(value) + '.');
+        }
+        view.setUint32(offset, value || 0, true);
+        break;
+      case type.RECORD:
+        if (value === null || typeof value !== 'object') {
+          throw new Error('Expected ' + name + ' to be an object.');
+        }
+        for (fieldName in t.$fields) {
+          if (!t.$fields.hasOwnProperty(fieldName)) {
+            continue;
+          }
+
+          if (!(fieldName in value)) {
+            if (t.$isUnion) {
+              continue;
+            }
+            throw new Error('Missing field ' + name + '.' + fieldName + '.');
+          }
+
+          field = t.$fields[fieldName];
+          encodeValue(view, offset + field.$offset, field.$type,
+                      value[fieldName], name + '.' + fieldName);
+        }
+        break;
+      case type.CONSTANTARRAY:
+        if (!value || value.length !== t.$arraySize) {
+          throw new Error('Expected ' + name + ' to have ' + t.$arraySize +
+                          ' elements.');
+        }
+        for (i = 0; i < t.$arraySize; ++i) {
+          encodeValue(view, offset + i * t.$elementType.$size, t.$elementType,
+                      value[i], name + '[' + i + ']');
+        }
+        break;
+      default:
+        throw new Error('Can\'t encode a value of type ' + t.$spelling + '.');
+    }
   }
 
   function Module(embed) {
@@ -2221,6 +2681,13 @@ var mod = (function(Long, type, utils) {
     this.$context = this.$createContext();
     this.$types = {};
     this.$tags = {};
+    // When true, $commit sends requests in the binary format where possible.
+    // This is much faster to parse for requests with many commands.
+    this.$binaryRequests = false;
+    // When true, the module packs the values returned by $commit into one
+    // ArrayBuffer, unless some of them are not numbers (e.g. strings).
+    this.$packedValues = false;
+    this.$nextProgramId_ = 1;
     this.$initMessage_();
   }
   Module.prototype.$defineFunction = function(name, functions) {
@@ -2267,6 +2734,7 @@ var mod = (function(Long, type, utils) {
     };
 
     this[name].$types = fnTypes;
+    this[name].$functions = functions;
     this.$functionsCount++;
   };
   Module.prototype.$defineEnum = function(name, value) {
@@ -2276,14 +2744,184 @@ var mod = (function(Long, type, utils) {
     this[name] = value;
     this.$enumValuesCount++;
   };
+  // The setArray and getArray builtins (see src/c/builtins.h) copy elements
+  // between native memory and a buffer handle. Wrap them so they can be called
+  // with typed arrays, and so getArray creates the buffer itself.
+  Module.prototype.$wrapArrayBuiltins_ = function() {
+    var self = this;
+    var setArray = this.setArray;
+    var getArray = this.getArray;
+
+    function elementSize(p, name) {
+      var pType;
+
+      if (!(p instanceof Handle)) {
+        throw new Error(name + ' expects a pointer handle.');
+      }
+
+      pType = type.getCanonical(p.$type);
+      if (pType.$kind !== type.POINTER || pType.$pointee.$size <= 0) {
+        throw new Error(name + ' expects a pointer handle, not ' +
+                        pType.$spelling + '.');
+      }
+
+      return pType.$pointee.$size;
+    }
+
+    function checkOffset(offset, name) {
+      if (typeof offset === 'number' && offset < 0) {
+        throw new Error(name + ' expects a non-negative offset, not ' + offset +
+                        '.');
+      }
+    }
+
+    // m.setArray(p, offset, array[, count]) copies |count| elements of
+    // |array| to p[offset]. |array| is an ArrayBuffer, a typed array or a
+    // handle. |count| defaults to the length of |array|.
+    this.setArray = function(p, offset, array, count) {
+      var size = elementSize(p, 'setArray');
+
+      if (ArrayBuffer.isView(array)) {
+        array = array.buffer.slice(array.byteOffset,
+                                   array.byteOffset + array.byteLength);
+      }
+
+      if (count === undefined) {
+        if (!(array instanceof ArrayBuffer)) {
+          throw new Error('setArray needs a count when given a handle.');
+        }
+        count = Math.floor(array.byteLength / size);
+      }
+
+      checkOffset(offset, 'setArray');
+      checkArrayCount('setArray', array, count, size);
+      return setArray(p, offset, array, count);
+    };
+    this.setArray.$types = setArray.$types;
+    this.setArray.$functions = setArray.$functions;
+
+    // m.getArray(p, offset, count) returns a handle to an ArrayBuffer with
+    // |count| elements copied from p[offset].
+    this.getArray = function(p, offset, count) {
+      var size = elementSize(p, 'getArray');
+      var buffer;
+
+      checkOffset(offset, 'getArray');
+      checkArrayCount('getArray', null, count, size);
+      buffer = self.$handle(new ArrayBuffer(count * size));
+
+      getArray(p, offset, buffer, count);
+      return buffer;
+    };
+    this.getArray.$types = getArray.$types;
+    this.getArray.$functions = getArray.$functions;
+  };
+  // The gather and scatter builtins copy one field of each record in an array
+  // of records to or from a packed buffer handle. Wrap them so the stride and
+  // offset are taken from the record type and field, and so gather creates
+  // the buffer itself.
+  Module.prototype.$wrapGatherBuiltins_ = function() {
+    var self = this;
+    var gather = this.gather;
+    var scatter = this.scatter;
+
+    // The builtins are only defined for primitive types, so find the one with
+    // the same representation as the field.
+    function elementType(recordType, field, name) {
+      var fType;
+
+      type.checkType(recordType, 'recordType');
+      if (type.getCanonical(recordType).$kind !== type.RECORD) {
+        throw new Error(name + ' expects a record type, not ' +
+                        recordType.$spelling + '.');
+      }
+
+      if (!field || field.$relOffset === null) {
+        throw new Error(name + ' expects a field with short syntax, i.e. ' +
+                        'my_struct.my_field.my_nested_field');
+      }
+
+      fType = type.getCanonical(field.$type).$unqualified();
+      switch (fType.$kind) {
+        case type.POINTER:
+          return type.Pointer(type.void);
+        case type.BOOL:
+          return type.uchar;
+        case type.WCHAR:
+        case type.ENUM:
+          return type.int;
+        case type.LONGDOUBLE:
+          break;
+        default:
+          if (type.isInteger(fType) || fType.$kind === type.FLOAT ||
+              fType.$kind === type.DOUBLE) {
+            return fType;
+          }
+      }
+
+      throw new Error(name + ' can\'t copy a field of type ' +
+                      field.$type.$spelling + '.');
+    }
+
+    // m.gather(p, recordType, field, count) returns a handle to an ArrayBuffer
+    // with |field| of each of the |count| records at |p|, packed. |field| is
+    // given with the short syntax, e.g. m.gather(p, Particle, Particle.pos.x,
+    // count).
+    this.gather = function(p, recordType, field, count) {
+      var eType = elementType(recordType, field, 'gather');
+      var buffer;
+
+      checkArrayCount('gather', null, count, eType.$size);
+      buffer = self.$handle(new ArrayBuffer(count * eType.$size),
+                            type.Pointer(eType));
+
+      gather(buffer, p, type.getCanonical(recordType).$size, field.$relOffset,
+             count);
+      return buffer;
+    };
+    this.gather.$types = gather.$types;
+    this.gather.$functions = gather.$functions;
+
+    // m.scatter(p, recordType, field, array[, count]) stores the elements of
+    // |array| to |field| of each record at |p|. |array| is an ArrayBuffer, a
+    // typed array or a handle. |count| defaults to the length of |array|.
+    this.scatter = function(p, recordType, field, array, count) {
+      var eType = elementType(recordType, field, 'scatter');
+
+      if (ArrayBuffer.isView(array)) {
+        array = array.buffer.slice(array.byteOffset,
+                                   array.byteOffset + array.byteLength);
+      }
+
+      if (count === undefined) {
+        if (!(array instanceof ArrayBuffer)) {
+          throw new Error('scatter needs a count when given a handle.');
+        }
+        count = Math.floor(array.byteLength / eType.$size);
+      }
+
+      checkArrayCount('scatter', array, count, eType.$size);
+
+      if (!(array instanceof Handle)) {
+        array = self.$handle(array, type.Pointer(eType));
+      } else {
+        array = array.$cast(type.Pointer(eType));
+      }
+
+      return scatter(array, p, type.getCanonical(recordType).$size,
+                     field.$relOffset, count);
+    };
+    this.scatter.$types = scatter.$types;
+    this.scatter.$functions = scatter.$functions;
+  };
   Object.defineProperty(Module.prototype, '$typesCount', {
     get: function() { return Object.keys(this.$types).length; }
   });
   Object.defineProperty(Module.prototype, '$tagsCount', {
     get: function() { return Object.keys(this.$tags).length; }
   });
-  Module.prototype.$createContext = function() {
-    return new Context(this.$handles_);
+  Module.prototype.$createContext = function(ephemeral) {
+    return new Context(this.$handles_, ephemeral);
   };
   Module.prototype.$initMessage_ = function() {
     var id = this.$nextId_++;
@@ -2361,13 +2999,19 @@ var mod = (function(Long, type, utils) {
     });
   };
   Module.prototype.$pushCommand_ = function(id, argHandles, retHandle) {
-    var command = {
+    var command;
+
+    if (this.$message_.program) {
+      throw new Error('A request that runs a program can\'t have commands.');
+    }
+
+    command = {
       id: id,
       args: handlesToIds(argHandles)
     };
 
     if (retHandle) {
-      command.ret = retHandle.$id;
+      command.ret = handleToId(retHandle);
     }
 
     if (!this.$message_.commands) {
@@ -2382,6 +3026,11 @@ var mod = (function(Long, type, utils) {
   Module.prototype.$processValues_ = function(handles, values) {
     var i;
 
+    // Packed values are already decoded to Longs.
+    if (values instanceof ArrayBuffer) {
+      return decodePackedValues(values);
+    }
+
     for (i = 0; i < handles.length; ++i) {
       if (handles[i].$type.$kind === type.LONGLONG ||
           handles[i].$type.$kind === type.ULONGLONG) {
@@ -2401,6 +3050,11 @@ var mod = (function(Long, type, utils) {
         }
 
         values[i] = Long(values[i][1], values[i][2]);
+      } else if (values[i] instanceof ArrayBuffer &&
+                 type.getCanonical(handles[i].$type).$kind === type.RECORD &&
+                 type.getCanonical(handles[i].$type).$tag !== 'PP_Var') {
+        // From $getStruct.
+        values[i] = decodeValue(new DataView(values[i]), 0, handles[i].$type);
       }
     }
 
@@ -2421,16 +3075,35 @@ var mod = (function(Long, type, utils) {
     }
 
     this.$message_.get = handlesToIds(handles);
-    this.$embed_.$postMessageWithResponse(this.$message_, function(msg) {
+    if (this.$packedValues) {
+      this.$message_.packed = true;
+    }
+
+    this.$postRequest_(this.$message_, function(msg) {
       // Call the callback with the same context as was set when $commit() was
       // called, then reset to the previous value.
       var oldContext = self.$context;
-      var values = self.$processValues_(handles, msg.values);
+      // A dropped request never ran, and one the module couldn't parse has an
+      // empty values array, so neither has values to process.
+      var ran = !msg.dropped &&
+                !(utils.getClass(msg.values) === 'Array' &&
+                  msg.values.length !== handles.length);
+      var values = ran ?
+          self.$processValues_(handles, msg.values) :
+          handles.map(function() { return undefined; });
       var expectedError = callback.length === handles.length + 1;
       var error;
 
       self.$context = context;
-      if (typeof msg.error !== 'undefined') {
+      if (msg.dropped) {
+        error = new Error('Request dropped because the module\'s message ' +
+                          'queue was full.');
+        if (expectedError) {
+          values.unshift(error);
+        } else {
+          console.error(error.stack);
+        }
+      } else if (typeof msg.error !== 'undefined') {
         error = self.$getError_(msg.error);
 
         if (expectedError) {
@@ -2447,8 +3120,137 @@ var mod = (function(Long, type, utils) {
       callback.apply(null, values);
       self.$context = oldContext;
     });
+    this.$handles_.$resetEphemeral();
     this.$initMessage_();
   };
+  Module.prototype.$postRequest_ = function(message, callback) {
+    var buffer;
+
+    if (this.$binaryRequests) {
+      buffer = encodeRequest(message);
+    }
+
+    this.$embed_.$postMessageWithResponse(buffer || message, callback,
+                                          message.id);
+  };
+  // Record the commands issued by |body| as a program, which can be run again
+  // by later requests without sending the commands each time. |body| is
+  // called with an input handle for each type in |argTypes|, and returns an
+  // array of the handles that $runProgram should return. All handles created
+  // by |body| are ephemeral.
+  Module.prototype.$prepare = function(argTypes, body) {
+    var oldContext = this.$context;
+    var oldMessage = this.$message_;
+    var oldErrors = this.$errors_;
+    var oldNextEphemeralId = this.$handles_.$nextEphemeralId_;
+    var oldEpoch = this.$handles_.$epoch_;
+    var context = this.$createContext(true);
+    var program;
+    var inputs;
+    var outputs;
+    var message;
+
+    this.$context = context;
+    this.$message_ = {id: this.$nextId_++, prepare: this.$nextProgramId_++};
+    this.$errors_ = {};
+    this.$handles_.$resetEphemeral();
+
+    // Restore the current request even if |body| throws.
+    try {
+      inputs = Array.prototype.map.call(argTypes, function(t) {
+        return context.$createHandle(t);
+      });
+      outputs = body.apply(null, inputs) || [];
+      utils.checkArray(outputs, Handle, 'outputs');
+
+      message = this.$message_;
+      program = new Program(message.prepare, inputs, outputs,
+                            message.set || {}, this.$errors_,
+                            this.$handles_.$nextEphemeralId_);
+    } finally {
+      this.$context = oldContext;
+      this.$message_ = oldMessage;
+      this.$errors_ = oldErrors;
+      this.$handles_.$nextEphemeralId_ = oldNextEphemeralId;
+      this.$handles_.$epoch_ = oldEpoch;
+    }
+
+    // Values set in |body| are constants, sent each time the program runs.
+    delete message.set;
+    this.$postRequest_(message, function(msg) {
+      if (msg.dropped || typeof msg.error !== 'undefined') {
+        // Requests that run the program fail too, but point at this instead.
+        program.$prepareFailed_ = true;
+        console.error('Failed to prepare program ' + program.$id + '.');
+      }
+    });
+    return program;
+  };
+  // Run |program| with the values |args| for its inputs. The program must be
+  // the only thing in the request. Returns the program's output handles, e.g.
+  // to pass to $commit.
+  Module.prototype.$runProgram = function(program, args) {
+    var message = this.$message_;
+    var inputs = program.$inputs;
+    var argType;
+    var id;
+    var i;
+
+    args = args || [];
+    if (program.$prepareFailed_) {
+      throw new Error('Program ' + program.$id + ' failed to prepare.');
+    }
+
+    if (message.commands || message.program ||
+        this.$handles_.$hasEphemeral()) {
+      throw new Error('A program must run in a request of its own.');
+    }
+
+    if (args.length !== inputs.length) {
+      throw new Error('Expected ' + inputs.length + ' program arguments, not ' +
+                      args.length + '.');
+    }
+
+    message.program = program.$id;
+    if (!message.set) {
+      message.set = {};
+    }
+
+    for (id in program.$set_) {
+      message.set[id] = program.$set_[id];
+    }
+
+    for (i = 0; i < args.length; ++i) {
+      argType = objectToType(args[i]);
+      if (argType.$canCastTo(inputs[i].$type) === type.CAST_ERROR) {
+        throw new Error('Program argument ' + i + ' has type ' +
+                        argType.$spelling + ', expected ' +
+                        inputs[i].$type.$spelling + '.');
+      }
+
+      message.set[inputs[i].$id] = this.$serializeJsValue_(args[i]);
+    }
+
+    for (i in program.$errors_) {
+      this.$errors_[i] = program.$errors_[i];
+    }
+
+    // Keep ephemeral ids from colliding with the program's.
+    this.$handles_.$nextEphemeralId_ = program.$nextEphemeralId_;
+
+    // The program's handles now refer to this request's values.
+    this.$handles_.$stampEpoch_(inputs);
+    this.$handles_.$stampEpoch_(program.$outputs);
+    return program.$outputs;
+  };
+  // Free the program in the module when the current request is sent.
+  Module.prototype.$unprepare = function(program) {
+    if (!this.$message_.unprepare) {
+      this.$message_.unprepare = [];
+    }
+
+    this.$message_.unprepare.push(program.$id);
+  };
   Module.prototype.$destroyHandles = function(context) {
     var c = context || this.$context;
     var handles = c.$handles;
@@ -2481,6 +3283,235 @@ var mod = (function(Long, type, utils) {
     commandIdx = this.$pushCommand_(ERROR_IF_ID, [handle]);
     this.$registerError_(commandIdx, (new Error()).stack);
   };
+  Module.prototype.$compactHandles = function() {
+    // Ask the module to give back memory held by its handle tables, e.g.
+    // after destroying a large batch of handles.
+    this.$pushCommand_(COMPACT_HANDLES_ID, []);
+  };
+  Module.prototype.$getStats = function() {
+    // Returns a handle to a dictionary of the module's queue counters and
+    // request timings, as of when this command runs.
+    var retHandle = this.$context.$createHandle(VAR_TYPE);
+    this.$pushCommand_(GET_STATS_ID, [], retHandle);
+    return retHandle;
+  };
+  // Run the commands pushed by |body| |count| times in the module, without a
+  // round trip per iteration. |body| is called once, with a handle that holds
+  // the iteration index. It may return an array of [to, from] handle pairs;
+  // after each iteration the value of |from| is moved to |to|, so |to| can
+  // carry a value to the next iteration. The |from| handles no longer exist
+  // after the loop.
+  Module.prototype.$repeat = function(count, body) {
+    var countHandle = this.$controlArgHandle_(count, '$repeat');
+    var indexHandle = this.$context.$createHandle(type.int);
+    this.$pushLoop_(REPEAT_ID, countHandle, indexHandle,
+                    function() { return body(indexHandle); });
+  };
+  // Like $repeat, but runs the commands pushed by |body| as long as |cond| is
+  // non-zero, or a non-NULL pointer. |cond| is checked before each iteration,
+  // so |body| should return a [cond, newCond] pair to update it.
+  Module.prototype.$while = function(cond, body) {
+    var condHandle = this.$controlArgHandle_(cond, '$while');
+    this.$pushLoop_(WHILE_ID, condHandle, undefined, body);
+  };
+  // Run the commands pushed by |thenBody| if |cond| is non-zero, or a
+  // non-NULL pointer, and the commands pushed by |elseBody| otherwise. The
+  // branch is taken in the module, so the request doesn't have to be split to
+  // inspect |cond| in JavaScript. Handles returned by the commands of the
+  // branch that isn't taken are never set.
+  Module.prototype.$if = function(cond, thenBody, elseBody) {
+    var condHandle = this.$controlArgHandle_(cond, '$if');
+    var commandIdx = this.$pushCommand_(IF_ID, [condHandle]);
+    var command = this.$message_.commands[commandIdx];
+    var thenCount;
+    var elseCount;
+
+    thenBody();
+    thenCount = this.$message_.commands.length - commandIdx - 1;
+    if (elseBody) {
+      elseBody();
+    }
+    elseCount = this.$message_.commands.length - commandIdx - 1 - thenCount;
+
+    command.args.push(this.$handle(thenCount, type.int).$id,
+                      this.$handle(elseCount, type.int).$id);
+  };
+  // Call |fn|, a function of this module such as m.add, |count| times in the
+  // module with one command. The i-th call is passed the i-th element of each
+  // column in |columns|; a column is a pointer handle or a typed array. If
+  // |fn| returns a value, the i-th result is stored in the i-th element of
+  // |out|, a pointer handle. If |out| is omitted, the results are stored in a
+  // new ArrayBuffer and a pointer handle to it is returned. Typed array
+  // columns are copied, so a typed array can't be used as |out|.
+  Module.prototype.$map = function(fn, count, columns, out) {
+    var self = this;
+    var colHandles;
+    var elementTypes;
+    var bestFnIdx;
+    var fnType;
+    var resultType;
+    var argHandles;
+    var i;
+
+    if (!fn || !fn.$functions) {
+      throw new Error('$map expects a function of this module.');
+    }
+
+    if (!Array.isArray(columns)) {
+      throw new Error('$map expects an array of columns.');
+    }
+
+    colHandles = columns.map(function(column) {
+      return self.$columnHandle_(column);
+    });
+    elementTypes = colHandles.map(function(h) {
+      return type.getCanonical(h.$type).$pointee;
+    });
+
+    bestFnIdx = type.getBestViableFunction(fn.$types, elementTypes);
+    if (bestFnIdx < 0) {
+      throw new Error('$map failed, no overload takes (' +
+                      elementTypes.map(type.getSpelling).join(', ') + ').');
+    }
+
+    fnType = fn.$functions[bestFnIdx].$type;
+    for (i = 0; i < elementTypes.length; ++i) {
+      if (!isColumnCompatible(elementTypes[i], fnType.$argTypes[i])) {
+        throw new Error('$map failed, column ' + i + ' has elements of type ' +
+                        elementTypes[i].$spelling + ', not ' +
+                        fnType.$argTypes[i].$spelling + '.');
+      }
+    }
+
+    resultType = fnType.$resultType;
+    if (type.getCanonical(resultType).$kind !== type.VOID) {
+      if (out === undefined) {
+        out = this.$handle(new ArrayBuffer(count * resultType.$size),
+                           type.Pointer(resultType));
+      } else {
+        if (!(out instanceof Handle)) {
+          throw new Error('$map failed, out must be a pointer handle. Omit ' +
+                          'out to get the results in a new handle.');
+        }
+        out = this.$columnHandle_(out);
+        if (!isColumnCompatible(type.getCanonical(out.$type).$pointee,
+                                resultType)) {
+          throw new Error('$map failed, out has elements of type ' +
+                          type.getCanonical(out.$type).$pointee.$spelling +
+                          ', not ' + resultType.$spelling + '.');
+        }
+      }
+    } else if (out !== undefined) {
+      throw new Error('$map failed, ' + fnType.$spelling + ' returns void, ' +
+                      'so it can\'t have an out column.');
+    }
+
+    this.$checkColumnLengths_(count, out ? colHandles.concat([out])
+                                         : colHandles);
+
+    argHandles = [this.$handle(fn.$functions[bestFnIdx].$id, type.int),
+                  this.$controlArgHandle_(count, '$map')].concat(colHandles);
+    if (out) {
+      argHandles.push(out);
+    }
+
+    this.$registerHandlesWithValues_(colHandles);
+    this.$pushCommand_(MAP_ID, argHandles);
+    return out;
+  };
+  Module.prototype.$columnHandle_ = function(column) {
+    var elementType;
+    var cType;
+
+    if (ArrayBuffer.isView(column)) {
+      elementType = TYPED_ARRAY_TYPES[utils.getClass(column)];
+      if (!elementType) {
+        throw new Error('$map can\'t use a ' + utils.getClass(column) +
+                        ' as a column.');
+      }
+
+      return this.$handle(
+          column.buffer.slice(column.byteOffset,
+                              column.byteOffset + column.byteLength),
+          type.Pointer(elementType));
+    }
+
+    if (column instanceof Handle) {
+      cType = type.getCanonical(column.$type);
+      if (cType.$kind === type.POINTER && cType.$pointee.$size > 0) {
+        return column;
+      }
+    }
+
+    throw new Error('$map expects a typed array or a pointer handle, not ' +
+                    (column instanceof Handle ? column.$type.$spelling :
+                                                utils.getClass(column)) + '.');
+  };
+  // The module can only check the length of ArrayBuffer columns, so check
+  // them here too, where the error is easier to find.
+  Module.prototype.$checkColumnLengths_ = function(count, colHandles) {
+    var length;
+    var i;
+
+    if (typeof count !== 'number') {
+      return;
+    }
+
+    if (count < 0) {
+      throw new Error('$map failed, count must be non-negative, not ' + count +
+                      '.');
+    }
+
+    for (i = 0; i < colHandles.length; ++i) {
+      if (colHandles[i].$value instanceof ArrayBuffer) {
+        length = colHandles[i].$value.byteLength /
+                 type.getCanonical(colHandles[i].$type).$pointee.$size;
+        if (count > length) {
+          throw new Error('$map failed, count is ' + count + ', but column ' +
+                          i + ' has only ' + Math.floor(length) +
+                          ' elements.');
+        }
+      }
+    }
+  };
+  Module.prototype.$controlArgHandle_ = function(arg, name) {
+    var handle = argToHandle(this.$context, arg);
+    var hType = handle.$type;
+
+    if (hType.$canCastTo(type.int) === type.CAST_ERROR) {
+      throw new Error(name + ' failed, invalid type: ' + hType.$spelling);
+    }
+
+    this.$registerHandleWithValue_(handle);
+    return handle;
+  };
+  Module.prototype.$pushLoop_ = function(id, argHandle, retHandle, body) {
+    var commandIdx = this.$pushCommand_(id, [argHandle], retHandle);
+    var command = this.$message_.commands[commandIdx];
+    var pairs = body() || [];
+    var bodyCount = this.$message_.commands.length - commandIdx - 1;
+    var carried = [];
+    var i;
+
+    utils.checkArray(pairs, Array, 'pairs');
+    command.args.push(this.$handle(bodyCount, type.int).$id);
+
+    for (i = 0; i < pairs.length; ++i) {
+      utils.checkArray(pairs[i], Handle, 'pair');
+      if (pairs[i].length !== 2) {
+        throw new Error('Expected [to, from] pair, not ' + pairs[i].length +
+                        ' handles.');
+      }
+
+      command.args.push(handleToId(pairs[i][0]), handleToId(pairs[i][1]));
+      carried.push(pairs[i][1]);
+    }
+
+    // The module destroys the |from| handles when their values are moved.
+    for (i = 0; i < carried.length; ++i) {
+      carried[i].$context.$forgetHandle_(carried[i]);
+    }
+  };
   Module.prototype.$registerError_ = function(commandIdx, stack) {
     this.$errors_[commandIdx] = {
       failedAt: commandIdx,
@@ -2488,7 +3519,12 @@ var mod = (function(Long, type, utils) {
     };
   };
   Module.prototype.$getError_ = function(commandIdx) {
-    return this.$errors_[commandIdx];
+    // Errors not raised by a command, e.g. a request for an unknown program,
+    // have no registered stack.
+    return this.$errors_[commandIdx] || {
+      failedAt: commandIdx,
+      stack: (new Error('The module failed to run the request.')).stack
+    };
   };
   Module.prototype.$clearErrors_ = function() {
     this.$errors_ = {};
@@ -2511,6 +3547,47 @@ var mod = (function(Long, type, utils) {
     var poff = field.$relOffset === 0 ? p : this.add(p, field.$relOffset);
     return this.get(poff.$cast(type.Pointer(field.$type)));
   };
+  // Read the whole record of type |recordType| at |p| with one command, instead
+  // of one $get per field. Returns a handle whose value, once committed, is an
+  // object with a property per field; see decodeValue. Needs the builtins.
+  Module.prototype.$getStruct = function(p, recordType) {
+    var size = this.$structSize_(p, recordType, '$getStruct');
+    var buffer = this.getArray(p.$cast(type.Pointer(type.uchar)), 0, size);
+    return buffer.$context.$createHandle(recordType, buffer.$value,
+                                         buffer.$id);
+  };
+  // Write |obj| to the record of type |recordType| at |p| with one command,
+  // instead of one $set per field. The whole record is written, so the bytes
+  // of a union not covered by the fields of |obj| are zeroed. Needs the
+  // builtins.
+  Module.prototype.$setStruct = function(p, recordType, obj) {
+    var size = this.$structSize_(p, recordType, '$setStruct');
+    var buffer = new ArrayBuffer(size);
+
+    encodeValue(new DataView(buffer), 0, recordType, obj, 'obj');
+    this.setArray(p.$cast(type.Pointer(type.uchar)), 0, buffer);
+  };
+  Module.prototype.$structSize_ = function(p, recordType, name) {
+    var cType;
+
+    if (!this.getArray || !this.setArray) {
+      throw new Error(name + ' needs the builtins (gen.py --builtins).');
+    }
+
+    if (!(p instanceof Handle) ||
+        type.getCanonical(p.$type).$kind !== type.POINTER) {
+      throw new Error(name + ' expects a pointer handle.');
+    }
+
+    type.checkType(recordType, 'recordType');
+    cType = type.getCanonical(recordType);
+    if (cType.$kind !== type.RECORD || cType.$size <= 0) {
+      throw new Error(name + ' expects a complete record type, not ' +
+                      recordType.$spelling + '.');
+    }
+
+    return cType.$size;
+  };
 
   function IdFunction(id, fnType) {
     if (!(this instanceof IdFunction)) { return new IdFunction(id, fnType); }
@@ -2525,8 +3602,23 @@ var mod = (function(Long, type, utils) {
     this.$type = fnType;
   }
 
+  function Program(id, inputs, outputs, set, errors, nextEphemeralId) {
+    this.$id = id;
+    this.$inputs = inputs;
+    this.$outputs = outputs;
+    this.$set_ = set;
+    this.$errors_ = errors;
+    this.$nextEphemeralId_ = nextEphemeralId;
+    this.$prepareFailed_ = false;
+  }
+
   function HandleList() {
     this.$nextId_ = 1;
+    this.$nextEphemeralId_ = -1;
+    // Ephemeral handles are only valid in the request they were created in,
+    // which is identified by its epoch.
+    this.$epoch_ = 0;
+    this.$nextEpoch_ = 1;
     this.$idToHandle_ = {};
   }
   HandleList.prototype.$createHandle = function(context, type, value, id) {
@@ -2534,8 +3626,14 @@ var mod = (function(Long, type, utils) {
     var handle;
 
     if (id === undefined) {
-      id = this.$nextId_++;
-      register = true;
+      if (context.$ephemeral) {
+        // Ephemeral handles are destroyed by the module at the end of the
+        // request, so they are not tracked.
+        id = this.$nextEphemeralId_--;
+      } else {
+        id = this.$nextId_++;
+        register = true;
+      }
     }
 
     handle = new Handle(context, type, value, id);
@@ -2553,10 +3651,27 @@ var mod = (function(Long, type, utils) {
   HandleList.prototype.$registerHandle = function(handle) {
     this.$idToHandle_[handle.$id] = handle;
   };
+  HandleList.prototype.$hasEphemeral = function() {
+    return this.$nextEphemeralId_ !== -1;
+  };
+  HandleList.prototype.$resetEphemeral = function() {
+    // Ephemeral ids are only unique within a request.
+    this.$nextEphemeralId_ = -1;
+    this.$epoch_ = this.$nextEpoch_++;
+  };
+  HandleList.prototype.$stampEpoch_ = function(handles) {
+    var i;
+    for (i = 0; i < handles.length; ++i) {
+      if (handles[i].$epoch !== null) {
+        handles[i].$epoch = this.$epoch_;
+      }
+    }
+  };
 
-  function Context(handleList) {
+  function Context(handleList, ephemeral) {
     this.$handleList = handleList;
     this.$handles = [];
+    this.$ephemeral = !!ephemeral;
   }
   Context.prototype.$createHandle = function(type, value, id) {
     return this.$handleList.$createHandle(this, type, value, id);
@@ -2565,6 +3680,14 @@ var mod = (function(Long, type, utils) {
     this.$handleList.$registerHandle(handle);
     this.$handles.push(handle);
   };
+  Context.prototype.$forgetHandle_ = function(handle) {
+    var idx = this.$handles.indexOf(this.$handleList.$get(handle.$id));
+    if (idx !== -1) {
+      this.$handles.splice(idx, 1);
+    }
+
+    delete this.$handleList.$idToHandle_[handle.$id];
+  };
   Context.prototype.$destroyHandles = function() {
     // Call all finalizers. Run them in reverse order of the handle creation.
     var i;
@@ -2584,20 +3707,39 @@ var mod = (function(Long, type, utils) {
     this.$value = value;
     this.$finalizer = null;
     this.$context = context;
+    this.$epoch = context.$ephemeral ? context.$handleList.$epoch_ : null;
   }
   Handle.prototype.$cast = function(toType) {
     var castResult = this.$type.$canCastTo(toType);
+    var handle;
+
     if (castResult === type.CAST_ERROR) {
       throw new Error('Invalid cast: ' + this.$type.$spelling + ' to ' +
                       toType.$spelling + '.');
     }
 
-    return this.$context.$handleList.$createHandle(
+    handle = this.$context.$handleList.$createHandle(
         this.$context, toType, this.$value, this.$id);
+    handle.$epoch = this.$epoch;
+    return handle;
+  };
+  Handle.prototype.$checkEpoch_ = function() {
+    if (this.$epoch !== null &&
+        this.$epoch !== this.$context.$handleList.$epoch_) {
+      throw new Error('Handle ' + this.$id + ' is ephemeral, and was created ' +
+                      'by an earlier request.');
+    }
   };
   Handle.prototype.$setFinalizer = function(callback) {
+    var root;
+
+    if (this.$context.$ephemeral) {
+      throw new Error('Handle ' + this.$id + ' is ephemeral, and can\'t have ' +
+                      'a finalizer.');
+    }
+
     // Get the "root" handle, i.e. the one not created by casting.
-    var root = this.$context.$handleList.$get(this.$id);
+    root = this.$context.$handleList.$get(this.$id);
     if (root.$finalizer !== null) {
       throw new Error('Handle ' + root.$id + ' already has finalizer.');
     }
@@ -2615,6 +3757,12 @@ var mod = (function(Long, type, utils) {
     objectToType: objectToType,
 
     ERROR_IF_ID: ERROR_IF_ID,
+    COMPACT_HANDLES_ID: COMPACT_HANDLES_ID,
+    GET_STATS_ID: GET_STATS_ID,
+    REPEAT_ID: REPEAT_ID,
+    WHILE_ID: WHILE_ID,
+    IF_ID: IF_ID,
+    MAP_ID: MAP_ID,
   };
 
 })(Long, type, utils);
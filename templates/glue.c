@@ -18,6 +18,7 @@
 [[if INCLUDE_FILES:]]
 #define NB_ONE_FILE
 {{IncludeFile('c/bool.h')}}
+{{IncludeFile('c/type.h')}}
 {{IncludeFile('c/error.h')}}
 {{IncludeFile('c/handle.h')}}
 {{IncludeFile('c/interfaces.h')}}
@@ -26,7 +27,6 @@
 {{IncludeFile('c/request.h')}}
 {{IncludeFile('c/response.h')}}
 {{IncludeFile('c/run.h')}}
-{{IncludeFile('c/type.h')}}
 {{IncludeFile('c/var.h')}}
 [[  if builtins:]]
 {{IncludeFile('c/builtins.h')}}
@@ -73,6 +73,27 @@ def FuncDef(fname, type, extra_args=None):
   if extra_args:
     args.extend(extra_args)
   return '%s %s(%s)' % (type.result_type.c_spelling, fname, ', '.join(args))
+
+MAP_COLUMN_KINDS = (
+    TypeKind.BOOL, TypeKind.CHAR_U, TypeKind.UCHAR, TypeKind.USHORT,
+    TypeKind.UINT, TypeKind.ULONG, TypeKind.ULONGLONG, TypeKind.CHAR_S,
+    TypeKind.SCHAR, TypeKind.SHORT, TypeKind.INT, TypeKind.LONG,
+    TypeKind.LONGLONG, TypeKind.FLOAT, TypeKind.DOUBLE, TypeKind.ENUM)
+
+def IsMapColumnType(type):
+  if type.kind == TypeKind.POINTER:
+    return type.pointee.kind not in (TypeKind.FUNCTIONPROTO,
+                                     TypeKind.FUNCTIONNOPROTO)
+  return type.kind in MAP_COLUMN_KINDS
+
+def IsMappable(fn):
+  if fn.type.kind != TypeKind.FUNCTIONPROTO or fn.type.is_variadic:
+    return False
+  types = [t.canonical for t in fn.type.arg_types]
+  result_type = fn.type.result_type.canonical
+  if result_type.kind != TypeKind.VOID:
+    types.append(result_type)
+  return all(IsMapColumnType(t) for t in types)
 ]]]
 [[for type in collector.types_topo:]]
 [[  if type.kind != TypeKind.RECORD or type.is_anonymous:]]
@@ -85,6 +106,17 @@ NB_COMPILE_ASSERT(offsetof({{type.c_spelling}}, {{name}}) == {{offset}});
 [[  ]]
 
 [[]]
+/* The number of callback slots in use, of any type. The C library may keep a
+ * callback and call it at any time, so nb_run_message_loop_pool runs every
+ * request alone while this is non-zero. Slots are only allocated and freed by
+ * requests that use JavaScript functions, which run on the thread reading the
+ * message queue. */
+static int32_t s_nb_callbacks_allocated = 0;
+
+int32_t nb_callbacks_allocated(void) {
+  return s_nb_callbacks_allocated;
+}
+
 [[for type in collector.types_topo:]]
 [[  if not (type.kind == TypeKind.POINTER and type.pointee.kind in (TypeKind.FUNCTIONPROTO, TypeKind.FUNCTIONNOPROTO)):]]
 [[    continue]]
@@ -108,7 +140,8 @@ static {{FuncDef('nb_callback_%s' % type.mangled, type.pointee, extra_args=['str
   {{type.pointee.result_type.GetCSpelling('result')}};
 [[  ]]
 
-  response = nb_response_create(callback_data->func_id);
+  response = nb_response_create(callback_data->func_id,
+                                {{len(type.pointee.arg_types)}});
   if (response == NULL) {
     NB_VERROR("nb_response_create(%d) failed.", callback_data->func_id);
     goto cleanup;
@@ -203,6 +236,7 @@ NB_Callback_{{type.mangled}} nb_callback_allocate_{{type.mangled}}(NB_FuncId fun
 
     s_nb_callback_data_{{type.mangled}}[i].func_id = func_id;
     s_nb_callback_data_{{type.mangled}}[i].message_queue = message_queue;
+    s_nb_callbacks_allocated++;
 
     return s_nb_callback_funcs_{{type.mangled}}[i];
   }
@@ -218,6 +252,7 @@ void nb_callback_free_{{type.mangled}}(NB_FuncId func_id) {
     }
 
     s_nb_callback_data_{{type.mangled}}[i].func_id = 0;
+    s_nb_callbacks_allocated--;
     return;
   }
 }
@@ -243,7 +278,17 @@ static NB_Bool nb_command_run_{{fn.spelling}}(struct NB_Queue* message_queue, st
   NB_Handle handle{{i}} = nb_request_command_arg(request, command_idx, {{i}});
 [[      if arg.kind == TypeKind.POINTER:]]
 [[        pointee = arg.pointee]]
-[[        if pointee.kind in (TypeKind.CHAR_S, TypeKind.CHAR_U):]]
+[[        is_char = pointee.kind in (TypeKind.CHAR_S, TypeKind.CHAR_U)]]
+[[        next_arg = arguments[i + 1].canonical if i + 1 < len(arguments) else None]]
+[[        has_length = next_arg and next_arg.kind in (TypeKind.UINT, TypeKind.ULONG)]]
+[[        if is_char and pointee.qualifiers.const and has_length:]]
+  /* The length is passed separately, so read the string in place. */
+  const char* arg{{i}};
+  if (!nb_handle_get_string(handle{{i}}, &arg{{i}}, NULL)) {
+    NB_VERROR("Unable to get handle %d as const char*.", handle{{i}});
+    return NB_FALSE;
+  }
+[[        elif is_char:]]
   char* arg{{i}};
   if (!nb_handle_get_charp(handle{{i}}, &arg{{i}})) {
     NB_VERROR("Unable to get handle %d as char*.", handle{{i}});
@@ -486,6 +531,113 @@ static NB_Bool nb_command_run_{{fn.spelling}}(struct NB_Queue* message_queue, st
 
 [[]]
 
+[[if any(IsMappable(fn) for fn in collector.functions):]]
+/* Checks that a $map column has room for |count| elements of |size| bytes.
+ * Only ArrayBuffer columns can be checked; the size of native memory isn't
+ * known. */
+static NB_Bool nb_map_check_column(NB_Handle handle, int32_t count, size_t size) {
+  uint32_t length;
+  if (count < 0) {
+    NB_VERROR("Expected a non-negative count, got %d.", count);
+    return NB_FALSE;
+  }
+  if (nb_handle_get_buffer_length(handle, &length) &&
+      (uint64_t)count * size > length) {
+    NB_VERROR("Handle %d has %u bytes, but %d elements need %llu.", handle,
+              length, count, (unsigned long long)((uint64_t)count * size));
+    return NB_FALSE;
+  }
+  return NB_TRUE;
+}
+
+[[]]
+[[for fn in collector.functions:]]
+[[  if not IsMappable(fn):]]
+[[    continue]]
+[[  ]]
+[[  arguments = [t.canonical for t in fn.type.arg_types]]]
+[[  result_type = fn.type.result_type.canonical]]
+[[  column_count = len(arguments) + (result_type.kind != TypeKind.VOID)]]
+/* $map({{fn.displayname}}) */
+static NB_Bool nb_command_map_{{fn.spelling}}(struct NB_Request* request, int command_idx, int32_t count) {
+  int arg_count = nb_request_command_arg_count(request, command_idx);
+  if (arg_count != {{column_count + 2}}) {
+    NB_VERROR("Expected %d args, got %d.", {{column_count + 2}}, arg_count);
+    return NB_FALSE;
+  }
+[[  for i, arg in enumerate(arguments):]]
+  NB_Handle handle{{i}} = nb_request_command_arg(request, command_idx, {{i + 2}});
+  void* col{{i}}x;
+  if (!nb_handle_get_voidp(handle{{i}}, &col{{i}}x)) {
+    NB_VERROR("Unable to get handle %d as void*.", handle{{i}});
+    return NB_FALSE;
+  }
+  if (!nb_map_check_column(handle{{i}}, count, sizeof({{arg.c_spelling}}))) {
+    return NB_FALSE;
+  }
+  {{arg.c_spelling}}* col{{i}} = ({{arg.c_spelling}}*) col{{i}}x;
+[[  ]]
+[[  call = '%s(%s)' % (fn.spelling, ', '.join('col%d[i]' % j for j in range(len(arguments))))]]
+  int32_t i;
+[[  if result_type.kind != TypeKind.VOID:]]
+  NB_Handle ret = nb_request_command_arg(request, command_idx, {{column_count + 1}});
+  void* outx;
+  if (!nb_handle_get_voidp(ret, &outx)) {
+    NB_VERROR("Unable to get handle %d as void*.", ret);
+    return NB_FALSE;
+  }
+  if (!nb_map_check_column(ret, count, sizeof({{result_type.c_spelling}}))) {
+    return NB_FALSE;
+  }
+  {{result_type.c_spelling}}* out = ({{result_type.c_spelling}}*) outx;
+  for (i = 0; i < count; ++i) {
+    out[i] = {{call}};
+  }
+[[  else:]]
+  for (i = 0; i < count; ++i) {
+    {{call}};
+  }
+[[  ]]
+  return NB_TRUE;
+}
+
+[[]]
+/* $map() */
+static NB_Bool nb_command_run_map(struct NB_Queue* message_queue, struct NB_Request* request, int command_idx) {
+  int arg_count = nb_request_command_arg_count(request, command_idx);
+  if (arg_count < 2) {
+    NB_VERROR("Expected at least %d args, got %d.", 2, arg_count);
+    return NB_FALSE;
+  }
+  NB_Handle handle0 = nb_request_command_arg(request, command_idx, 0);
+  int32_t func_id;
+  if (!nb_handle_get_int32(handle0, &func_id)) {
+    NB_VERROR("Unable to get handle %d as int32_t.", handle0);
+    return NB_FALSE;
+  }
+  NB_Handle handle1 = nb_request_command_arg(request, command_idx, 1);
+  int32_t count;
+  if (!nb_handle_get_int32(handle1, &count)) {
+    NB_VERROR("Unable to get handle %d as int32_t.", handle1);
+    return NB_FALSE;
+  }
+  if (count < 0) {
+    NB_VERROR("Expected a non-negative count, got %d.", count);
+    return NB_FALSE;
+  }
+
+  switch (func_id) {
+[[for fn in collector.functions:]]
+[[  if IsMappable(fn):]]
+    case {{fn.fn_id}}: return nb_command_map_{{fn.spelling}}(request, command_idx, count);
+[[  ]]
+[[]]
+    default:
+      NB_VERROR("Function id %d can't be mapped.", func_id);
+      return NB_FALSE;
+  }
+}
+
 /* getFunc() */
 static NB_Bool nb_command_run_get_func(struct NB_Queue* message_queue, struct NB_Request* request, int command_idx) {
   int arg_count = nb_request_command_arg_count(request, command_idx);
@@ -537,12 +689,48 @@ static NB_Bool nb_command_run_error_if(struct NB_Queue* message_queue, struct NB
   return arg != 0 ? NB_FALSE : NB_TRUE;
 }
 
+/* $compactHandles() */
+static NB_Bool nb_command_run_compact_handles(struct NB_Queue* message_queue, struct NB_Request* request, int command_idx) {
+  int arg_count = nb_request_command_arg_count(request, command_idx);
+  if (arg_count != 0) {
+    NB_VERROR("Expected %d args, got %d.", 0, arg_count);
+    return NB_FALSE;
+  }
+  nb_handle_compact();
+  return NB_TRUE;
+}
+
+/* $getStats() */
+static NB_Bool nb_command_run_get_stats(struct NB_Queue* message_queue, struct NB_Request* request, int command_idx) {
+  int arg_count = nb_request_command_arg_count(request, command_idx);
+  if (arg_count != 0) {
+    NB_VERROR("Expected %d args, got %d.", 0, arg_count);
+    return NB_FALSE;
+  }
+  if (!nb_request_command_has_ret(request, command_idx)) {
+    NB_ERROR("Return type is non-void, but no return handle given.");
+    return NB_FALSE;
+  }
+  NB_Handle ret = nb_request_command_ret(request, command_idx);
+
+  struct PP_Var result = nb_run_get_stats(message_queue);
+  NB_Bool register_ok = nb_handle_register_var(ret, result);
+  nb_var_release(result);
+  if (!register_ok) {
+    NB_VERROR("Failed to register handle %d of type struct PP_Var.", ret);
+    return NB_FALSE;
+  }
+  return NB_TRUE;
+}
+
 enum {
   NUM_FUNCTIONS = {{len(collector.functions)}}
 };
 
 typedef NB_Bool (*nb_command_func_t)(struct NB_Queue*, struct NB_Request*, int);
 static nb_command_func_t s_functions[] = {
+  nb_command_run_get_stats,  /* -4 */
+  nb_command_run_compact_handles,  /* -3 */
   nb_command_run_get_func,  /* -2 */
   nb_command_run_error_if,  /* -1 */
 [[for fn in collector.functions:]]
@@ -554,11 +742,15 @@ NB_Bool nb_request_command_run(struct NB_Queue* message_queue,
                                struct NB_Request* request,
                                int command_idx) {
   int function_idx = nb_request_command_function(request, command_idx);
-  if (function_idx < -2 || function_idx >= NUM_FUNCTIONS) {
-    NB_VERROR("Function id %d is out of range [-2, %d).", function_idx, NUM_FUNCTIONS);
+  if (function_idx == NB_COMMAND_MAP) {
+    return nb_command_run_map(message_queue, request, command_idx);
+  }
+
+  if (function_idx < -4 || function_idx >= NUM_FUNCTIONS) {
+    NB_VERROR("Function id %d is out of range [-4, %d).", function_idx, NUM_FUNCTIONS);
     return NB_FALSE;
   }
 
-  NB_Bool result = s_functions[function_idx + 2](message_queue, request, command_idx);
+  NB_Bool result = s_functions[function_idx + 4](message_queue, request, command_idx);
   return result;
 }
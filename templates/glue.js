@@ -112,6 +112,11 @@ function createModule(nmf, mimeType) {
   ]);
 [[]]
 
+[[if builtins:]]
+  m.$wrapArrayBuiltins_();
+  m.$wrapGatherBuiltins_();
+
+[[]]
 [[for enum_name, enum_type in collector.SortedEnums():]]
   /* {{enum_name}} constants */
 [[  for enum_const_name, enum_const_value in enum_type.constants:]]
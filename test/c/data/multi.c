@@ -35,3 +35,15 @@ struct PP_Var char_to_var(char* s) {
 void var_release(struct PP_Var var) {
   nb_var_release(var);
 }
+
+int count_char(const char* s, size_t len, int c) {
+  int count = 0;
+  int i;
+  for (i = 0; i < len; ++i) {
+    if (s[i] == c) {
+      count++;
+    }
+  }
+
+  return count;
+}
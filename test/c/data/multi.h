@@ -9,3 +9,4 @@ void rot13(char* s, size_t len);
 // TODO(binji): Add support to directly convert char* -> String PP_Var
 struct PP_Var char_to_var(char* s);
 void var_release(struct PP_Var var);
+int count_char(const char* s, size_t len, int c);
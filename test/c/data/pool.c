@@ -0,0 +1,51 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static int s_signaled = 0;
+
+int_func g_pool_callback = NULL;
+
+int pool_wait(int timeout_ms) {
+  struct timeval now;
+  struct timespec deadline;
+  int result;
+
+  gettimeofday(&now, NULL);
+  deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+  deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&s_mutex);
+  while (!s_signaled) {
+    if (pthread_cond_timedwait(&s_cond, &s_mutex, &deadline) != 0) {
+      break;
+    }
+  }
+  result = s_signaled;
+  pthread_mutex_unlock(&s_mutex);
+  return result;
+}
+
+void pool_signal(void) {
+  pthread_mutex_lock(&s_mutex);
+  s_signaled = 1;
+  pthread_cond_broadcast(&s_cond);
+  pthread_mutex_unlock(&s_mutex);
+}
+
+void pool_reset(void) {
+  pthread_mutex_lock(&s_mutex);
+  s_signaled = 0;
+  pthread_mutex_unlock(&s_mutex);
+}
+
+void pool_keep_callback(int_func f) {
+  g_pool_callback = f;
+}
@@ -0,0 +1,10 @@
+typedef int (*int_func)(int);
+
+/* Returns 1 if pool_signal is called within |timeout_ms|, otherwise 0. */
+int pool_wait(int timeout_ms);
+void pool_signal(void);
+void pool_reset(void);
+/* Keeps |f| in g_pool_callback without calling it, like a C library
+ * registering a callback. */
+extern int_func g_pool_callback;
+void pool_keep_callback(int_func f);
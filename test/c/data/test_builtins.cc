@@ -12,8 +12,16 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "test_gen.h"
 #include "glue.h"
+#include "json.h"
+#include "run.h"
 
 TEST_F(GeneratorTest, Simple) {
   const int kBufferSize = 1000;
@@ -47,3 +55,772 @@ TEST_F(GeneratorTest, Simple) {
   const char* response_json = "{\"id\":1,\"values\":[10,11,7,0]}\n";
   RunTest(buffer, response_json);
 }
+
+TEST_F(GeneratorTest, Array) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 8,"
+      "     \"2\": 1,"
+      "     \"3\": \"hi\","
+      "     \"4\": 2},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 5},"        // p = my_malloc(8)
+      "     {\"id\": %d, \"args\": [1], \"ret\": 6},"        // q = my_malloc(8)
+      "     {\"id\": %d, \"args\": [5, 2, 3, 4]},"           // p[1..2] = "hi"
+      "     {\"id\": %d, \"args\": [5, 2, 6, 4]},"           // q[0..1] = p[1..]
+      "     {\"id\": %d, \"args\": [6, 2], \"ret\": 7},"     // r = q + 1
+      "     {\"id\": %d, \"args\": [6], \"ret\": 8},"        // a = *q
+      "     {\"id\": %d, \"args\": [7], \"ret\": 9},"        // b = *r
+      "     {\"id\": %d, \"args\": [5]},"                    // my_free(p)
+      "     {\"id\": %d, \"args\": [6]}],"                   // my_free(q)
+      " \"get\": [8, 9],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_GET_ARRAY_CHAR,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_MY_FREE,
+           NB_FUNC_MY_FREE);
+  const char* response_json = "{\"id\":1,\"values\":[104,105]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, ArrayNegative) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 8,"
+      "     \"2\": 0,"
+      "     \"3\": \"hi\","
+      "     \"4\": 2,"
+      "     \"5\": 1,"
+      "     \"6\": -1,"
+      "     \"7\": \"xy\"},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 8},"        // p = my_malloc(8)
+      "     {\"id\": %d, \"args\": [8, 2, 3, 4]},"           // p[0..1] = "hi"
+      "     {\"id\": %d, \"args\": [8, 5], \"ret\": 9},"     // r = p + 1
+      "     {\"id\": %d, \"args\": [9, 6, 7, 4]},"           // r[-1..0] = "xy"
+      "     {\"id\": %d, \"args\": [8, 2, 7, 6]},"           // p[0..-2] = "xy"
+      "     {\"id\": %d, \"args\": [8], \"ret\": 10},"       // a = *p
+      "     {\"id\": %d, \"args\": [9], \"ret\": 11},"       // b = *r
+      "     {\"id\": %d, \"args\": [8]}],"                   // my_free(p)
+      " \"get\": [10, 11],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_MY_FREE);
+  // A negative offset or count copies nothing.
+  const char* response_json = "{\"id\":1,\"values\":[104,105]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, Kernels) {
+  const int kBufferSize = 2000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 8,"
+      "     \"2\": 0,"
+      "     \"3\": \"abcd\","
+      "     \"4\": 4,"
+      "     \"5\": 196,"
+      "     \"6\": 197},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 7},"           // my_malloc(8)
+      "     {\"id\": %d, \"args\": [7, 2, 3, 4]},"              // p = "abcd"
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 8},"        // sum(p)
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 9},"        // min(p)
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 10},"       // max(p)
+      "     {\"id\": %d, \"args\": [7, 7, 4], \"ret\": 11},"    // dot(p, p)
+      "     {\"id\": %d, \"args\": [7, 7, 7, 4]},"              // p += p
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 12},"       // sum(p)
+      "     {\"id\": %d, \"args\": [7, 7, 5, 6, 4]},"           // clamp(p)
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 13},"       // sum(p)
+      "     {\"id\": %d, \"args\": [7]}],"                      // my_free(p)
+      " \"get\": [8, 9, 10, 11, 12, 13],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_SET_ARRAY_UCHAR,
+           NB_FUNC_NB_SUM_ARRAY_UCHAR,
+           NB_FUNC_NB_MIN_ARRAY_UCHAR,
+           NB_FUNC_NB_MAX_ARRAY_UCHAR,
+           NB_FUNC_NB_DOT_ARRAY_UCHAR,
+           NB_FUNC_NB_ADD_ARRAY_UCHAR,
+           NB_FUNC_NB_SUM_ARRAY_UCHAR,
+           NB_FUNC_NB_CLAMP_ARRAY_UCHAR,
+           NB_FUNC_NB_SUM_ARRAY_UCHAR,
+           NB_FUNC_MY_FREE);
+  const char* response_json =
+      "{\"id\":1,\"values\":[394,97,100,38814,788,786]}\n";
+  RunTest(buffer, response_json);
+}
+
+// Builds a request one command at a time. Every handle it creates is
+// destroyed at the end of the request, except those passed to Keep. Use
+// Destroy for handles made by an earlier request.
+class RequestBuilder {
+ public:
+  explicit RequestBuilder(int first_handle) : next_handle_(first_handle) {}
+
+  // Returns a new handle for |value|, which should be an integer.
+  int Set(double value) {
+    char buffer[100];
+    int handle = next_handle_++;
+    snprintf(buffer, sizeof(buffer), "%s\"%d\": %.0f",
+             set_.empty() ? "" : ", ", handle, value);
+    set_ += buffer;
+    handles_.push_back(handle);
+    return handle;
+  }
+
+  // Calls |fn| with the non-zero handles |a0| through |a4|. Returns the handle
+  // of the result if |ret| is true, otherwise 0.
+  int Call(int fn, bool ret, int a0, int a1 = 0, int a2 = 0, int a3 = 0,
+           int a4 = 0) {
+    char buffer[200];
+    int args[] = {a0, a1, a2, a3, a4};
+    std::string args_json;
+    for (int i = 0; i < 5 && args[i] != 0; ++i) {
+      snprintf(buffer, sizeof(buffer), i == 0 ? "%d" : ", %d", args[i]);
+      args_json += buffer;
+    }
+
+    int handle = ret ? next_handle_++ : 0;
+    if (ret) {
+      snprintf(buffer, sizeof(buffer),
+               "%s{\"id\": %d, \"args\": [%s], \"ret\": %d}",
+               commands_.empty() ? "" : ", ", fn, args_json.c_str(), handle);
+      handles_.push_back(handle);
+    } else {
+      snprintf(buffer, sizeof(buffer), "%s{\"id\": %d, \"args\": [%s]}",
+               commands_.empty() ? "" : ", ", fn, args_json.c_str());
+    }
+    commands_ += buffer;
+    return handle;
+  }
+
+  void Get(int handle) { gets_.push_back(handle); }
+
+  void Keep(int handle) {
+    handles_.erase(std::find(handles_.begin(), handles_.end(), handle));
+  }
+
+  void Destroy(int handle) { handles_.push_back(handle); }
+
+  std::string Json() const {
+    return "{\"id\": 1, \"set\": {" + set_ + "}, \"commands\": [" +
+           commands_ + "], \"get\": [" + List(gets_) + "], \"destroy\": [" +
+           List(handles_) + "]}";
+  }
+
+ private:
+  static std::string List(const std::vector<int>& handles) {
+    char buffer[20];
+    std::string json;
+    for (size_t i = 0; i < handles.size(); ++i) {
+      snprintf(buffer, sizeof(buffer), i == 0 ? "%d" : ", %d", handles[i]);
+      json += buffer;
+    }
+    return json;
+  }
+
+  int next_handle_;
+  std::string set_;
+  std::string commands_;
+  std::vector<int> gets_;
+  std::vector<int> handles_;
+};
+
+// The response of a request whose gets are |count| comparisons that all
+// succeeded.
+static std::string AllEqualJson(int count) {
+  std::string json = "{\"id\":1,\"values\":[";
+  for (int i = 0; i < count; ++i) {
+    json += i == 0 ? "1" : ",1";
+  }
+  return json + "]}\n";
+}
+
+// The buffer kernels of one element type. |eq_acc| compares values of the
+// type sums and dot products are accumulated in.
+struct KernelFuncs {
+  const char* name;
+  int size;
+  bool is_signed;
+  int set, get, eq, eq_acc, sum, min, max, dot, scale, clamp, add;
+};
+
+// Small integers, so every result is exact in float too. The largest and
+// smallest values are last, so they are in the scalar remainder when |count|
+// isn't a multiple of the lane count, and in the vector loop when it is.
+static double KernelValue(const KernelFuncs& f, int i, int count) {
+  if (i == count - 1) {
+    return 50;
+  } else if (i == count - 2) {
+    return f.is_signed ? -50 : 0;
+  }
+  return (i * 5) % 7 + (f.is_signed ? -3 : 1);
+}
+
+// A request, and the number of comparisons it gets, which should all be 1.
+struct CheckedRequest {
+  CheckedRequest(const std::string& json, int check_count)
+      : json(json), check_count(check_count) {}
+
+  std::string json;
+  int check_count;
+};
+
+// Handles made by a request that checks the results of another start here,
+// above those of the request that filled the buffers.
+static const int kCheckFirstHandle = 1000;
+
+// Compares every element of |p| with |expected|. The fake interfaces only
+// have room for so many vars, so this is a request of its own.
+static CheckedRequest CheckElements(const KernelFuncs& f,
+                                    int p,
+                                    const std::vector<double>& expected) {
+  RequestBuilder b(kCheckFirstHandle);
+  int stride = b.Set(f.size);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    int x = b.Call(f.get, true, p);
+    b.Get(b.Call(f.eq, true, x, b.Set(expected[i])));
+    if (i + 1 < expected.size()) {
+      p = b.Call(NB_FUNC_NB_ADD_VOIDP, true, p, stride);
+    }
+  }
+  return CheckedRequest(b.Json(), expected.size());
+}
+
+// Runs every kernel of |f| on |count| elements, and compares each result with
+// the scalar answer computed here.
+static std::vector<CheckedRequest> KernelRequests(const KernelFuncs& f,
+                                                  int count) {
+  std::vector<CheckedRequest> requests;
+  std::vector<double> values(count);
+  std::vector<double> expected(count);
+  double sum = 0, dot = 0, min = 0, max = 0;
+  const double factor = 3;
+  const double lo = f.is_signed ? -10 : 5;
+  const double hi = 20;
+
+  // p = values, and q is uninitialized. Both outlive this request.
+  RequestBuilder fill(1);
+  int bytes = fill.Set(count * f.size);
+  int stride = fill.Set(f.size);
+  int p = fill.Call(NB_FUNC_MY_MALLOC, true, bytes);
+  int q = fill.Call(NB_FUNC_MY_MALLOC, true, bytes);
+  int pi = p;
+  for (int i = 0; i < count; ++i) {
+    double v = values[i] = KernelValue(f, i, count);
+    fill.Call(f.set, false, pi, fill.Set(v));
+    if (i + 1 < count) {
+      pi = fill.Call(NB_FUNC_NB_ADD_VOIDP, true, pi, stride);
+    }
+    sum += v;
+    dot += v * v;
+    min = i == 0 || v < min ? v : min;
+    max = i == 0 || v > max ? v : max;
+  }
+  fill.Keep(p);
+  fill.Keep(q);
+  requests.push_back(CheckedRequest(fill.Json(), 0));
+
+  RequestBuilder b(kCheckFirstHandle);
+  int n = b.Set(count);
+  b.Get(b.Call(f.eq_acc, true, b.Call(f.sum, true, p, n), b.Set(sum)));
+  b.Get(b.Call(f.eq, true, b.Call(f.min, true, p, n), b.Set(min)));
+  b.Get(b.Call(f.eq, true, b.Call(f.max, true, p, n), b.Set(max)));
+  b.Get(b.Call(f.eq_acc, true, b.Call(f.dot, true, p, p, n), b.Set(dot)));
+  // q = p * factor
+  b.Call(f.scale, false, q, p, b.Set(factor), n);
+  requests.push_back(CheckedRequest(b.Json(), 4));
+  for (int i = 0; i < count; ++i) {
+    expected[i] = values[i] * factor;
+  }
+  requests.push_back(CheckElements(f, q, expected));
+
+  // q = clamp(q, lo, hi), in place.
+  RequestBuilder clamp(kCheckFirstHandle);
+  clamp.Call(f.clamp, false, q, q, clamp.Set(lo), clamp.Set(hi),
+             clamp.Set(count));
+  requests.push_back(CheckedRequest(clamp.Json(), 0));
+  for (int i = 0; i < count; ++i) {
+    expected[i] = expected[i] < lo ? lo : expected[i] > hi ? hi : expected[i];
+  }
+  requests.push_back(CheckElements(f, q, expected));
+
+  // q += p
+  RequestBuilder add(kCheckFirstHandle);
+  add.Call(f.add, false, q, q, p, add.Set(count));
+  requests.push_back(CheckedRequest(add.Json(), 0));
+  for (int i = 0; i < count; ++i) {
+    expected[i] += values[i];
+  }
+  requests.push_back(CheckElements(f, q, expected));
+
+  RequestBuilder cleanup(kCheckFirstHandle);
+  cleanup.Call(NB_FUNC_MY_FREE, false, p);
+  cleanup.Call(NB_FUNC_MY_FREE, false, q);
+  cleanup.Destroy(p);
+  cleanup.Destroy(q);
+  requests.push_back(CheckedRequest(cleanup.Json(), 0));
+  return requests;
+}
+
+TEST_F(GeneratorTest, KernelLanes) {
+  const KernelFuncs kFuncs[] = {
+      {"float", sizeof(float), true,
+       NB_FUNC_NB_SET_FLOAT, NB_FUNC_NB_GET_FLOAT, NB_FUNC_NB_EQ_FLOAT,
+       NB_FUNC_NB_EQ_FLOAT, NB_FUNC_NB_SUM_ARRAY_FLOAT,
+       NB_FUNC_NB_MIN_ARRAY_FLOAT, NB_FUNC_NB_MAX_ARRAY_FLOAT,
+       NB_FUNC_NB_DOT_ARRAY_FLOAT, NB_FUNC_NB_SCALE_ARRAY_FLOAT,
+       NB_FUNC_NB_CLAMP_ARRAY_FLOAT, NB_FUNC_NB_ADD_ARRAY_FLOAT},
+      {"double", sizeof(double), true,
+       NB_FUNC_NB_SET_DOUBLE, NB_FUNC_NB_GET_DOUBLE, NB_FUNC_NB_EQ_DOUBLE,
+       NB_FUNC_NB_EQ_DOUBLE, NB_FUNC_NB_SUM_ARRAY_DOUBLE,
+       NB_FUNC_NB_MIN_ARRAY_DOUBLE, NB_FUNC_NB_MAX_ARRAY_DOUBLE,
+       NB_FUNC_NB_DOT_ARRAY_DOUBLE, NB_FUNC_NB_SCALE_ARRAY_DOUBLE,
+       NB_FUNC_NB_CLAMP_ARRAY_DOUBLE, NB_FUNC_NB_ADD_ARRAY_DOUBLE},
+      {"int", sizeof(int), true,
+       NB_FUNC_NB_SET_INT, NB_FUNC_NB_GET_INT, NB_FUNC_NB_EQ_INT,
+       NB_FUNC_NB_EQ_INT, NB_FUNC_NB_SUM_ARRAY_INT,
+       NB_FUNC_NB_MIN_ARRAY_INT, NB_FUNC_NB_MAX_ARRAY_INT,
+       NB_FUNC_NB_DOT_ARRAY_INT, NB_FUNC_NB_SCALE_ARRAY_INT,
+       NB_FUNC_NB_CLAMP_ARRAY_INT, NB_FUNC_NB_ADD_ARRAY_INT},
+      {"uchar", sizeof(unsigned char), false,
+       NB_FUNC_NB_SET_UCHAR, NB_FUNC_NB_GET_UCHAR, NB_FUNC_NB_EQ_UCHAR,
+       NB_FUNC_NB_EQ_UINT, NB_FUNC_NB_SUM_ARRAY_UCHAR,
+       NB_FUNC_NB_MIN_ARRAY_UCHAR, NB_FUNC_NB_MAX_ARRAY_UCHAR,
+       NB_FUNC_NB_DOT_ARRAY_UCHAR, NB_FUNC_NB_SCALE_ARRAY_UCHAR,
+       NB_FUNC_NB_CLAMP_ARRAY_UCHAR, NB_FUNC_NB_ADD_ARRAY_UCHAR},
+  };
+
+  for (size_t i = 0; i < sizeof(kFuncs) / sizeof(kFuncs[0]); ++i) {
+    const KernelFuncs& f = kFuncs[i];
+    // The kernels use 16-byte vectors when they can. Cover fewer elements
+    // than one vector, exactly one and two vectors, and a remainder.
+    int lanes = 16 / f.size;
+    int counts[] = {1, lanes - 1, lanes, lanes + 1, 2 * lanes, 2 * lanes + 3};
+    for (size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); ++j) {
+      if (counts[j] < 1) {
+        continue;
+      }
+
+      SCOPED_TRACE(testing::Message() << f.name << " x " << counts[j]);
+      std::vector<CheckedRequest> requests = KernelRequests(f, counts[j]);
+      for (size_t k = 0; k < requests.size(); ++k) {
+        RunTest(requests[k].json.c_str(),
+                AllEqualJson(requests[k].check_count).c_str());
+      }
+    }
+  }
+}
+
+TEST_F(GeneratorTest, Map) {
+  const int kBufferSize = 2000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 8,"
+      "     \"2\": 4,"
+      "     \"3\": 10,"
+      "     \"4\": 20,"
+      "     \"5\": %d,"
+      "     \"6\": 2},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 7},"       // p = my_malloc(8)
+      "     {\"id\": %d, \"args\": [1], \"ret\": 8},"       // q = my_malloc(8)
+      "     {\"id\": %d, \"args\": [7, 2], \"ret\": 9},"    // r = p + 4
+      "     {\"id\": %d, \"args\": [7, 3]},"                // p[0] = 10
+      "     {\"id\": %d, \"args\": [9, 4]},"                // p[1] = 20
+      "     {\"id\": -8, \"args\": [5, 6, 7, 7, 8]},"       // q = map(add)
+      "     {\"id\": %d, \"args\": [8, 2], \"ret\": 10},"   // s = q + 4
+      "     {\"id\": %d, \"args\": [8], \"ret\": 11},"      // a = q[0]
+      "     {\"id\": %d, \"args\": [10], \"ret\": 12},"     // b = q[1]
+      "     {\"id\": %d, \"args\": [7]},"                   // my_free(p)
+      "     {\"id\": %d, \"args\": [8]}],"                  // my_free(q)
+      " \"get\": [11, 12],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_NB_ADD_INT,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_SET_INT,
+           NB_FUNC_NB_SET_INT,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_GET_INT,
+           NB_FUNC_NB_GET_INT,
+           NB_FUNC_MY_FREE,
+           NB_FUNC_MY_FREE);
+  const char* response_json = "{\"id\":1,\"values\":[20,40]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, GatherScatter) {
+  const int kBufferSize = 2000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 24,"
+      "     \"2\": 0,"
+      "     \"3\": \"abcdefghijklmnopqrstuvwx\","
+      "     \"4\": 8,"
+      "     \"5\": 1,"
+      "     \"6\": 3},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 7},"       // p = my_malloc(24)
+      "     {\"id\": %d, \"args\": [6], \"ret\": 8},"       // q = my_malloc(3)
+      "     {\"id\": %d, \"args\": [7, 2, 3, 1]},"          // p = "abc..."
+      "     {\"id\": %d, \"args\": [8, 7, 4, 5, 6]},"       // q[i] = p[i*8+1]
+      "     {\"id\": %d, \"args\": [8, 7, 4, 2, 6]},"       // p[i*8] = q[i]
+      "     {\"id\": %d, \"args\": [8, 5], \"ret\": 9},"    // r = q + 1
+      "     {\"id\": %d, \"args\": [7, 4], \"ret\": 10},"   // s = p + 8
+      "     {\"id\": %d, \"args\": [9], \"ret\": 11},"      // a = *r
+      "     {\"id\": %d, \"args\": [10], \"ret\": 12},"     // b = *s
+      "     {\"id\": %d, \"args\": [7], \"ret\": 13},"      // c = *p
+      "     {\"id\": %d, \"args\": [7]},"                   // my_free(p)
+      "     {\"id\": %d, \"args\": [8]}],"                  // my_free(q)
+      " \"get\": [11, 12, 13],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_GATHER_UCHAR,
+           NB_FUNC_NB_SCATTER_UCHAR,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_GET_UCHAR,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_NB_GET_CHAR,
+           NB_FUNC_MY_FREE,
+           NB_FUNC_MY_FREE);
+  const char* response_json = "{\"id\":1,\"values\":[106,106,98]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, GatherScatterNegative) {
+  const int kBufferSize = 2000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 8,"
+      "     \"2\": 0,"
+      "     \"3\": \"abcdefgh\","
+      "     \"4\": 4,"
+      "     \"5\": -1,"
+      "     \"6\": 2,"
+      "     \"7\": 1},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [1], \"ret\": 8},"       // p = my_malloc(8)
+      "     {\"id\": %d, \"args\": [1], \"ret\": 9},"       // q = my_malloc(8)
+      "     {\"id\": %d, \"args\": [8, 2, 3, 1]},"          // p = "abc..."
+      "     {\"id\": %d, \"args\": [9, 2, 3, 1]},"          // q = "abc..."
+      "     {\"id\": %d, \"args\": [8, 4], \"ret\": 10},"   // r = p + 4
+      "     {\"id\": %d, \"args\": [9, 10, 5, 2, 6]},"      // stride -1
+      "     {\"id\": %d, \"args\": [9, 10, 7, 5, 6]},"      // offset -1
+      "     {\"id\": %d, \"args\": [10, 9, 5, 2, 6]},"      // stride -1
+      "     {\"id\": %d, \"args\": [10, 9, 7, 2, 5]},"      // count -1
+      "     {\"id\": %d, \"args\": [9, 7], \"ret\": 11},"   // s = q + 1
+      "     {\"id\": %d, \"args\": [9], \"ret\": 12},"      // a = *q
+      "     {\"id\": %d, \"args\": [11], \"ret\": 13},"     // b = *s
+      "     {\"id\": %d, \"args\": [8]},"                   // my_free(p)
+      "     {\"id\": %d, \"args\": [9]}],"                  // my_free(q)
+      " \"get\": [12, 13],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_MY_MALLOC,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_SET_ARRAY_CHAR,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_GATHER_UCHAR,
+           NB_FUNC_NB_GATHER_UCHAR,
+           NB_FUNC_NB_SCATTER_UCHAR,
+           NB_FUNC_NB_SCATTER_UCHAR,
+           NB_FUNC_NB_ADD_VOIDP,
+           NB_FUNC_NB_GET_UCHAR,
+           NB_FUNC_NB_GET_UCHAR,
+           NB_FUNC_MY_FREE,
+           NB_FUNC_MY_FREE);
+  // A negative count, stride or offset copies nothing.
+  const char* response_json = "{\"id\":1,\"values\":[97,98]}\n";
+  RunTest(buffer, response_json);
+}
+
+static double NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Sums the |count| floats at |p| with one command per element, the way a
+// JavaScript loop over m.get and m.add would. Handles start at 100, above
+// the buffer made by the benchmark.
+static std::string SumPerElementJson(int p, int count) {
+  RequestBuilder b(100);
+  int stride = b.Set(sizeof(float));
+  int sum = b.Set(0);
+  int q = p;
+  for (int i = 0; i < count; ++i) {
+    int x = b.Call(NB_FUNC_NB_GET_FLOAT, true, q);
+    sum = b.Call(NB_FUNC_NB_ADD_FLOAT, true, sum, x);
+    if (i + 1 < count) {
+      q = b.Call(NB_FUNC_NB_ADD_VOIDP, true, q, stride);
+    }
+  }
+  b.Get(b.Call(NB_FUNC_NB_EQ_FLOAT, true, sum, b.Set(count)));
+  return b.Json();
+}
+
+static std::string SumKernelJson(int p, int count) {
+  RequestBuilder b(100);
+  int sum = b.Call(NB_FUNC_NB_SUM_ARRAY_FLOAT, true, p, b.Set(count));
+  b.Get(b.Call(NB_FUNC_NB_EQ_FLOAT, true, sum, b.Set(count)));
+  return b.Json();
+}
+
+// Run with --gtest_also_run_disabled_tests.
+TEST_F(GeneratorTest, DISABLED_KernelBenchmark) {
+  const int kCount = 64;
+  const int kIterations = 1000;
+
+  // Fill a buffer of 1.0f once; it stays alive across the timed requests.
+  RequestBuilder setup(1);
+  int one = setup.Set(1);
+  int bytes = setup.Set(kCount * sizeof(float));
+  int p = setup.Call(NB_FUNC_MY_MALLOC, true, bytes);
+  for (int i = 0; i < kCount; ++i) {
+    int pi = setup.Call(NB_FUNC_NB_ADD_VOIDP, true, p,
+                        setup.Set(i * sizeof(float)));
+    setup.Call(NB_FUNC_NB_SET_FLOAT, false, pi, one);
+  }
+  setup.Keep(p);
+  RunTest(setup.Json().c_str(), "{\"id\":1,\"values\":[]}\n");
+
+  std::string requests[] = {SumPerElementJson(p, kCount),
+                            SumKernelJson(p, kCount)};
+  const char* names[] = {"command per element", "nb_sum_array_float"};
+  for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+    double start_ms = NowMs();
+    for (int j = 0; j < kIterations; ++j) {
+      RunTest(requests[i].c_str(), AllEqualJson(1).c_str());
+    }
+    double elapsed_ms = NowMs() - start_ms;
+    printf("%s: %.3f us/request (%d elements)\n", names[i],
+           elapsed_ms * 1000 / kIterations, kCount);
+  }
+
+  RequestBuilder cleanup(100);
+  cleanup.Call(NB_FUNC_MY_FREE, false, p);
+  cleanup.Destroy(p);
+  RunTest(cleanup.Json().c_str(), "{\"id\":1,\"values\":[]}\n");
+}
+
+TEST_F(GeneratorTest, RepeatCarry) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 0,"
+      "     \"2\": 5,"
+      "     \"3\": 1},"
+      " \"commands\": ["
+      "     {\"id\": -5, \"args\": [2, 3, 1, 5], \"ret\": 4},"  // repeat 5
+      "     {\"id\": %d, \"args\": [1, 4], \"ret\": 5}],"       //   s' = s + i
+      " \"get\": [1, 4],"
+      " \"destroy\": [1, 2, 3, 4]}";
+  snprintf(buffer, kBufferSize, request_json, NB_FUNC_NB_ADD_INT);
+  // s = 0 + 1 + 2 + 3 + 4, and the ret handle has the last index.
+  const char* response_json = "{\"id\":1,\"values\":[10,4]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, WhileCondition) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 3,"
+      "     \"2\": 0,"
+      "     \"3\": 1,"
+      "     \"4\": 3,"
+      "     \"5\": 0},"
+      " \"commands\": ["
+      "     {\"id\": %d, \"args\": [2, 1], \"ret\": 6},"        // c = 0 < n
+      "     {\"id\": -6, \"args\": [6, 4, 1, 7, 6, 8, 5, 9]},"  // while (c)
+      "     {\"id\": %d, \"args\": [1, 3], \"ret\": 7},"        //   n' = n - 1
+      "     {\"id\": %d, \"args\": [2, 7], \"ret\": 8},"        //   c' = 0 < n'
+      "     {\"id\": %d, \"args\": [5, 3], \"ret\": 9}],"       //   k' = k + 1
+      " \"get\": [1, 5, 6],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_NB_LT_INT,
+           NB_FUNC_NB_SUB_INT,
+           NB_FUNC_NB_LT_INT,
+           NB_FUNC_NB_ADD_INT);
+  const char* response_json = "{\"id\":1,\"values\":[0,3,0]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, NestedLoops) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 0,"
+      "     \"2\": 3,"
+      "     \"3\": 4,"
+      "     \"4\": 1,"
+      "     \"5\": 2,"
+      "     \"6\": 1},"
+      " \"commands\": ["
+      "     {\"id\": -5, \"args\": [2, 5], \"ret\": 7},"        // repeat 3
+      "     {\"id\": -5, \"args\": [3, 6, 1, 8], \"ret\": 9},"  //   repeat 4
+      "     {\"id\": %d, \"args\": [1, 4], \"ret\": 8}],"       //     s++
+      " \"get\": [1, 7, 9],"
+      " \"destroy\": [1, 2, 3, 4, 5, 6, 7, 9]}";
+  snprintf(buffer, kBufferSize, request_json, NB_FUNC_NB_ADD_INT);
+  const char* response_json = "{\"id\":1,\"values\":[12,2,3]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, BadBodyCount) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_jsons[] = {
+      // The loop body runs past the end of the commands.
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 2, \"2\": 2},"
+      " \"commands\": ["
+      "     {\"id\": -5, \"args\": [1, 2]},"
+      "     {\"id\": %d, \"args\": [1, 1], \"ret\": 3}],"
+      " \"destroy\": [1, 2]}",
+      // A negative body count.
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 2, \"2\": -1},"
+      " \"commands\": ["
+      "     {\"id\": -6, \"args\": [1, 2]},"
+      "     {\"id\": %d, \"args\": [1, 1], \"ret\": 3}],"
+      " \"destroy\": [1, 2]}",
+  };
+
+  for (size_t i = 0; i < sizeof(request_jsons) / sizeof(request_jsons[0]);
+       ++i) {
+    CleanUp();
+    SetUp();
+    snprintf(buffer, kBufferSize, request_jsons[i], NB_FUNC_NB_ADD_INT);
+    request_ = json_to_var(buffer);
+    ASSERT_EQ(PP_VARTYPE_DICTIONARY, request_.type);
+    EXPECT_EQ(NB_FALSE, nb_request_run(NULL, request_, &response_))
+        << "Expected invalid: " << i;
+
+    // The loop command fails, and nothing is run.
+    char* response_json = var_to_json_flat(response_);
+    EXPECT_STREQ("{\"error\":0,\"id\":1,\"values\":[]}\n", response_json)
+        << "Expected invalid: " << i;
+    free(response_json);
+  }
+}
+
+TEST_F(GeneratorTest, IfElse) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {"
+      "     \"1\": 1,"
+      "     \"2\": 0,"
+      "     \"3\": 10,"
+      "     \"4\": 1},"
+      " \"commands\": ["
+      "     {\"id\": -7, \"args\": [1, 4, 4]},"           // if (1)
+      "     {\"id\": %d, \"args\": [3, 4], \"ret\": 5},"  //   a = x + 1
+      "     {\"id\": %d, \"args\": [3, 4], \"ret\": 6},"  // else b = x - 1
+      "     {\"id\": -7, \"args\": [2, 4, 4]},"           // if (0)
+      "     {\"id\": %d, \"args\": [3, 4], \"ret\": 7},"  //   c = x + 1
+      "     {\"id\": %d, \"args\": [3, 4], \"ret\": 8}],"  // else d = x - 1
+      " \"get\": [5, 8],"
+      " \"destroy\": [1, 2, 3, 4, 5, 8]}";
+  snprintf(buffer,
+           kBufferSize,
+           request_json,
+           NB_FUNC_NB_ADD_INT,
+           NB_FUNC_NB_SUB_INT,
+           NB_FUNC_NB_ADD_INT,
+           NB_FUNC_NB_SUB_INT);
+  const char* response_json = "{\"id\":1,\"values\":[11,9]}\n";
+  RunTest(buffer, response_json);
+}
+
+TEST_F(GeneratorTest, BadBranchCount) {
+  const int kBufferSize = 1000;
+  char buffer[kBufferSize];
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 1, \"2\": 2, \"3\": -1},"
+      " \"commands\": ["
+      "     {\"id\": -7, \"args\": [1, %d, %d]},"
+      "     {\"id\": %d, \"args\": [1, 1], \"ret\": 4}],"
+      " \"destroy\": [1, 2, 3]}";
+  // Pairs of handles for the then and else counts: a branch runs past the end
+  // of the commands, or a count is negative.
+  const int counts[][2] = {{1, 2}, {2, 1}, {3, 1}, {1, 3}};
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+    CleanUp();
+    SetUp();
+    snprintf(buffer, kBufferSize, request_json, counts[i][0], counts[i][1],
+             NB_FUNC_NB_ADD_INT);
+    request_ = json_to_var(buffer);
+    ASSERT_EQ(PP_VARTYPE_DICTIONARY, request_.type);
+    EXPECT_EQ(NB_FALSE, nb_request_run(NULL, request_, &response_))
+        << "Expected invalid: " << i;
+
+    // The if command fails, and neither branch is run.
+    char* response_json = var_to_json_flat(response_);
+    EXPECT_STREQ("{\"error\":0,\"id\":1,\"values\":[]}\n", response_json)
+        << "Expected invalid: " << i;
+    free(response_json);
+  }
+}
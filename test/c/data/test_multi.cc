@@ -31,3 +31,18 @@ TEST_F(GeneratorTest, MultipleCommands) {
   const char* response_json = "{\"id\":1,\"values\":[\"Uryyb\"]}\n";
   RunTest(request_json, response_json);
 }
+
+TEST_F(GeneratorTest, ConstCharWithLength) {
+  // count_char takes a const char* and a length, so the string var is read in
+  // place; "Hello" isn't NULL-terminated, and only the first 4 chars count.
+  const char *request_json =
+    "{\"id\": 1,"
+    " \"set\": {\"1\": \"Hello\","
+    "           \"2\": 4,"
+    "           \"3\": 108},"
+    " \"commands\": [{\"id\": 6, \"args\": [1, 2, 3], \"ret\": 4}],"
+    " \"get\": [4],"
+    " \"destroy\": [1, 2, 3, 4]}";
+  const char* response_json = "{\"id\":1,\"values\":[2]}\n";
+  RunTest(request_json, response_json);
+}
@@ -0,0 +1,333 @@
+// Copyright 2014 Ben Smith. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+#include <ppapi/c/pp_var.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <set>
+#include "bool.h"
+#include "fake_interfaces.h"
+#include "glue.h"
+#include "json.h"
+#include "queue.h"
+#include "run.h"
+#include "var.h"
+
+extern "C" {
+#include "pool.h"
+}
+
+// The function ids of $compactHandles and $getStats.
+#define COMPACT_HANDLES -3
+#define GET_STATS -4
+
+// The pool can't be stopped, so one is started for all tests, and each test
+// waits for the responses to all of its requests.
+class PoolTest : public ::testing::Test {
+ public:
+  static const int kQueueSize = 256;
+  static const int kWorkersCount = 4;
+  // See NB_RUN_POOL_MAX_JOBS.
+  static const int kMaxJobs = 64;
+
+  virtual void SetUp() {
+    if (!js_to_c_queue_) {
+      js_to_c_queue_ = nb_queue_create(kQueueSize);
+      c_to_js_queue_ = nb_queue_create(kQueueSize);
+      fake_interface_set_post_message_callback(&OnPostMessage, NULL);
+
+      pthread_t thread;
+      pthread_create(&thread, NULL, &ThreadFunc, NULL);
+    }
+
+    pool_reset();
+  }
+
+  virtual void TearDown() {
+    EXPECT_EQ(0u, nb_queue_size(js_to_c_queue_));
+    EXPECT_EQ(0u, nb_queue_size(c_to_js_queue_));
+    EXPECT_EQ(NB_TRUE, fake_interface_check_no_references());
+  }
+
+  static void* ThreadFunc(void*) {
+    nb_run_message_loop_pool(js_to_c_queue_, kWorkersCount);
+    return NULL;
+  }
+
+  // Called on the dispatcher and on the workers, so the producer side of the
+  // queue must be locked.
+  static void OnPostMessage(struct PP_Var message, void*) {
+    pthread_mutex_lock(&post_mutex_);
+    EXPECT_EQ(1, nb_queue_enqueue(c_to_js_queue_, message));
+    pthread_mutex_unlock(&post_mutex_);
+  }
+
+  void EnqueueCMessage(const char* format, ...) {
+    char buffer[1000];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    struct PP_Var message = json_to_var(buffer);
+    ASSERT_EQ(PP_VARTYPE_DICTIONARY, message.type);
+    ASSERT_EQ(1, nb_queue_enqueue(js_to_c_queue_, message));
+    nb_var_release(message);
+  }
+
+  void ExpectJsMessage(const char* expected_json) {
+    struct PP_Var message = nb_queue_dequeue(c_to_js_queue_);
+    char* json = var_to_json_flat(message);
+    EXPECT_STREQ(expected_json, json);
+    free(json);
+    nb_var_release(message);
+  }
+
+ protected:
+  static NB_Queue* js_to_c_queue_;
+  static NB_Queue* c_to_js_queue_;
+  static pthread_mutex_t post_mutex_;
+};
+
+NB_Queue* PoolTest::js_to_c_queue_ = NULL;
+NB_Queue* PoolTest::c_to_js_queue_ = NULL;
+pthread_mutex_t PoolTest::post_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+TEST_F(PoolTest, OverlappingJobsKeepOrder) {
+  // The second request gets the handle the first one sets, after a wait that
+  // times out.
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 100},"
+      " \"commands\": [{\"id\": %d, \"args\": [1], \"ret\": 2}]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"get\": [2],"
+      " \"destroy\": [1, 2]}");
+
+  ExpectJsMessage("{\"id\":1,\"values\":[]}\n");
+  ExpectJsMessage("{\"id\":2,\"values\":[0]}\n");
+}
+
+TEST_F(PoolTest, DisjointJobsRunConcurrently) {
+  // The first request waits until the second one signals it, so they must
+  // run at the same time.
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 5000},"
+      " \"commands\": [{\"id\": %d, \"args\": [1], \"ret\": 2}],"
+      " \"get\": [2],"
+      " \"destroy\": [1, 2]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"commands\": [{\"id\": %d, \"args\": []}]}",
+      NB_FUNC_POOL_SIGNAL);
+
+  ExpectJsMessage("{\"id\":2,\"values\":[]}\n");
+  ExpectJsMessage("{\"id\":1,\"values\":[1]}\n");
+}
+
+TEST_F(PoolTest, BuiltinDrainsPool) {
+  // $compactHandles uses no handles, but must wait for the first request.
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 100},"
+      " \"commands\": [{\"id\": %d, \"args\": [1], \"ret\": 2}],"
+      " \"get\": [2],"
+      " \"destroy\": [1, 2]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"commands\": [{\"id\": %d, \"args\": []}]}",
+      COMPACT_HANDLES);
+
+  ExpectJsMessage("{\"id\":1,\"values\":[0]}\n");
+  ExpectJsMessage("{\"id\":2,\"values\":[]}\n");
+}
+
+TEST_F(PoolTest, FunctionDrainsPool) {
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 100},"
+      " \"commands\": [{\"id\": %d, \"args\": [1], \"ret\": 2}],"
+      " \"get\": [2],"
+      " \"destroy\": [1, 2]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"set\": {\"3\": [\"function\", 7]},"
+      " \"destroy\": [3]}");
+
+  ExpectJsMessage("{\"id\":1,\"values\":[0]}\n");
+  ExpectJsMessage("{\"id\":2,\"values\":[]}\n");
+}
+
+TEST_F(PoolTest, MovedFunctionDrainsPool) {
+  // Move the function from handle 1 to handle 2 with a loop carry.
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": [\"function\", 7], \"10\": 1, \"11\": 0},"
+      " \"commands\": [{\"id\": %d, \"args\": [10, 11, 2, 1]}],"
+      " \"destroy\": [10, 11]}",
+      NB_COMMAND_REPEAT);
+  ExpectJsMessage("{\"id\":1,\"values\":[]}\n");
+
+  // Handle 2 isn't set by this request, but still holds a function.
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"set\": {\"3\": 100},"
+      " \"commands\": [{\"id\": %d, \"args\": [3], \"ret\": 4}],"
+      " \"get\": [4],"
+      " \"destroy\": [3, 4]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 3,"
+      " \"commands\": [{\"id\": %d, \"args\": [2]}],"
+      " \"destroy\": [2]}",
+      NB_FUNC_POOL_KEEP_CALLBACK);
+
+  ExpectJsMessage("{\"id\":2,\"values\":[0]}\n");
+  ExpectJsMessage("{\"id\":3,\"values\":[]}\n");
+}
+
+TEST_F(PoolTest, KeptCallbackMakesPoolExclusive) {
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"set\": {\"1\": [\"function\", 7]},"
+      " \"commands\": [{\"id\": %d, \"args\": [1]}]}",
+      NB_FUNC_POOL_KEEP_CALLBACK);
+  ExpectJsMessage("{\"id\":1,\"values\":[]}\n");
+
+  // While the callback is kept, these disjoint requests run one at a time, so
+  // the wait times out.
+  EnqueueCMessage(
+      "{\"id\": 2,"
+      " \"set\": {\"2\": 100},"
+      " \"commands\": [{\"id\": %d, \"args\": [2], \"ret\": 3}],"
+      " \"get\": [3],"
+      " \"destroy\": [2, 3]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 3,"
+      " \"commands\": [{\"id\": %d, \"args\": []}]}",
+      NB_FUNC_POOL_SIGNAL);
+  ExpectJsMessage("{\"id\":2,\"values\":[0]}\n");
+  ExpectJsMessage("{\"id\":3,\"values\":[]}\n");
+
+  // Destroying the function frees the callback, so they can run at the same
+  // time again.
+  EnqueueCMessage("{\"id\": 4, \"destroy\": [1]}");
+  ExpectJsMessage("{\"id\":4,\"values\":[]}\n");
+  pool_reset();
+
+  EnqueueCMessage(
+      "{\"id\": 5,"
+      " \"set\": {\"2\": 5000},"
+      " \"commands\": [{\"id\": %d, \"args\": [2], \"ret\": 3}],"
+      " \"get\": [3],"
+      " \"destroy\": [2, 3]}",
+      NB_FUNC_POOL_WAIT);
+  EnqueueCMessage(
+      "{\"id\": 6,"
+      " \"commands\": [{\"id\": %d, \"args\": []}]}",
+      NB_FUNC_POOL_SIGNAL);
+  ExpectJsMessage("{\"id\":6,\"values\":[]}\n");
+  ExpectJsMessage("{\"id\":5,\"values\":[1]}\n");
+}
+
+TEST_F(PoolTest, GetStatsHasQueueCounters) {
+  // $getStats runs on the thread reading the queue, so it has the queue's
+  // counters too.
+  EnqueueCMessage(
+      "{\"id\": 1,"
+      " \"commands\": [{\"id\": %d, \"args\": [], \"ret\": 1}],"
+      " \"get\": [1],"
+      " \"destroy\": [1]}",
+      GET_STATS);
+
+  struct PP_Var message = nb_queue_dequeue(c_to_js_queue_);
+  struct PP_Var values_var = nb_var_dict_get(message, "values");
+  ASSERT_EQ(PP_VARTYPE_ARRAY, values_var.type);
+  struct PP_Var stats_var = nb_var_array_get(values_var, 0);
+  ASSERT_EQ(PP_VARTYPE_DICTIONARY, stats_var.type);
+
+  struct PP_Var keys_var = nb_var_dict_get_keys(stats_var);
+  EXPECT_EQ(15u, nb_var_array_length(keys_var));
+
+  struct PP_Var max_size_var = nb_var_dict_get(stats_var, "queueMaxSize");
+  ASSERT_EQ(PP_VARTYPE_DOUBLE, max_size_var.type);
+  EXPECT_EQ(kQueueSize, max_size_var.value.as_double);
+
+  struct PP_Var enqueued_var = nb_var_dict_get(stats_var, "queueEnqueued");
+  ASSERT_EQ(PP_VARTYPE_DOUBLE, enqueued_var.type);
+  EXPECT_LE(1, enqueued_var.value.as_double);
+
+  nb_var_release(keys_var);
+  nb_var_release(stats_var);
+  nb_var_release(values_var);
+  nb_var_release(message);
+}
+
+TEST_F(PoolTest, MaxJobs) {
+  int i;
+
+  // Fill the pool with requests that wait, then send two more, one at a time.
+  // The first of these is held by the dispatcher until a job finishes, so the
+  // second stays in the message queue.
+  for (i = 0; i < kMaxJobs; ++i) {
+    int handle = 100 + i * 2;
+    EnqueueCMessage(
+        "{\"id\": %d,"
+        " \"set\": {\"%d\": 5000},"
+        " \"commands\": [{\"id\": %d, \"args\": [%d], \"ret\": %d}],"
+        " \"get\": [%d],"
+        " \"destroy\": [%d, %d]}",
+        i + 1, handle, NB_FUNC_POOL_WAIT, handle, handle + 1, handle + 1,
+        handle, handle + 1);
+  }
+  usleep(200 * 1000);
+  EnqueueCMessage("{\"id\": %d}", kMaxJobs + 1);
+  usleep(200 * 1000);
+  EnqueueCMessage("{\"id\": %d}", kMaxJobs + 2);
+  usleep(200 * 1000);
+
+  EXPECT_EQ(1u, nb_queue_size(js_to_c_queue_));
+  EXPECT_EQ(0u, nb_queue_size(c_to_js_queue_));
+
+  pool_signal();
+
+  std::set<int> ids;
+  for (i = 0; i < kMaxJobs + 2; ++i) {
+    struct PP_Var message = nb_queue_dequeue(c_to_js_queue_);
+    char* json = var_to_json_flat(message);
+    int id;
+    ASSERT_EQ(1, sscanf(json, "{\"id\":%d", &id));
+    char expected_json[100];
+    snprintf(expected_json, sizeof(expected_json),
+             id <= kMaxJobs ? "{\"id\":%d,\"values\":[1]}\n"
+                            : "{\"id\":%d,\"values\":[]}\n",
+             id);
+    EXPECT_STREQ(expected_json, json);
+    ids.insert(id);
+    free(json);
+    nb_var_release(message);
+  }
+  EXPECT_EQ(static_cast<size_t>(kMaxJobs + 2), ids.size());
+}
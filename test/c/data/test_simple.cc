@@ -13,6 +13,9 @@
 // limitations under the License.
 
 #include "test_gen.h"
+#include "json.h"
+#include "run.h"
+#include "var.h"
 
 extern "C" {
 int g_foo_called = 0;
@@ -25,3 +28,146 @@ TEST_F(GeneratorTest, Simple) {
   RunTest(request_json, response_json);
   EXPECT_EQ(1, g_foo_called);
 }
+
+TEST_F(GeneratorTest, CompactHandles) {
+  const char* request_json =
+      "{\"id\": 1, \"commands\": [{\"id\": -3, \"args\": []}]}";
+  const char* response_json = "{\"id\":1,\"values\":[]}\n";
+  RunTest(request_json, response_json);
+}
+
+TEST_F(GeneratorTest, GetStats) {
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"commands\": [{\"id\": -4, \"args\": [], \"ret\": 1}],"
+      " \"get\": [1],"
+      " \"destroy\": [1]}";
+  // There is no message queue, so there are no queue counters.
+  const char* keys[] = {
+      "requests",      "parseTime",     "executeTime",       "serializeTime",
+      "lastParseTime", "lastExecuteTime", "lastSerializeTime",
+  };
+  const uint32_t keys_count = sizeof(keys) / sizeof(keys[0]);
+  double requests[2];
+
+  for (int i = 0; i < 2; ++i) {
+    CleanUp();
+    SetUp();
+    request_ = json_to_var(request_json);
+    ASSERT_EQ(PP_VARTYPE_DICTIONARY, request_.type);
+    ASSERT_EQ(NB_TRUE, nb_request_run(NULL, request_, &response_));
+
+    struct PP_Var values_var = nb_var_dict_get(response_, "values");
+    ASSERT_EQ(PP_VARTYPE_ARRAY, values_var.type);
+    struct PP_Var stats_var = nb_var_array_get(values_var, 0);
+    nb_var_release(values_var);
+    ASSERT_EQ(PP_VARTYPE_DICTIONARY, stats_var.type);
+
+    struct PP_Var keys_var = nb_var_dict_get_keys(stats_var);
+    EXPECT_EQ(keys_count, nb_var_array_length(keys_var));
+    nb_var_release(keys_var);
+
+    for (uint32_t j = 0; j < keys_count; ++j) {
+      struct PP_Var value_var = nb_var_dict_get(stats_var, keys[j]);
+      ASSERT_EQ(PP_VARTYPE_DOUBLE, value_var.type) << keys[j];
+      EXPECT_LE(0, value_var.value.as_double) << keys[j];
+      if (j == 0) {
+        requests[i] = value_var.value.as_double;
+      }
+    }
+    nb_var_release(stats_var);
+  }
+
+  // The first request was counted by the time the second one ran.
+  EXPECT_LE(1, requests[0]);
+  EXPECT_EQ(requests[0] + 1, requests[1]);
+}
+
+TEST_F(GeneratorTest, GetHandles) {
+  // The values array is pre-sized to the get count, and each value is set in
+  // place, in order, even if a handle is repeated.
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 5, \"2\": \"hi\", \"3\": 2.5, \"4\": null},"
+      " \"get\": [3, 1, 2, 1, 4],"
+      " \"destroy\": [1, 2, 3, 4]}";
+  const char* response_json =
+      "{\"id\":1,\"values\":[2.5,5,\"hi\",5,null]}\n";
+  RunTest(request_json, response_json);
+}
+
+TEST_F(GeneratorTest, PackedValues) {
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 5, \"2\": 2.5, \"3\": [\"long\", 1, 2], \"4\": null,"
+      "         \"5\": -7},"
+      " \"get\": [1, 2, 3, 4, 5],"
+      " \"packed\": true,"
+      " \"destroy\": [1, 2, 3, 4, 5]}";
+
+  request_ = json_to_var(request_json);
+  ASSERT_EQ(PP_VARTYPE_DICTIONARY, request_.type);
+  ASSERT_EQ(NB_TRUE, nb_request_run(NULL, request_, &response_));
+
+  struct PP_Var values_var = nb_var_dict_get(response_, "values");
+  ASSERT_EQ(PP_VARTYPE_ARRAY_BUFFER, values_var.type);
+
+  // A uint32 count, a tag byte per value (0: int32, 1: double, 2: int64, 3:
+  // null), padding to a multiple of 8, then each value in 8 little-endian
+  // bytes.
+  const uint8_t expected[] = {
+      5, 0, 0, 0,
+      0, 1, 2, 3, 0,
+      0, 0, 0, 0, 0, 0, 0,
+      5, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 4, 0x40,
+      1, 0, 0, 0, 2, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0xf9, 0xff, 0xff, 0xff, 0, 0, 0, 0,
+  };
+  ASSERT_EQ(sizeof(expected), nb_var_buffer_byte_length(values_var));
+
+  const uint8_t* data =
+      static_cast<const uint8_t*>(nb_var_buffer_map(values_var));
+  ASSERT_TRUE(data != NULL);
+  for (size_t i = 0; i < sizeof(expected); ++i) {
+    EXPECT_EQ(expected[i], data[i]) << "at byte " << i;
+  }
+  nb_var_buffer_unmap(values_var);
+  nb_var_release(values_var);
+}
+
+TEST_F(GeneratorTest, PackedValuesFallback) {
+  // A string can't be packed, so the values are sent as an array.
+  const char* request_json =
+      "{\"id\": 1,"
+      " \"set\": {\"1\": 5, \"2\": \"hi\"},"
+      " \"get\": [1, 2],"
+      " \"packed\": true,"
+      " \"destroy\": [1, 2]}";
+  const char* response_json = "{\"id\":1,\"values\":[5,\"hi\"]}\n";
+  RunTest(request_json, response_json);
+}
+
+TEST_F(GeneratorTest, UnknownProgram) {
+  // The request can't be parsed, but still gets an error response with its
+  // id.
+  const char* request_json = "{\"id\": 2, \"program\": 7, \"get\": [1]}";
+
+  request_ = json_to_var(request_json);
+  ASSERT_EQ(PP_VARTYPE_DICTIONARY, request_.type);
+  ASSERT_EQ(NB_FALSE, nb_request_run(NULL, request_, &response_));
+
+  struct PP_Var id_var = nb_var_dict_get(response_, "id");
+  EXPECT_EQ(PP_VARTYPE_INT32, id_var.type);
+  EXPECT_EQ(2, id_var.value.as_int);
+
+  struct PP_Var error_var = nb_var_dict_get(response_, "error");
+  EXPECT_EQ(PP_VARTYPE_INT32, error_var.type);
+  EXPECT_EQ(-1, error_var.value.as_int);
+
+  struct PP_Var values_var = nb_var_dict_get(response_, "values");
+  EXPECT_EQ(PP_VARTYPE_ARRAY, values_var.type);
+  EXPECT_EQ(0U, nb_var_array_length(values_var));
+  nb_var_release(values_var);
+}
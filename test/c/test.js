@@ -37,6 +37,7 @@ describe('C Unit Tests', function() {
     var infiles = [
           path.join(srcdir, 'handle.c'),
           path.join(srcdir, 'interfaces.c'),
+          path.join(srcdir, 'queue.c'),
           path.join(srcdir, 'request.c'),
           path.join(srcdir, 'type.c'),
           path.join(srcdir, 'var.c'),
@@ -45,6 +46,7 @@ describe('C Unit Tests', function() {
           path.join(__dirname, 'main.cc'),
           path.join(__dirname, 'test_handle.cc'),
           path.join(__dirname, 'test_json.cc'),
+          path.join(__dirname, 'test_queue.cc'),
           path.join(__dirname, 'test_request.cc'),
         ];
     var opts = {
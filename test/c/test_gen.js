@@ -160,4 +160,8 @@ describe('C Generator Tests', function() {
   it('should succeed for test_callback', function(done) {
     genAndRun('callback.h', 'callback.c', 'test_callback.cc', done);
   });
+
+  it('should succeed for test_pool', function(done) {
+    genAndRun('pool.h', 'pool.c', 'test_pool.cc', done);
+  });
 });
@@ -12,7 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
 #include <vector>
 #include <gtest/gtest.h>
 #include <ppapi/c/pp_var.h>
@@ -363,7 +368,7 @@ TEST_F(HandleTest, Var) {
   {
     struct PP_Var v = nb_var_buffer_create(10);
     //           i8 u8 i16 u16 i32 u32 i64 u64 f32 f64 vp  v
-    ROW(var, v,   _, _, _,   _,  _,  _,  _,  _,  _,  _, _, O);
+    ROW(var, v,   _, _, _,   _,  _,  _,  _,  _,  _,  _, T, O);
     nb_var_release(v);
   }
 }
@@ -384,6 +389,51 @@ TEST_F(HandleTest, Charp) {
   nb_handle_destroy(1);
 }
 
+TEST_F(HandleTest, Buffer) {
+  struct PP_Var v = nb_var_buffer_create(4);
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(1, v));
+
+  // The buffer's data is used in place, not copied.
+  void* p;
+  char* s;
+  EXPECT_EQ(NB_TRUE, nb_handle_get_voidp(1, &p));
+  memcpy(p, "abc", 4);
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s));
+  EXPECT_EQ(p, s);
+
+  struct PP_Var var;
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_var(1, &var));
+  EXPECT_EQ(PP_VARTYPE_ARRAY_BUFFER, var.type);
+  EXPECT_EQ(v.value.as_id, var.value.as_id);
+  nb_var_release(var);
+
+  nb_handle_destroy(1);
+  EXPECT_STREQ("abc", (char*)nb_var_buffer_map(v));
+  nb_var_buffer_unmap(v);
+  nb_var_release(v);
+}
+
+TEST_F(HandleTest, BufferLength) {
+  struct PP_Var v = nb_var_buffer_create(12);
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(1, v));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_voidp(2, &v));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_int32(3, 12));
+
+  uint32_t length;
+  EXPECT_EQ(NB_TRUE, nb_handle_get_buffer_length(1, &length));
+  EXPECT_EQ(12u, length);
+
+  // Only ArrayBuffer handles have a known length.
+  EXPECT_EQ(NB_FALSE, nb_handle_get_buffer_length(2, &length));
+  EXPECT_EQ(NB_FALSE, nb_handle_get_buffer_length(3, &length));
+  EXPECT_EQ(NB_FALSE, nb_handle_get_buffer_length(4, &length));
+
+  nb_handle_destroy(1);
+  nb_handle_destroy(2);
+  nb_handle_destroy(3);
+  nb_var_release(v);
+}
+
 #define CONVERT_OK(reg, val, pp_type, as)                  \
   {                                                        \
     struct PP_Var var;                                     \
@@ -403,6 +453,120 @@ TEST_F(HandleTest, Charp) {
     nb_handle_destroy(1);                                   \
   }
 
+TEST_F(HandleTest, CharpArena) {
+  std::string big(10000, 'x');
+  struct PP_Var v = nb_var_string_create("hi", 2);
+  struct PP_Var big_v = nb_var_string_create(big.data(), big.size());
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(1, v));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(2, big_v));
+  nb_var_release(v);
+  nb_var_release(big_v);
+
+  NB_HandleArenaMark outer = nb_handle_arena_push();
+  char* s;
+  char* s2;
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s));
+  EXPECT_STREQ("hi", s);
+  // The copy is reused for the rest of the request.
+  s[0] = 'H';
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s2));
+  EXPECT_EQ(s, s2);
+
+  {
+    NB_HandleArenaMark inner = nb_handle_arena_push();
+    EXPECT_EQ(NB_TRUE, nb_handle_get_charp(2, &s2));
+    EXPECT_EQ(big, s2);
+    nb_handle_arena_pop(inner);
+  }
+
+  // Popping a frame invalidates the cached copies.
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s2));
+  EXPECT_STREQ("hi", s2);
+  nb_handle_arena_pop(outer);
+
+  nb_handle_destroy(1);
+  nb_handle_destroy(2);
+  nb_handle_compact();
+}
+
+static void* CharpArenaThread(void*) {
+  NB_HandleArenaMark mark = nb_handle_arena_push();
+  char* s;
+  intptr_t ok = nb_handle_get_charp(2, &s) && strcmp(s, "yo") == 0;
+  nb_handle_arena_pop(mark);
+  return reinterpret_cast<void*>(ok);
+}
+
+TEST_F(HandleTest, CharpArenaThreads) {
+  struct PP_Var v = nb_var_string_create("hi", 2);
+  struct PP_Var v2 = nb_var_string_create("yo", 2);
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(1, v));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(2, v2));
+  nb_var_release(v);
+  nb_var_release(v2);
+
+  NB_HandleArenaMark mark = nb_handle_arena_push();
+  char* s;
+  char* s2;
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s));
+
+  // A request finishing on another thread doesn't invalidate this thread's
+  // copies.
+  pthread_t thread;
+  void* ok;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &CharpArenaThread, NULL));
+  ASSERT_EQ(0, pthread_join(thread, &ok));
+  EXPECT_EQ(reinterpret_cast<void*>(1), ok);
+  EXPECT_EQ(NB_TRUE, nb_handle_get_charp(1, &s2));
+  EXPECT_EQ(s, s2);
+  nb_handle_arena_pop(mark);
+
+  nb_handle_destroy(1);
+  nb_handle_destroy(2);
+  nb_handle_compact();
+}
+
+TEST_F(HandleTest, String) {
+  struct PP_Var v = nb_var_string_create("hello", 5);
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(1, v));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_voidp(2, (void*)"bye"));
+  ASSERT_EQ(NB_TRUE, nb_handle_register_int32(3, 42));
+
+  const char* s;
+  uint32_t len;
+  const char* var_s;
+  uint32_t var_len;
+  ASSERT_EQ(NB_TRUE, nb_var_string(v, &var_s, &var_len));
+  EXPECT_EQ(NB_TRUE, nb_handle_get_string(1, &s, &len));
+  // The string is not copied.
+  EXPECT_EQ(var_s, s);
+  EXPECT_EQ(5, len);
+
+  EXPECT_EQ(NB_TRUE, nb_handle_get_string(2, &s, &len));
+  EXPECT_STREQ("bye", s);
+  EXPECT_EQ(3, len);
+
+  // The length is optional.
+  s = NULL;
+  EXPECT_EQ(NB_TRUE, nb_handle_get_string(2, &s, NULL));
+  EXPECT_STREQ("bye", s);
+
+  EXPECT_EQ(NB_FALSE, nb_handle_get_string(3, &s, &len));
+
+  struct PP_Var b = nb_var_buffer_create(8);
+  ASSERT_EQ(NB_TRUE, nb_handle_register_var(4, b));
+  EXPECT_EQ(NB_TRUE, nb_handle_get_string(4, &s, &len));
+  EXPECT_NE((const char*)NULL, s);
+  EXPECT_EQ(8, len);
+
+  nb_var_release(v);
+  nb_var_release(b);
+  nb_handle_destroy(1);
+  nb_handle_destroy(2);
+  nb_handle_destroy(3);
+  nb_handle_destroy(4);
+}
+
 TEST_F(HandleTest, ConvertToVar) {
   CONVERT_OK(int8, 0x70, PP_VARTYPE_INT32, as_int);
   CONVERT_OK(uint8, 0xf0, PP_VARTYPE_INT32, as_int);
@@ -485,6 +649,48 @@ TEST_F(HandleTest, ConvertToVar) {
   }
 }
 
+TEST_F(HandleTest, ConvertToScalar) {
+  NB_Type type;
+  NB_HandleScalar value;
+  int dummy;
+
+  EXPECT_EQ(NB_TRUE, nb_handle_register_uint16(1, 0xf000));
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_scalar(1, &type, &value));
+  EXPECT_EQ(NB_TYPE_INT32, type);
+  EXPECT_EQ(0xf000, value.int32);
+  nb_handle_destroy(1);
+
+  EXPECT_EQ(NB_TRUE, nb_handle_register_float(1, 3.25));
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_scalar(1, &type, &value));
+  EXPECT_EQ(NB_TYPE_DOUBLE, type);
+  EXPECT_EQ(3.25, value.float64);
+  nb_handle_destroy(1);
+
+  EXPECT_EQ(NB_TRUE, nb_handle_register_uint64(1, 0xf00000000000000fLL));
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_scalar(1, &type, &value));
+  EXPECT_EQ(NB_TYPE_INT64, type);
+  EXPECT_EQ((int64_t)0xf00000000000000fLL, value.int64);
+  nb_handle_destroy(1);
+
+  EXPECT_EQ(NB_TRUE, nb_handle_register_voidp(1, &dummy));
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_scalar(1, &type, &value));
+  EXPECT_EQ(NB_TYPE_INT32, type);
+  EXPECT_EQ(1, value.int32);
+  nb_handle_destroy(1);
+
+  EXPECT_EQ(NB_TRUE, nb_handle_register_voidp(1, NULL));
+  EXPECT_EQ(NB_TRUE, nb_handle_convert_to_scalar(1, &type, &value));
+  EXPECT_EQ(NB_TYPE_INVALID, type);
+  nb_handle_destroy(1);
+
+  // Vars can't be converted to scalars.
+  struct PP_Var dummy_var = nb_var_array_create();
+  EXPECT_EQ(NB_TRUE, nb_handle_register_var(1, dummy_var));
+  EXPECT_EQ(NB_FALSE, nb_handle_convert_to_scalar(1, &type, &value));
+  nb_var_release(dummy_var);
+  nb_handle_destroy(1);
+}
+
 class HandleStressTest : public HandleTest {};
 
 TEST_F(HandleStressTest, Basic) {
@@ -526,3 +732,350 @@ TEST_F(HandleStressTest, OneHandle) {
     nb_handle_destroy(1);
   }
 }
+
+TEST_F(HandleStressTest, SlidingWindow) {
+  // Handle 1 stays alive while the window of live handles slides far past it.
+  const int window = 100;
+  const int count = 100000;
+  ASSERT_EQ(NB_TRUE, nb_handle_register_int32(1, 42));
+  for (NB_Handle handle = 2; handle < count; ++handle) {
+    ASSERT_EQ(NB_TRUE, nb_handle_register_int32(handle, handle));
+    if (handle - window >= 2) {
+      nb_handle_destroy(handle - window);
+    }
+  }
+
+  // Handle 1 has been moved out of the way, but is still registered.
+  EXPECT_EQ(NB_FALSE, nb_handle_register_int32(1, 0));
+  int32_t val;
+  ASSERT_EQ(NB_TRUE, nb_handle_get_int32(1, &val));
+  EXPECT_EQ(42, val);
+  EXPECT_EQ(window + 1, nb_handle_count());
+
+  nb_handle_destroy(1);
+  for (NB_Handle handle = count - window; handle < count; ++handle) {
+    nb_handle_destroy(handle);
+  }
+}
+
+TEST_F(HandleStressTest, Sparse) {
+  // Every one of these handles maps to the same slot.
+  const int count = 1000;
+  for (int i = 1; i <= count; ++i) {
+    ASSERT_EQ(NB_TRUE, nb_handle_register_int32(i << 16, i));
+  }
+
+  for (int i = 1; i <= count; ++i) {
+    int32_t val;
+    ASSERT_EQ(NB_TRUE, nb_handle_get_int32(i << 16, &val));
+    ASSERT_EQ(i, val);
+  }
+
+  for (int i = count; i >= 1; --i) {
+    nb_handle_destroy(i << 16);
+  }
+}
+
+TEST_F(HandleStressTest, DestroyMany) {
+  // Mix dense handles with sparse ones, which don't fit in the slot table.
+  const int count = 10000;
+  unsigned int seed = 0xface;
+  struct PP_Var var = nb_var_string_create("hello", 5);
+  std::vector<NB_Handle> handles;
+  for (int i = 1; i <= count; ++i) {
+    NB_Handle handle = (i % 10 == 0) ? (i << 12) : i;
+    if (i % 3 == 0) {
+      ASSERT_EQ(NB_TRUE, nb_handle_register_var(handle, var));
+    } else {
+      ASSERT_EQ(NB_TRUE, nb_handle_register_int32(handle, i));
+    }
+    handles.push_back(handle);
+  }
+  nb_var_release(var);
+
+  for (int i = count - 1; i > 0; --i) {
+    std::swap(handles[i], handles[rand_r(&seed) % (i + 1)]);
+  }
+
+  // Destroy half, then make sure the rest are still reachable.
+  size_t half = handles.size() / 2;
+  nb_handle_destroy_many(handles.data(), half);
+  EXPECT_EQ(count - half, nb_handle_count());
+  for (size_t i = half; i < handles.size(); ++i) {
+    void* val;
+    int32_t ival;
+    ASSERT_TRUE(nb_handle_get_voidp(handles[i], &val) ||
+                nb_handle_get_int32(handles[i], &ival));
+  }
+
+  // Destroying a handle twice, or one that doesn't exist, is not fatal.
+  handles.push_back(handles.back());
+  handles.push_back(count + 1);
+  nb_handle_destroy_many(&handles[half], handles.size() - half);
+}
+
+TEST_F(HandleTest, Ephemeral) {
+  struct PP_Var var = nb_var_string_create("hello", 5);
+  NB_HandleArenaMark mark = nb_handle_arena_push();
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1, 42));
+  EXPECT_EQ(NB_FALSE, nb_handle_register_int32(-1, 42));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_var(-3, var));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(1, 1));
+  EXPECT_EQ(3, nb_handle_count());
+  nb_var_release(var);
+
+  { EXPECT_GET(int32_t, int32, -1, 42); }
+  { EXPECT_FAIL(int32_t, int32, -2); }
+
+  // Popping the arena destroys all ephemeral handles, but no others.
+  nb_handle_arena_pop(mark);
+  EXPECT_EQ(1, nb_handle_count());
+  nb_handle_destroy(1);
+}
+
+TEST_F(HandleTest, EphemeralNested) {
+  NB_HandleArenaMark outer = nb_handle_arena_push();
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1, 1));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-2, 2));
+
+  {
+    // A nested request can reuse the same ids.
+    NB_HandleArenaMark inner = nb_handle_arena_push();
+    { EXPECT_FAIL(int32_t, int32, -2); }
+    EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1, 10));
+    { EXPECT_GET(int32_t, int32, -1, 10); }
+    nb_handle_arena_pop(inner);
+  }
+
+  EXPECT_EQ(2, nb_handle_count());
+  { EXPECT_GET(int32_t, int32, -1, 1); }
+  nb_handle_destroy(-2);
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1000, 1000));
+  nb_handle_arena_pop(outer);
+}
+
+TEST_F(HandleTest, EphemeralOutOfRange) {
+  NB_HandleArenaMark outer = nb_handle_arena_push();
+  EXPECT_EQ(NB_FALSE, nb_handle_register_int32(-2000000000, 1));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1, 1));
+
+  {
+    // The nested frame starts above the outer one, so the arena index of the
+    // most negative id doesn't fit in an int32.
+    NB_HandleArenaMark inner = nb_handle_arena_push();
+    EXPECT_EQ(NB_FALSE, nb_handle_register_int32(-0x7fffffff - 1, 2));
+    EXPECT_EQ(NB_TRUE, nb_handle_register_int32(-1, 2));
+    { EXPECT_FAIL(int32_t, int32, -2000000000); }
+    nb_handle_arena_pop(inner);
+  }
+
+  EXPECT_EQ(1, nb_handle_count());
+  nb_handle_arena_pop(outer);
+}
+
+TEST_F(HandleTest, DestroyManySkipsMissing) {
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(1, 10));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(3, 30));
+
+  NB_Handle to_destroy[] = {1, 2, 3};
+  nb_handle_destroy_many(&to_destroy[0], 3);
+  EXPECT_EQ(0, nb_handle_count());
+}
+
+TEST_F(HandleTest, Move) {
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(1, 10));
+  EXPECT_EQ(NB_TRUE, nb_handle_register_int32(2, 20));
+
+  // Moving replaces the value of |to|, and destroys |from|.
+  EXPECT_EQ(NB_TRUE, nb_handle_move(1, 2));
+  { EXPECT_GET(int32_t, int32, 2, 10); }
+  { EXPECT_FAIL(int32_t, int32, 1); }
+  EXPECT_EQ(1, nb_handle_count());
+
+  // A failed move leaves |to| alone.
+  EXPECT_EQ(NB_FALSE, nb_handle_move(3, 2));
+  { EXPECT_GET(int32_t, int32, 2, 10); }
+  EXPECT_EQ(NB_FALSE, nb_handle_move(2, 2));
+  { EXPECT_GET(int32_t, int32, 2, 10); }
+  // Out of range of the handle arena.
+  EXPECT_EQ(NB_FALSE, nb_handle_move(2, -(1 << 23)));
+  { EXPECT_GET(int32_t, int32, 2, 10); }
+
+  // |to| doesn't have to exist.
+  EXPECT_EQ(NB_TRUE, nb_handle_move(2, 4));
+  { EXPECT_GET(int32_t, int32, 4, 10); }
+  nb_handle_destroy(4);
+}
+
+TEST_F(HandleStressTest, ShrinkAndCompact) {
+  // Grow the tables with a burst of handles, then destroy most of them.
+  const int count = 100000;
+  std::vector<NB_Handle> handles;
+  for (int i = 1; i <= count; ++i) {
+    ASSERT_EQ(NB_TRUE, nb_handle_register_int32(i, i));
+    if (i % 1000 != 0) {
+      handles.push_back(i);
+    }
+  }
+
+  nb_handle_destroy_many(handles.data(), handles.size());
+  EXPECT_EQ(count / 1000, nb_handle_count());
+
+  // Add some sparse handles that can't live in the slot table.
+  for (int i = 1; i <= 100; ++i) {
+    ASSERT_EQ(NB_TRUE, nb_handle_register_int32(count + (i << 16), i));
+  }
+
+  nb_handle_compact();
+  EXPECT_EQ(count / 1000 + 100, nb_handle_count());
+
+  for (int i = 1000; i <= count; i += 1000) {
+    int32_t val;
+    ASSERT_EQ(NB_TRUE, nb_handle_get_int32(i, &val));
+    EXPECT_EQ(i, val);
+    nb_handle_destroy(i);
+  }
+
+  for (int i = 1; i <= 100; ++i) {
+    int32_t val;
+    ASSERT_EQ(NB_TRUE, nb_handle_get_int32(count + (i << 16), &val));
+    EXPECT_EQ(i, val);
+    nb_handle_destroy(count + (i << 16));
+  }
+
+  nb_handle_compact();
+}
+
+static void* HandleThread(void* user_data) {
+  intptr_t thread_index = reinterpret_cast<intptr_t>(user_data);
+  intptr_t failures = 0;
+  for (int round = 0; round < 200; ++round) {
+    NB_HandleArenaMark mark = nb_handle_arena_push();
+    NB_Handle base = thread_index * 1000000 + round * 100 + 1;
+    for (int i = 0; i < 50; ++i) {
+      failures += !nb_handle_register_int32(base + i, i);
+      // Every thread uses the same request-scoped ids.
+      failures += !nb_handle_register_int32(-1 - i, thread_index);
+    }
+
+    for (int i = 0; i < 50; ++i) {
+      int32_t value;
+      failures += !nb_handle_get_int32(base + i, &value) || value != i;
+      failures += !nb_handle_get_int32(-1 - i, &value) ||
+                  value != thread_index;
+    }
+
+    for (int i = 0; i < 50; ++i) {
+      nb_handle_destroy(base + i);
+    }
+    nb_handle_arena_pop(mark);
+  }
+  return reinterpret_cast<void*>(failures);
+}
+
+TEST_F(HandleStressTest, Threaded) {
+  const int kThreadCount = 4;
+  pthread_t threads[kThreadCount];
+
+  nb_handle_set_thread_safe();
+  for (intptr_t i = 0; i < kThreadCount; ++i) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, &HandleThread,
+                                reinterpret_cast<void*>(i)));
+  }
+
+  for (int i = 0; i < kThreadCount; ++i) {
+    void* failures;
+    ASSERT_EQ(0, pthread_join(threads[i], &failures));
+    EXPECT_EQ(NULL, failures);
+  }
+}
+
+static double NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Not run by default; pass --gtest_also_run_disabled_tests to run it. Every
+// eighth handle is a var, which is registered and destroyed outside of the
+// timed sections since the fake var interface logs each reference change.
+TEST_F(HandleStressTest, DISABLED_Benchmark) {
+  const int count = 1 << 18;
+  const int lookups = 1 << 22;
+  unsigned int seed = 0xface;
+  std::vector<NB_Handle> handles;
+  std::vector<NB_Handle> var_handles;
+  for (int i = 1; i <= count; ++i) {
+    // Mostly dense ids, with a few sparse ones that go to the overflow map.
+    NB_Handle handle = (i % 64 == 0) ? (i << 8) : i;
+    if (i % 8 == 0) {
+      var_handles.push_back(handle);
+    } else {
+      handles.push_back(handle);
+    }
+  }
+
+  double start = NowMs();
+  for (size_t i = 0; i < handles.size(); ++i) {
+    if (i % 3 == 0) {
+      ASSERT_EQ(NB_TRUE, nb_handle_register_double(handles[i], i));
+    } else {
+      ASSERT_EQ(NB_TRUE, nb_handle_register_int32(handles[i], i));
+    }
+  }
+  double register_ms = NowMs() - start;
+
+  struct PP_Var var = nb_var_string_create("hello", 5);
+  for (size_t i = 0; i < var_handles.size(); ++i) {
+    ASSERT_EQ(NB_TRUE, nb_handle_register_var(var_handles[i], var));
+  }
+  nb_var_release(var);
+
+  std::vector<int> order(lookups);
+  for (int i = 0; i < lookups; ++i) {
+    order[i] = rand_r(&seed) % count;
+  }
+
+  start = NowMs();
+  double sum = 0;
+  for (int i = 0; i < lookups; ++i) {
+    int index = order[i];
+    if (index % 8 == 0) {
+      struct PP_Var v;
+      ASSERT_EQ(NB_TRUE, nb_handle_get_var(var_handles[index / 8], &v));
+      sum += v.type;
+    } else {
+      double d;
+      ASSERT_EQ(NB_TRUE,
+                nb_handle_get_double(handles[index - index / 8 - 1], &d));
+      sum += d;
+    }
+  }
+  double lookup_ms = NowMs() - start;
+
+  // Requests usually read handles in the order they were created.
+  start = NowMs();
+  for (int i = 0; i < lookups / (int)handles.size(); ++i) {
+    for (size_t j = 0; j < handles.size(); ++j) {
+      double d;
+      ASSERT_EQ(NB_TRUE, nb_handle_get_double(handles[j], &d));
+      sum += d;
+    }
+  }
+  double sequential_ms = NowMs() - start;
+
+  nb_handle_destroy_many(var_handles.data(), var_handles.size());
+  start = NowMs();
+  nb_handle_destroy_many(handles.data(), handles.size());
+  double destroy_ms = NowMs() - start;
+
+  printf("register:          %.1f ns/handle\n",
+         register_ms * 1e6 / handles.size());
+  printf("random lookup:     %.1f ns/handle\n", lookup_ms * 1e6 / lookups);
+  printf("sequential lookup: %.1f ns/handle (checksum %g)\n",
+         sequential_ms * 1e6 /
+             (lookups / handles.size() * handles.size()),
+         sum);
+  printf("destroy:           %.1f ns/handle\n",
+         destroy_ms * 1e6 / handles.size());
+}
@@ -0,0 +1,307 @@
+// Copyright 2014 Ben Smith. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <ppapi/c/pp_var.h>
+#include "fake_interfaces.h"
+#include "queue.h"
+#include "var.h"
+
+class QueueTest : public ::testing::Test {
+ public:
+  QueueTest() : queue(NULL) {}
+
+  virtual void TearDown() {
+    if (queue) {
+      nb_queue_destroy(queue);
+    }
+
+    EXPECT_EQ(NB_TRUE, fake_interface_check_no_references());
+  }
+
+ protected:
+  struct NB_Queue* queue;
+};
+
+TEST_F(QueueTest, Basic) {
+  queue = nb_queue_create(4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  // The queue is full, so the message is dropped.
+  EXPECT_EQ(0, nb_queue_enqueue(queue, PP_MakeInt32(4)));
+
+  for (int i = 0; i < 4; ++i) {
+    struct PP_Var var = nb_queue_dequeue(queue);
+    EXPECT_EQ(PP_VARTYPE_INT32, var.type);
+    EXPECT_EQ(i, var.value.as_int);
+  }
+
+  // Wrap around the ring.
+  EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(5)));
+  EXPECT_EQ(5, nb_queue_dequeue(queue).value.as_int);
+}
+
+TEST_F(QueueTest, TakesReference) {
+  queue = nb_queue_create(4);
+  struct PP_Var var = nb_var_string_create("hi", 2);
+  EXPECT_EQ(1, nb_queue_enqueue(queue, var));
+  nb_var_release(var);
+
+  struct PP_Var dequeued = nb_queue_dequeue(queue);
+  EXPECT_EQ(var.value.as_id, dequeued.value.as_id);
+  nb_var_release(dequeued);
+}
+
+TEST_F(QueueTest, Grow) {
+  queue = nb_queue_create(100);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  // The queue has grown to the hard cap.
+  EXPECT_EQ(100, nb_queue_size(queue));
+  EXPECT_EQ(0, nb_queue_enqueue(queue, PP_MakeInt32(100)));
+
+  for (int i = 0; i < 50; ++i) {
+    EXPECT_EQ(i, nb_queue_dequeue(queue).value.as_int);
+  }
+
+  for (int i = 100; i < 150; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  for (int i = 50; i < 150; ++i) {
+    EXPECT_EQ(i, nb_queue_dequeue(queue).value.as_int);
+  }
+  EXPECT_EQ(0, nb_queue_size(queue));
+}
+
+TEST_F(QueueTest, Unbounded) {
+  queue = nb_queue_create(4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  // Unbounded messages go past the hard cap, and bounded ones still don't.
+  EXPECT_EQ(1, nb_queue_enqueue_unbounded(queue, PP_MakeInt32(4)));
+  EXPECT_EQ(1, nb_queue_enqueue_unbounded(queue, PP_MakeInt32(5)));
+  EXPECT_EQ(6, nb_queue_size(queue));
+  EXPECT_EQ(0, nb_queue_enqueue(queue, PP_MakeInt32(6)));
+
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(i, nb_queue_dequeue(queue).value.as_int);
+  }
+}
+
+TEST_F(QueueTest, DequeueBatch) {
+  queue = nb_queue_create(8);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  struct PP_Var messages[8];
+  EXPECT_EQ(3, nb_queue_dequeue_batch(queue, messages, 3));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(i, messages[i].value.as_int);
+  }
+
+  EXPECT_EQ(2, nb_queue_dequeue_batch(queue, messages, 8));
+  EXPECT_EQ(3, messages[0].value.as_int);
+  EXPECT_EQ(4, messages[1].value.as_int);
+  EXPECT_EQ(0, nb_queue_size(queue));
+}
+
+TEST_F(QueueTest, Stats) {
+  queue = nb_queue_create(4);
+  for (int i = 0; i < 5; ++i) {
+    nb_queue_enqueue(queue, PP_MakeInt32(i));
+  }
+  nb_queue_dequeue(queue);
+
+  struct NB_QueueStats stats;
+  nb_queue_get_stats(queue, &stats);
+  EXPECT_EQ(3, stats.size);
+  EXPECT_EQ(4, stats.max_size);
+  EXPECT_EQ(4, stats.max_depth);
+  EXPECT_EQ(4, stats.enqueued);
+  EXPECT_EQ(1, stats.dequeued);
+  EXPECT_EQ(1, stats.dropped);
+
+  for (int i = 0; i < 3; ++i) {
+    nb_queue_dequeue(queue);
+  }
+}
+
+static std::vector<int> s_watermarks;
+
+static void RecordWatermark(struct NB_Queue* queue,
+                            int above_high_water,
+                            void* user_data) {
+  s_watermarks.push_back(above_high_water);
+}
+
+TEST_F(QueueTest, Watermarks) {
+  s_watermarks.clear();
+  queue = nb_queue_create(8);
+  nb_queue_set_watermarks(queue, 2, 6, &RecordWatermark, NULL);
+
+  for (int i = 0; i < 5; ++i) {
+    nb_queue_enqueue(queue, PP_MakeInt32(i));
+  }
+  EXPECT_EQ(0, s_watermarks.size());
+
+  nb_queue_enqueue(queue, PP_MakeInt32(5));
+  ASSERT_EQ(1, s_watermarks.size());
+  EXPECT_EQ(1, s_watermarks[0]);
+
+  // Only called again after dropping to the low-water mark.
+  nb_queue_enqueue(queue, PP_MakeInt32(6));
+  for (int i = 0; i < 4; ++i) {
+    nb_queue_dequeue(queue);
+  }
+  EXPECT_EQ(1, s_watermarks.size());
+
+  nb_queue_dequeue(queue);
+  ASSERT_EQ(2, s_watermarks.size());
+  EXPECT_EQ(0, s_watermarks[1]);
+
+  nb_queue_dequeue(queue);
+  nb_queue_dequeue(queue);
+  EXPECT_EQ(2, s_watermarks.size());
+}
+
+static const int kThreadedCount = 100000;
+
+static void* ConsumerThread(void* user_data) {
+  struct NB_Queue* queue = static_cast<struct NB_Queue*>(user_data);
+  for (int i = 0; i < kThreadedCount; ++i) {
+    struct PP_Var var = nb_queue_dequeue(queue);
+    if (var.value.as_int != i) {
+      return reinterpret_cast<void*>(1);
+    }
+  }
+  return NULL;
+}
+
+TEST_F(QueueTest, Threaded) {
+  queue = nb_queue_create(16);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &ConsumerThread, queue));
+
+  // Retry dropped messages, so the consumer has to sleep and be woken up
+  // both when the queue is empty and when it is full.
+  for (int i = 0; i < kThreadedCount; ++i) {
+    while (!nb_queue_enqueue(queue, PP_MakeInt32(i))) {
+      sched_yield();
+    }
+  }
+
+  void* result;
+  ASSERT_EQ(0, pthread_join(thread, &result));
+  EXPECT_EQ(NULL, result);
+}
+
+TEST_F(QueueTest, ThreadedGrow) {
+  queue = nb_queue_create(kThreadedCount);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &ConsumerThread, queue));
+
+  // The queue is big enough to never drop a message, so it grows whenever the
+  // producer gets ahead of the consumer.
+  for (int i = 0; i < kThreadedCount; ++i) {
+    EXPECT_EQ(1, nb_queue_enqueue(queue, PP_MakeInt32(i)));
+  }
+
+  void* result;
+  ASSERT_EQ(0, pthread_join(thread, &result));
+  EXPECT_EQ(NULL, result);
+}
+
+static const int kThreadedStuckSpins = 100000;
+static volatile int s_threaded_watermark;
+static volatile int s_threaded_watermark_repeated;
+
+static void RecordThreadedWatermark(struct NB_Queue* queue,
+                                    int above_high_water,
+                                    void* user_data) {
+  // Serialized by the queue, and only called when the state changes.
+  if (above_high_water == s_threaded_watermark) {
+    s_threaded_watermark_repeated = 1;
+  }
+  s_threaded_watermark = above_high_water;
+}
+
+static void* BatchConsumerThread(void* user_data) {
+  struct NB_Queue* queue = static_cast<struct NB_Queue*>(user_data);
+  struct PP_Var messages[3];
+  int expected = 0;
+  while (expected < kThreadedCount) {
+    uint32_t count = nb_queue_dequeue_batch(queue, messages, 3);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (messages[i].value.as_int != expected++) {
+        return reinterpret_cast<void*>(1);
+      }
+    }
+
+    if (nb_queue_size(queue) > nb_queue_max_size(queue)) {
+      return reinterpret_cast<void*>(2);
+    }
+  }
+  return NULL;
+}
+
+TEST_F(QueueTest, ThreadedWatermarks) {
+  s_threaded_watermark = 0;
+  s_threaded_watermark_repeated = 0;
+  queue = nb_queue_create(8);
+  // Tight watermarks, so both threads cross them all the time.
+  nb_queue_set_watermarks(queue, 1, 2, &RecordThreadedWatermark, NULL);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &BatchConsumerThread, queue));
+
+  // Like the page, stop sending while throttled. If the queue is empty and
+  // stays throttled, nothing will ever unthrottle it, so give up waiting and
+  // fail.
+  int stuck = 0;
+  for (int i = 0; i < kThreadedCount; ++i) {
+    int empty_spins = 0;
+    while (!stuck && s_threaded_watermark) {
+      if (nb_queue_size(queue) != 0) {
+        empty_spins = 0;
+      } else if (++empty_spins == kThreadedStuckSpins) {
+        stuck = 1;
+      }
+      sched_yield();
+    }
+
+    while (!nb_queue_enqueue(queue, PP_MakeInt32(i))) {
+      sched_yield();
+    }
+  }
+
+  void* result;
+  ASSERT_EQ(0, pthread_join(thread, &result));
+  EXPECT_EQ(NULL, result);
+
+  // The queue is drained, so the last report must have been below the
+  // low-water mark.
+  EXPECT_EQ(0, stuck);
+  EXPECT_EQ(0, nb_queue_size(queue));
+  EXPECT_EQ(0, s_threaded_watermark);
+  EXPECT_EQ(0, s_threaded_watermark_repeated);
+}
@@ -12,6 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 #include <ppapi/c/pp_var.h>
 #include "fake_interfaces.h"
@@ -37,6 +42,20 @@ class RequestTest : public ::testing::Test {
     nb_var_release(var);
   }
 
+  void WordsToRequest(const std::vector<int32_t>& words) {
+    if (request) {
+      nb_request_destroy(request);
+    }
+
+    uint32_t size = words.size() * sizeof(int32_t);
+    struct PP_Var var = nb_var_buffer_create(size);
+    memcpy(nb_var_buffer_map(var), words.data(), size);
+    nb_var_buffer_unmap(var);
+
+    request = nb_request_parse(var);
+    nb_var_release(var);
+  }
+
   virtual void TearDown() {
     if (request) {
       nb_request_destroy(request);
@@ -189,6 +208,31 @@ TEST_F(RequestTest, SetHandles_String) {
   nb_var_release(value);
 }
 
+TEST_F(RequestTest, SetHandles_Buffer) {
+  struct PP_Var var = json_to_var("{\"id\": 1}");
+  struct PP_Var set = nb_var_dict_create();
+  struct PP_Var buffer = nb_var_buffer_create(8);
+  ASSERT_EQ(NB_TRUE, nb_var_dict_set(set, "1", buffer));
+  ASSERT_EQ(NB_TRUE, nb_var_dict_set(var, "set", set));
+  nb_var_release(set);
+
+  request = nb_request_parse(var);
+  nb_var_release(var);
+  ASSERT_NE(NULL_REQUEST, request);
+
+  EXPECT_EQ(1, nb_request_sethandles_count(request));
+
+  NB_Handle handle;
+  struct PP_Var value;
+
+  nb_request_sethandle(request, 0, &handle, &value);
+  EXPECT_EQ(1, handle);
+  EXPECT_EQ(PP_VARTYPE_ARRAY_BUFFER, value.type);
+  EXPECT_EQ(buffer.value.as_id, value.value.as_id);
+  nb_var_release(value);
+  nb_var_release(buffer);
+}
+
 TEST_F(RequestTest, SetHandles_Null) {
   const char* json = "{\"id\": 1, \"set\": {\"1\": null}}";
   JsonToRequest(json);
@@ -264,6 +308,19 @@ TEST_F(RequestTest, SetHandles_Function) {
   nb_var_release(value);
 }
 
+TEST_F(RequestTest, Packed) {
+  JsonToRequest("{\"id\": 1}");
+  ASSERT_NE(NULL_REQUEST, request);
+  EXPECT_EQ(NB_FALSE, nb_request_packed_values(request));
+
+  JsonToRequest("{\"id\": 1, \"packed\": true}");
+  ASSERT_NE(NULL_REQUEST, request);
+  EXPECT_EQ(NB_TRUE, nb_request_packed_values(request));
+
+  JsonToRequest("{\"id\": 1, \"packed\": 1}");
+  EXPECT_EQ(NULL_REQUEST, request);
+}
+
 TEST_F(RequestTest, GetHandles) {
   const char* json = "{\"id\": 1, \"get\": [4, 5, 100]}";
   JsonToRequest(json);
@@ -306,3 +363,276 @@ TEST_F(RequestTest, Commands) {
   EXPECT_EQ(NB_TRUE, nb_request_command_has_ret(request, 0));
   EXPECT_EQ(5, nb_request_command_ret(request, 0));
 }
+
+static const int32_t kBinaryMagic = 0x3152424e;
+
+static void PushDouble(std::vector<int32_t>* words, double value) {
+  int32_t halves[2];
+  memcpy(halves, &value, sizeof(value));
+  words->push_back(halves[0]);
+  words->push_back(halves[1]);
+}
+
+TEST_F(RequestTest, Binary) {
+  // header: magic, id, flags, prepare, program, set, commands, args, get,
+  // destroy
+  int32_t header[] = {kBinaryMagic, 3, 1, 0, 0, 4, 2, 3, 1, 2};
+  std::vector<int32_t> words(header, header + 10);
+  // set: 1 = 42, 2 = 3.5, 3 = long(0, 1), 4 = null
+  words.push_back(1); words.push_back(0); words.push_back(42);
+  words.push_back(2); words.push_back(1); PushDouble(&words, 3.5);
+  words.push_back(3); words.push_back(2); words.push_back(0);
+  words.push_back(1);
+  words.push_back(4); words.push_back(3);
+  // commands: 7(1, 2) -> 5, 8(5) -> none
+  words.push_back(7); words.push_back(5); words.push_back(2);
+  words.push_back(1); words.push_back(2);
+  words.push_back(8); words.push_back(0); words.push_back(1);
+  words.push_back(5);
+  // get, destroy
+  words.push_back(5);
+  words.push_back(1); words.push_back(2);
+
+  WordsToRequest(words);
+  ASSERT_NE(NULL_REQUEST, request);
+
+  EXPECT_EQ(3, nb_request_id(request));
+  EXPECT_EQ(NB_TRUE, nb_request_packed_values(request));
+  ASSERT_EQ(4, nb_request_sethandles_count(request));
+
+  NB_Handle handle;
+  struct PP_Var value;
+  int64_t i64_value;
+
+  nb_request_sethandle(request, 0, &handle, &value);
+  EXPECT_EQ(1, handle);
+  EXPECT_EQ(PP_VARTYPE_INT32, value.type);
+  EXPECT_EQ(42, value.value.as_int);
+
+  nb_request_sethandle(request, 1, &handle, &value);
+  EXPECT_EQ(2, handle);
+  EXPECT_EQ(PP_VARTYPE_DOUBLE, value.type);
+  EXPECT_EQ(3.5, value.value.as_double);
+
+  nb_request_sethandle(request, 2, &handle, &value);
+  EXPECT_EQ(3, handle);
+  EXPECT_EQ(NB_TRUE, nb_var_int64(value, &i64_value));
+  EXPECT_EQ(0x100000000LL, i64_value);
+  nb_var_release(value);
+
+  nb_request_sethandle(request, 3, &handle, &value);
+  EXPECT_EQ(4, handle);
+  EXPECT_EQ(PP_VARTYPE_NULL, value.type);
+
+  ASSERT_EQ(2, nb_request_commands_count(request));
+  EXPECT_EQ(7, nb_request_command_function(request, 0));
+  EXPECT_EQ(2, nb_request_command_arg_count(request, 0));
+  EXPECT_EQ(1, nb_request_command_arg(request, 0, 0));
+  EXPECT_EQ(2, nb_request_command_arg(request, 0, 1));
+  EXPECT_EQ(NB_TRUE, nb_request_command_has_ret(request, 0));
+  EXPECT_EQ(5, nb_request_command_ret(request, 0));
+  EXPECT_EQ(8, nb_request_command_function(request, 1));
+  EXPECT_EQ(1, nb_request_command_arg_count(request, 1));
+  EXPECT_EQ(5, nb_request_command_arg(request, 1, 0));
+  EXPECT_EQ(NB_FALSE, nb_request_command_has_ret(request, 1));
+
+  ASSERT_EQ(1, nb_request_gethandles_count(request));
+  EXPECT_EQ(5, nb_request_gethandle(request, 0));
+  ASSERT_EQ(2, nb_request_destroyhandles_count(request));
+  EXPECT_EQ(1, nb_request_destroyhandle(request, 0));
+  EXPECT_EQ(2, nb_request_destroyhandle(request, 1));
+}
+
+TEST_F(RequestTest, Binary_Invalid) {
+  const int32_t M = kBinaryMagic;
+  const int32_t invalid_requests[][15] = {
+    // Bad magic
+    {7, 1, 0, 0, 0, 0, 0, 0, 0, 0},
+    // id must be > 0
+    {M, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    // Count larger than the buffer
+    {M, 1, 0, 0, 0, 0, 0, 0, 1000, 0},
+    // Negative count
+    {M, 1, 0, 0, 0, 0, 0, 0, -1, 0},
+    // Unknown set value tag
+    {M, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 9, 0},
+    // Truncated double
+    {M, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 0},
+    // Command uses more args than the header says
+    {M, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 2},
+    // Command uses fewer args than the header says
+    {M, 1, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0, 2},
+    // Unknown program
+    {M, 1, 0, 0, 1000, 0, 0, 0, 0, 0},
+    // Trailing data
+    {M, 1, 0, 0, 0, 0, 0, 0, 1, 0, 1, 2},
+  };
+  const size_t invalid_sizes[] = {10, 10, 10, 10, 13, 13, 14, 14, 10, 12};
+
+  for (size_t i = 0; i < sizeof(invalid_sizes) / sizeof(invalid_sizes[0]);
+       ++i) {
+    std::vector<int32_t> words(invalid_requests[i],
+                               invalid_requests[i] + invalid_sizes[i]);
+    WordsToRequest(words);
+    EXPECT_EQ(NULL_REQUEST, request) << "Expected invalid: " << i;
+  }
+}
+
+TEST_F(RequestTest, VarId) {
+  struct PP_Var var;
+
+  var = json_to_var("{\"id\": 3, \"get\": [1]}");
+  EXPECT_EQ(3, nb_request_var_id(var));
+  nb_var_release(var);
+
+  // Callback results aren't requests.
+  var = json_to_var("{\"id\": 3, \"cbId\": 1, \"values\": []}");
+  EXPECT_EQ(0, nb_request_var_id(var));
+  nb_var_release(var);
+
+  var = json_to_var("{\"id\": -1}");
+  EXPECT_EQ(0, nb_request_var_id(var));
+  nb_var_release(var);
+
+  int32_t words[] = {kBinaryMagic, 5, 0, 0, 0, 0, 0, 0, 0, 0};
+  var = nb_var_buffer_create(sizeof(words));
+  memcpy(nb_var_buffer_map(var), words, sizeof(words));
+  nb_var_buffer_unmap(var);
+  EXPECT_EQ(5, nb_request_var_id(var));
+  nb_var_release(var);
+
+  // Too short to hold an id.
+  var = nb_var_buffer_create(4);
+  EXPECT_EQ(0, nb_request_var_id(var));
+  nb_var_release(var);
+}
+
+TEST_F(RequestTest, Programs) {
+  JsonToRequest(
+      "{\"id\": 1, \"prepare\": 3,"
+      " \"commands\": [{\"id\": 1, \"args\": [-1, -2], \"ret\": -3},"
+      "                {\"id\": 2, \"args\": [-3]}]}");
+  ASSERT_NE(NULL_REQUEST, request);
+  // The commands are stored, not run.
+  EXPECT_EQ(0, nb_request_commands_count(request));
+
+  JsonToRequest("{\"id\": 2, \"program\": 3, \"set\": {\"-1\": 4}}");
+  ASSERT_NE(NULL_REQUEST, request);
+  EXPECT_EQ(1, nb_request_sethandles_count(request));
+  ASSERT_EQ(2, nb_request_commands_count(request));
+  EXPECT_EQ(1, nb_request_command_function(request, 0));
+  EXPECT_EQ(2, nb_request_command_arg_count(request, 0));
+  EXPECT_EQ(-1, nb_request_command_arg(request, 0, 0));
+  EXPECT_EQ(-2, nb_request_command_arg(request, 0, 1));
+  EXPECT_EQ(-3, nb_request_command_ret(request, 0));
+  EXPECT_EQ(2, nb_request_command_function(request, 1));
+  EXPECT_EQ(-3, nb_request_command_arg(request, 1, 0));
+  EXPECT_EQ(NB_FALSE, nb_request_command_has_ret(request, 1));
+
+  // A request that uses a program can't have commands of its own.
+  struct NB_Request* in_use = request;
+  request = NULL;
+  JsonToRequest(
+      "{\"id\": 3, \"program\": 3,"
+      " \"commands\": [{\"id\": 1, \"args\": []}]}");
+  EXPECT_EQ(NULL_REQUEST, request);
+
+  // Unpreparing the program keeps it alive for requests that use it.
+  JsonToRequest("{\"id\": 4, \"unprepare\": [3]}");
+  ASSERT_NE(NULL_REQUEST, request);
+  EXPECT_EQ(1, nb_request_command_function(in_use, 0));
+  nb_request_destroy(in_use);
+
+  JsonToRequest("{\"id\": 5, \"program\": 3}");
+  EXPECT_EQ(NULL_REQUEST, request);
+}
+
+TEST_F(RequestTest, Programs_InvalidId) {
+  const char* invalid_requests[] = {
+    "{\"id\": 1, \"prepare\": 0, \"commands\": []}",
+    "{\"id\": 1, \"prepare\": -1, \"commands\": []}",
+    // The program table is bounded.
+    "{\"id\": 1, \"prepare\": 1048577, \"commands\": []}",
+    "{\"id\": 1, \"unprepare\": [2147483647]}",
+  };
+
+  for (size_t i = 0; i < sizeof(invalid_requests) / sizeof(invalid_requests[0]);
+       ++i) {
+    JsonToRequest(invalid_requests[i]);
+    EXPECT_EQ(NULL_REQUEST, request) << "Expected invalid: " << i;
+  }
+}
+
+static std::string ManyCommandsJson(int count) {
+  std::string json = "{\"id\": 1, \"get\": [1], \"commands\": [";
+  char buffer[64];
+  for (int i = 0; i < count; ++i) {
+    snprintf(buffer, sizeof(buffer), "%s{\"id\": %d, \"args\": [%d, %d]}",
+             i ? ", " : "", i, i, i + 1);
+    json += buffer;
+  }
+  json += "], \"destroy\": [1]}";
+  return json;
+}
+
+TEST_F(RequestTest, ManyCommands) {
+  // Enough commands to need more than one chunk of memory. The fake
+  // interfaces only allow 1024 live vars, so it can't be much larger.
+  std::string json = ManyCommandsJson(200);
+  JsonToRequest(json.c_str());
+  ASSERT_NE(NULL_REQUEST, request);
+  ASSERT_EQ(200, nb_request_commands_count(request));
+  for (int i = 0; i < 200; ++i) {
+    EXPECT_EQ(i, nb_request_command_function(request, i));
+    ASSERT_EQ(2, nb_request_command_arg_count(request, i));
+    EXPECT_EQ(i, nb_request_command_arg(request, i, 0));
+    EXPECT_EQ(i + 1, nb_request_command_arg(request, i, 1));
+  }
+  EXPECT_EQ(1, nb_request_gethandle(request, 0));
+  EXPECT_EQ(1, nb_request_destroyhandle(request, 0));
+}
+
+TEST_F(RequestTest, ReusesMemory) {
+  std::string json = ManyCommandsJson(200);
+  JsonToRequest(json.c_str());
+  ASSERT_NE(NULL_REQUEST, request);
+
+  // The memory of a destroyed request is reused by the next one, once it is
+  // large enough.
+  JsonToRequest(json.c_str());
+  NB_Request* previous = request;
+  JsonToRequest(json.c_str());
+  EXPECT_EQ(previous, request);
+}
+
+static double NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Run with --gtest_also_run_disabled_tests.
+TEST_F(RequestTest, DISABLED_Benchmark) {
+  std::string many_commands = ManyCommandsJson(200);
+  const char* requests[] = {
+    "{\"id\": 1, \"get\": [10], \"destroy\": [1, 5, 10]}",
+    "{\"id\": 1, \"set\": {\"1\": 4, \"2\": 3.5, \"3\": null}}",
+    "{\"id\": 1, \"commands\": [{\"id\": 1, \"args\": [42, 3], \"ret\": 5}]}",
+    many_commands.c_str(),
+  };
+  const int kIterations[] = {100000, 100000, 100000, 1000};
+
+  for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+    struct PP_Var var = json_to_var(requests[i]);
+    double start_ms = NowMs();
+    for (int j = 0; j < kIterations[i]; ++j) {
+      NB_Request* parsed = nb_request_parse(var);
+      ASSERT_NE(NULL_REQUEST, parsed);
+      nb_request_destroy(parsed);
+    }
+    double elapsed_ms = NowMs() - start_ms;
+    printf("%.40s...: %.3f us/request\n", requests[i],
+           elapsed_ms * 1000 / kIterations[i]);
+    nb_var_release(var);
+  }
+}
@@ -21,6 +21,7 @@ function NaClEmbedForTesting(fireEventsImmediately) {
   this.$loaded = false;
   this.$listeners = {};
   this.$postMessageCallback = null;
+  this.$attributes = {};
   this.$lastError = undefined;
   this.$exitStatus = undefined;
   this.$fireEventsImmediately = fireEventsImmediately || false;
@@ -99,6 +100,10 @@ NaClEmbedForTesting.prototype.$addCrashListener = function(callback) {
 NaClEmbedForTesting.prototype.$appendToBody = function() {
 };
 
+NaClEmbedForTesting.prototype.$setAttribute = function(name, value) {
+  this.$attributes[name] = value;
+};
+
 NaClEmbedForTesting.prototype.$setPostMessageCallback = function(callback) {
   this.$postMessageCallback = callback;
 }
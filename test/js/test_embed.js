@@ -138,6 +138,109 @@ describe('Embed', function() {
 
   var fireEventsImmediately = true;
 
+  it('should hold messages while the module queue is full', function() {
+    var ne = NaClEmbed(fireEventsImmediately);
+    var e = Embed(ne);
+    var posted = [];
+    var ignore = function() {};
+    var i;
+
+    ne.$setPostMessageCallback(function(msg) {
+      posted.push(msg.id);
+    });
+
+    ne.$load();
+    e.$postMessageWithResponse({id: 1}, ignore);
+    assert.deepEqual(posted, [1]);
+
+    // The module reached its high-water mark.
+    ne.$message({id: 0, throttle: true, space: 1});
+    for (i = 2; i <= 5; ++i) {
+      e.$postMessageWithResponse({id: i}, ignore);
+    }
+    assert.deepEqual(posted, [1]);
+
+    // The module drained, and has room for two more messages.
+    ne.$message({id: 0, throttle: false, space: 2});
+    assert.deepEqual(posted, [1, 2, 3]);
+
+    // Still behind the held messages.
+    e.$postMessageWithResponse({id: 6}, ignore);
+    assert.deepEqual(posted, [1, 2, 3]);
+
+    // Each response makes room for one more.
+    ne.$message({id: 1});
+    assert.deepEqual(posted, [1, 2, 3, 4]);
+    ne.$message({id: 2});
+    ne.$message({id: 3});
+    assert.deepEqual(posted, [1, 2, 3, 4, 5, 6]);
+
+    e.$postMessageWithResponse({id: 7}, ignore);
+    assert.deepEqual(posted, [1, 2, 3, 4, 5, 6, 7]);
+  });
+
+  it('should not post more requests than the module can queue', function() {
+    var ne = NaClEmbed(fireEventsImmediately);
+    var e = Embed(ne);
+    var posted = [];
+    var ignore = function() {};
+    var i;
+
+    ne.$setPostMessageCallback(function(msg) {
+      posted.push(msg.id);
+    });
+
+    e.$maxInFlight = 2;
+    ne.$load();
+    for (i = 1; i <= 4; ++i) {
+      e.$postMessageWithResponse({id: i}, ignore);
+    }
+    assert.deepEqual(posted, [1, 2]);
+
+    // A dropped request has a response too, so it makes room.
+    ne.$message({id: 1, dropped: true});
+    assert.deepEqual(posted, [1, 2, 3]);
+    ne.$message({id: 3});
+    assert.deepEqual(posted, [1, 2, 3, 4]);
+  });
+
+  it('should not post more requests than the module can queue on load',
+     function(done) {
+    var ne = NaClEmbed();
+    var e = Embed(ne);
+    var posted = [];
+    var ignore = function() {};
+    var i;
+
+    ne.$setPostMessageCallback(function(msg) {
+      posted.push(msg.id);
+    });
+
+    e.$maxInFlight = 2;
+    for (i = 1; i <= 4; ++i) {
+      e.$postMessageWithResponse({id: i}, ignore);
+    }
+
+    ne.$load();
+    setTimeout(function() {
+      assert.deepEqual(posted, [1, 2]);
+      done();
+    }, 0);
+  });
+
+  it('should set the module\'s queue size with $setQueueMaxSize', function() {
+    var ne = NaClEmbed(fireEventsImmediately);
+    var e = Embed(ne);
+
+    assert.throws(function() { e.$setQueueMaxSize(2); }, />= 4/);
+    e.$setQueueMaxSize(64);
+    assert.strictEqual(ne.$attributes['nb-queue-max-size'], '64');
+    assert.strictEqual(e.$maxInFlight, 64);
+
+    ne.$load();
+    assert.throws(function() { e.$setQueueMaxSize(128); }, /loaded/);
+  });
+
   it('should throw if the message is not an object', function() {
     var ne = NaClEmbed(fireEventsImmediately);
     var e = Embed(ne);
@@ -720,7 +720,7 @@ describe('Generate JS', function() {
         assert.ok(false, 'Error generating JS.\n' + error);
       }
 
-      assert.strictEqual(11, m.$functionsCount);
+      assert.strictEqual(22, m.$functionsCount);
       assert.strictEqual(0, m.$typesCount);
       assert.strictEqual(0, m.$tagsCount);
 
@@ -734,6 +734,17 @@ describe('Generate JS', function() {
       assert.ok(m.ne);
       assert.ok(m.add);
       assert.ok(m.sub);
+      assert.ok(m.setArray);
+      assert.ok(m.getArray);
+      assert.ok(m.gather);
+      assert.ok(m.scatter);
+      assert.ok(m.sumArray);
+      assert.ok(m.minArray);
+      assert.ok(m.maxArray);
+      assert.ok(m.dotArray);
+      assert.ok(m.scaleArray);
+      assert.ok(m.clampArray);
+      assert.ok(m.addArray);
 
       // Make sure non-builtins are added too.
       assert.ok(m.foo);
@@ -748,6 +759,17 @@ describe('Generate JS', function() {
       assert.strictEqual(m.ne.$types.length, 14);
       assert.strictEqual(m.add.$types.length, 7);
       assert.strictEqual(m.sub.$types.length, 7);
+      assert.strictEqual(m.setArray.$types.length, 14);
+      assert.strictEqual(m.getArray.$types.length, 14);
+      assert.strictEqual(m.gather.$types.length, 14);
+      assert.strictEqual(m.scatter.$types.length, 14);
+      assert.strictEqual(m.sumArray.$types.length, 4);
+      assert.strictEqual(m.minArray.$types.length, 4);
+      assert.strictEqual(m.maxArray.$types.length, 4);
+      assert.strictEqual(m.dotArray.$types.length, 4);
+      assert.strictEqual(m.scaleArray.$types.length, 4);
+      assert.strictEqual(m.clampArray.$types.length, 4);
+      assert.strictEqual(m.addArray.$types.length, 4);
       assert.strictEqual(m.foo.$types.length, 1);
 
       done();
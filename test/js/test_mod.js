@@ -199,6 +199,121 @@ describe('Module', function() {
       });
     });
 
+    it('should send binary requests when enabled', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var addType = type.Function(type.double, [type.int, type.double]);
+      var h;
+
+      m.$defineFunction('add', [mod.Function(5, addType)]);
+      m.$binaryRequests = true;
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        var view;
+        var words = [];
+        var i;
+
+        assert.ok(msg instanceof ArrayBuffer);
+        view = new DataView(msg);
+        for (i = 0; i < msg.byteLength; i += 4) {
+          words.push(view.getInt32(i, true));
+        }
+
+        // header: magic, id, flags, prepare, program, set, commands, args,
+        // get, destroy
+        assert.deepEqual(words.slice(0, 10),
+                         [0x3152424e, 1, 0, 0, 0, 2, 1, 2, 1, 0]);
+        // set 1 = int32 3
+        assert.deepEqual(words.slice(10, 13), [1, 0, 3]);
+        // set 2 = double 4.5
+        assert.deepEqual(words.slice(13, 15), [2, 1]);
+        assert.strictEqual(view.getFloat64(60, true), 4.5);
+        // command 5(1, 2) -> 3, then get [3]
+        assert.deepEqual(words.slice(17), [5, 3, 2, 1, 2, 3]);
+
+        ne.$message({id: 1, values: [7.5]});
+      });
+
+      h = m.add(3, 4.5);
+      m.$commit([h], function(hVal) {
+        assert.strictEqual(hVal, 7.5);
+        done();
+      });
+    });
+
+    it('should send strings as objects in binary mode', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var charp = type.Pointer(type.char.$qualify(type.CONST));
+      var putsType = type.Function(type.int, [charp]);
+      var h;
+
+      m.$defineFunction('puts', [mod.Function(0, putsType)]);
+      m.$binaryRequests = true;
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        assert.deepEqual(msg, {
+          id: 1,
+          get: [2],
+          set: {1: 'hi'},
+          commands: [ {id: 0, args: [1], ret: 2} ]
+        });
+
+        ne.$message({id: 1, values: [3]});
+      });
+
+      h = m.puts('hi');
+      m.$commit([h], function(hVal) {
+        assert.strictEqual(hVal, 3);
+        done();
+      });
+    });
+
+    it('should decode packed values', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var h1 = m.$handle(1);
+      var h2 = m.$handle(2.5);
+      var h3 = m.$handle(Long.fromBits(1, 2));
+      var h4 = m.$handle(null);
+
+      m.$packedValues = true;
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        // count, 4 tags, then 8-byte values starting at offset 8.
+        var buffer = new ArrayBuffer(8 + 4 * 8);
+        var view = new DataView(buffer);
+
+        assert.strictEqual(msg.packed, true);
+
+        view.setUint32(0, 4, true);
+        view.setUint8(4, 0);
+        view.setUint8(5, 1);
+        view.setUint8(6, 2);
+        view.setUint8(7, 3);
+        view.setInt32(8, -7, true);
+        view.setFloat64(16, 2.5, true);
+        view.setInt32(24, 1, true);
+        view.setInt32(28, 2, true);
+        ne.$message({id: 1, values: buffer});
+      });
+
+      m.$commit([h1, h2, h3, h4], function(v1, v2, v3, v4) {
+        assert.strictEqual(v1, -7);
+        assert.strictEqual(v2, 2.5);
+        assert.ok(v3 instanceof Long);
+        assert.ok(v3.equals(Long.fromBits(1, 2)));
+        assert.strictEqual(v4, null);
+        done();
+      });
+    });
+
     it('should pass current context to commit callback', function(done) {
       var ne = NaClEmbed();
       var e = Embed(ne);
@@ -285,6 +400,28 @@ describe('Module', function() {
       });
     });
 
+    it('should return an error if the request was dropped', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var getLongType = type.Function(type.longlong, []);
+      var h;
+
+      m.$defineFunction('getLong', [mod.Function(0, getLongType)]);
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        ne.$message({id: 1, dropped: true});
+      });
+
+      h = m.getLong();
+      m.$commit([h], function(error, hVal) {
+        assert.ok(error instanceof Error);
+        assert.strictEqual(hVal, undefined);
+        done();
+      });
+    });
+
     it('should push undefined error when everything works', function(done) {
       var ne = NaClEmbed();
       var e = Embed(ne);
@@ -381,6 +518,96 @@ describe('Module', function() {
     });
   });
 
+  describe('ephemeral context', function() {
+    it('should create handles with negative ids', function() {
+      var m = mod.Module();
+      var c = m.$createContext(true);
+      var h1;
+      var h2;
+
+      m.$context = c;
+      h1 = m.$handle(1);
+      h2 = m.$handle(2);
+
+      assert.strictEqual(h1.$id, -1);
+      assert.strictEqual(h2.$id, -2);
+      assert.strictEqual(h1.$cast(type.int).$id, -1);
+      assert.deepEqual(m.$getMessage().set, {'-1': 1, '-2': 2});
+    });
+
+    it('should not track handles for destruction', function() {
+      var m = mod.Module();
+
+      m.$context = m.$createContext(true);
+      m.$handle(1);
+      m.$destroyHandles();
+
+      assert.strictEqual(m.$context.$handles.length, 0);
+      assert.deepEqual(m.$getMessage().destroy, []);
+    });
+
+    it('should reuse ids after a commit', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var h;
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        ne.$message({id: msg.id, values: [1]});
+      });
+
+      m.$context = m.$createContext(true);
+      h = m.$handle(1);
+      m.$handle(2);
+      m.$commit([h], function(hVal) {
+        assert.strictEqual(hVal, 1);
+        done();
+      });
+
+      assert.strictEqual(m.$handle(3).$id, -1);
+    });
+
+    it('should throw if a handle from an earlier request is used', function() {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var a;
+      var b;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        ne.$message({id: msg.id, values: [3]});
+      });
+
+      m.$context = m.$createContext(true);
+      a = m.add(1, 2);
+      m.$commit([a], function(aVal) {});
+
+      // |b| gets the same id as |a|.
+      b = m.add(10, 20);
+      assert.strictEqual(b.$id, a.$id);
+      assert.throws(function() { m.add(a, 0); }, /earlier request/);
+      assert.throws(function() { m.add(a.$cast(type.int), 0); },
+                    /earlier request/);
+      assert.throws(function() { m.$commit([a], function(aVal) {}); },
+                    /earlier request/);
+      m.$commit([b], function(bVal) {});
+    });
+
+    it('should throw if setFinalizer is called', function() {
+      var m = mod.Module();
+
+      m.$context = m.$createContext(true);
+      assert.throws(function() {
+        m.$handle(1).$setFinalizer(function() {});
+      });
+    });
+  });
+
   describe('$commitDestroy', function() {
     it('should be equivalent to calling destroy then commit', function(done) {
       var ne = NaClEmbed();
@@ -448,6 +675,618 @@ describe('Module', function() {
     });
   });
 
+  describe('$compactHandles', function() {
+    it('should add a command with id of COMPACT_HANDLES_ID', function() {
+      var m = mod.Module();
+
+      m.$compactHandles();
+
+      assert.deepEqual(m.$getMessage(), {
+        id: 1,
+        commands: [ {id: mod.COMPACT_HANDLES_ID, args: []} ]
+      });
+    });
+  });
+
+  describe('$getStats', function() {
+    it('should add a command with id of GET_STATS_ID', function() {
+      var m = mod.Module();
+      var h = m.$getStats();
+
+      assert.deepEqual(m.$getMessage(), {
+        id: 1,
+        commands: [ {id: mod.GET_STATS_ID, args: [], ret: h.$id} ]
+      });
+    });
+  });
+
+  describe('$wrapArrayBuiltins_', function() {
+    var voidp = type.Pointer(type.void);
+    var floatp = type.Pointer(type.float);
+    var intp = type.Pointer(type.int);
+    var cvoidp = type.Pointer(type.void.$qualify(type.CONST));
+
+    function arrayModule() {
+      var m = mod.Module();
+      m.$defineFunction('malloc', [
+        mod.Function(0, type.Function(voidp, [type.uint]))
+      ]);
+      m.$defineFunction('setArray', [
+        mod.Function(1, type.Function(type.void,
+                                      [floatp, type.int, cvoidp, type.int])),
+        mod.Function(2, type.Function(type.void,
+                                      [intp, type.int, cvoidp, type.int])),
+      ]);
+      m.$defineFunction('getArray', [
+        mod.Function(3, type.Function(type.void,
+                                      [floatp, type.int, voidp, type.int])),
+        mod.Function(4, type.Function(type.void,
+                                      [intp, type.int, voidp, type.int])),
+      ]);
+      m.$wrapArrayBuiltins_();
+      return m;
+    }
+
+    it('should take the count from a typed array', function() {
+      var m = arrayModule();
+      var p = m.malloc(16).$cast(floatp);
+      var array = new Float32Array([1, 2, 3]);
+      var msg;
+
+      m.setArray(p, 1, array);
+
+      msg = m.$getMessage();
+      assert.deepEqual(msg.commands[1], {id: 1, args: [2, 3, 4, 5]});
+      assert.ok(msg.set[4] instanceof ArrayBuffer);
+      assert.deepEqual(new Float32Array(msg.set[4]), array);
+      assert.strictEqual(msg.set[5], 3);
+    });
+
+    it('should copy only the viewed part of a typed array', function() {
+      var m = arrayModule();
+      var p = m.malloc(16).$cast(intp);
+      var array = new Int32Array([1, 2, 3, 4]).subarray(1, 3);
+
+      m.setArray(p, 0, array);
+
+      assert.deepEqual(new Int32Array(m.$getMessage().set[4]),
+                       new Int32Array([2, 3]));
+      assert.strictEqual(m.$getMessage().commands[1].id, 2);
+    });
+
+    it('should create the buffer for getArray', function() {
+      var m = arrayModule();
+      var p = m.malloc(16).$cast(intp);
+      var h = m.getArray(p, 2, 2);
+
+      assertTypesEqual(h.$type, voidp);
+      assert.strictEqual(m.$getMessage().set[h.$id].byteLength, 8);
+      assert.deepEqual(m.$getMessage().commands[1],
+                       {id: 4, args: [2, 4, h.$id, 5]});
+    });
+
+    it('should fail without a pointer handle', function() {
+      var m = arrayModule();
+
+      assert.throws(function() { m.getArray(4, 0, 1); });
+      assert.throws(function() {
+        m.setArray(m.$handle(new ArrayBuffer(4)), 0, new ArrayBuffer(4));
+      });
+    });
+
+    it('should fail if the count is too large for the array', function() {
+      var m = arrayModule();
+      var p = m.malloc(16).$cast(intp);
+
+      assert.throws(function() {
+        m.setArray(p, 0, new Int32Array(2), 3);
+      }, /only 2/);
+      assert.throws(function() {
+        m.setArray(p, 0, new ArrayBuffer(8), 3);
+      }, /only 2/);
+      assert.throws(function() {
+        m.setArray(p, 0, m.$handle(new ArrayBuffer(4)), 2);
+      }, /only 1/);
+      m.setArray(p, 0, new Int32Array(4), 2);
+    });
+
+    it('should fail with a negative offset or count', function() {
+      var m = arrayModule();
+      var p = m.malloc(16).$cast(intp);
+
+      assert.throws(function() { m.setArray(p, -1, new Int32Array(1)); },
+                    /offset/);
+      assert.throws(function() { m.setArray(p, 0, new Int32Array(1), -1); },
+                    /count/);
+      assert.throws(function() { m.getArray(p, -1, 1); }, /offset/);
+      assert.throws(function() { m.getArray(p, 0, -1); }, /count/);
+    });
+  });
+
+  describe('$wrapGatherBuiltins_', function() {
+    var voidp = type.Pointer(type.void);
+    var floatp = type.Pointer(type.float);
+    var cfloatp = type.Pointer(type.float.$qualify(type.CONST));
+    var cvoidp = type.Pointer(type.void.$qualify(type.CONST));
+    var vec = type.Record('vec', 8, type.STRUCT);
+    var particle = type.Record('particle', 16, type.STRUCT);
+
+    vec.$addField('x', type.float, 0);
+    vec.$addField('y', type.float, 4);
+    particle.$addField('id', type.int, 0);
+    particle.$addField('pos', vec, 4);
+    particle.$addField('next', type.Pointer(particle), 12);
+
+    function gatherModule() {
+      var m = mod.Module();
+      m.$defineFunction('malloc', [
+        mod.Function(0, type.Function(voidp, [type.uint]))
+      ]);
+      m.$defineFunction('gather', [
+        mod.Function(1, type.Function(type.void, [
+          floatp, cvoidp, type.int, type.int, type.int])),
+        mod.Function(2, type.Function(type.void, [
+          type.Pointer(voidp), cvoidp, type.int, type.int, type.int]))
+      ]);
+      m.$defineFunction('scatter', [
+        mod.Function(3, type.Function(type.void, [
+          cfloatp, voidp, type.int, type.int, type.int]))
+      ]);
+      m.$wrapGatherBuiltins_();
+      return m;
+    }
+
+    it('should take the stride and offset from the record', function() {
+      var m = gatherModule();
+      var p = m.malloc(particle.$size * 10);
+      var h = m.gather(p, particle, particle.pos.y, 10);
+      var msg = m.$getMessage();
+
+      assertTypesEqual(h.$type, floatp);
+      assert.strictEqual(msg.set[h.$id].byteLength, 40);
+      assert.deepEqual(msg.commands[1], {id: 1, args: [3, 2, 4, 5, 6]});
+      assert.strictEqual(msg.set[4], 16);
+      assert.strictEqual(msg.set[5], 8);
+      assert.strictEqual(msg.set[6], 10);
+    });
+
+    it('should gather pointer fields as void*', function() {
+      var m = gatherModule();
+      var p = m.malloc(particle.$size * 2);
+
+      m.gather(p, particle, particle.next, 2);
+      assert.strictEqual(m.$getMessage().commands[1].id, 2);
+    });
+
+    it('should scatter a typed array', function() {
+      var m = gatherModule();
+      var p = m.malloc(particle.$size * 3);
+      var msg;
+
+      m.scatter(p, particle, particle.pos.x, new Float32Array([1, 2, 3]));
+
+      msg = m.$getMessage();
+      assert.deepEqual(msg.commands[1], {id: 3, args: [3, 2, 4, 5, 6]});
+      assert.deepEqual(new Float32Array(msg.set[3]),
+                       new Float32Array([1, 2, 3]));
+      assert.strictEqual(msg.set[5], 4);
+      assert.strictEqual(msg.set[6], 3);
+    });
+
+    it('should fail without a usable field', function() {
+      var m = gatherModule();
+      var p = m.malloc(particle.$size);
+
+      assert.throws(function() {
+        m.gather(p, particle, particle.$fields.id, 1);
+      }, /short syntax/);
+      assert.throws(function() {
+        m.gather(p, particle, particle.pos, 1);
+      }, /can't copy/);
+      assert.throws(function() {
+        m.gather(p, type.int, particle.id, 1);
+      }, /record type/);
+      assert.throws(function() {
+        m.scatter(p, particle, particle.pos.x, m.$handle(null, voidp));
+      }, /needs a count/);
+    });
+
+    it('should fail with a bad count', function() {
+      var m = gatherModule();
+      var p = m.malloc(particle.$size * 4);
+
+      assert.throws(function() {
+        m.gather(p, particle, particle.pos.x, -1);
+      }, /non-negative/);
+      assert.throws(function() {
+        m.scatter(p, particle, particle.pos.x, new Float32Array(2), 3);
+      }, /only 2/);
+      assert.throws(function() {
+        m.scatter(p, particle, particle.pos.x,
+                  m.$handle(new ArrayBuffer(12), floatp), 4);
+      }, /only 3/);
+      assert.throws(function() {
+        m.scatter(p, particle, particle.pos.x, new Float32Array(2), -1);
+      }, /non-negative/);
+    });
+  });
+
+  describe('$repeat', function() {
+    it('should add a REPEAT_ID command before its body', function() {
+      var m = mod.Module();
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var acc;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+      acc = m.$handle(0, type.int);
+      m.$repeat(5, function(i) {
+        return [[acc, m.add(acc, i)]];
+      });
+
+      assert.deepEqual(m.$getMessage(), {
+        id: 1,
+        set: {1: 0, 2: 5, 5: 1},
+        commands: [
+          {id: mod.REPEAT_ID, args: [2, 5, 1, 4], ret: 3},
+          {id: 0, args: [1, 3], ret: 4}
+        ]
+      });
+    });
+
+    it('should forget the handles that are moved from', function() {
+      var m = mod.Module();
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var acc;
+      var sum;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+      acc = m.$handle(0, type.int);
+      m.$repeat(2, function(i) {
+        sum = m.add(acc, i);
+        return [[acc, sum]];
+      });
+      m.$destroyHandles();
+
+      assert.deepEqual(m.$getMessage().destroy, [1, 2, 3, 5]);
+    });
+
+    it('should throw if the count isn\'t convertible to int', function() {
+      var m = mod.Module();
+      var rec = type.Record('rec', 4, type.STRUCT);
+
+      assert.throws(function() {
+        m.$repeat(m.$handle(null, rec), function() {});
+      }, /invalid type/);
+    });
+  });
+
+  describe('$while', function() {
+    it('should add a WHILE_ID command before its body', function() {
+      var m = mod.Module();
+      var subType = type.Function(type.int, [type.int, type.int]);
+      var n;
+
+      m.$defineFunction('sub', [mod.Function(1, subType)]);
+      n = m.$handle(3, type.int);
+      m.$while(n, function() {
+        return [[n, m.sub(n, 1)]];
+      });
+
+      assert.deepEqual(m.$getMessage(), {
+        id: 1,
+        set: {1: 3, 2: 1, 4: 1},
+        commands: [
+          {id: mod.WHILE_ID, args: [1, 4, 1, 3]},
+          {id: 1, args: [1, 2], ret: 3}
+        ]
+      });
+    });
+  });
+
+  describe('$if', function() {
+    it('should add an IF_ID command before its branches', function() {
+      var m = mod.Module();
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var subType = type.Function(type.int, [type.int, type.int]);
+      var x;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+      m.$defineFunction('sub', [mod.Function(1, subType)]);
+      x = m.$handle(1, type.int);
+      m.$if(x, function() {
+        m.add(x, 2);
+      }, function() {
+        m.sub(x, 3);
+        m.sub(x, 4);
+      });
+
+      assert.deepEqual(m.$getMessage(), {
+        id: 1,
+        set: {1: 1, 2: 2, 4: 3, 6: 4, 8: 1, 9: 2},
+        commands: [
+          {id: mod.IF_ID, args: [1, 8, 9]},
+          {id: 0, args: [1, 2], ret: 3},
+          {id: 1, args: [1, 4], ret: 5},
+          {id: 1, args: [1, 6], ret: 7}
+        ]
+      });
+    });
+
+    it('should allow the else branch to be omitted', function() {
+      var m = mod.Module();
+      var p = m.$handle(null, type.Pointer(type.void));
+
+      m.$if(p, function() { m.$errorIf(p); });
+
+      assert.deepEqual(m.$getMessage().commands, [
+        {id: mod.IF_ID, args: [1, 2, 3]},
+        {id: mod.ERROR_IF_ID, args: [1]}
+      ]);
+      assert.strictEqual(m.$getMessage().set[2], 1);
+      assert.strictEqual(m.$getMessage().set[3], 0);
+    });
+  });
+
+  describe('$map', function() {
+    var intp = type.Pointer(type.int);
+    var floatp = type.Pointer(type.float);
+
+    function mapModule() {
+      var m = mod.Module();
+      m.$defineFunction('malloc', [
+        mod.Function(0, type.Function(type.Pointer(type.void), [type.uint]))
+      ]);
+      m.$defineFunction('add', [
+        mod.Function(1, type.Function(type.int, [type.int, type.int])),
+        mod.Function(2, type.Function(type.float, [type.float, type.float]))
+      ]);
+      m.$defineFunction('fill', [
+        mod.Function(3, type.Function(type.void, [intp, type.int]))
+      ]);
+      return m;
+    }
+
+    it('should add a MAP_ID command for typed array columns', function() {
+      var m = mapModule();
+      var a = new Float32Array([1, 2, 3]);
+      var b = new Float32Array([4, 5, 6, 7]).subarray(1);
+      var out = m.$map(m.add, 3, [a, b]);
+      var msg = m.$getMessage();
+
+      assertTypesEqual(out.$type, floatp);
+      assert.deepEqual(msg.commands, [
+        {id: mod.MAP_ID, args: [4, 5, 1, 2, 3]}
+      ]);
+      assert.deepEqual(new Float32Array(msg.set[1]), a);
+      assert.deepEqual(new Float32Array(msg.set[2]),
+                       new Float32Array([5, 6, 7]));
+      assert.strictEqual(msg.set[3].byteLength, 12);
+      assert.strictEqual(msg.set[4], 2);
+      assert.strictEqual(msg.set[5], 3);
+    });
+
+    it('should allow pointer handles as columns and out', function() {
+      var m = mapModule();
+      var p = m.malloc(16).$cast(intp);
+      var ps = m.malloc(4).$cast(type.Pointer(intp));
+
+      assert.strictEqual(m.$map(m.add, 4, [p, p], p), p);
+      assert.strictEqual(m.$map(m.fill, 1, [ps, new Int32Array([9])]),
+                         undefined);
+      assert.deepEqual(m.$getMessage().commands.slice(2), [
+        {id: mod.MAP_ID, args: [5, 6, 2, 2, 2]},
+        {id: mod.MAP_ID, args: [8, 9, 4, 7]}
+      ]);
+    });
+
+    it('should fail if a column doesn\'t match the argument', function() {
+      var m = mapModule();
+      var d = new Float64Array([1]);
+
+      assert.throws(function() { m.$map(m.add, 1, [d, d]); }, /column 0/);
+      assert.throws(function() {
+        m.$map(m.add, 1, [new Int32Array(1), new Int32Array(1)],
+               m.$handle(new ArrayBuffer(4), floatp));
+      }, /out has elements/);
+    });
+
+    it('should fail with invalid arguments', function() {
+      var m = mapModule();
+      var a = new Int32Array(1);
+
+      assert.throws(function() { m.$map(function() {}, 1, [a, a]); });
+      assert.throws(function() { m.$map(m.add, 1, [a, [1]]); });
+      assert.throws(function() { m.$map(m.add, 1, [a, new ArrayBuffer(4)]); });
+      assert.throws(function() {
+        m.$map(m.fill, 1, [m.$handle(null, type.Pointer(intp)), a], a);
+      }, /returns void/);
+      assert.throws(function() { m.$map(m.add, -1, [a, a]); }, /non-negative/);
+    });
+
+    it('should fail if a column is too short', function() {
+      var m = mapModule();
+      var a = new Int32Array(4);
+      var p = m.malloc(16).$cast(intp);
+
+      assert.throws(function() {
+        m.$map(m.add, 5, [a, p]);
+      }, /column 0 has only 4 elements/);
+      assert.throws(function() {
+        m.$map(m.add, 4, [p, m.$handle(new ArrayBuffer(12), intp)]);
+      }, /column 1 has only 3 elements/);
+      assert.throws(function() {
+        m.$map(m.add, 4, [a, a], m.$handle(new ArrayBuffer(8), intp));
+      }, /column 2 has only 2 elements/);
+      // The size of native memory isn't known.
+      m.$map(m.add, 100, [p, p], p);
+    });
+
+    it('should not allow a typed array as out', function() {
+      var m = mapModule();
+      var a = new Int32Array(4);
+
+      assert.throws(function() {
+        m.$map(m.add, 4, [a, a], new Int32Array(4));
+      }, /out must be a pointer handle/);
+    });
+  });
+
+  describe('$prepare', function() {
+    it('should send the program commands once', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var messages = [];
+      var program;
+      var outputs;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        messages.push(msg);
+        ne.$message({id: msg.id, values: msg.get ? [10] : []});
+      });
+
+      program = m.$prepare([type.int], function(x) {
+        return [m.add(m.add(x, 1), x)];
+      });
+
+      outputs = m.$runProgram(program, [4]);
+      m.$commit(outputs, function(value) {
+        assert.strictEqual(value, 10);
+        assert.deepEqual(messages, [
+          {
+            id: 2,
+            prepare: 1,
+            commands: [
+              {id: 0, args: [-1, -2], ret: -3},
+              {id: 0, args: [-3, -1], ret: -4}
+            ]
+          },
+          {id: 1, program: 1, set: {'-1': 4, '-2': 1}, get: [-4]}
+        ]);
+        done();
+      });
+    });
+
+    it('should let each run use the program outputs', function() {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var program;
+      var outputs;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        ne.$message({id: msg.id, values: msg.get ? [5] : []});
+      });
+
+      program = m.$prepare([type.int], function(x) {
+        return [m.add(x, 1)];
+      });
+
+      outputs = m.$runProgram(program, [4]);
+      m.$commit(outputs, function(value) {});
+
+      // The outputs are from the last run until the program runs again.
+      assert.throws(function() { m.$commit(outputs, function(value) {}); },
+                    /earlier request/);
+      outputs = m.$runProgram(program, [5]);
+      m.$commit(outputs, function(value) {});
+    });
+
+    it('should not allow other commands with a program', function() {
+      var m = mod.Module(Embed(NaClEmbed()));
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var program;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+      program = m.$prepare([], function() { return []; });
+
+      m.$runProgram(program);
+      assert.throws(function() { m.add(1, 2); });
+    });
+
+    it('should check program argument types', function() {
+      var m = mod.Module(Embed(NaClEmbed()));
+      var program = m.$prepare([type.double], function() { return []; });
+
+      assert.throws(function() { m.$runProgram(program, []); });
+      assert.throws(function() { m.$runProgram(program, ['hi']); });
+    });
+
+    it('should restore the current request if body throws', function() {
+      var m = mod.Module(Embed(NaClEmbed()));
+      var context = m.$context;
+      var message = m.$getMessage();
+
+      assert.throws(function() {
+        m.$prepare([], function() { throw new Error('oops'); });
+      }, /oops/);
+      assert.strictEqual(m.$context, context);
+      assert.strictEqual(m.$getMessage(), message);
+    });
+
+    it('should fail to run a program that failed to prepare', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var program;
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        ne.$message({id: msg.id, values: [], error: -1});
+      });
+
+      program = m.$prepare([], function() { return []; });
+      setTimeout(function() {
+        assert.throws(function() { m.$runProgram(program); }, /prepare/);
+        done();
+      }, 0);
+    });
+
+    it('should pass an error if the program is unknown', function(done) {
+      var ne = NaClEmbed();
+      var e = Embed(ne);
+      var m = mod.Module(e);
+      var addType = type.Function(type.int, [type.int, type.int]);
+      var program;
+
+      m.$defineFunction('add', [mod.Function(0, addType)]);
+
+      ne.$load();
+      ne.$setPostMessageCallback(function(msg) {
+        if (msg.prepare) {
+          ne.$message({id: msg.id, values: []});
+        } else {
+          // E.g. the program was unprepared. The module can't parse the
+          // request, so it has no values.
+          ne.$message({id: msg.id, values: [], error: -1});
+        }
+      });
+
+      program = m.$prepare([], function() { return [m.add(1, 2)]; });
+      m.$commit(m.$runProgram(program), function(error, value) {
+        assert.strictEqual(error.failedAt, -1);
+        assert.strictEqual(value, undefined);
+        done();
+      });
+    });
+
+    it('should unprepare programs', function() {
+      var m = mod.Module(Embed(NaClEmbed()));
+      var program = m.$prepare([], function() { return []; });
+
+      m.$unprepare(program);
+      assert.deepEqual(m.$getMessage(), {id: 1, unprepare: [1]});
+    });
+  });
+
   describe('numberToType', function() {
     it('should return smallest type for a given number', function() {
       assertTypesEqual(mod.numberToType(0), type.schar);
@@ -710,6 +1549,167 @@ describe('Module', function() {
     });
   });
 
+  // A module with the byte array builtins used by $getStruct and $setStruct.
+  function structModule() {
+    var voidp = type.Pointer(type.void);
+    var ucharp = type.Pointer(type.uchar);
+    var cvoidp = type.Pointer(type.void.$qualify(type.CONST));
+    var m = mod.Module();
+
+    m.$defineFunction('malloc', [
+      mod.Function(0, type.Function(voidp, [type.uint]))
+    ]);
+    m.$defineFunction('setArray', [
+      mod.Function(1, type.Function(type.void,
+                                    [ucharp, type.int, cvoidp, type.int]))
+    ]);
+    m.$defineFunction('getArray', [
+      mod.Function(2, type.Function(type.void,
+                                    [ucharp, type.int, voidp, type.int]))
+    ]);
+    m.$wrapArrayBuiltins_();
+    return m;
+  }
+
+  describe('$getStruct', function() {
+    var voidp = type.Pointer(type.void);
+
+    function structType() {
+      var s = type.Record('s', 32, type.STRUCT);
+      var u = type.Record('u', 4, type.UNION);
+      u.$addField('i', type.int, 0);
+      u.$addField('f', type.float, 0);
+      s.$addField('a', type.short, 0);
+      s.$addField('b', type.double, 8);
+      s.$addField('c', type.Array(type.uchar, 3), 16);
+      s.$addField('p', voidp, 20);
+      s.$addField('u', u, 24);
+      s.$addField('l', type.longlong, 24);
+      return s;
+    }
+
+    it('should read the record with one getArray command', function() {
+      var m = structModule();
+      var s = structType();
+      var p = m.malloc(s.$size);
+      var h = m.$getStruct(p, s);
+      var buffer = m.$getMessage().set[h.$id];
+
+      assertTypesEqual(h.$type, s);
+      assert.strictEqual(buffer.byteLength, 32);
+      assert.deepEqual(m.$getMessage().commands[1],
+                       {id: 2, args: [2, 4, h.$id, 5]});
+    });
+
+    it('should decode the value of the record handle', function() {
+      var m = structModule();
+      var s = structType();
+      var h = m.$getStruct(m.malloc(s.$size), s);
+      var view = new DataView(new ArrayBuffer(32));
+      var values;
+
+      view.setInt16(0, -2, true);
+      view.setFloat64(8, 1.5, true);
+      view.setUint8(17, 200);
+      view.setUint32(20, 0, true);
+      view.setInt32(24, -1, true);
+      view.setInt32(28, 1, true);
+
+      values = m.$processValues_([h], [view.buffer]);
+      assert.deepEqual(Object.keys(values[0]), ['a', 'b', 'c', 'p', 'u', 'l']);
+      assert.strictEqual(values[0].a, -2);
+      assert.strictEqual(values[0].b, 1.5);
+      assert.deepEqual(values[0].c, [0, 200, 0]);
+      assert.strictEqual(values[0].p, null);
+      assert.strictEqual(values[0].u.i, -1);
+      assert.ok(isNaN(values[0].u.f));
+      assert.ok(values[0].l.equals(Long(-1, 1)));
+    });
+
+    it('should fail without the builtins or a record type', function() {
+      var m = structModule();
+      var p = m.malloc(4);
+
+      assert.throws(function() {
+        mod.Module().$getStruct(p, structType());
+      }, /builtins/);
+      assert.throws(function() { m.$getStruct(p, type.int); }, /record/);
+      assert.throws(function() {
+        m.$getStruct(p, type.Record('incomplete', 0, type.STRUCT));
+      }, /record/);
+      assert.throws(function() { m.$getStruct(4, structType()); });
+    });
+  });
+
+  describe('$setStruct', function() {
+    var voidp = type.Pointer(type.void);
+
+    function structType() {
+      var s = type.Record('s', 16, type.STRUCT);
+      var u = type.Record('u', 4, type.UNION);
+      u.$addField('i', type.int, 0);
+      u.$addField('f', type.float, 0);
+      s.$addField('a', type.uint, 0);
+      s.$addField('c', type.Array(type.schar, 2), 4);
+      s.$addField('u', u, 8);
+      s.$addField('p', voidp, 12);
+      return s;
+    }
+
+    it('should write the record with one setArray command', function() {
+      var m = structModule();
+      var s = structType();
+      var p = m.malloc(s.$size);
+      var view;
+
+      m.$setStruct(p, s, {a: 0xffffffff, c: [-1, 2], u: {f: 0.5}, p: 16});
+
+      assert.deepEqual(m.$getMessage().commands[1],
+                       {id: 1, args: [2, 3, 4, 5]});
+      view = new DataView(m.$getMessage().set[4]);
+      assert.strictEqual(view.byteLength, 16);
+      assert.strictEqual(view.getUint32(0, true), 0xffffffff);
+      assert.strictEqual(view.getInt8(4), -1);
+      assert.strictEqual(view.getInt8(5), 2);
+      assert.strictEqual(view.getFloat32(8, true), 0.5);
+      assert.strictEqual(view.getUint32(12, true), 16);
+      assert.strictEqual(m.$getMessage().set[5], 16);
+    });
+
+    it('should zero the bytes of a union not covered by its fields',
+       function() {
+      var m = structModule();
+      var u = type.Record('u', 4, type.UNION);
+      var view;
+
+      u.$addField('i', type.int, 0);
+      u.$addField('c', type.uchar, 0);
+      m.$setStruct(m.malloc(u.$size), u, {c: 0xff});
+
+      view = new DataView(m.$getMessage().set[4]);
+      assert.strictEqual(view.getUint32(0, true), 0xff);
+    });
+
+    it('should fail if the object doesn\'t match the record', function() {
+      var m = structModule();
+      var s = structType();
+      var p = m.malloc(s.$size);
+
+      assert.throws(function() {
+        m.$setStruct(p, s, {a: 1, c: [1, 2], u: {}});
+      }, /obj\.p/);
+      assert.throws(function() {
+        m.$setStruct(p, s, {a: 1, c: [1], u: {}, p: null});
+      }, /obj\.c/);
+      assert.throws(function() {
+        m.$setStruct(p, s, {a: 'x', c: [1, 2], u: {}, p: null});
+      }, /obj\.a/);
+      assert.throws(function() {
+        m.$setStruct(p, s, {a: 1, c: [1, 2], u: {}, p: p});
+      }, /obj\.p/);
+    });
+  });
+
   describe('Handle', function() {
     describe('create', function() {
       it('should allow creation of handles', function() {
@@ -796,6 +1796,15 @@ describe('Module', function() {
         });
       });
 
+      it('should allow creation of ArrayBuffer handles', function() {
+        var m = mod.Module();
+        var buffer = new ArrayBuffer(16);
+        var h = m.$handle(buffer);
+
+        assertTypesEqual(h.$type, type.Pointer(type.void));
+        assert.strictEqual(m.$getMessage().set[1], buffer);
+      });
+
       it('should allow creation of null handles', function() {
         var m = mod.Module();
         var h = m.$handle(null);